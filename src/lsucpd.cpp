@@ -26,12 +26,43 @@ static const char * const my_name { "lsucpd: " };
 #include <filesystem>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <set>
 #include <ranges>
 #include <algorithm>            // needed for ranges::sort()
 #include <regex>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <random>
+#include <optional>
+#include <charconv>             // std::to_chars()
 #include <cstring>              // needed for strstr()
 #include <cstdio>               // using sscanf()
+#include <cstdlib>              // using getenv()
 #include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>             // opendir(), fewer syscalls than fs::
+#include <sys/file.h>           // flock()
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>                // writev()
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>       // getrusage()
+#include <linux/netlink.h>
+#include <netdb.h>                  // getaddrinfo()
+#include <csignal>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -41,7 +72,12 @@ static const char * const my_name { "lsucpd: " };
 #include <source_location>
 #endif
 
+#ifdef HAVE_SQLITE3_H
+#include <sqlite3.h>            // --sqlite=DB
+#endif
+
 #include "lsucpd.hpp"
+#include "lsucpd_shm.h"
 // Bill Weinman's header library for C++20 follows. Expect to drop if moved
 // to >= C++23 and then s/bw::print/std::print/ .
 #include "bwprint.hpp"
@@ -83,10 +119,8 @@ static const fs::directory_iterator end_itr { };
 static const sstring empty_str { };
 static const auto dir_opt = fs::directory_options::skip_permission_denied;
 
-// vector of /sys/class/power_supply/ucsi* filename<
-std::vector<sstring> pow_sup_ucsi_v;
-
 int lsucpd_verbose = 0;
+thread_local FILE * lsucpd_hr_fp = nullptr;
 
 enum class pw_op_mode_e {
     def = 0,    // "default": 5 Volts at 900 mA (need to confirm)
@@ -133,6 +167,10 @@ struct tc_dir_elem : public fs::directory_entry {
     // maps /sys/class/typec/port<num>[-partner]/* regular filenames to
     // contents
     std::map<sstring, sstring> tc_sdir_reg_m;
+
+    // alternate mode directories (e.g. port0-partner.0) and their regular
+    // files' contents. Only loaded for --long given twice
+    std::vector<std::pair<sstring, std::map<sstring, sstring>>> alt_md_v_;
 };
 
 enum class pdo_e {
@@ -154,6 +192,8 @@ struct pdo_elem {
     bool is_source_caps_;
     uint16_t pdo_ind_;  // usb-c pd PDO index (starts at 1)
     uint32_t raw_pdo_;
+    bool raw_unavail_ { };      // an attribute was unavailable (see
+                                // --deadline=) so raw_pdo_ was not built
     fs::path pdo_d_p_; // for example: /.../1:fixed_supply
 
     mutable strstr_m ascii_pdo_m_;
@@ -179,11 +219,24 @@ struct upd_dir_elem : public fs::directory_entry {
     sstring match_str_;         // pd<pd_num>
     bool is_partner_ { };       // only used by --data (direction) option
     bool usb_comms_incapable_ { };  // only used by --data (direction) option
+    bool pdos_populated_ { };   // source_pdo_v_ and sink_pdo_v_ are valid
 
     std::vector<pdo_elem> source_pdo_v_;
     std::vector<pdo_elem> sink_pdo_v_;
 };
 
+// A sysfs tree and the class directories scanned below it
+struct sysfs_tree {
+    sstring root_ { "/sys" };
+    fs::path typec_pt_;         // <root>/class/typec
+    fs::path upd_pt_;           // <root>/class/usb_power_delivery
+    fs::path powsup_pt_;        // <root>/class/power_supply
+
+    void set_root(const sstring & root) noexcept;
+};
+
+class fp_model_tab;
+
 // command line options and other things that would otherwise be at file
 // scope. Don't mark with trailing _
 struct opts_t {
@@ -193,14 +246,51 @@ struct opts_t {
     bool is_pdo_snk;
     bool verbose_given;
     bool version_given;
+    bool scan_all;      // scan everything irrespective of output options
+    int cache_pol;      // --cache[=POL]: 0 -> off, else cache_pol_e
     int do_caps;
     int do_help;
     int do_long;
+    int do_profile_io;
+    int verbose;            // lsucpd_verbose is set from this
+    int deadline_ms;        // --deadline=MS[,RUN_MS], 0 --> no deadline
+    int run_deadline_ms;
+    int scan_retries;       // --retries=N, re-scan rounds for torn objects
+    int scan_rounds;        // re-scan rounds actually used
+    bool scan_inconsistent; // retry budget used up, output may be torn
     const char * pseudo_mount_point;
     const char * json_arg;  /* carries [JO] if any */
     const char * js_file; /* --js-file= argument */
     const char * pdo_opt_p;
     const char * rdo_opt_p;
+    const char * shm_name;  // --shm=NAME, publish to /dev/shm/NAME
+    const char * serve_path;    // --serve=PATH, unix socket to listen on
+    const char * http_addr;     // --http=[ADDR:]PORT, HTTP listener
+    const char * rec_path;      // --record=FILE, append port table changes
+    const char * hist_path;     // --history=FILE, read a --record=FILE
+    const char * hist_at;       // --at=TIME
+    const char * hist_between;  // --between=T1[,T2]
+    const char * cap_path;      // --capture=FILE, uevents and sysfs changes
+    const char * replay_path;   // --replay=FILE[,N]
+    int replay_speed;           // N times recorded speed, 0: no delays
+    int storm_rate;             // --storm=RATE[,SECS], changes per second
+    int storm_secs;
+    const char * batch_path;    // --batch=FILE|-
+    bool do_count;              // --count or --check=
+    const char * check_arg;     // --check=COND[,COND...]
+    const char * fields_arg;    // --fields=LIST
+    const char * arrow_prefix;  // --arrow=PREFIX
+    const char * sqlite_db;     // --sqlite=DB
+    char pdo_sep;               // --csv: ',' or --tsv: '\t', else 0
+    bool do_fingerprint;        // --fingerprint[=MFILE]
+    const char * fp_model_fn;   // MFILE: fingerprint to charger model
+    std::shared_ptr<const fp_model_tab> fp_models;  // loaded from MFILE
+    bool do_compliance;         // --check-compliance[=FILE]
+    const char * compl_fn;      // FILE: raw PDO words, '-' for stdin
+    bool do_watch;          // --watch[=QUIET[,MAX]]
+    int watch_quiet_ms;     // events are merged until this long quiet
+    int watch_max_ms;       // ... or this long after the first one
+    int max_age_ms;         // --max-age=MS, -1 --> use default
     sgj_state json_st;  /* -j[JO] or --json[=JO] */
     // vector of sorted /sys/class/typec/*  tc_dir_elem objects
     std::vector<tc_dir_elem> tc_de_v;
@@ -209,9 +299,84 @@ struct opts_t {
     std::map<int, upd_dir_elem> upd_de_m;
     // map of port_number to summary line string (with trailing \n)
     std::map<unsigned int, sstring> summ_out_m;
+    // port numbers whose objects failed to scan, probably torn by a
+    // concurrent attach or detach. And those that have been re-scanned.
+    std::set<unsigned int> torn_port_s;
+    std::set<unsigned int> rescan_port_s;
 
     std::vector<sstring> filter_port_v;
     std::vector<sstring> filter_pd_v;
+    std::vector<const char *> root_v;   // each --sysfsroot=SPATH
+    // where scans look. Each thread that scans uses its own opts_t so
+    // that, together with the above, scans share no mutable state
+    sysfs_tree tree;
+};
+
+// Immutable results of one scan. Once published by a snap_holder, readers
+// (e.g. the output code) use it without locks and without sysfs I/O.
+struct scan_snap {
+    std::vector<tc_dir_elem> tc_de_v;
+    std::map<int, upd_dir_elem> upd_de_m;
+    // summary lines: [0] without and [1] with --data direction. Only those
+    // asked for when the snapshot was taken are present
+    std::map<unsigned int, sstring> summ_out_a[2];
+
+    const std::map<unsigned int, sstring> & summ(bool data_dir) const
+        { return summ_out_a[data_dir ? 1 : 0]; }
+
+    uint64_t generation { };    // set by snap_holder::publish()
+    // same as generation unless the kernel reported no uevents since the
+    // previous snapshot, in which case it is carried over from that one.
+    // Anything derived from a snapshot stays valid while this is unchanged
+    uint64_t content_gen { };   // set by snap_holder::publish()
+    bool have_seqnum { };
+    bool inconsistent { };      // torn by topology changes during the scan
+    uint64_t seqnum { };        // uevent_seqnum at end of scan
+    std::chrono::steady_clock::time_point scan_tp { };
+};
+
+// Holds the current scan_snap. One thread (the refresher) builds the next
+// snapshot off to the side and then swaps it in with publish(). Readers
+// call load() and keep the returned pointer for as long as they need; an
+// older snapshot is freed when its last reader lets go.
+class snap_holder {
+public:
+    std::shared_ptr<const scan_snap> load() const noexcept
+#ifdef __cpp_lib_atomic_shared_ptr
+        { return cur_.load(std::memory_order_acquire); }
+#else
+        { return std::atomic_load_explicit(&cur_,
+                                           std::memory_order_acquire); }
+#endif
+
+    void publish(std::shared_ptr<scan_snap> sp) noexcept
+    {
+        std::lock_guard<std::mutex> lk { pub_mtx_ };  // one refresher
+        const auto prev { load() };
+
+        sp->generation = prev ? (prev->generation + 1) : 1;
+        if (prev && prev->have_seqnum && sp->have_seqnum &&
+            (prev->seqnum == sp->seqnum) && (! prev->inconsistent) &&
+            (! sp->inconsistent))
+            sp->content_gen = prev->content_gen;
+        else
+            sp->content_gen = sp->generation;
+#ifdef __cpp_lib_atomic_shared_ptr
+        cur_.store(std::move(sp), std::memory_order_release);
+#else
+        std::atomic_store_explicit(&cur_,
+                                   std::shared_ptr<const scan_snap>(sp),
+                                   std::memory_order_release);
+#endif
+    }
+
+private:
+#ifdef __cpp_lib_atomic_shared_ptr
+    std::atomic<std::shared_ptr<const scan_snap>> cur_;
+#else
+    std::shared_ptr<const scan_snap> cur_;
+#endif
+    std::mutex pub_mtx_;
 };
 
 struct do_fld_desc_t {   // 4 bytes long describing a PDO and a RDO field
@@ -229,29 +394,213 @@ struct do_fld_desc_t {   // 4 bytes long describing a PDO and a RDO field
 #define P_IT_FL_SRC   0x40      // source_pdo_capability or giveback_flag=1
 #define P_IT_FL_CONT  0x80      // continue if PDO index is 1, skip otherwise
 
+// Values returned by getopt_long() for long options that have no short
+// option equivalent. Keep them out of the range of (unsigned) char.
+enum long_only_opt_e {
+    lo_profile_io = 256,
+    lo_deadline,
+    lo_cache,
+    lo_retries,
+    lo_shm,
+    lo_serve,
+    lo_max_age,
+    lo_http,
+    lo_watch,
+    lo_record,
+    lo_history,
+    lo_at,
+    lo_between,
+    lo_capture,
+    lo_replay,
+    lo_storm,
+    lo_batch,
+    lo_count,
+    lo_check,
+    lo_fields,
+    lo_arrow,
+    lo_sqlite,
+    lo_csv,
+    lo_tsv,
+    lo_fingerprint,
+    lo_check_compliance,
+};
+
+// What to do with volatile attributes (e.g. power_role) when the scan
+// results come from the cache. See the --cache[=POL] option.
+enum cache_pol_e {
+    cache_pol_off = 0,
+    cache_pol_reread,       // re-read them from sysfs (default)
+    cache_pol_flag,         // use cached values, flag them as maybe stale
+};
+
+// Number of log2 (microsecond) buckets in each latency histogram kept by
+// the --profile-io option. Bucket 0 is for less than 1 microsecond, bucket
+// k (k > 0) is for [2^(k-1), 2^k) microseconds and the last bucket takes
+// everything larger.
+#define IO_PROF_NUM_BUCKETS 24
+
+// Default number of targeted re-scan rounds, see --retries=N
+#define DEF_SCAN_RETRIES 3
+
+// Defaults and limits for the --serve=PATH service
+#define DEF_MAX_AGE_MS 1000     // default for --max-age=MS
+#define SERVE_MAX_REQ_LEN 1024
+#define SERVE_MAX_CLIENTS 64
+#define SERVE_MAX_CACHED 32     // rendered responses held by the service
+
+// Limits for the --http=[ADDR:]PORT listener
+#define HTTP_MAX_REQ_LEN 8192   // request line plus headers
+#define HTTP_IDLE_MS 30000      // keep-alive connections idle this long go
+#define HTTP_MAX_PENDING (256 * 1024)   // slow /events readers are dropped
+
+// Threads that do the blocking work (scans) of the long running modes
+#define EV_NUM_WORKERS 1
+
+// Defaults for --watch[=QUIET[,MAX]] which also apply to the re-scans that
+// events cause in --serve and --http modes
+#define DEF_WATCH_QUIET_MS 50
+#define DEF_WATCH_MAX_MS 500
+#define WATCH_MAX_QUEUED 16     // records waiting to be written to stdout
+
+// --record=FILE writes a full keyframe after this many delta records
+#define REC_KEYFRAME_EVERY 64
+
+// Per attribute (i.e. sysfs regular file name) I/O latency accumulators
+struct io_prof_elem {
+    uint64_t count {};
+    uint64_t errs {};
+    uint64_t open_ns {};        // time spent in fopen()
+    uint64_t read_ns {};        // time spent in fgets() and fclose()
+    uint64_t max_ns {};
+    uint32_t hist[IO_PROF_NUM_BUCKETS] {};
+
+    uint64_t total_ns() const noexcept { return open_ns + read_ns; }
+};
+
+// State of --profile-io option. Only get_value() adds to attr_m, holding
+// mtx since scans may be done by several threads.
+struct io_prof_t {
+    bool active {};
+    std::chrono::steady_clock::time_point start_tp;
+    std::mutex mtx;
+    std::map<sstring, io_prof_elem> attr_m;
+};
+
+// A read of one sysfs attribute handed to a worker thread when the
+// --deadline= option is given. Shared between the issuer and the worker
+// since the issuer may give up (time out) before the worker is finished.
+struct rd_job {
+    fs::path pt;
+    int max_len { };
+    int err { };                // errno from fopen(), 0 if good
+    bool done { };
+    bool taken { };             // by a worker; this and below under pool
+    bool released { };          // worker finished and back in the pool
+    bool abandoned { };         // caller gave up while worker was reading
+    uint64_t open_ns { };
+    uint64_t read_ns { };
+    sstring val;
+    std::mutex mtx;
+    std::condition_variable cv;
+};
+
+// Pool of worker threads that perform the (blocking) fopen() and fgets()
+// on behalf of get_value(). A worker stuck in a wedged read is abandoned
+// and no longer counts against max_threads, so another worker is started
+// if no worker is idle. At most max_wedged workers may be abandoned at
+// once; if a wedged read does return, its worker rejoins the pool (or
+// exits if the pool is full). Workers are detached and the pool is never
+// destroyed so exit() is not held up by a read that never returns.
+class rd_pool {
+public:
+    static constexpr int max_threads { 8 };
+    static constexpr int max_wedged { 32 };
+
+    enum class res_e {
+        done,
+        timed_out,      // 'jp' was not done before 'dl' (the deadline)
+        exhausted,      // no worker and max_wedged reached, not issued
+    };
+
+    res_e submit_wait(const std::shared_ptr<rd_job> & jp,
+                      const std::chrono::steady_clock::time_point & dl);
+
+private:
+    void worker() noexcept;
+
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::deque<std::shared_ptr<rd_job>> q_;
+    int num_threads_ { };       // excludes abandoned (wedged) workers
+    int num_idle_ { };
+    int num_wedged_ { };
+};
+
+// State of the --deadline=MS[,RUN_MS] option
+struct rd_deadline_t {
+    bool active { };
+    std::chrono::milliseconds attr_ms { };
+    std::chrono::steady_clock::time_point run_end {
+                        std::chrono::steady_clock::time_point::max() };
+    std::atomic<uint64_t> num_timeouts { };
+    std::atomic<uint64_t> num_exhausted { };    // reads not issued
+};
+
+
+// Short options for getopt_long(); '^' is --json[=JO]
+static const char * const short_opts { "^cdhj::J:lp:P:r:vVy:" };
 
 // Note that "no_argument" entries should appear in chk_short_opts
 static const struct option long_options[] = {
+    {"arrow", required_argument, 0, lo_arrow},
+    {"at", required_argument, 0, lo_at},
+    {"batch", required_argument, 0, lo_batch},
+    {"between", required_argument, 0, lo_between},
+    {"cache", optional_argument, 0, lo_cache},
     {"cap", no_argument, 0, 'c'},
     {"caps", no_argument, 0, 'c'},
+    {"capture", required_argument, 0, lo_capture},
+    {"check", required_argument, 0, lo_check},
+    {"check-compliance", optional_argument, 0, lo_check_compliance},
+    {"check_compliance", optional_argument, 0, lo_check_compliance},
+    {"count", no_argument, 0, lo_count},
     {"capability", no_argument, 0, 'c'},
     {"capabilities", no_argument, 0, 'c'},
+    {"csv", no_argument, 0, lo_csv},
     {"data", no_argument, 0, 'd'},
+    {"deadline", required_argument, 0, lo_deadline},
+    {"fields", required_argument, 0, lo_fields},
+    {"fingerprint", optional_argument, 0, lo_fingerprint},
     {"help", no_argument, 0, 'h'},
+    {"history", required_argument, 0, lo_history},
+    {"http", required_argument, 0, lo_http},
     {"json", optional_argument, 0, '^'},    /* short option is '-j' */
     {"js-file", required_argument, 0, 'J'},
     {"js_file", required_argument, 0, 'J'},
     {"long", no_argument, 0, 'l'},
+    {"max-age", required_argument, 0, lo_max_age},
+    {"max_age", required_argument, 0, lo_max_age},
     {"pdo-snk", required_argument, 0, 'p'},
     {"pdo_snk", required_argument, 0, 'p'},
     {"pdo-sink", required_argument, 0, 'p'},
     {"pdo-src", required_argument, 0, 'P'},
     {"pdo_src", required_argument, 0, 'P'},
     {"pdo-source", required_argument, 0, 'P'},
+    {"profile-io", no_argument, 0, lo_profile_io},
+    {"profile_io", no_argument, 0, lo_profile_io},
     {"rdo", required_argument, 0, 'r'},
+    {"record", required_argument, 0, lo_record},
+    {"replay", required_argument, 0, lo_replay},
+    {"retries", required_argument, 0, lo_retries},
+    {"serve", required_argument, 0, lo_serve},
+    {"shm", required_argument, 0, lo_shm},
+    {"sqlite", required_argument, 0, lo_sqlite},
+    {"storm", required_argument, 0, lo_storm},
     {"sysfsroot", required_argument, 0, 'y'},
+    {"tsv", no_argument, 0, lo_tsv},
     {"verbose", no_argument, 0, 'v'},
     {"version", no_argument, 0, 'V'},
+    {"watch", optional_argument, 0, lo_watch},
     {0, 0, 0, 0},
 };
 
@@ -397,7 +746,6 @@ static const struct do_fld_desc_t pdo_part_a[67] = {
     {0, 0, 0, 0},       // sentinel
 };
 
-static sstring sysfs_root { "/sys" };
 static const char * const upd_sn = "usb_power_delivery";
 static const char * const class_s = "class";
 static const char * const typec_s = "typec";
@@ -417,11 +765,34 @@ static const char * const num_alt_modes_sn = "number_of_alternate_modes";
 static const char * const ct_sn = "class_typec";
 static const char * const cupd_sn = "class_usb_power_delivery";
 static const char * const lsucpd_jn_sn = "lsucpd_join";
+static const char * const seqnum_sn = "uevent_seqnum";
+static const char * const cache_magic_s = "lsucpd_scan_cache 2";
+// attributes of local ports that may change without the topology changing
+static const char * const volatile_attr_a[] = {
+    "power_role", "data_role", "power_operation_mode",
+};
+
+// sysfs_tree::set_root() is defined after the names it joins
+void
+sysfs_tree::set_root(const sstring & root) noexcept
+{
+    const fs::path sc_pt { fs::path(root) / class_s };
 
-static fs::path sc_pt;
-static fs::path sc_typec_pt;
-static fs::path sc_upd_pt;
-static fs::path sc_powsup_pt;
+    root_ = root;
+    typec_pt_ = sc_pt / typec_s;
+    upd_pt_ = sc_pt / upd_sn;
+    powsup_pt_ = sc_pt / powsup_sn;
+}
+
+static io_prof_t io_prof;
+static rd_deadline_t rd_deadline;
+static snap_holder cur_snap;    // most recent scan results
+
+// Value placed in name to value maps for attributes whose read did not
+// complete before the deadline given to --deadline=
+static const char * const rd_timed_out_s = "<unavailable: read timed out>";
+static const char * const rd_exhausted_s =
+                "<unavailable: read pool exhausted>";
 
 static inline sstring filename_as_str(const fs::path & pt) noexcept
 {
@@ -430,20 +801,106 @@ static inline sstring filename_as_str(const fs::path & pt) noexcept
 
 
 static const char * const usage_message1 =
-    "Usage: lsucpd [--caps] [--data] [--help] [--json[=JO]] [--js-file=JFN]\n"
-    "              [--long] [--pdo-snk=SI_PDO[,IND]] "
-    "[--pdo-src=SO_PDO[,IND]]\n"
-    "              [--rdo=RDO,REF] [--sysfsroot=SPATH] [--verbose] "
-    "[--version]\n"
-    "              [FILTER ...]\n"
+    "Usage: lsucpd [--arrow=PREFIX] [--at=TIME] [--batch=FILE]\n"
+    "              [--between=T1[,T2]] [--cache[=POL]] [--caps] "
+    "[--capture=FILE]\n"
+    "              [--check=COND[,COND...]] [--check-compliance[=FILE]] "
+    "[--count]\n"
+    "              [--csv] [--data] [--deadline=MS[,RUN_MS]] [--fields=LIST]\n"
+    "              [--fingerprint[=MFILE]] [--help] [--history=FILE]\n"
+    "              [--http=[ADDR:]PORT] [--json[=JO]] [--js-file=JFN] "
+    "[--long]\n"
+    "              [--max-age=MS] [--pdo-snk=SI_PDO[,IND]]\n"
+    "              [--pdo-src=SO_PDO[,IND]] [--profile-io] [--rdo=RDO,REF]\n"
+    "              [--record=FILE] [--replay=FILE[,N]] [--retries=N]\n"
+    "              [--serve=PATH] [--shm=NAME] [--sqlite=DB]\n"
+    "              [--storm=RATE[,SECS]] [--sysfsroot=SPATH] [--tsv] "
+    "[--verbose]\n"
+    "              [--version] [--watch[=QUIET[,MAX]]] [FILTER ...]\n"
     "  where:\n"
+    "    --arrow=PREFIX    also write the ports and PDOs as Arrow IPC "
+    "files:\n"
+    "                      PREFIX.ports.arrow and PREFIX.pdos.arrow\n"
+    "    --at=TIME         with --history=: port table as recorded at "
+    "TIME. TIME\n"
+    "                      is 'now', '@SECS', '-N{s|m|h|d}' (ago) or\n"
+    "                      'YYYY-MM-DD[ HH:MM[:SS]]'\n"
+    "    --batch=FILE      answer each line of FILE ('-' for stdin), "
+    "made of output\n"
+    "                      options and FILTERs, from one scan. With "
+    "--json the\n"
+    "                      output is JSON lines\n"
+    "    --between=T1[,T2]    with --history=: list changes recorded "
+    "from T1 to\n"
+    "                      T2 (def: now)\n"
+    "    --cache[=POL]     keep scan results in a cache file (under "
+    "/run) that is\n"
+    "                      reused while the sysfs topology is unchanged. "
+    "POL is\n"
+    "                      'reread' (def: re-read port roles) or 'flag'\n"
     "    --caps|-c         list pd sink and source capabilities. Once: one "
     "line\n"
     "                      per capability; twice: name: 'value' pairs; "
     "three\n"
     "                      times: PDO object position 1 only (first PDO)\n"
+    "    --capture=FILE    keep running and append each relevant uevent "
+    "and the\n"
+    "                      sysfs changes each scan finds to FILE, for "
+    "--replay=\n"
+    "    --check=COND[,COND...]    as --count with a status line and exit "
+    "status\n"
+    "                      of 0 (ok), 1 (warning), 2 (critical) or 3 "
+    "(unknown).\n"
+    "                      COND is [w:]NAME{=|<|>|<=|>=}N with NAME one "
+    "of\n"
+    "                      ports, partners or pd (partners in PD mode)\n"
+    "    --check-compliance[=FILE]    instead check each pd's source and "
+    "sink\n"
+    "                      caps against USB PD rules (PDO order, ranges, "
+    "reserved\n"
+    "                      bits). FILE ('-' for stdin) has lines of "
+    "[LABEL]\n"
+    "                      {source|sink} PDO... in hex, sysfs is not "
+    "read. Exit\n"
+    "                      status is 2 if any is not compliant. Implies "
+    "--caps\n"
+    "    --count           count ports, partners and partners in PD mode "
+    "from\n"
+    "                      directory listings only\n"
+    "    --csv             instead output a row per PDO: pd, partner, caps, "
+    "index,\n"
+    "                      type, raw, min_mv, max_mv, ma, mw and flags, "
+    "comma\n"
+    "                      separated after a header row. Implies --caps\n"
     "    --data|-d         show USB data direction {device} <| {host}\n"
+    "    --deadline=MS[,RUN_MS]    each sysfs attribute read must complete "
+    "within\n"
+    "                      MS milliseconds and all within RUN_MS (def: no "
+    "limit),\n"
+    "                      otherwise the attribute is shown as "
+    "unavailable\n"
+    "    --fields=LIST     only output (and read) the listed fields of "
+    "each port:\n"
+    "                      port, partner, pd, partner_pd, ATTR, "
+    "partner.ATTR or\n"
+    "                      GRP.ATTR where GRP is [partner_]source_caps "
+    "or\n"
+    "                      [partner_]sink_caps (one value per PDO)\n"
+    "                      (e.g. '--fields=port,power_role,"
+    "source_caps.voltage')\n"
+    "    --fingerprint[=MFILE]    instead list the 64 bit fingerprint of "
+    "each pd's\n"
+    "                      source and sink caps, then each distinct PDO "
+    "set once.\n"
+    "                      MFILE maps fingerprints to charger models. "
+    "Implies --caps\n"
     "    --help|-h         this usage information\n"
+    "    --history=FILE    read a --record=FILE; lists all changes "
+    "recorded unless\n"
+    "                      --at= or --between= is given\n"
+    "    --http=[ADDR:]PORT    HTTP/1.1 listener (def ADDR: 127.0.0.1) "
+    "serving\n"
+    "                      /metrics, /state.json and /events\n"
     "    --json[=JO]|-j[=JO]     output in JSON instead of plain text\n"
     "                            use --json=? for JSON help\n"
     "    --js-file=JFN|-J JFN    JFN is a filename to which JSON output is\n"
@@ -453,21 +910,68 @@ static const char * const usage_message1 =
     "given\n"
     "                      twice display partner's alternate mode "
     "information\n"
+    "    --max-age=MS      with --serve= or --http=: oldest scan results "
+    "(in ms)\n"
+    "                      a request may be answered from (def: 1000)\n"
     "    --pdo-snk=SI_PDO[,IND]|-p SI_PDO[,IND]\n"
     "                      decode SI_PDO as sink PDO into component fields.\n"
     "                      if IND of 1 is given, fixed supplies have more\n"
     "                      fields (def: not 1). After decoding it exits.\n"
     "    --pdo-src=SO_PDO[,IND]|-P SO_PDO[,IND]\n"
     "                      similar to --pdo-snk= but for source PDO\n"
+    "    --profile-io      time each sysfs attribute open and read, then "
+    "report\n"
+    "                      latency per attribute name; twice: add "
+    "histograms\n"
     "    --rdo=RDO,REF|-r RDO,REF    RDO is a 32 bit value (def: in "
     "decimal).\n"
     "                                REF is one of F|B|V|P|A for Fixed, "
     "Battery,\n"
     "                                Variable, PPS or AVS\n"
+    "    --record=FILE     keep running and append each change of the "
+    "port table\n"
+    "                      to FILE as a compact binary record\n"
+    "    --replay=FILE[,N]    feed a --capture=FILE into the tree given by\n"
+    "                      --sysfsroot= at N times the captured speed "
+    "(def: 1;\n"
+    "                      0: no delays), then report latency and cpu "
+    "use\n"
+    "    --retries=N       re-scan rounds when the topology changes during "
+    "a scan\n"
+    "                      (def: 3); 0 only reports an inconsistent "
+    "scan\n"
+    "    --serve=PATH      listen on unix socket PATH; each request "
+    "line holds\n"
+    "                      output options and FILTERs, concurrent requests "
+    "share\n"
+    "                      scans\n"
+    "    --shm=NAME        publish ports, pd objects and decoded PDOs in "
+    "the\n"
+    "                      shared memory segment /dev/shm/NAME (see "
+    "lsucpd_shm.h)\n"
+    "    --sqlite=DB       also append what was scanned to the SQLite "
+    "database DB,\n"
+    "                      creating its tables and indexes if needed\n"
+    "    --storm=RATE[,SECS]    make RATE changes per second to the "
+    "--sysfsroot=\n"
+    "                      tree for SECS seconds (def: 10), each with a "
+    "uevent,\n"
+    "                      then report latency, missed changes and cpu "
+    "use\n"
     "    --sysfsroot=SPATH|-y SPATH    set sysfs mount point to SPATH (def: "
-    "/sys)\n"
+    "/sys).\n"
+    "                      If given more than once, the trees are scanned "
+    "in\n"
+    "                      parallel and listed one after another\n"
+    "    --tsv             like --csv but the fields are tab separated\n"
     "    --verbose|-v      increase verbosity, more debug information\n"
-    "    --version|-V      output version string and exit\n\n";
+    "    --version|-V      output version string and exit\n"
+    "    --watch[=QUIET[,MAX]]    output a record each time ports or pd "
+    "objects\n"
+    "                      change. Events are merged until QUIET ms pass "
+    "without\n"
+    "                      one (def: 50) but for no longer than MAX ms "
+    "(def: 500)\n\n";
 static const char * const usage_message2 =
     "LiSt Usb-C Power Delivery (lsucpd) information on the command line in a\n"
     "compact form. This utility obtains that information from sysfs (under:\n"
@@ -485,7 +989,7 @@ usage() noexcept
     bw::print("{}", usage_message2);
 }
 
-static sstring
+static const char *
 pdo_e_to_str(enum pdo_e p_e) noexcept
 {
     switch (p_e) {
@@ -699,51 +1203,278 @@ regex_match_noexc(const sstring & actual, const std::basic_regex<char> & pat,
     return res;
 }
 
+static void
+io_prof_add(const fs::path & vnm, uint64_t o_ns, uint64_t r_ns, bool is_err)
+            noexcept
+{
+    const uint64_t t_ns { o_ns + r_ns };
+    uint64_t us { t_ns / 1000 };
+    int k;
+
+    for (k = 0; (us > 0) && (k < (IO_PROF_NUM_BUCKETS - 1)); ++k)
+        us >>= 1;
+    try {
+        std::lock_guard<std::mutex> lk(io_prof.mtx);
+        auto & pe { io_prof.attr_m[filename_as_str(vnm)] };
+
+        ++pe.count;
+        if (is_err)
+            ++pe.errs;
+        pe.open_ns += o_ns;
+        pe.read_ns += r_ns;
+        if (t_ns > pe.max_ns)
+            pe.max_ns = t_ns;
+        ++pe.hist[k];
+    } catch (...) { }
+}
+
+static inline uint64_t
+ns_between(const std::chrono::steady_clock::time_point & from,
+           const std::chrono::steady_clock::time_point & to) noexcept
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(to -
+                                                                from).count();
+}
+
+// Reads the first line of the file named fn, up to max_len - 1 bytes, into
+// val_out less any trailing '\n'. If fopen() fails returns its errno, else
+// returns 0 . If prof is true, places the time taken by fopen() in o_ns and
+// the remainder (i.e. fgets() plus fclose()) in r_ns .
+static int
+read_attr(const char * fn, sstring & val_out, int max_len, bool prof,
+          uint64_t & o_ns, uint64_t & r_ns) noexcept
+{
+    FILE * f;
+    char * bp;
+    std::chrono::steady_clock::time_point t0, t1;
+
+    val_out.clear();
+    val_out.resize(max_len);
+    bp = val_out.data();
+    if (prof)
+        t0 = std::chrono::steady_clock::now();
+    f = fopen(fn, "r");
+    if (prof) {
+        t1 = std::chrono::steady_clock::now();
+        o_ns = ns_between(t0, t1);
+        r_ns = 0;
+    }
+    if (nullptr == f) {
+        int err { errno };
+
+        val_out.clear();
+        return err ? err : EIO;
+    }
+    if (nullptr == fgets(bp, max_len, f)) {
+        /* assume empty */
+        val_out.clear();
+    } else {
+        auto len = strlen(bp);
+        if ((len > 0) && (bp[len - 1] == '\n')) {
+            bp[len - 1] = '\0';
+            --len;
+        }
+        val_out.resize(len);
+    }
+    fclose(f);
+    if (prof)
+        r_ns = ns_between(t1, std::chrono::steady_clock::now());
+    return 0;
+}
+
+void
+rd_pool::worker() noexcept
+{
+    while (true) {
+        std::shared_ptr<rd_job> jp;
+
+        {
+            std::unique_lock<std::mutex> lk(mtx_);
+
+            ++num_idle_;
+            cv_.wait(lk, [this] { return ! q_.empty(); });
+            --num_idle_;
+            jp = std::move(q_.front());
+            q_.pop_front();
+            jp->taken = true;
+        }
+        sstring val;
+        uint64_t o_ns { }, r_ns { };
+        int err = read_attr(jp->pt.c_str(), val, jp->max_len, true, o_ns,
+                            r_ns);
+        {
+            std::lock_guard<std::mutex> lk(jp->mtx);
+
+            jp->err = err;
+            jp->val.swap(val);
+            jp->open_ns = o_ns;
+            jp->read_ns = r_ns;
+            jp->done = true;
+        }
+        jp->cv.notify_one();
+
+        std::lock_guard<std::mutex> lk(mtx_);
+
+        jp->released = true;
+        if (jp->abandoned) {    // replaced while wedged, rejoin if room
+            --num_wedged_;
+            if (num_threads_ >= max_threads)
+                return;
+            ++num_threads_;
+        }
+    }
+}
+
+rd_pool::res_e
+rd_pool::submit_wait(const std::shared_ptr<rd_job> & jp,
+                     const std::chrono::steady_clock::time_point & dl)
+{
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+
+        // idle workers may already be claimed by earlier queued jobs
+        if (num_idle_ <= static_cast<int>(q_.size())) {
+            if ((num_threads_ < max_threads) && (num_wedged_ < max_wedged)) {
+                std::thread(&rd_pool::worker, this).detach();
+                ++num_threads_;
+            } else if (0 == num_threads_)
+                return res_e::exhausted;
+        }
+        q_.push_back(jp);
+    }
+    cv_.notify_one();
+    {
+        std::unique_lock<std::mutex> lk(jp->mtx);
+
+        if (jp->cv.wait_until(lk, dl, [&jp] { return jp->done; }))
+            return res_e::done;
+    }
+    std::lock_guard<std::mutex> lk(mtx_);
+
+    if (! jp->taken) {          // still queued, so no worker is lost
+        std::erase(q_, jp);
+        return res_e::timed_out;
+    }
+    if (jp->released)           // finished after the deadline
+        return res_e::done;
+    jp->abandoned = true;
+    --num_threads_;
+    ++num_wedged_;
+    return res_e::timed_out;
+}
+
+// The --deadline= variant of get_value(). The read is issued on a worker
+// thread and abandoned if it does not complete before the earlier of the
+// per attribute and per run deadlines.
+static std::error_code
+get_value_dl(const fs::path & vnm, sstring & val_out, int max_value_len)
+             noexcept
+{
+    rd_pool::res_e rd_res { rd_pool::res_e::timed_out };
+    const auto t0 { std::chrono::steady_clock::now() };
+    const auto dl { std::min(t0 + rd_deadline.attr_ms, rd_deadline.run_end) };
+    std::error_code ec { };
+
+    val_out.clear();
+    if (t0 < dl) {
+        try {
+            auto jp { std::make_shared<rd_job>() };
+
+            jp->pt = vnm;
+            jp->max_len = max_value_len;
+            // deliberately never freed
+            static rd_pool * const poolp { new rd_pool };
+
+            rd_res = poolp->submit_wait(jp, dl);
+            if (rd_pool::res_e::done == rd_res) {
+                val_out.swap(jp->val);
+                if (jp->err)
+                    ec.assign(jp->err, std::system_category());
+                if (io_prof.active)
+                    io_prof_add(vnm, jp->open_ns, jp->read_ns, !! jp->err);
+                return ec;
+            }
+        } catch (...) {
+            ec.assign(ENOMEM, std::system_category());
+            return ec;
+        }
+    }
+    if (rd_pool::res_e::exhausted == rd_res) {
+        ++rd_deadline.num_exhausted;
+        print_err(2, "{}: read of {} not issued, all read workers are "
+                  "wedged\n", __func__, vnm.string());
+        return std::make_error_code(
+                        std::errc::resource_unavailable_try_again);
+    }
+    ++rd_deadline.num_timeouts;
+    if (io_prof.active)
+        io_prof_add(vnm, 0, ns_between(t0, std::chrono::steady_clock::now()),
+                    true);
+    print_err(2, "{}: read of {} timed out\n", __func__, vnm.string());
+    return std::make_error_code(std::errc::timed_out);
+}
+
+// Returns the value shown for an attribute whose read under --deadline=
+// timed out or could not be issued, else nullptr
+static const char *
+rd_unavail_val(const std::error_code & ec) noexcept
+{
+    if (ec == std::errc::timed_out)
+        return rd_timed_out_s;
+    if (ec == std::errc::resource_unavailable_try_again)
+        return rd_exhausted_s;
+    return nullptr;
+}
+
+// True if v holds one of the values from rd_unavail_val()
+static bool
+rd_is_unavail(const sstring & v) noexcept
+{
+    return (v == rd_timed_out_s) || (v == rd_exhausted_s);
+}
+
 // If base_name.empty() is true, just use dir_or_fn_pt as name. If good
-// and last char in val_out is '\n' then erase it.
+// and last char in val_out is '\n' then erase it. When --profile-io is
+// active the time taken by the open and the read is accumulated against
+// the filename of the attribute. When --deadline= is active the read is
+// done by a worker thread and may fail with std::errc::timed_out , or with
+// std::errc::resource_unavailable_try_again if it could not be issued
+// (see rd_unavail_val()).
 // Returns errno in ec.value() if ec() is true, else returns false for good
 static std::error_code
 get_value(const fs::path & dir_or_fn_pt, const sstring & base_name,
           sstring & val_out, int max_value_len = 32) noexcept
 {
-    FILE * f;
-    char * bp;
+    const bool prof { io_prof.active };
+    int err;
+    uint64_t o_ns { }, r_ns { };
     fs::path vnm { base_name.empty() ? dir_or_fn_pt :
                                        dir_or_fn_pt / base_name };
     std::error_code ec { };
 
-    val_out.clear();
-    val_out.resize(max_value_len);
-    bp = val_out.data();
-    if (nullptr == (f = fopen(vnm.c_str(), "r"))) {
-        ec.assign(errno, std::system_category());
+    if (rd_deadline.active)
+        return get_value_dl(vnm, val_out, max_value_len);
+    err = read_attr(vnm.c_str(), val_out, max_value_len, prof, o_ns, r_ns);
+    if (prof)
+        io_prof_add(vnm, o_ns, r_ns, !! err);
+    if (err) {
+        ec.assign(err, std::system_category());
         print_err(6, "{}: unable to fopen: {}\n", __func__, vnm.string());
-        return ec;
     }
-    if (nullptr == fgets(bp, max_value_len, f)) {
-        /* assume empty */
-        val_out.clear();
-        fclose(f);
-        return ec;
-    }
-    auto len = strlen(bp);
-    if ((len > 0) && (bp[len - 1] == '\n')) {
-        bp[len - 1] = '\0';
-        --len;
-    }
-    // val_out = std::move( sstring { bp, len } );
-    val_out.assign(bp, len);
-    fclose(f);
     return ec;
 }
 
 /* If returned ec.value() is 0 (good return) then the directory dir_pt
  * has been scanned and all regular file names with the corresponding
  * contents form a pair inserted into map_io. Hidden files (files starting
- * with ".") are skipped. Only the first 32 bytes of each file are read. */
+ * with ".") are skipped. Only the first 32 bytes of each file are read.
+ * Files whose read exceeds the --deadline= (or is not issued) are given
+ * the value from rd_unavail_val() and the scan continues. A failure is
+ * reported at verbosity vb (see torn_vb()) unless dir_pt has gone, which
+ * is left to the caller. */
 static std::error_code
 map_d_regu_files(const fs::path & dir_pt, strstr_m & map_io,
-              bool ignore_uevent = true) noexcept
+              bool ignore_uevent = true, int vb = -1) noexcept
 {
     std::error_code ecc { };
     std::error_code ec { };
@@ -767,19 +1498,41 @@ map_d_regu_files(const fs::path & dir_pt, strstr_m & map_io,
             if (ignore_uevent && (name == "uevent"))
                 continue;
             ec = get_value(*itr, empty_str, val);
-            if (ec)
+            if (const char * ccp = rd_unavail_val(ec)) {
+                map_io[name] = ccp;
+                ec.clear();
+                continue;
+            } else if (ec)
                 break;
             map_io[name] = val;
         } else if (ec)
             break;
     }
     if (ecc) {
-        pr3ser(-1, dir_pt, "<< was scanning when failed", ec);
+        if (ecc == std::errc::no_such_file_or_directory)
+            vb = 3;
+        pr3ser(vb, dir_pt, "<< was scanning when failed", ecc);
         ec = ecc;
     }
     return ec;
 }
 
+// Outputs one sysfs attribute as name='value' in plain text and as a named
+// JSON string. Attributes whose read timed out (see --deadline=) are shown
+// as unavailable and given a JSON null value.
+static void
+pr_attr_nv(sgj_state * jsp, sgj_opaque_p jop, const char * lead,
+           const sstring & n, const sstring & v) noexcept
+{
+    if (rd_is_unavail(v)) {
+        sgj_hr_pri(jsp, "{}{}: {}\n", lead, n, v);
+        sgj_js_nv_o(jsp, jop, n.c_str(), sgj_new_unattached_null_r(jsp));
+    } else {
+        sgj_hr_pri(jsp, "{}{}='{}'\n", lead, n, v);
+        sgj_js_nv_s(jsp, jop, n.c_str(), v.c_str());
+    }
+}
+
 // Expect to find keys: "power_role" and "power_operation_mode" in 'm'.
 static bool
 query_power_dir(const std::map<sstring, sstring> & m, bool & is_source,
@@ -890,22 +1643,25 @@ get_unitless(const sstring & name, const strstr_m & m) noexcept
 }
 
 static void
-build_raw_pdo(const fs::path & pt, pdo_elem & a_pdo) noexcept
+build_raw_pdo(const fs::path & pt, pdo_elem & a_pdo, int vb) noexcept
 {
     bool src_caps { a_pdo.is_source_caps_ };
     unsigned int mv, ma, mw;
     uint32_t r_pdo { };
     uint32_t v;
-    std::error_code ec { map_d_regu_files(pt, a_pdo.ascii_pdo_m_) };
+    std::error_code ec { map_d_regu_files(pt, a_pdo.ascii_pdo_m_, true,
+                                          vb) };
 
     if (ec) {
-        pr3ser(-1, pt, "failed in map_d_regu_files()", ec);
+        pr3ser(vb, pt, "failed in map_d_regu_files()", ec);
         a_pdo.raw_pdo_ = 0;
         return;
     }
     const auto & ss_map { a_pdo.ascii_pdo_m_ };
 
-    if (ss_map.empty()) {
+    a_pdo.raw_unavail_ = std::ranges::any_of(ss_map, [](const auto & nv) {
+                                return rd_is_unavail(nv.second); });
+    if (ss_map.empty() || a_pdo.raw_unavail_) {
         a_pdo.raw_pdo_ = 0;
         return;
     }
@@ -988,6 +1744,17 @@ build_raw_pdo(const fs::path & pt, pdo_elem & a_pdo) noexcept
         }
         break;
     case pdo_e::apdo_spr_avs:   // APDO: B31...B30: 11b; B29...B28: 10b [SPR]
+        r_pdo = 3 << 30;
+        r_pdo |= 2 << 28;
+        ma = get_milliamps("maximum_current_9V_to_15V", ss_map);
+        r_pdo |= (ma / 10) & 0x3ff;
+        ma = get_milliamps("maximum_current_15V_to_20V", ss_map);
+        r_pdo |= ((ma / 10) & 0x3ff) << 10;
+        if (src_caps) {
+            v = get_unitless("peak_current", ss_map);
+            if (v)
+                r_pdo |= (v & 3) << 26;
+        }
         break;
     case pdo_e::apdo_epr_avs:   // APDO: B31...B30: 11b; B29...B28: 01b [EPR]
         r_pdo = 3 << 30;
@@ -1009,6 +1776,9 @@ build_raw_pdo(const fs::path & pt, pdo_elem & a_pdo) noexcept
     a_pdo.raw_pdo_ = r_pdo;
 }
 
+// Text summary of a PDO with its decoded values added to jop. A value that
+// was unavailable (see --deadline=) is a JSON null and the summary shows
+// the PDO's type followed by why, rather than a 0 reading.
 static sstring
 build_summary_s(const pdo_elem & a_pdo, struct opts_t * op,
                 sgj_opaque_p jop) noexcept
@@ -1018,8 +1788,11 @@ build_summary_s(const pdo_elem & a_pdo, struct opts_t * op,
     uint32_t v;
     sgj_state * jsp { &op->json_st };
     const char * ccp;
+    const char * unavail_s { };
     const auto & pt { a_pdo.pdo_d_p_ };
-    std::error_code ec { map_d_regu_files(pt, a_pdo.ascii_pdo_m_) };
+    std::error_code ec { };
+    strstr_m io_m;
+    sstring res;
     static const char * v_sn = "voltage";
     static const char * max_v_sn = "maximum_voltage";
     static const char * min_v_sn = "minimum_voltage";
@@ -1034,97 +1807,190 @@ build_summary_s(const pdo_elem & a_pdo, struct opts_t * op,
     static const char * u_ma_s = "unit: milliAmp";
     static const char * u_mw_s = "unit: milliWatt";
 
+    // a snapshot already holds the PDO's attributes, avoid sysfs I/O. Don't
+    // modify a_pdo as other threads may be reading it
+    if (a_pdo.ascii_pdo_m_.empty())
+        ec = map_d_regu_files(pt, io_m);
     if (ec) {
         pr3ser(-1, pt, "failed in map_d_regu_files()", ec);
         return "";
     }
-    const auto & ss_map { a_pdo.ascii_pdo_m_ };
+    const auto & ss_map { a_pdo.ascii_pdo_m_.empty() ? io_m :
+                                                       a_pdo.ascii_pdo_m_ };
 
     if (ss_map.empty())
         return "";
-    strstr_m::const_iterator it;
-    const strstr_m::const_iterator it_end { };
+    // adds the decoded value of attribute nm to jop, or null if it was
+    // unavailable
+    auto js_val = [&](const char * nm, unsigned int val, const char * u) {
+        const auto it { ss_map.find(nm) };
+
+        if ((it != ss_map.end()) && rd_is_unavail(it->second)) {
+            if (nullptr == unavail_s)
+                unavail_s = it->second.c_str();
+            sgj_js_nv_o(jsp, jop, nm, sgj_new_unattached_null_r(jsp));
+        } else
+            sgj_js_nv_ihex_nex(jsp, jop, nm, val, false, u);
+    };
 
     switch (a_pdo.pdo_el_) {
     case pdo_e::pdo_fixed:      // B31...B30: 00b
         mv = get_millivolts(v_sn, ss_map);
-        sgj_js_nv_ihex_nex(jsp, jop, v_sn, mv, false, u_mv_s);
+        js_val(v_sn, mv, u_mv_s);
         ccp = src_caps ? max_a_sn : op_a_sn;
         ma = get_milliamps(ccp, ss_map);
-        sgj_js_nv_ihex_nex(jsp, jop, ccp, ma, false, u_ma_s);
-        return fmt_to_str("fixed: {}.{:02} Volts, {}.{:02} Amps ({})",
-                          mv / 1000, (mv % 1000) / 10, ma / 1000,
-                          (ma % 1000) / 10, (src_caps ? "max" : "op"));
+        js_val(ccp, ma, u_ma_s);
+        res = fmt_to_str("fixed: {}.{:02} Volts, {}.{:02} Amps ({})",
+                         mv / 1000, (mv % 1000) / 10, ma / 1000,
+                         (ma % 1000) / 10, (src_caps ? "max" : "op"));
+        break;
     case pdo_e::pdo_battery:    // B31...B30: 01b
         ccp = src_caps ? max_all_p_sn : op_p_sn;
         mw = get_milliwatts(ccp, ss_map);
-        sgj_js_nv_ihex_nex(jsp, jop, ccp, mw, false, u_mw_s);
+        js_val(ccp, mw, u_mw_s);
         mv_min = get_millivolts(min_v_sn, ss_map);
-        sgj_js_nv_ihex_nex(jsp, jop, min_v_sn, mv_min, false, u_mv_s);
+        js_val(min_v_sn, mv_min, u_mv_s);
         mv = get_millivolts(max_v_sn, ss_map);
-        sgj_js_nv_ihex_nex(jsp, jop, max_v_sn, mv, false, u_mv_s);
-        return fmt_to_str("battery: {}.{:02} to {}.{:02} Volts, "
-                          "{}.{:02} Watts ({})",
-                          mv_min / 1000, (mv_min % 1000) / 10,
-                          mv / 1000, (mv % 1000) / 10,
-                          mw / 1000, (mw % 1000) / 10,
-                          (src_caps ? "max" : "op"));
+        js_val(max_v_sn, mv, u_mv_s);
+        res = fmt_to_str("battery: {}.{:02} to {}.{:02} Volts, "
+                         "{}.{:02} Watts ({})",
+                         mv_min / 1000, (mv_min % 1000) / 10,
+                         mv / 1000, (mv % 1000) / 10,
+                         mw / 1000, (mw % 1000) / 10,
+                         (src_caps ? "max" : "op"));
+        break;
     case pdo_e::pdo_variable:   // B31...B30: 10b
         ccp = src_caps ? max_a_sn : op_a_sn;
         ma = get_milliamps(ccp, ss_map);
-        sgj_js_nv_ihex_nex(jsp, jop, ccp, ma, false, u_ma_s);
+        js_val(ccp, ma, u_ma_s);
         mv_min = get_millivolts(min_v_sn, ss_map);
-        sgj_js_nv_ihex_nex(jsp, jop, min_v_sn, mv_min, false, u_mv_s);
+        js_val(min_v_sn, mv_min, u_mv_s);
         mv = get_millivolts(max_v_sn, ss_map);
-        sgj_js_nv_ihex_nex(jsp, jop, max_v_sn, mv, false, u_mv_s);
-        return fmt_to_str("variable: {}.{:02} to {}.{:02} Volts, "
-                          "{}.{:02} Amps ({})",
-                          mv_min / 1000, (mv_min % 1000) / 10,
-                          mv / 1000, (mv % 1000) / 10,
-                          ma / 1000, (ma % 1000) / 10,
-                          (src_caps ? "max" : "op"));
+        js_val(max_v_sn, mv, u_mv_s);
+        res = fmt_to_str("variable: {}.{:02} to {}.{:02} Volts, "
+                         "{}.{:02} Amps ({})",
+                         mv_min / 1000, (mv_min % 1000) / 10,
+                         mv / 1000, (mv % 1000) / 10,
+                         ma / 1000, (ma % 1000) / 10,
+                         (src_caps ? "max" : "op"));
+        break;
     case pdo_e::apdo_pps:       // APDO: B31...B30: 11b; B29...B28: 00b [SPR]
         ma = get_milliamps(max_a_sn, ss_map);
-        sgj_js_nv_ihex_nex(jsp, jop, max_a_sn, ma, false, u_ma_s);
+        js_val(max_a_sn, ma, u_ma_s);
         mv_min = get_millivolts(min_v_sn, ss_map);
-        sgj_js_nv_ihex_nex(jsp, jop, min_v_sn, mv_min, false, u_mv_s);
+        js_val(min_v_sn, mv_min, u_mv_s);
         mv = get_millivolts(max_v_sn, ss_map);
-        sgj_js_nv_ihex_nex(jsp, jop, max_v_sn, mv, false, u_mv_s);
+        js_val(max_v_sn, mv, u_mv_s);
         v = (src_caps ? get_unitless(ppl_sn, ss_map) : 0);
         if (src_caps)
-            sgj_js_nv_ihex_nex(jsp, jop, ppl_sn, v, false,
-                               "Pps Power Limited");
-        return fmt_to_str("pps: {}.{:02} to {}.{:02} Volts, "
-                          "{}.{:02} Amps (max){}",
-                          mv_min / 1000, (mv_min % 1000) / 10,
-                          mv / 1000, (mv % 1000) / 10,
-                          ma / 1000, (ma % 1000) / 10,
-                          (v ? " [PL]" : ""));
+            js_val(ppl_sn, v, "Pps Power Limited");
+        res = fmt_to_str("pps: {}.{:02} to {}.{:02} Volts, "
+                         "{}.{:02} Amps (max){}",
+                         mv_min / 1000, (mv_min % 1000) / 10,
+                         mv / 1000, (mv % 1000) / 10,
+                         ma / 1000, (ma % 1000) / 10,
+                         (v ? " [PL]" : ""));
+        break;
     case pdo_e::apdo_spr_avs:   // APDO: B31...B30: 11b; B29...B28: 10b [SPR]
     case pdo_e::apdo_epr_avs:   // APDO: B31...B30: 11b; B29...B28: 01b [EPR]
         mw = get_milliwatts(pdp_sn, ss_map);
-        sgj_js_nv_ihex_nex(jsp, jop, pdp_sn, mw, false, u_mw_s);
+        js_val(pdp_sn, mw, u_mw_s);
         mv_min = get_millivolts(min_v_sn, ss_map);
-        sgj_js_nv_ihex_nex(jsp, jop, min_v_sn, mv_min, false, u_mv_s);
+        js_val(min_v_sn, mv_min, u_mv_s);
         mv = get_millivolts(max_v_sn, ss_map);
-        sgj_js_nv_ihex_nex(jsp, jop, max_v_sn, mv, false, u_mv_s);
-        mv = get_millivolts("maximum_voltage", ss_map);
+        js_val(max_v_sn, mv, u_mv_s);
         v = (src_caps ? get_unitless(pk_a_sn, ss_map) : 0);
         if (src_caps)
-            sgj_js_nv_ihex_nex(jsp, jop, pk_a_sn, v, false, "unitless");
-        return fmt_to_str("avs: {}.{:02} to {}.{:02} Volts, "
-                          "{}.{:02} Watts, Peak current setting {}",
-                          mv_min / 1000, (mv_min % 1000) / 10,
-                          mv / 1000, (mv % 1000) / 10,
-                          mw / 1000, (mw % 1000) / 10, v);
+            js_val(pk_a_sn, v, "unitless");
+        res = fmt_to_str("avs: {}.{:02} to {}.{:02} Volts, "
+                         "{}.{:02} Watts, Peak current setting {}",
+                         mv_min / 1000, (mv_min % 1000) / 10,
+                         mv / 1000, (mv % 1000) / 10,
+                         mw / 1000, (mw % 1000) / 10, v);
+        break;
     default:
         return "";
     }
+    if (unavail_s)      // keep the type, e.g. "fixed: "
+        res = res.substr(0, res.find(' ') + 1) + unavail_s;
+    return res;
+}
+
+// The raw PDO in hex, or why it was not built
+static sstring
+raw_pdo_str(const pdo_elem & a_pdo) noexcept
+{
+    if (a_pdo.raw_unavail_)
+        return "<unavailable: attribute not read>";
+    return fmt_to_str("0x{:08x}", a_pdo.raw_pdo_);
+}
+
+// Decoded values of a PDO in milliVolts, milliAmps and milliWatts. Those
+// that do not apply to the PDO's type are 0. A fixed supply has its
+// voltage in both mv_min and mv_max .
+struct pdo_vals_t {
+    unsigned int mv_min;
+    unsigned int mv_max;
+    unsigned int ma;
+    unsigned int mw;
+};
+
+static pdo_vals_t
+decode_pdo_vals(const pdo_elem & a_pdo) noexcept
+{
+    bool src_caps { a_pdo.is_source_caps_ };
+    pdo_vals_t res { };
+    strstr_m io_m;
+
+    if (a_pdo.ascii_pdo_m_.empty()) {
+        std::error_code ec { map_d_regu_files(a_pdo.pdo_d_p_, io_m) };
+        if (ec) {
+            pr3ser(0, a_pdo.pdo_d_p_, "failed in map_d_regu_files()", ec);
+            return res;
+        }
+    }
+    const auto & ss_map { a_pdo.ascii_pdo_m_.empty() ? io_m :
+                                                       a_pdo.ascii_pdo_m_ };
+    switch (a_pdo.pdo_el_) {
+    case pdo_e::pdo_fixed:
+        res.mv_min = get_millivolts("voltage", ss_map);
+        res.mv_max = res.mv_min;
+        res.ma = get_milliamps(src_caps ? "maximum_current" :
+                                          "operational_current", ss_map);
+        break;
+    case pdo_e::pdo_battery:
+        res.mw = get_milliwatts(src_caps ? "maximum_allowable_power" :
+                                           "operational_power", ss_map);
+        res.mv_min = get_millivolts("minimum_voltage", ss_map);
+        res.mv_max = get_millivolts("maximum_voltage", ss_map);
+        break;
+    case pdo_e::pdo_variable:
+        res.ma = get_milliamps(src_caps ? "maximum_current" :
+                                          "operational_current", ss_map);
+        res.mv_min = get_millivolts("minimum_voltage", ss_map);
+        res.mv_max = get_millivolts("maximum_voltage", ss_map);
+        break;
+    case pdo_e::apdo_pps:
+        res.ma = get_milliamps("maximum_current", ss_map);
+        res.mv_min = get_millivolts("minimum_voltage", ss_map);
+        res.mv_max = get_millivolts("maximum_voltage", ss_map);
+        break;
+    case pdo_e::apdo_spr_avs:
+    case pdo_e::apdo_epr_avs:
+        res.mw = get_milliwatts("pdp", ss_map);
+        res.mv_min = get_millivolts("minimum_voltage", ss_map);
+        res.mv_max = get_millivolts("maximum_voltage", ss_map);
+        break;
+    default:
+        break;
+    }
+    return res;
 }
 
+// Errors are reported at verbosity vb, see torn_vb()
 static std::error_code
 populate_pdos(const fs::path & cap_pt, bool is_source_caps,
-              upd_dir_elem & val, const struct opts_t * op) noexcept
+              upd_dir_elem & val, const struct opts_t * op, int vb) noexcept
 {
     std::error_code ecc { };
     std::vector<pdo_elem> pdo_el_v;
@@ -1163,15 +2029,17 @@ populate_pdos(const fs::path & cap_pt, bool is_source_caps,
                         a_pdo.pdo_el_ = pdo_e::pdo_null;
 
                     a_pdo.pdo_d_p_ = pt;
-                    if (op->do_long > 0)
-                        build_raw_pdo(pt, a_pdo);
+                    if ((op->do_long > 0) || op->scan_all ||
+                        op->pdo_sep || op->do_fingerprint ||
+                        op->do_compliance)
+                        build_raw_pdo(pt, a_pdo, vb);
                     pdo_el_v.push_back(a_pdo);
                 }
             }
         }
     }
     if (ecc)
-        pr3ser(-1, cap_pt, "was scanning when failed", ecc);
+        pr3ser(vb, cap_pt, "was scanning when failed", ecc);
     if (pdo_el_v.size() > 1)
         std::ranges::sort(pdo_el_v);
 
@@ -1183,23 +2051,28 @@ populate_pdos(const fs::path & cap_pt, bool is_source_caps,
 }
 
 static std::error_code
-populate_src_snk_pdos(upd_dir_elem & val, const struct opts_t * op) noexcept
+populate_src_snk_pdos(upd_dir_elem & val, const struct opts_t * op,
+                      int vb = -1) noexcept
 {
     std::error_code ec { }, ec2 { };
     const fs::path & pd_pt { val.path() };
 
+    if (val.pdos_populated_)
+        return ec;
     const auto src_cap_pt = pd_pt / src_cap_s;
     if (fs::exists(src_cap_pt, ec)) {
         pr3ser(3, src_cap_pt, "exists");
-        ec = populate_pdos(src_cap_pt, true, val, op);
+        ec = populate_pdos(src_cap_pt, true, val, op, vb);
     }
     const auto sink_cap_pt = pd_pt / sink_cap_s;
     if (fs::exists(sink_cap_pt, ec)) {
         pr3ser(3, sink_cap_pt, "exists");
-        ec2 = populate_pdos(sink_cap_pt, false, val, op);
+        ec2 = populate_pdos(sink_cap_pt, false, val, op, vb);
     }
     print_err(4, "Number of source PDOs: {}, number of sink PDOs: {}\n",
               val.source_pdo_v_.size(), val.sink_pdo_v_.size());
+    if (! (ec || ec2))
+        val.pdos_populated_ = true;
     return ec ? ec : ec2;
 }
 
@@ -1279,12 +2152,43 @@ pd_is_partner(int pd_inum, const struct opts_t * op) noexcept
     return false;
 }
 
+// Reads the alternate mode sub-directories (e.g. port0-partner.0) of a port
+// or partner, as counted by its number_of_alternate_modes attribute, into
+// de.alt_md_v_ .
+static void
+load_alt_modes(tc_dir_elem & de) noexcept
+{
+    unsigned int n_a_m { };
+    std::error_code ec { };
+    const sstring basename { filename_as_str(de.path()) };
+    const auto it { de.tc_sdir_reg_m.find(num_alt_modes_sn) };
+
+    de.alt_md_v_.clear();
+    if (it == de.tc_sdir_reg_m.end())
+        return;
+    if (1 != sscanf(it->second.c_str(), "%u", &n_a_m)) {
+        print_err(1, "unable to decode {}\n", num_alt_modes_sn);
+        return;
+    }
+    for (unsigned int k = 0; k < n_a_m; ++k) {
+        const auto alt_md_pt { de.path() /
+                               sstring(basename + "." + std::to_string(k)) };
+        if (fs::is_directory(alt_md_pt, ec)) {
+            strstr_m nv_m;
+
+            ec = map_d_regu_files(alt_md_pt, nv_m);
+            if (ec)
+                nv_m.clear();
+            de.alt_md_v_.emplace_back(alt_md_pt.string(), std::move(nv_m));
+        }
+    }
+}
+
 static std::error_code
 list_port(const tc_dir_elem & entry, struct opts_t * op,
           sgj_opaque_p jop) noexcept
 {
     bool want_alt_md = (op->do_long > 1);
-    unsigned int n_a_m { };
     std::error_code ec { };
     sgj_state * jsp { &op->json_st };
     sgj_opaque_p jo2p;
@@ -1300,37 +2204,16 @@ list_port(const tc_dir_elem & entry, struct opts_t * op,
         sgj_hr_pri(jsp, "{}{}:\n", (is_ptner ? "   " : "> "), basename);
     }
     if (entry.is_directory(ec) && entry.is_symlink(ec)) {
-        for (auto&& [n, v] : entry.tc_sdir_reg_m) {
-            sgj_hr_pri(jsp, "      {}='{}'\n", n, v);
-            sgj_js_nv_s(jsp, jop, n.c_str(), v.c_str());
-            if (want_alt_md && (n == num_alt_modes_sn)) {
-                /* only one should match, need to visit the rest */
-                if (1 != sscanf(v.c_str(), "%u", &n_a_m)) {
-                    print_err(1, "unable to decode {}\n", num_alt_modes_sn);
-                    continue;
-                }
-            }
-        }
-        if (n_a_m > 0) {
+        for (auto&& [n, v] : entry.tc_sdir_reg_m)
+            pr_attr_nv(jsp, jop, "      ", n, v);
+        if (want_alt_md && (! entry.alt_md_v_.empty())) {
             jap = sgj_named_subarray_r(jsp, jop, "alternate_mode_list");
-            for (unsigned int k = 0; k < n_a_m; ++k) {
-                const auto alt_md_pt { entry.path() /
-                            sstring(basename + "." + std::to_string(k)) };
-                if (fs::is_directory(alt_md_pt, ec)) {
-                    strstr_m nv_m;
-
-                    jo2p = sgj_new_unattached_object_r(jsp);
-                    ec = map_d_regu_files(alt_md_pt, nv_m);
-                    sgj_hr_pri(jsp, "      Alternate mode: {}\n",
-                               alt_md_pt.string());
-                    if (! ec) {
-                        for (auto&& [n, v] : nv_m) {
-                            sgj_hr_pri(jsp, "        {}='{}'\n", n, v);
-                            sgj_js_nv_s(jsp, jo2p, n.c_str(), v.c_str());
-                        }
-                    }
-                    sgj_js_nv_o(jsp, jap, nullptr, jo2p);
-                }
+            for (const auto & [alt_md_s, nv_m] : entry.alt_md_v_) {
+                jo2p = sgj_new_unattached_object_r(jsp);
+                sgj_hr_pri(jsp, "      Alternate mode: {}\n", alt_md_s);
+                for (auto&& [n, v] : nv_m)
+                    pr_attr_nv(jsp, jo2p, "        ", n, v);
+                sgj_js_nv_o(jsp, jap, nullptr, jo2p);
             }
         }
     } else {
@@ -1363,8 +2246,8 @@ list_pd(int pd_num, const upd_dir_elem & upd_d_el,
                 sgj_hr_pri(jsp, "  >> {}; {}\n", pdo_nm,
                            build_summary_s(a_pdo, op, jo3p));
                 if (op->do_long > 0)
-                    sgj_hr_pri(jsp, "        raw_pdo: 0x{:08x}\n",
-                               a_pdo.raw_pdo_);
+                    sgj_hr_pri(jsp, "        raw_pdo: {}\n",
+                               raw_pdo_str(a_pdo));
                 continue;
             } else if (op->do_caps > 2) {
                 if (a_pdo.pdo_ind_ > 1)
@@ -1384,19 +2267,15 @@ list_pd(int pd_num, const upd_dir_elem & upd_d_el,
                            "map_d_regu_files()", ec);
                     break;
                 }
-                for (auto&& [n, v] : map_io) {
-                    sgj_hr_pri(jsp, "      {}='{}'\n", n, v);
-                    sgj_js_nv_s(jsp, jo3p, n.c_str(), v.c_str());
-                }
+                for (auto&& [n, v] : map_io)
+                    pr_attr_nv(jsp, jo3p, "      ", n, v);
             } else {
-                for (auto&& [n, v] : a_pdo.ascii_pdo_m_) {
-                    sgj_hr_pri(jsp, "      {}='{}'\n", n, v);
-                    sgj_js_nv_s(jsp, jo3p, n.c_str(), v.c_str());
-                }
+                for (auto&& [n, v] : a_pdo.ascii_pdo_m_)
+                    pr_attr_nv(jsp, jo3p, "      ", n, v);
             }
             if (op->do_long > 0)
-                sgj_hr_pri(jsp, "        raw_pdo: 0x{:08x}\n",
-                           a_pdo.raw_pdo_);
+                sgj_hr_pri(jsp, "        raw_pdo: {}\n",
+                           raw_pdo_str(a_pdo));
         }
     }
     if (ec)
@@ -1416,8 +2295,8 @@ list_pd(int pd_num, const upd_dir_elem & upd_d_el,
                 sgj_hr_pri(jsp, "   >> {}; {}\n", pdo_nm,
                            build_summary_s(a_pdo, op, jo3p));
                 if (op->do_long > 0)
-                    sgj_hr_pri(jsp, "        raw_pdo: 0x{:08x}\n",
-                               a_pdo.raw_pdo_);
+                    sgj_hr_pri(jsp, "        raw_pdo: {}\n",
+                               raw_pdo_str(a_pdo));
                 continue;
             } else if (op->do_caps > 2) {
                 if (a_pdo.pdo_ind_ > 1)
@@ -1437,114 +2316,183 @@ list_pd(int pd_num, const upd_dir_elem & upd_d_el,
                            "map_d_regu_files()", ec);
                     break;
                 }
-                for (auto&& [n, v] : map_io) {
-                    sgj_hr_pri(jsp, "      {}='{}'\n", n, v);
-                    sgj_js_nv_s(jsp, jo3p, n.c_str(), v.c_str());
-                }
+                for (auto&& [n, v] : map_io)
+                    pr_attr_nv(jsp, jo3p, "      ", n, v);
             } else {
-                for (auto&& [n, v] : a_pdo.ascii_pdo_m_) {
-                    sgj_hr_pri(jsp, "      {}='{}'\n", n, v);
-                    sgj_js_nv_s(jsp, jo3p, n.c_str(), v.c_str());
-                }
+                for (auto&& [n, v] : a_pdo.ascii_pdo_m_)
+                    pr_attr_nv(jsp, jo3p, "      ", n, v);
             }
             if (op->do_long > 0)
-                sgj_hr_pri(jsp, "        raw_pdo: 0x{:08x}\n", a_pdo.raw_pdo_);
+                sgj_hr_pri(jsp, "        raw_pdo: {}\n",
+                           raw_pdo_str(a_pdo));
         }
     }
     return ec;
 }
 
-/* Populates op->tc_de_v[0..n-1] {vector of 'struct tc_dir_elem' objects} with
- * initial class/typec sysfs information. Any users of op->tc_de_v[0..n-1]
- * need this function called first. */
-static std::error_code
-scan_for_typec_obj(bool & ucsi_psup_possible, struct opts_t * op) noexcept
+// Verbosity of errors on objects that may be torn (e.g. a partner detached
+// mid-scan): while consistent_scan() has --retries= rounds left they will
+// be re-scanned, so only shown with -v; once the budget is used up they
+// are always shown.
+static int
+torn_vb(const struct opts_t * op) noexcept
 {
-    std::error_code ec { };
-    std::error_code ecc { };    // only use for directory_iterator failure
-
-    // choose traditional for loop over range-based for, for flexibility
-    for (fs::directory_iterator itr(sc_typec_pt, dir_opt, ecc);
-         (! ecc) && itr != end_itr;
-         itr.increment(ecc) ) {
-        const fs::path & it_pt { itr->path() };
-        const sstring basename = it_pt.filename();
+    return (op->scan_rounds < op->scan_retries) ? 0 : -1;
+}
 
-        pr3ser(4, basename, "filename() of entry in /sys/class/typec");
-        const char * base_s = basename.data();
-        tc_dir_elem de { *itr };
+/* Scans one port<num>[-partner] entry (de) of class/typec and if
+ * successful appends a tc_dir_elem object to op->tc_de_v . A failure after
+ * the port number is known is assumed to be a torn read (e.g. the partner
+ * was detached mid-scan) so that port number is added to op->torn_port_s
+ * for a later targeted re-scan. ENOENT (the entry, or the pd object it
+ * links to, has gone) is not reported while retries remain; after that it
+ * is left to the caller's "scan still inconsistent" report. */
+static void
+scan_one_typec(const fs::directory_entry & dent, bool & ucsi_psup_possible,
+               struct opts_t * op) noexcept
+{
+    const int vb { torn_vb(op) };
+    std::error_code ec { };
+    const fs::path & it_pt { dent.path() };
+    const sstring basename = it_pt.filename();
+
+    pr3ser(4, basename, "filename() of entry in /sys/class/typec");
+    const char * base_s = basename.data();
+    tc_dir_elem de { dent };
+    auto map_failed = [&]() {
+        if (ec == std::errc::no_such_file_or_directory)
+            pr3ser(vb ? 0 : 3, it_pt, "has gone, detached mid-scan?", ec);
+        else
+            pr3ser(vb, it_pt, "failed in map_d_regu_files()", ec);
+        op->torn_port_s.insert(de.port_num_);
+    };
 
-        if (itr->is_directory(ec) && itr->is_symlink(ec)) {
+    if (dent.is_directory(ec) && dent.is_symlink(ec)) {
 
-            if (1 != sscanf(base_s, "port%u", &de.port_num_)) {
-                pr3ser(0, it_pt, "unable to decode 'port<num>', skip");
-                continue;
+        if (1 != sscanf(base_s, "port%u", &de.port_num_)) {
+            pr3ser(0, it_pt, "unable to decode 'port<num>', skip");
+            return;
+        } else {
+            de.match_str_ = sstring("p") + std::to_string(de.port_num_);
+            if (strstr(base_s, "partner")) {
+                // needs C++23: if (basename.contains("partner"))
+                ec = map_d_regu_files(it_pt, de.tc_sdir_reg_m, true, vb);
+                if (ec) {
+                    map_failed();
+                    return;
+                }
+                de.partner_ = true;
+                de.match_str_ += "p";
             } else {
-                de.match_str_ = sstring("p") + std::to_string(de.port_num_);
-                if (strstr(base_s, "partner")) {
-                    // needs C++23: if (basename.contains("partner"))
-                    ec = map_d_regu_files(it_pt, de.tc_sdir_reg_m);
-                    if (ec) {
-                        pr3ser(-1, it_pt, "failed in map_d_regu_files()", ec);
-                        continue;
-                    }
-                    de.partner_ = true;
-                    de.match_str_ += "p";
-                } else {
-                    ec = map_d_regu_files(it_pt, de.tc_sdir_reg_m);
-                    if (ec) {
-                        pr3ser(-1, it_pt, "failed in map_d_regu_files()", ec);
-                        continue;
-                    }
-                    de.source_sink_known_ = query_power_dir(de.tc_sdir_reg_m,
-                                                            de.is_source_,
-                                                            de.pow_op_mode_);
-                    de.data_role_known_ = query_data_dir(de.tc_sdir_reg_m,
-                                                         de.is_host_);
+                ec = map_d_regu_files(it_pt, de.tc_sdir_reg_m, true, vb);
+                if (ec) {
+                    map_failed();
+                    return;
                 }
+                de.source_sink_known_ = query_power_dir(de.tc_sdir_reg_m,
+                                                        de.is_source_,
+                                                        de.pow_op_mode_);
+                de.data_role_known_ = query_data_dir(de.tc_sdir_reg_m,
+                                                     de.is_host_);
             }
-            fs::path pt { it_pt / upd_sn };
+        }
+        fs::path pt { it_pt / upd_sn };
 
-            if (fs::exists(pt, ec)) {
-                sstring attr;
-                int k;
+        if (fs::exists(pt, ec)) {
+            int k;
 
-                de.upd_dir_exists_ = true;
-                fs::path c_pt { fs::canonical(pt, ec) };
-                if (ec) {
-                    pr3ser(-1, pt, "failed to canonize", ec);
-                    continue;
-                }
-                sstring pd_x { c_pt.filename() };
-                if (1 != sscanf(pd_x.c_str(), "pd%d", &k)) {
-                    pr3ser(-1, pd_x, "sscanf could find match");
-                } else
-                    de.pd_inum_ = k;
-                if (de.partner_)
-                    ucsi_psup_possible = true;
-                else {
-                    ec = get_value(itr->path(), "power_role", attr);
-                    if (ec) {
-                        pr3ser(-1, itr->path(), "returned by get_value()",
-                               ec);
-                    } else
-                        print_err(3, "{}: power_role: {:s}\n", __func__,
-                                  attr);
-                }
-            }
-        } else {
+            de.upd_dir_exists_ = true;
+            fs::path c_pt { fs::canonical(pt, ec) };
             if (ec) {
-                pr3ser(-1, itr->path(), "not symlink to directory", ec);
-                continue;
+                pr3ser(vb, pt, "failed to canonize", ec);
+                op->torn_port_s.insert(de.port_num_);
+                return;
+            }
+            sstring pd_x { c_pt.filename() };
+            if (1 != sscanf(pd_x.c_str(), "pd%d", &k)) {
+                pr3ser(-1, pd_x, "sscanf could find match");
+            } else
+                de.pd_inum_ = k;
+            if (de.partner_)
+                ucsi_psup_possible = true;
+            else {
+                // already read into tc_sdir_reg_m, don't read it again
+                // (under --deadline= that could be another timeout)
+                const auto it { de.tc_sdir_reg_m.find("power_role") };
+
+                if (it != de.tc_sdir_reg_m.end())
+                    print_err(3, "{}: power_role: {:s}\n", __func__,
+                              it->second);
             }
         }
-        op->tc_de_v.push_back(de);
+    } else {
+        if (ec) {
+            pr3ser(vb, dent.path(), "not symlink to directory", ec);
+            if (1 == sscanf(base_s, "port%u", &de.port_num_))
+                op->torn_port_s.insert(de.port_num_);
+            return;
+        }
     }
-    if (ecc)
-        pr3ser(0, sc_typec_pt, "failed in iterate of scan directory", ec);
+    op->tc_de_v.push_back(de);
+}
+
+/* Populates op->tc_de_v[0..n-1] {vector of 'struct tc_dir_elem' objects} with
+ * initial class/typec sysfs information. Any users of op->tc_de_v[0..n-1]
+ * need this function called first. */
+static std::error_code
+scan_for_typec_obj(bool & ucsi_psup_possible, struct opts_t * op) noexcept
+{
+    std::error_code ecc { };    // only use for directory_iterator failure
+
+    // choose traditional for loop over range-based for, for flexibility
+    for (fs::directory_iterator itr(op->tree.typec_pt_, dir_opt, ecc);
+         (! ecc) && itr != end_itr;
+         itr.increment(ecc) )
+        scan_one_typec(*itr, ucsi_psup_possible, op);
+    if (ecc)
+        pr3ser(0, op->tree.typec_pt_, "failed in iterate of scan directory",
+               ecc);
     return ecc;
 }
 
+/* Scans one pd<num> entry (dent) of class/usb_power_delivery and adds a
+ * upd_dir_elem object to op->upd_de_m . */
+static void
+scan_one_upd(const fs::directory_entry & dent, struct opts_t * op) noexcept
+{
+    bool want_ucc = op->do_data_dir || op->scan_all;
+    std::error_code ec { };
+    const fs::path & pt { dent.path() };
+    int k;
+
+    if (dent.is_directory(ec)) {
+        if (1 != sscanf(pt.filename().c_str(), "pd%d", &k))
+            pr2ser(-1, "unable to find 'pd<num>' to decode");
+        else {
+            upd_dir_elem ue(dent, pd_is_partner(k, op));
+
+            if (want_ucc && ue.is_partner_) {
+                sstring attr;
+
+                ec = get_value(dent, src_ucc_s, attr);
+                if (ec)
+                    pr3ser(2, pt, "<< failed get src_ucc", ec);
+                else {
+                    unsigned int u;
+
+                    if (1 == sscanf(attr.c_str(), "%u", &u)) {
+                        if (u == 0)
+                            ue.usb_comms_incapable_ = true;
+                    }
+                }
+            }
+            ue.match_str_.assign(sstring("pd") + std::to_string(k));
+            op->upd_de_m.emplace(std::make_pair(k, ue));
+        }
+    } else if (ec)
+        pr3ser(-1, pt, "failed in is_directory()", ec);
+}
+
 /* Further populates op->tc_de_v[0..n-1] {vector of 'struct tc_dir_elem'
  * objects} with information from class/usb_power_delivery/. Users of
  * op->tc_de_v[0..n-1] may need this function called (but scan_for_typec_obj()
@@ -1552,681 +2500,8679 @@ scan_for_typec_obj(bool & ucsi_psup_possible, struct opts_t * op) noexcept
 static std::error_code
 scan_for_upd_obj(struct opts_t * op) noexcept
 {
-    bool want_ucc = op->do_data_dir;
-    std::error_code ec { };
     std::error_code ecc { };
 
-    for (fs::directory_iterator itr(sc_upd_pt, dir_opt, ecc);
+    for (fs::directory_iterator itr(op->tree.upd_pt_, dir_opt, ecc);
          (! ecc) && itr != end_itr;
-         itr.increment(ecc) ) {
-        const fs::path & pt { itr->path() };
-        int k;
+         itr.increment(ecc) )
+        scan_one_upd(*itr, op);
+    if (ecc)
+        pr3ser(-1, op->tree.upd_pt_, "was scanning when failed", ecc);
+    return ecc;
+}
 
-        if (itr->is_directory(ec)) {
-            if (1 != sscanf(pt.filename().c_str(), "pd%d", &k))
-                pr2ser(-1, "unable to find 'pd<num>' to decode");
-            else {
-                upd_dir_elem ue(*itr, pd_is_partner(k, op));
+// 64 bit FNV-1a hash. Pass the previous result as 'h' to continue the hash
+// over another buffer.
+static uint64_t
+fnv1a64(const void * vp, size_t n, uint64_t h = 0xcbf29ce484222325ULL)
+        noexcept
+{
+    const uint8_t * bp { static_cast<const uint8_t *>(vp) };
 
-                if (want_ucc && ue.is_partner_) {
-                    sstring attr;
+    for (size_t k = 0; k < n; ++k) {
+        h ^= bp[k];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
 
-                    ec = get_value(*itr, src_ucc_s, attr);
-                    if (ec)
-                        pr3ser(2, itr->path(), "<< failed get src_ucc", ec);
-                    else {
-                        unsigned int u;
+// Reads <root>/kernel/uevent_seqnum which the kernel increments for
+// each uevent (e.g. when a partner or pd object is added or removed).
+// Returns false if it is not available (e.g. in a copied sysfs tree).
+static bool
+read_uevent_seqnum(const sysfs_tree & tr, uint64_t & seqnum) noexcept
+{
+    unsigned long long ull;
+    sstring val;
+    std::error_code ec { get_value(fs::path(tr.root_) / "kernel",
+                                   seqnum_sn, val) };
+
+    if (ec || (1 != sscanf(val.c_str(), "%llu", &ull)))
+        return false;
+    seqnum = ull;
+    return true;
+}
 
-                        if (1 == sscanf(attr.c_str(), "%u", &u)) {
-                            if (u == 0)
-                                ue.usb_comms_incapable_ = true;
-                        }
-                    }
-                }
-                ue.match_str_.assign(sstring("pd") + std::to_string(k));
-                op->upd_de_m.emplace(std::make_pair(k, ue));
-            }
-        } else if (ec)
-            pr3ser(-1, pt, "failed in is_directory()", ec);
+// Cheap fingerprint of the class/typec and class/usb_power_delivery
+// directory listings: a hash of their sorted entry names.
+static uint64_t
+listing_fprint(const sysfs_tree & tr) noexcept
+{
+    uint64_t h { fnv1a64("", 0) };
+    std::error_code ecc { };
+    std::vector<sstring> nm_v;
+
+    for (const auto & dpt : { tr.typec_pt_, tr.upd_pt_ }) {
+        nm_v.clear();
+        for (fs::directory_iterator itr(dpt, dir_opt, ecc);
+             (! ecc) && itr != end_itr;
+             itr.increment(ecc) )
+            nm_v.push_back(filename_as_str(itr->path()));
+        std::ranges::sort(nm_v);
+        for (const auto & nm : nm_v)
+            h = fnv1a64(nm.c_str(), nm.size() + 1, h);
+        h = fnv1a64("/", 1, h);
     }
-    if (ecc)
-        pr3ser(-1, sc_upd_pt, "was scanning when failed", ecc);
-    return ecc;
+    return h;
 }
 
-static void
-do_my_join(struct opts_t * op, sgj_opaque_p jop) noexcept
+// Cache file is placed in $XDG_RUNTIME_DIR, or failing that /run, and
+// its name is keyed by a hash of the sysfs root. Returns false if neither
+// directory is writable.
+static bool
+cache_filename(const sysfs_tree & tr, sstring & fn) noexcept
 {
-    sgj_state * jsp { &op->json_st };
-    sgj_opaque_p jo2p { };
-    sgj_opaque_p jap { };
+    const char * ccp { getenv("XDG_RUNTIME_DIR") };
 
-    jap = sgj_named_subarray_r(jsp, jop, "typec_dir_elem_list");
-    for (const auto& elem : op->tc_de_v) {
-        jo2p = sgj_new_unattached_object_r(jsp);
-        sgj_js_nv_i(jsp, jo2p, "partner", elem.partner_);
-        sgj_js_nv_i(jsp, jo2p, "upd_dir_exists", elem.upd_dir_exists_);
-        sgj_js_nv_i(jsp, jo2p, "source_sink_known", elem.source_sink_known_);
-        sgj_js_nv_i(jsp, jo2p, "is_source", elem.is_source_);
-        sgj_js_nv_i(jsp, jo2p, "data_role_known", elem.data_role_known_);
-        sgj_js_nv_i(jsp, jo2p, "is_host", elem.is_host_);
-        sgj_js_nv_i(jsp, jo2p, "pow_op_mode", (unsigned int)elem.pow_op_mode_);
-        sgj_js_nv_i(jsp, jo2p, "port_num", elem.port_num_);
-        sgj_js_nv_i(jsp, jo2p, "pd_inum", elem.pd_inum_);
-        sgj_js_nv_i(jsp, jo2p, "partner_ind", elem.partner_ind_);
-        sgj_js_nv_s(jsp, jo2p, "match_str_", elem.match_str_.c_str());
+    if ((nullptr == ccp) || ('\0' == *ccp) || access(ccp, W_OK)) {
+        ccp = "/run";
+        if (access(ccp, W_OK)) {
+            pr3ser(1, ccp, "not writable so no scan cache");
+            return false;
+        }
+    }
+    fn = fmt_to_str("{}/lsucpd-{:016x}.cache", ccp,
+                    fnv1a64(tr.root_.data(), tr.root_.size()));
+    return true;
+}
 
+// Fields of the cache file are separated by tabs and records by newlines,
+// so backslash, tab, newline and carriage return in names, values and
+// paths are escaped as \\, \t, \n and \r .
+static sstring
+cache_esc(const sstring & s) noexcept
+{
+    sstring res;
 
-        sgj_js_nv_o(jsp, jap, nullptr, jo2p);
+    res.reserve(s.size());
+    for (char c : s) {
+        switch (c) {
+        case '\\':
+            res += "\\\\";
+            break;
+        case '\t':
+            res += "\\t";
+            break;
+        case '\n':
+            res += "\\n";
+            break;
+        case '\r':
+            res += "\\r";
+            break;
+        default:
+            res += c;
+            break;
+        }
     }
+    return res;
 }
 
-// want mapping from PDO's [{B31..B30} * 2 + (obj_pos==1)] to index in
-// pdo_part_a[]. Special case for PPS and AVS which are last 2 entries.
-static const uint8_t pdo_part_map[] = {9, 0, 13, 13, 17, 17, 21,
-                                       26 /* AVS */};
+// Reverses cache_esc(). Returns false if sv has a bad escape sequence.
+static bool
+cache_unesc(sstring_vw sv, sstring & out) noexcept
+{
+    out.clear();
+    for (size_t k = 0; k < sv.size(); ++k) {
+        if ('\\' != sv[k]) {
+            out += sv[k];
+            continue;
+        }
+        if (++k >= sv.size())
+            return false;
+        switch (sv[k]) {
+        case '\\':
+            out += '\\';
+            break;
+        case 't':
+            out += '\t';
+            break;
+        case 'n':
+            out += '\n';
+            break;
+        case 'r':
+            out += '\r';
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
 
-// want mapping from RDO's object type; {f+v}:0, {b}:1, {pps}:2, {avs}:3
-// to index in pdo_part_a[].
-static const uint8_t rdo_part_map[] = {30, 40, 50, 58};
+static void
+store_map(FILE * fp, const strstr_m & m) noexcept
+{
+    for (const auto & [n, v] : m)
+        fprintf(fp, "a\t%s\t%s\n", cache_esc(n).c_str(),
+                cache_esc(v).c_str());
+}
 
+/* Serializes the scan results in op (the port table, pd map and PDO
+ * vectors) to a cache file named fn, along with what was used to validate
+ * it: the sysfs root, uevent_seqnum and the listing fingerprint. Written
+ * to a temporary file then renamed so readers never see a partial file. */
 static void
-pdo2str(uint32_t a_pdo, bool ind1, bool is_src, sstring & out) noexcept
+store_scan_cache(const sstring & fn, bool have_seqnum, uint64_t seqnum,
+                 uint64_t fprint, const struct opts_t * op) noexcept
 {
-    bool fl_cont { false };
-    uint8_t k, num_b_typ, nb;
-    uint8_t pp_map_ind = ((a_pdo >> 30) << 1);
-    uint32_t l_pdo, mask;
-    if (ind1)
-        pp_map_ind |= 1;
-    const struct do_fld_desc_t * do_fld_p =
-                         pdo_part_a + pdo_part_map[pp_map_ind];
+    sstring tmp_fn { fn + "." + std::to_string(getpid()) };
+    FILE * fp { fopen(tmp_fn.c_str(), "w") };
 
-    k = static_cast<uint8_t>(a_pdo >> 30);
-    switch (k) {
-    case 0:
-        out = "Fixed";
-        break;
-    case 1:
-        out = "Battery";
-        break;
-    case 2:
-        out = "Variable";
-        break;
-    case 3:
-        pp_map_ind = 6;
-        if (0x10000000 & a_pdo) {
-            do_fld_p = pdo_part_a + pdo_part_map[pp_map_ind + 1];
-            out = "Adjustable voltage";
-        } else {
-            do_fld_p = pdo_part_a + pdo_part_map[pp_map_ind];
-            out = "Programmable power";
+    if (nullptr == fp) {
+        pr3ser(1, tmp_fn, "unable to create cache file");
+        return;
+    }
+    fprintf(fp, "%s\nroot\t%s\n", cache_magic_s,
+            cache_esc(op->tree.root_).c_str());
+    if (have_seqnum)
+        fprintf(fp, "seqnum\t%" PRIu64 "\n", seqnum);
+    fprintf(fp, "fprint\t%" PRIx64 "\n", fprint);
+    for (const auto & de : op->tc_de_v) {
+        fprintf(fp, "T\t%d\t%d\t%u\t%d\t%s\n", (int)de.partner_,
+                (int)de.upd_dir_exists_, de.port_num_, de.pd_inum_,
+                cache_esc(de.path().string()).c_str());
+        store_map(fp, de.tc_sdir_reg_m);
+    }
+    for (const auto & [k, ue] : op->upd_de_m) {
+        fprintf(fp, "U\t%d\t%d\t%d\t%s\n", k, (int)ue.is_partner_,
+                (int)ue.usb_comms_incapable_,
+                cache_esc(ue.path().string()).c_str());
+        for (const auto * pv : { &ue.source_pdo_v_, &ue.sink_pdo_v_ }) {
+            for (const auto & a_pdo : *pv) {
+                fprintf(fp, "P\t%c\t%u\t%d\t%" PRIx32 "\t%s\n",
+                        a_pdo.is_source_caps_ ? 'S' : 'K', a_pdo.pdo_ind_,
+                        static_cast<int>(a_pdo.pdo_el_), a_pdo.raw_pdo_,
+                        cache_esc(a_pdo.pdo_d_p_.string()).c_str());
+                store_map(fp, a_pdo.ascii_pdo_m_);
+            }
         }
-        break;
     }
-    out += " supply PDO for ";
-    out += is_src ? "source" : "sink";
-    out += ind1 ? ", object index 1:\n" : ":\n";
+    fprintf(fp, "end\n");
+    if (ferror(fp) || fclose(fp) || rename(tmp_fn.c_str(), fn.c_str())) {
+        pr3ser(1, fn, "failed to write cache file");
+        unlink(tmp_fn.c_str());
+    } else
+        pr3ser(3, fn, "scan cache written");
+}
 
-    for (k = 0; true; ++k, ++do_fld_p) {
-        num_b_typ = do_fld_p->num_bits_typ;
-        if (0 == num_b_typ)
-            break;
-        if (! fl_cont) {
-            if ((k > 0) && (num_b_typ & P_IT_FL_START))
+// Splits line at its first 'n - 1' tabs into 'n' fields in f_a[].
+// Returns false if there are fewer than 'n' fields.
+static bool
+split_tabs(const sstring & line, sstring_vw * f_a, int n) noexcept
+{
+    sstring_vw rem { line };
+
+    for (int k = 0; k < (n - 1); ++k) {
+        auto pos = rem.find('\t');
+
+        if (pos == sstring_vw::npos)
+            return false;
+        f_a[k] = rem.substr(0, pos);
+        rem.remove_prefix(pos + 1);
+    }
+    f_a[n - 1] = rem;
+    return true;
+}
+
+/* Loads the scan results into op from the cache file named fn if it is
+ * valid for the current sysfs root, uevent_seqnum and listing fingerprint.
+ * Returns true on a cache hit. On a miss op is left as it was found. */
+static bool
+load_scan_cache(const sstring & fn, bool have_seqnum, uint64_t seqnum,
+                uint64_t fprint, struct opts_t * op) noexcept
+{
+    bool ok { false };
+    std::vector<tc_dir_elem> tc_v;
+    std::map<int, upd_dir_elem> upd_m;
+    strstr_m * cur_mp { };
+    upd_dir_elem * cur_ue { };
+
+    try {
+        std::ifstream ifs(fn);
+        sstring line;
+        sstring s1, s2;
+        sstring_vw f_a[6];
+        std::error_code ec { };
+
+        if ((! std::getline(ifs, line)) || (line != cache_magic_s))
+            return false;
+        if ((! std::getline(ifs, line)) ||
+            (line != (sstring("root\t") + cache_esc(op->tree.root_))))
+            return false;
+        if (have_seqnum) {
+            if ((! std::getline(ifs, line)) ||
+                (line != fmt_to_str("seqnum\t{}", seqnum)))
+                return false;
+        }
+        if ((! std::getline(ifs, line)) ||
+            (line != fmt_to_str("fprint\t{:x}", fprint)))
+            return false;
+        while (std::getline(ifs, line)) {
+            if (line.empty())
+                continue;
+            switch (line[0]) {
+            case 'T':
+                if ((! split_tabs(line, f_a, 6)) ||
+                    (! cache_unesc(f_a[5], s1)))
+                    return false;
+                {
+                    tc_dir_elem de { fs::directory_entry(fs::path(s1), ec) };
+
+                    de.partner_ = (f_a[1] == "1");
+                    de.upd_dir_exists_ = (f_a[2] == "1");
+                    de.port_num_ = std::stoul(sstring(f_a[3]));
+                    de.pd_inum_ = std::stoi(sstring(f_a[4]));
+                    de.match_str_ = sstring("p") +
+                                    std::to_string(de.port_num_);
+                    if (de.partner_)
+                        de.match_str_ += "p";
+                    tc_v.push_back(de);
+                    cur_mp = &tc_v.back().tc_sdir_reg_m;
+                }
+                break;
+            case 'U':
+                if ((! split_tabs(line, f_a, 5)) ||
+                    (! cache_unesc(f_a[4], s1)))
+                    return false;
+                {
+                    int k { std::stoi(sstring(f_a[1])) };
+                    upd_dir_elem ue(fs::directory_entry(fs::path(s1), ec),
+                                    f_a[2] == "1");
+
+                    ue.usb_comms_incapable_ = (f_a[3] == "1");
+                    ue.pdos_populated_ = true;
+                    ue.match_str_.assign(sstring("pd") + std::to_string(k));
+                    cur_ue = &upd_m.emplace(k, ue).first->second;
+                    cur_mp = nullptr;
+                }
+                break;
+            case 'P':
+                if ((nullptr == cur_ue) || (! split_tabs(line, f_a, 6)) ||
+                    (! cache_unesc(f_a[5], s1)))
+                    return false;
+                {
+                    pdo_elem a_pdo { };
+
+                    a_pdo.is_source_caps_ = (f_a[1] == "S");
+                    a_pdo.pdo_ind_ = std::stoul(sstring(f_a[2]));
+                    a_pdo.pdo_el_ = static_cast<pdo_e>(
+                                        std::stoi(sstring(f_a[3])));
+                    a_pdo.raw_pdo_ = std::stoul(sstring(f_a[4]), nullptr,
+                                                16);
+                    a_pdo.pdo_d_p_ = fs::path(s1);
+                    auto & pv { a_pdo.is_source_caps_ ?
+                                cur_ue->source_pdo_v_ : cur_ue->sink_pdo_v_ };
+                    pv.push_back(a_pdo);
+                    cur_mp = &pv.back().ascii_pdo_m_;
+                }
+                break;
+            case 'a':
+                if ((nullptr == cur_mp) || (! split_tabs(line, f_a, 3)) ||
+                    (! cache_unesc(f_a[1], s1)) ||
+                    (! cache_unesc(f_a[2], s2)))
+                    return false;
+                (*cur_mp)[s1] = s2;
+                break;
+            case 'e':
+                ok = (line == "end");
+                break;
+            default:
+                return false;
+            }
+            if (ok)
                 break;
         }
-        fl_cont = !!(P_IT_FL_CONT & num_b_typ);
-        if ((P_IT_FL_SRC & num_b_typ) && (! is_src))
-            continue;
-        if ((P_IT_FL_SINK & num_b_typ) && is_src)
+    } catch (...) {
+        return false;
+    }
+    if (! ok)
+        return false;
+    for (auto & de : tc_v) {
+        if (! de.partner_) {
+            de.source_sink_known_ = query_power_dir(de.tc_sdir_reg_m,
+                                                    de.is_source_,
+                                                    de.pow_op_mode_);
+            de.data_role_known_ = query_data_dir(de.tc_sdir_reg_m,
+                                                 de.is_host_);
+        }
+    }
+    op->tc_de_v.swap(tc_v);
+    op->upd_de_m.swap(upd_m);
+    return true;
+}
+
+// Re-reads the volatile attributes (e.g. power_role) of each local port
+// found in the cache. Returns true if any of them changed.
+static bool
+reread_volatile(struct opts_t * op) noexcept
+{
+    bool changed { false };
+    std::error_code ec { };
+
+    for (auto & de : op->tc_de_v) {
+        if (de.partner_)
             continue;
-        if (do_fld_p->low_pdo_bit > 0)
-            l_pdo = a_pdo >> do_fld_p->low_pdo_bit;
-        else
-            l_pdo = a_pdo;
-        nb = num_b_typ & 0xf;
-        mask = (1 << nb) - 1;
-        l_pdo &= mask;
-        out += sstring("  ") + sstring(pdo_str[do_fld_p->nam_str_off]);
-        uint8_t mult = do_fld_p->mult;
-        uint16_t l_pdo16 = (uint16_t)l_pdo;
-        if (mult) {
-            arr_of_ch<16> b { };
+        for (const char * ccp : volatile_attr_a) {
+            sstring nm { ccp };
+            sstring val;
+            auto it { de.tc_sdir_reg_m.find(nm) };
 
-            l_pdo16 *= mult;
-            snprintf(b.d(), b.sz(), "=%u.%02u\n",
-                     l_pdo16 / 100, l_pdo16 % 100);
-            out += sstring(b.d());
-        } else
-            out += sstring("=") + std::to_string(l_pdo16) + sstring("\n");
+            if (it == de.tc_sdir_reg_m.end())
+                continue;
+            ec = get_value(de.path(), nm, val);
+            if (ec) {
+                const char * ccp { rd_unavail_val(ec) };
+
+                val = ccp ? ccp : "";
+            }
+            if (val != it->second) {
+                it->second = val;
+                changed = true;
+            }
+        }
+        de.source_sink_known_ = query_power_dir(de.tc_sdir_reg_m,
+                                                de.is_source_,
+                                                de.pow_op_mode_);
+        de.data_role_known_ = query_data_dir(de.tc_sdir_reg_m, de.is_host_);
     }
+    return changed;
 }
 
-static int
-do_pdo_opt(sstring & o_str, struct opts_t * op) noexcept
+// Returns the port numbers whose class/typec entries (i.e. port<n> and
+// port<n>-partner) or their usb_power_delivery links now differ from what
+// is held in op->tc_de_v .
+static std::set<unsigned int>
+changed_ports(const struct opts_t * op) noexcept
 {
-    int64_t n = sg_get_llnum(op->pdo_opt_p);
-    const char * snk_src_s = op->is_pdo_snk ? "snk" : "src";
+    std::error_code ecc { };
+    std::map<sstring, std::pair<unsigned int, int>> now_m, then_m;
+    std::set<unsigned int> res;
 
-    if (n < 0) {
-        print_err(-1, "bad argument to --pdo-{}, decimal is the default\n",
-                  snk_src_s);
-        return 1;
-    } else if (n > UINT32_MAX) {
-        print_err(-1, "argument to --pdo-{}= does fit in 32 bits\n",
-                  snk_src_s);
-        return 1;
+    for (fs::directory_iterator itr(op->tree.typec_pt_, dir_opt, ecc);
+         (! ecc) && itr != end_itr;
+         itr.increment(ecc) ) {
+        std::error_code ec { };
+        unsigned int pn;
+        int k { -1 };
+        const sstring basename { itr->path().filename() };
+
+        if (1 != sscanf(basename.c_str(), "port%u", &pn))
+            continue;
+        fs::path c_pt { fs::canonical(itr->path() / upd_sn, ec) };
+        if ((! ec) && (1 != sscanf(c_pt.filename().c_str(), "pd%d", &k)))
+            k = -1;
+        now_m[basename] = std::make_pair(pn, k);
     }
-    int k = 0;
-    if (const char * ccp = strchr(op->pdo_opt_p, ',')) {
-        k = sg_get_num(ccp + 1);
-        if (k < 0) {
-            print_err(-1, "bad numeric index to --pdo-{}=<si_pdo>,IND\n",
-                      snk_src_s);
-            return 1;
-        }
+    if (ecc)
+        pr3ser(0, op->tree.typec_pt_, "failed in iterate of scan directory",
+               ecc);
+    for (const auto & de : op->tc_de_v)
+        then_m[de.path().filename()] = std::make_pair(de.port_num_,
+                                                      de.pd_inum_);
+    for (const auto & [nm, v] : now_m) {
+        auto it { then_m.find(nm) };
+
+        if ((it == then_m.end()) || (it->second != v))
+            res.insert(v.first);
     }
-    pdo2str((uint32_t)n, 1 == k, ! op->is_pdo_snk, o_str);
-    return 0;
+    for (const auto & [nm, v] : then_m) {
+        if (! now_m.contains(nm))
+            res.insert(v.first);
+    }
+    return res;
 }
 
-/* RDOs are always sent by the sink to the source */
+// Drops what is held for port number pn (the port, its partner and their
+// pd objects) then scans them again.
 static void
-rdo2str(uint32_t a_rdo, pdo_e ref_pdo, sstring & out) noexcept
+rescan_port(unsigned int pn, bool want_upd, bool & ucsi_psup_possible,
+            struct opts_t * op) noexcept
 {
-    bool fl_cont { false };
-    bool check_giveback { false };
-    uint8_t k, num_b_typ, nb;
-    uint16_t ind;
-    uint32_t l_rdo, mask;
+    std::error_code ecc { };
 
-    switch (ref_pdo) {
-    case pdo_e::pdo_fixed:
-        ind = rdo_part_map[0];
-        check_giveback = true;
-        break;
-    case pdo_e::pdo_battery:
-        ind = rdo_part_map[1];
-        check_giveback = true;
-        break;
-    case pdo_e::pdo_variable:
-        ind = rdo_part_map[0]; // Fixed and Variable RDOs have same structure
-        check_giveback = true;
-        break;
-    case pdo_e::apdo_pps:
-        ind = rdo_part_map[2];
-        break;
-    case pdo_e::apdo_epr_avs:
-        ind = rdo_part_map[3];
-        break;
-    case pdo_e::apdo_spr_avs:
-        ind = rdo_part_map[3];  // PD r3.2 v1.0 table 6.16 needs correction
-        break;
-    default:
-        out = "RDO refers to bad PDO type\n";
+    std::erase_if(op->tc_de_v, [pn, op](const tc_dir_elem & de) {
+        if (de.port_num_ != pn)
+            return false;
+        if (de.pd_inum_ >= 0)
+            op->upd_de_m.erase(de.pd_inum_);
+        return true;
+    });
+    for (fs::directory_iterator itr(op->tree.typec_pt_, dir_opt, ecc);
+         (! ecc) && itr != end_itr;
+         itr.increment(ecc) ) {
+        unsigned int k;
+
+        if ((1 == sscanf(itr->path().filename().c_str(), "port%u", &k)) &&
+            (k == pn))
+            scan_one_typec(*itr, ucsi_psup_possible, op);
+    }
+    if ((! want_upd) || ecc)
         return;
+    for (const auto & de : op->tc_de_v) {
+        if ((de.port_num_ != pn) || (de.pd_inum_ < 0))
+            continue;
+        fs::directory_entry d_ent(op->tree.upd_pt_ / ("pd" +
+                                  std::to_string(de.pd_inum_)), ecc);
+        if (! ecc)
+            scan_one_upd(d_ent, op);
     }
-    out = sstring("RDO for ") + pdo_e_to_str(ref_pdo) + "\n";
-    const struct do_fld_desc_t * do_fld_p = pdo_part_a + ind;
+}
 
-    for (k = 0; true; ++k, ++do_fld_p) {
-        num_b_typ = do_fld_p->num_bits_typ;
-        if (0 == num_b_typ)
-            break;
-        if (! fl_cont) {
-            if ((k > 0) && (num_b_typ & P_IT_FL_START))
-                break;
-        }
-        fl_cont = !!(P_IT_FL_CONT & num_b_typ);
-        if (check_giveback) {
-            bool report_giveback = !! (0x08000000 & a_rdo);
-            if ((P_IT_FL_SRC & num_b_typ) && (! report_giveback))
-                continue;
-            if ((P_IT_FL_SINK & num_b_typ) && report_giveback)
-                continue;
-        }
-        if (do_fld_p->low_pdo_bit > 0)
-            l_rdo = a_rdo >> do_fld_p->low_pdo_bit;
-        else
-            l_rdo = a_rdo;
-        nb = num_b_typ & 0xf;
-        mask = (1 << nb) - 1;
-        l_rdo &= mask;
-        out += sstring("  ") + sstring(pdo_str[do_fld_p->nam_str_off]);
-        uint8_t mult = do_fld_p->mult;
-        uint16_t l_rdo16 = (uint16_t)l_rdo;
-        if (mult) {
-            arr_of_ch<16> b { };
+// Brings op->upd_de_m into line with the class/usb_power_delivery
+// directory: removes pd objects that have gone and scans new ones.
+static void
+sync_upd_obj(struct opts_t * op) noexcept
+{
+    std::error_code ecc { };
+    std::set<int> now_s;
 
-            if (0xff == mult) {
-                // special case for AVS, bottom 2 lsb_s of voltage always 0
-                // mult should be 2.5 but is an integer, improvise ...
-                l_rdo16 = (l_rdo16 >> 1) * 25;
-            } else
-                l_rdo16 *= mult;
-            snprintf(b.d(), b.sz(), "=%u.%02u\n",
-                     l_rdo16 / 100, l_rdo16 % 100);
-            out += sstring(b.d());
-        } else
-            out += sstring("=") + std::to_string(l_rdo16) + sstring("\n");
+    for (fs::directory_iterator itr(op->tree.upd_pt_, dir_opt, ecc);
+         (! ecc) && itr != end_itr;
+         itr.increment(ecc) ) {
+        int k;
+
+        if (1 != sscanf(itr->path().filename().c_str(), "pd%d", &k))
+            continue;
+        now_s.insert(k);
+        if (! op->upd_de_m.contains(k))
+            scan_one_upd(*itr, op);
     }
+    if (ecc)
+        return;
+    std::erase_if(op->upd_de_m, [&now_s](const auto & pr) {
+        return ! now_s.contains(pr.first);
+    });
 }
 
-static int
-do_rdo_opt(sstring & o_str, struct opts_t * op) noexcept
+// Populates the PDOs of all pd objects not yet populated. A pd object
+// that fails is assumed to be torn and its port is noted for a re-scan.
+static void
+populate_all_pdos(struct opts_t * op) noexcept
 {
-    int64_t n = sg_get_llnum(op->rdo_opt_p);
+    const int vb { torn_vb(op) };
+    std::error_code ec { };
 
-    if (n < 0) {
-        print_err(-1, "bad argument to --rdo=, decimal is the default\n");
-        return 1;
-    } else if (n > UINT32_MAX) {
-        print_err(-1, "argument to --rdo=RDO does fit in 32 bits\n");
-        return 1;
-    }
-    pdo_e ref_pdo { };
-    if (const char * ccp = strchr(op->rdo_opt_p, ',')) {
-        switch (toupper(*(ccp + 1))) {
-        case 'F':
-            ref_pdo = pdo_e::pdo_fixed;
-            break;
-        case 'B':
-            ref_pdo = pdo_e::pdo_battery;
-            break;
-        case 'V':
-            ref_pdo = pdo_e::pdo_variable;
-            break;
-        case 'P':
-            ref_pdo = pdo_e::apdo_pps;
-            break;
-        case 'A':
-        case 'E':
-            ref_pdo = pdo_e::apdo_epr_avs;
-            break;
-        case 'S':
-            ref_pdo = pdo_e::apdo_spr_avs;
-            break;
-        default:
-            print_err(-1, "--rdo=<rdo>,REF expects F, B, V, P, A, E or S\n");
-            return 1;
+    for (auto && [nm, upd_d_el] : op->upd_de_m) {
+        ec = populate_src_snk_pdos(upd_d_el, op, vb);
+        if (! ec)
+            continue;
+        pr3ser(vb, upd_d_el.path(), "from populate_src_snk_pdos", ec);
+        for (const auto & de : op->tc_de_v) {
+            if (de.pd_inum_ == nm) {
+                op->torn_port_s.insert(de.port_num_);
+                break;
+            }
         }
-    } else {
-        print_err(-1, "--rdo= takes two arguments: RDO and REF separated by "
-                  "a comma, no spaces\n");
-        return 1;
     }
-    rdo2str((uint32_t)n, ref_pdo, o_str);
-    return 0;
 }
 
-/* Sorts op->tc_de_v[0..n-1] {vector of 'struct tc_dir_elem' objects} in
- * ascending order so that port<m>-partner entry will appear immediately
- * after the port<m>. Build a summary map [port_num->summary_string]. */
-static int
-primary_scan(struct opts_t * op) noexcept
+/* Scans class/typec and (if want_upd) class/usb_power_delivery, bracketed
+ * by reads of uevent_seqnum. If the seqnum moved during the scan, or some
+ * objects were torn (e.g. a partner detached mid-walk), only the ports
+ * concerned are re-scanned; this is repeated until a consistent snapshot
+ * is seen or op->scan_retries rounds have been used. If want_pdos then the
+ * PDOs are read within the bracket. On exit seqnum holds the last value
+ * read (when have_seqnum is true). */
+static std::error_code
+consistent_scan(bool want_upd, bool want_pdos, bool & ucsi_psup_possible,
+                bool & have_seqnum, uint64_t & seqnum,
+                struct opts_t * op) noexcept
 {
-    size_t sz { op->tc_de_v.size() };
-    tc_dir_elem * elemp { };
-    arr_of_ch<128> b { };
-
-    if (sz > 1) {
-        std::ranges::sort(op->tc_de_v);
-        // assume, for example, "port3" precedes "port3-partner" after sort
-        // sort order example using match string: p0, p0p, p1, p2, p2p
-
-        tc_dir_elem * prev_elemp = nullptr;
-        [[maybe_unused]] int b_ind { };
-        arr_of_ch<32> c;
+    uint64_t sn2 { };
+    std::error_code ec { };
 
-#if 0
-        if (ucsi_psup_possible) {
-            for (fs::directory_iterator itr(sc_powsup_pt, dir_opt, ecc);
-                 (! ecc) && itr != end_itr;
-                 itr.increment(ecc) ) {
-                const fs::path & pt { itr->path() };
-                const sstring & name { pt.filename() };
-// xxxxxxxxxxx  missing code for power_supply object; don't know which one.
-// xxxxxxxxxxx  Would like symlink from pd object to corresponding
-// xxxxxxxxxxx  power_supply. Also having the active RDO (in hex ?) would
-// xxxxxxxxxxx  be extremely useful.
-            }
-            if (ecc)
-                pr3ser(-1, sc_powsup_pt, "was scanning when failed", ecc);
+    have_seqnum = read_uevent_seqnum(op->tree, seqnum);
+    ec = scan_for_typec_obj(ucsi_psup_possible, op);
+    if (ec)
+        return ec;
+    if (want_upd) {
+        ec = scan_for_upd_obj(op);
+        if (ec)
+            return ec;
+    }
+    if (want_pdos)
+        populate_all_pdos(op);
+    for (int k = 0; ; ++k) {
+        bool moved { have_seqnum && read_uevent_seqnum(op->tree, sn2) &&
+                     (sn2 != seqnum) };
+
+        if ((! moved) && op->torn_port_s.empty())
+            return ec;
+        if (k >= op->scan_retries)
+            break;
+        ++op->scan_rounds;
+        std::set<unsigned int> port_s;
+
+        port_s.swap(op->torn_port_s);
+        if (moved) {
+            print_err(2, "{}: {} moved from {} to {}\n", __func__, seqnum_sn,
+                      seqnum, sn2);
+            seqnum = sn2;
+            port_s.merge(changed_ports(op));
         }
-#endif
-
-        // associate ports (and possible partners) with pd objects
-        for (size_t k = 0; k < sz; ++k, prev_elemp = elemp) {
-            int j;
-
-            elemp = &op->tc_de_v[k];
-            j = elemp->pd_inum_;
-            if (elemp->partner_) {
-                if (k > 0) {
-                    bool ddir = op->do_data_dir;
-                    prev_elemp->partner_ind_ = k;
-                    elemp->partner_ind_ = k - 1;
-                    elemp->source_sink_known_ = prev_elemp->source_sink_known_;
-                    if (prev_elemp->source_sink_known_)
-                        elemp->is_source_ = ! prev_elemp->is_source_;
-                    elemp->data_role_known_ = prev_elemp->data_role_known_;
-                    if (elemp->data_role_known_)
-                        elemp->is_host_ = ! prev_elemp->is_host_;
-                    if (ddir && elemp->is_source_) {
-                        const auto it { op->upd_de_m.find(j) };
-                        if ((it != op->upd_de_m.end()) &&
-                            it->second.usb_comms_incapable_)
-                            ddir = false;
-                    }
-                    process_pw_d_dir_mode(prev_elemp, true, c.sz(), c.d(),
-                                          ddir);
-                    b_ind += sg_scn3pr(b.d(), b.sz(), b_ind, "%s partner ",
-                                       c.d());
-                    if (j > 0) {        // PDO of 0x0000 is place holder
-                        b_ind += sg_scn3pr(b.d(), b.sz(), b_ind, "[pd%d] ",
-                                           j);
-                    }
-                    op->summ_out_m.emplace(
-                        std::make_pair(prev_elemp->port_num_, b.d()));
-                    b_ind = 0;
-                } else {
-                    // don't expect partner as first element
-                    op->summ_out_m.emplace(
-                        std::make_pair(elemp->port_num_, "logic_err"));
-                    b_ind = 0;
-                }
-            } else {    /* local (machine's) typec port */
-                if (prev_elemp && (b_ind > 0)) {
-                    process_pw_d_dir_mode(prev_elemp, false, c.sz(), c.d(),
-                                          op->do_data_dir);
-                    sg_scn3pr(b.d(), b.sz(), b_ind, "%s", c.d());
-                    op->summ_out_m.emplace(
-                        std::make_pair(prev_elemp->port_num_, b.d()));
-                    b_ind = 0;
+        for (auto pn : port_s)
+            rescan_port(pn, want_upd, ucsi_psup_possible, op);
+        op->rescan_port_s.insert(port_s.begin(), port_s.end());
+        if (moved) {
+            // same objects but maybe new roles or a new contract
+            if (want_upd)
+                sync_upd_obj(op);
+            reread_volatile(op);
+            if (want_pdos) {
+                for (auto && [nm, upd_d_el] : op->upd_de_m) {
+                    if (upd_d_el.is_partner_)
+                        upd_d_el.pdos_populated_ = false;
                 }
-                b_ind += sg_scn3pr(b.d(), b.sz(), b_ind, " port%d ",
-                                   elemp->port_num_);
-                if (j >= 0)
-                    b_ind += sg_scn3pr(b.d(), b.sz(), b_ind, "[pd%d] ", j);
             }
-        }       // <<<<<<<<<<<  end of long classic for loop
-        // above loop needs potential cleanup on exit and that follows
-        if (prev_elemp && (b_ind > 0)) {
-            process_pw_d_dir_mode(prev_elemp, false, c.sz(), c.d(),
-                                  op->do_data_dir);
-            sg_scn3pr(b.d(), b.sz(), b_ind, "%s", c.d());
-            op->summ_out_m.emplace(std::make_pair(prev_elemp->port_num_,
-                                   b.d()));
         }
-    } else if (sz == 1) {
-        int b_ind { };
-        arr_of_ch<32> c;
+        if (want_pdos)
+            populate_all_pdos(op);
+    }
+    op->scan_inconsistent = true;
+    return ec;
+}
 
-        elemp = &op->tc_de_v[0];
-        int j = elemp->pd_inum_;
+// The pdo_e and pw_op_mode_e values are published as is
+static_assert(static_cast<int>(pdo_e::apdo_epr_avs) ==
+              LSUCPD_SHM_PDO_EPR_AVS);
+static_assert(static_cast<int>(pw_op_mode_e::usb_pd) ==
+              LSUCPD_SHM_POM_USB_PD);
 
-        b_ind += sg_scn3pr(b.d(), b.sz(), b_ind, " port%d ",
-                           elemp->port_num_);
-        if (j >= 0)
-            b_ind += sg_scn3pr(b.d(), b.sz(), b_ind, "[pd%d] ", j);
-        process_pw_d_dir_mode(elemp, false, c.sz(), c.d(), op->do_data_dir);
-        sg_scn3pr(b.d(), b.sz(), b_ind, "%s", c.d());
-        op->summ_out_m.emplace(std::make_pair(elemp->port_num_, b.d()));
+static void
+shm_fill_pdos(const std::vector<pdo_elem> & pdo_v, struct lsucpd_shm_pdo * p,
+              uint8_t & num, uint32_t & bflags) noexcept
+{
+    num = 0;
+    for (const auto & a_pdo : pdo_v) {
+        if (num >= LSUCPD_SHM_MAX_PDOS) {
+            bflags |= LSUCPD_SHM_BF_TRUNCATED;
+            break;
+        }
+        const pdo_vals_t pv { decode_pdo_vals(a_pdo) };
+
+        p->raw = a_pdo.raw_pdo_;
+        p->type = static_cast<uint8_t>(a_pdo.pdo_el_);
+        p->index = a_pdo.pdo_ind_;
+        p->min_mv = pv.mv_min;
+        p->max_mv = pv.mv_max;
+        p->ma = pv.ma;
+        p->mw = pv.mw;
+        ++p;
+        ++num;
     }
-    return 0;
 }
 
+// Builds the body of the shared memory segment from the scan results.
 static void
-do_filter(bool filter_for_port, bool filter_for_pd,
-          struct opts_t * op, sgj_opaque_p jop) noexcept
+shm_fill_body(struct lsucpd_shm_body & b, const scan_snap & ss) noexcept
 {
-    std::error_code ec { };
-    sgj_state * jsp { &op->json_st };
-    sgj_opaque_p jo2p { };
-    sgj_opaque_p jo3p { };
-    sgj_opaque_p jo4p { };
-    sgj_opaque_p jap { };
-
-    if (filter_for_port) {
-        for (const auto& filt : op->filter_port_v) {
-            sregex pat;     // standard say this is noexcept
+    for (const auto & de : ss.tc_de_v) {
+        struct lsucpd_shm_port * pp { };
 
-            regex_ctor_noexc(pat, filt, std::regex_constants::grep |
-                                        std::regex_constants::icase, ec);
-            if (ec) {
-                pr3ser(-1, filt,
-                       "filter was an unacceptable regex pattern");
+        for (uint32_t k = 0; k < b.num_ports; ++k) {
+            if (b.ports[k].port_num == de.port_num_) {
+                pp = b.ports + k;
                 break;
             }
-            if (jsp->pr_as_json) {
-                jo2p = sgj_named_subobject_r(jsp, jop, ct_sn);
-                jap = sgj_named_subarray_r(jsp, jo2p, "typec_list");
+        }
+        if (nullptr == pp) {
+            if (b.num_ports >= LSUCPD_SHM_MAX_PORTS) {
+                b.flags |= LSUCPD_SHM_BF_TRUNCATED;
+                continue;
             }
-            for (const auto& entry : op->tc_de_v) {
-                if (regex_match_noexc(entry.match_str_, pat, ec)) {
-                    const unsigned int port_num = entry.port_num_;
-                    if (port_num == UINT32_MAX) {
-                        print_err(0, "uninitialized port number for {}\n",
-                                  entry.match_str_);
-                        continue;
-                    }
-                    sgj_hr_pri(jsp, "{}\n", op->summ_out_m[port_num]);
-                    if (op->do_long > 0) {
-                        jo3p = sgj_new_unattached_object_r(jsp);
-                        sstring s { "port" + std::to_string(port_num) };
-                        if (entry.partner_)
-                            s += "_partner";
-                        jo4p = sgj_named_subobject_r(jsp, jo3p,
-                                                     s.c_str());
-                        list_port(entry, op, jo4p);
-                        sgj_js_nv_o(jsp, jap, nullptr, jo3p);
-                    }
-                } else if (ec) {
-                    pr3ser(-1, filt, "filter was an unacceptable regex "
-                           "pattern");
-                    break;
+            pp = b.ports + b.num_ports++;
+            pp->port_num = de.port_num_;
+            pp->pd_num = -1;
+            pp->partner_pd_num = -1;
+        }
+        if (de.partner_) {
+            pp->flags |= LSUCPD_SHM_PF_PARTNER;
+            pp->partner_pd_num = de.pd_inum_;
+            continue;
+        }
+        pp->pd_num = de.pd_inum_;
+        pp->pow_op_mode = static_cast<uint8_t>(de.pow_op_mode_);
+        if (de.source_sink_known_) {
+            pp->flags |= LSUCPD_SHM_PF_ROLE_KNOWN;
+            if (de.is_source_)
+                pp->flags |= LSUCPD_SHM_PF_SOURCE;
+        }
+        if (de.data_role_known_) {
+            pp->flags |= LSUCPD_SHM_PF_DATA_KNOWN;
+            if (de.is_host_)
+                pp->flags |= LSUCPD_SHM_PF_HOST;
+        }
+    }
+    for (const auto & [k, ue] : ss.upd_de_m) {
+        if (b.num_pds >= LSUCPD_SHM_MAX_PDS) {
+            b.flags |= LSUCPD_SHM_BF_TRUNCATED;
+            break;
+        }
+        struct lsucpd_shm_pd * pdp { b.pds + b.num_pds++ };
+
+        pdp->pd_num = k;
+        if (ue.is_partner_)
+            pdp->flags |= LSUCPD_SHM_DF_PARTNER;
+        if (ue.usb_comms_incapable_)
+            pdp->flags |= LSUCPD_SHM_DF_USB_COMMS_INCAPABLE;
+        shm_fill_pdos(ue.source_pdo_v_, pdp->src_pdos, pdp->num_src_pdos,
+                      b.flags);
+        shm_fill_pdos(ue.sink_pdo_v_, pdp->snk_pdos, pdp->num_snk_pdos,
+                      b.flags);
+    }
+}
+
+/* Publishes the snapshot ss in the shared memory segment /dev/shm/<name>,
+ * creating it if needed. shm_open() does not follow a symlink at <name> and
+ * an existing segment must be a regular file owned by this effective user,
+ * else EPERM is returned. Writers (e.g. several lsucpd instances) are
+ * serialized with flock() and readers are protected by the seqlock in
+ * struct lsucpd_shm . The segment is only written (and its generation
+ * incremented) if the published state has changed. Returns 0 on success,
+ * else an errno value. On success generation and changed are set. */
+static int
+shm_publish(const char * name, const scan_snap & ss, uint64_t & generation,
+            bool & changed) noexcept
+{
+    int res { };
+    const size_t sz { sizeof(struct lsucpd_shm) };
+    const sstring fn { sstring("/dev/shm/") + name };
+    auto nbp { std::make_unique<struct lsucpd_shm_body>() };
+    struct stat st { };
+    struct lsucpd_shm * shp;
+
+    shm_fill_body(*nbp, ss);
+    int fd { shm_open((sstring("/") + name).c_str(),
+                      O_RDWR | O_CREAT | O_CLOEXEC, 0644) };
+
+    if (fd < 0) {
+        res = errno;
+        pr3ser(0, fn, "shm_open failed");
+        return res;
+    }
+    if ((flock(fd, LOCK_EX) < 0) || (fstat(fd, &st) < 0)) {
+        res = errno;
+        close(fd);
+        return res;
+    }
+    if ((! S_ISREG(st.st_mode)) || (st.st_uid != geteuid())) {
+        pr3ser(0, fn, "not a regular file owned by this user, refuse");
+        close(fd);
+        return EPERM;
+    }
+    // a new file is all zeros so gets a fresh header below
+    if ((static_cast<size_t>(st.st_size) != sz) && (ftruncate(fd, sz) < 0)) {
+        res = errno;
+        close(fd);
+        return res;
+    }
+    void * vp { mmap(nullptr, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                     0) };
+    if (MAP_FAILED == vp) {
+        res = errno;
+        close(fd);
+        return res;
+    }
+    shp = static_cast<struct lsucpd_shm *>(vp);
+    std::atomic_ref<uint64_t> seq { shp->seq };
+    const bool valid_hdr { (LSUCPD_SHM_MAGIC == shp->magic) &&
+                           (LSUCPD_SHM_VERSION == shp->version) &&
+                           (sz == shp->size) };
+
+    changed = (! valid_hdr) ||
+              (0 != memcmp(&shp->body, nbp.get(), sizeof(*nbp)));
+    if (changed) {
+        const uint64_t s { seq.load(std::memory_order_relaxed) & ~1ULL };
+        struct timespec ts { };
+
+        seq.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        if (! valid_hdr) {
+            shp->magic = LSUCPD_SHM_MAGIC;
+            shp->version = LSUCPD_SHM_VERSION;
+            shp->size = sz;
+            shp->generation = 0;
+        }
+        ++shp->generation;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        shp->update_ns = static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL +
+                         ts.tv_nsec;
+        shp->uevent_seqnum = ss.have_seqnum ? ss.seqnum : 0;
+        memcpy(&shp->body, nbp.get(), sizeof(*nbp));
+        seq.store(s + 2, std::memory_order_release);
+    }
+    generation = shp->generation;
+    munmap(vp, sz);
+    close(fd);          // also releases flock()
+    return 0;
+}
+
+/* --record=FILE appends the changes of the port table to FILE. The file
+ * starts with the 8 byte rec_magic, followed by records. Each record is:
+ *     varint   length of what follows
+ *     byte     'K' (keyframe) or 'D' (delta)
+ *   keyframe:
+ *     varint   CLOCK_REALTIME in milliseconds
+ *     varint   CLOCK_BOOTTIME in milliseconds
+ *     varint   number of ports, then for each: the port number and all
+ *              the fields below
+ *   delta (from the previous record):
+ *     svarint  change of CLOCK_REALTIME in milliseconds
+ *     varint   change of CLOCK_BOOTTIME in milliseconds
+ *     varint   number of changed ports, then for each: the port number,
+ *              a byte of rec_f_* flags and the fields that flags name
+ * where a varint is LEB128 (7 bits per byte, least significant first) and
+ * an svarint is a zigzag encoded varint. The fields, in this order, are:
+ *     byte     LSUCPD_SHM_PF_* flags of the port
+ *     byte     LSUCPD_SHM_POM_* power operation mode
+ *     varint   pd number of the port plus 1, 0 for none
+ *     varint   pd number of the partner plus 1, 0 for none
+ *     4 bytes  hash of the PDOs of both, little endian
+ * A keyframe is written first by each run and then after every
+ * REC_KEYFRAME_EVERY deltas, so a reader need not start at the beginning
+ * of the file. FILE.idx is a sparse time index: a rec_idx_ent for each
+ * keyframe. It is rebuilt from FILE when recording (re)starts. */
+static const char rec_magic[8] { 'L', 'C', 'P', 'D', 'R', 'E', 'C', '1' };
+
+enum rec_f_e : uint8_t {
+    rec_f_flags = 0x1,
+    rec_f_pom = 0x2,
+    rec_f_pd = 0x4,
+    rec_f_partner_pd = 0x8,
+    rec_f_pdo_hash = 0x10,
+    rec_f_all = 0x1f,
+    rec_f_removed = 0x80,       // port has gone, no fields follow
+};
+
+// One row of the recorded port table
+struct rec_port {
+    uint8_t flags { };          // LSUCPD_SHM_PF_*
+    uint8_t pow_op_mode { };    // LSUCPD_SHM_POM_*
+    int32_t pd_num { -1 };
+    int32_t partner_pd_num { -1 };
+    uint32_t pdo_hash { };
+
+    bool operator==(const rec_port &) const = default;
+};
+
+// key is the port number
+using rec_table = std::map<uint32_t, rec_port>;
+
+// Entry of FILE.idx, in host byte order
+struct rec_idx_ent {
+    uint64_t wall_ms;           // of the keyframe
+    uint64_t offset;            // of the keyframe's length in FILE
+};
+
+static void
+rec_put_uv(sstring & b, uint64_t v) noexcept
+{
+    while (v >= 0x80) {
+        b += static_cast<char>((v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    b += static_cast<char>(v);
+}
+
+static void
+rec_put_sv(sstring & b, int64_t v) noexcept
+{
+    rec_put_uv(b, (static_cast<uint64_t>(v) << 1) ^
+                  static_cast<uint64_t>(v >> 63));
+}
+
+// Decodes a varint at bp (which must be before ep) and advances bp past
+// it. Returns false if it is truncated or too long.
+static bool
+rec_get_uv(const uint8_t * & bp, const uint8_t * ep, uint64_t & v) noexcept
+{
+    v = 0;
+    for (int sh = 0; (bp < ep) && (sh < 64); sh += 7) {
+        const uint8_t c { *bp++ };
+
+        v |= static_cast<uint64_t>(c & 0x7f) << sh;
+        if (0 == (c & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static uint64_t
+clock_ms(clockid_t cid) noexcept
+{
+    struct timespec ts { };
+
+    clock_gettime(cid, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+// wall_ms (since the epoch) as local time: "YYYY-MM-DD HH:MM:SS.mmm"
+static sstring
+local_time_ms(uint64_t wall_ms) noexcept
+{
+    const time_t t ( wall_ms / 1000 );
+    struct tm tm { };
+    char b[64];
+
+    localtime_r(&t, &tm);
+    strftime(b, sizeof(b), "%Y-%m-%d %H:%M:%S", &tm);
+    snprintf(b + strlen(b), sizeof(b) - strlen(b), ".%03u",
+             static_cast<unsigned int>(wall_ms % 1000));
+    return b;
+}
+
+// The port table as recorded, derived from the same data as the shared
+// memory segment. The PDOs of a port's pd and its partner's pd are reduced
+// to a 32 bit hash.
+static rec_table
+rec_table_of(const scan_snap & ss) noexcept
+{
+    auto bp { std::make_unique<struct lsucpd_shm_body>() };
+    rec_table tab;
+
+    shm_fill_body(*bp, ss);
+    for (uint32_t k = 0; k < bp->num_ports; ++k) {
+        const struct lsucpd_shm_port & sp { bp->ports[k] };
+        rec_port & rp { tab[sp.port_num] };
+        uint64_t h { fnv1a64("", 0) };
+
+        rp.flags = sp.flags;
+        rp.pow_op_mode = sp.pow_op_mode;
+        rp.pd_num = sp.pd_num;
+        rp.partner_pd_num = sp.partner_pd_num;
+        for (uint32_t j = 0; j < bp->num_pds; ++j) {
+            const struct lsucpd_shm_pd & pd { bp->pds[j] };
+
+            if ((pd.pd_num != sp.pd_num) && (pd.pd_num != sp.partner_pd_num))
+                continue;
+            h = fnv1a64(&pd.pd_num, sizeof(pd.pd_num), h);
+            for (int n = 0; n < pd.num_src_pdos; ++n)
+                h = fnv1a64(&pd.src_pdos[n].raw, sizeof(uint32_t), h);
+            h = fnv1a64("/", 1, h);
+            for (int n = 0; n < pd.num_snk_pdos; ++n)
+                h = fnv1a64(&pd.snk_pdos[n].raw, sizeof(uint32_t), h);
+        }
+        rp.pdo_hash = static_cast<uint32_t>(h ^ (h >> 32));
+    }
+    return tab;
+}
+
+static void
+rec_put_fields(sstring & b, const rec_port & rp, uint8_t fl) noexcept
+{
+    if (fl & rec_f_flags)
+        b += static_cast<char>(rp.flags);
+    if (fl & rec_f_pom)
+        b += static_cast<char>(rp.pow_op_mode);
+    if (fl & rec_f_pd)
+        rec_put_uv(b, rp.pd_num + 1);
+    if (fl & rec_f_partner_pd)
+        rec_put_uv(b, rp.partner_pd_num + 1);
+    if (fl & rec_f_pdo_hash) {
+        for (int k = 0; k < 4; ++k)
+            b += static_cast<char>((rp.pdo_hash >> (8 * k)) & 0xff);
+    }
+}
+
+// Appends to a --record=FILE. Only used by one thread at a time (i.e. the
+// scan worker).
+class port_recorder {
+public:
+    int open(const char * fn) noexcept;
+    void append(const scan_snap & ss) noexcept;
+    void close() noexcept;
+
+private:
+    int fd_ { -1 };
+    int idx_fd_ { -1 };         // FILE.idx
+    off_t end_ { };             // where the next record goes
+    bool have_last_ { };        // else the next record is a keyframe
+    unsigned int num_deltas_ { };   // since the last keyframe
+    rec_table last_;
+    uint64_t last_wall_ms_ { };
+    uint64_t last_boot_ms_ { };
+};
+
+static port_recorder port_rec;
+
+/* Opens (or creates) fn for appending. The file is locked for as long as
+ * it is open so two recorders can not interleave their records. A record
+ * left incomplete (e.g. by a crash) at the end of the file is cut off and
+ * the index is rebuilt. Returns 0 on success, else an errno value. */
+int
+port_recorder::open(const char * fn) noexcept
+{
+    int res { };
+    struct stat st { };
+    sstring b;
+    std::vector<rec_idx_ent> idx_v;
+    const sstring idx_fn { sstring(fn) + ".idx" };
+
+    fd_ = ::open(fn, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd_ < 0)
+        return errno;
+    if (flock(fd_, LOCK_EX | LOCK_NB) < 0) {
+        res = errno;
+        pr3ser(-1, fn, "is being recorded by another process");
+        close();
+        return res;
+    }
+    if (fstat(fd_, &st) < 0) {
+        res = errno;
+        close();
+        return res;
+    }
+    b.resize(st.st_size);
+    if (pread(fd_, b.data(), b.size(), 0) != st.st_size) {
+        res = errno ? errno : EIO;
+        close();
+        return res;
+    }
+    if (b.empty()) {
+        if (write(fd_, rec_magic, sizeof(rec_magic)) !=
+            static_cast<ssize_t>(sizeof(rec_magic))) {
+            res = errno ? errno : EIO;
+            close();
+            return res;
+        }
+        b.assign(rec_magic, sizeof(rec_magic));
+    }
+    if ((b.size() < sizeof(rec_magic)) ||
+        (0 != memcmp(b.data(), rec_magic, sizeof(rec_magic)))) {
+        pr3ser(-1, fn, "is not a lsucpd --record= file");
+        close();
+        return EINVAL;
+    }
+    const uint8_t * bp { reinterpret_cast<const uint8_t *>(b.data()) +
+                         sizeof(rec_magic) };
+    const uint8_t * const ep { reinterpret_cast<const uint8_t *>(b.data()) +
+                               b.size() };
+    const uint8_t * good_p { bp };
+
+    while (bp < ep) {
+        uint64_t len;
+        rec_idx_ent ie { 0, static_cast<uint64_t>(
+                    bp - reinterpret_cast<const uint8_t *>(b.data())) };
+
+        if ((! rec_get_uv(bp, ep, len)) ||
+            (len > static_cast<uint64_t>(ep - bp)))
+            break;
+        const uint8_t * kp { bp + 1 };
+
+        if ((len > 1) && ('K' == *bp) && rec_get_uv(kp, bp + len, ie.wall_ms))
+            idx_v.push_back(ie);
+        bp += len;
+        good_p = bp;
+    }
+    end_ = good_p - reinterpret_cast<const uint8_t *>(b.data());
+    if (end_ < static_cast<off_t>(b.size())) {
+        pr3ser(0, fn, "incomplete last record removed");
+        if (ftruncate(fd_, end_) < 0) {
+            res = errno;
+            close();
+            return res;
+        }
+    }
+    idx_fd_ = ::open(idx_fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC |
+                     O_APPEND | O_CLOEXEC, 0644);
+    if (idx_fd_ < 0) {
+        res = errno;
+        pr3ser(-1, idx_fn, "open failed");
+        close();
+        return res;
+    }
+    const ssize_t idx_sz = idx_v.size() * sizeof(rec_idx_ent);
+
+    if (write(idx_fd_, idx_v.data(), idx_sz) != idx_sz) {
+        res = errno ? errno : EIO;
+        close();
+        return res;
+    }
+    return 0;
+}
+
+// Appends a record if the port table in ss differs from the last one
+// recorded (or a keyframe if this run has not written one yet).
+void
+port_recorder::append(const scan_snap & ss) noexcept
+{
+    const bool key { (! have_last_) ||
+                     (num_deltas_ >= REC_KEYFRAME_EVERY) };
+    const uint64_t wall_ms { clock_ms(CLOCK_REALTIME) };
+    const uint64_t boot_ms { clock_ms(CLOCK_BOOTTIME) };
+    unsigned int num_chg { };
+    rec_table tab;
+    sstring body;
+    sstring b;
+
+    if (fd_ < 0)
+        return;
+    tab = rec_table_of(ss);
+    if ((! key) && (tab == last_))
+        return;
+    if (key) {
+        body += 'K';
+        rec_put_uv(body, wall_ms);
+        rec_put_uv(body, boot_ms);
+        rec_put_uv(body, tab.size());
+        for (const auto & [pn, rp] : tab) {
+            rec_put_uv(body, pn);
+            rec_put_fields(body, rp, rec_f_all);
+        }
+    } else {
+        sstring chg;
+
+        for (const auto & [pn, rp] : tab) {
+            const auto it { last_.find(pn) };
+            const rec_port * op { (it == last_.end()) ? nullptr :
+                                                        &it->second };
+            uint8_t fl { };
+
+            if (nullptr == op)
+                fl = rec_f_all;
+            else {
+                if (rp.flags != op->flags)
+                    fl |= rec_f_flags;
+                if (rp.pow_op_mode != op->pow_op_mode)
+                    fl |= rec_f_pom;
+                if (rp.pd_num != op->pd_num)
+                    fl |= rec_f_pd;
+                if (rp.partner_pd_num != op->partner_pd_num)
+                    fl |= rec_f_partner_pd;
+                if (rp.pdo_hash != op->pdo_hash)
+                    fl |= rec_f_pdo_hash;
+            }
+            if (0 == fl)
+                continue;
+            rec_put_uv(chg, pn);
+            chg += static_cast<char>(fl);
+            rec_put_fields(chg, rp, fl);
+            ++num_chg;
+        }
+        for (const auto & [pn, rp] : last_) {
+            if (tab.contains(pn))
+                continue;
+            rec_put_uv(chg, pn);
+            chg += static_cast<char>(rec_f_removed);
+            ++num_chg;
+        }
+        body += 'D';
+        rec_put_sv(body, static_cast<int64_t>(wall_ms - last_wall_ms_));
+        rec_put_uv(body, boot_ms - last_boot_ms_);
+        rec_put_uv(body, num_chg);
+        body += chg;
+    }
+    rec_put_uv(b, body.size());
+    b += body;
+    // one write() per record; a short one is undone so the file stays
+    // parseable and the next record is a keyframe
+    if (pwrite(fd_, b.data(), b.size(), end_) !=
+        static_cast<ssize_t>(b.size())) {
+        pr3ser(0, "--record=FILE", "write failed");
+        if (ftruncate(fd_, end_) < 0)
+            pr3ser(0, "--record=FILE", "truncate failed");
+        have_last_ = false;
+        return;
+    }
+    if (key) {
+        const rec_idx_ent ie { wall_ms, static_cast<uint64_t>(end_) };
+
+        if (write(idx_fd_, &ie, sizeof(ie)) != sizeof(ie))
+            pr3ser(0, "--record=FILE", "index write failed");
+    }
+    end_ += b.size();
+    print_err(2, "--record: {} record, {} bytes\n", key ? "key" : "delta",
+              b.size());
+    num_deltas_ = key ? 0 : (num_deltas_ + 1);
+    have_last_ = true;
+    last_ = std::move(tab);
+    last_wall_ms_ = wall_ms;
+    last_boot_ms_ = boot_ms;
+}
+
+void
+port_recorder::close() noexcept
+{
+    if (idx_fd_ >= 0) {
+        ::close(idx_fd_);
+        idx_fd_ = -1;
+    }
+    if (fd_ >= 0) {
+        ::close(fd_);   // also releases flock()
+        fd_ = -1;
+    }
+}
+
+/* --capture=FILE writes the relevant uevents as they arrive and, after
+ * each scan, the changes to the part of sysfs this utility reads. So the
+ * scans can be repeated later with --replay=FILE against a --sysfsroot
+ * copy. The file is text with binary payloads:
+ *     lsucpd-capture 1 <wall_ms>\n       when the capture started
+ *     U <ms> <len>\n<len bytes>\n        a uevent as received
+ *     S <ms> <n>\n                       followed by n of:
+ *       D <path>\n                       directory
+ *       F <len> <path>\n<len bytes>\n    regular file and its contents
+ *       L <len> <path>\n<len bytes>\n    symbolic link and its target
+ *       R <path>\n                       removed
+ * where <ms> is the time since the capture started and each <path> is
+ * relative to the sysfs root. The first S record holds everything, later
+ * ones only what changed. */
+static const char cap_magic[] = "lsucpd-capture 1";
+
+#define CAP_MAX_DEPTH 4         // below a port or pd directory
+#define CAP_MAX_FILE 4096       // bytes kept from each regular file
+
+struct cap_ent {
+    char type { };              // 'D', 'F' or 'L'
+    sstring data;               // contents or link target
+
+    bool operator==(const cap_ent &) const = default;
+};
+
+// key is a path relative to the sysfs root
+using cap_state = std::map<sstring, cap_ent>;
+
+// Adds what is below rel to m, not following symbolic links. Power
+// management ("power") directories are skipped since their counters
+// change all the time.
+static void
+cap_walk(const fs::path & root, const sstring & rel, int depth,
+         cap_state & m) noexcept
+{
+    std::error_code ec { };
+    char b[CAP_MAX_FILE];
+
+    for (fs::directory_iterator itr(root / rel, dir_opt, ec);
+         (! ec) && (itr != end_itr); itr.increment(ec)) {
+        const sstring nm { itr->path().filename() };
+        const sstring r { rel + "/" + nm };
+        const fs::path pt { itr->path() };
+
+        if (itr->is_symlink(ec)) {
+            m[r] = { 'L', fs::read_symlink(pt, ec).string() };
+        } else if (itr->is_directory(ec)) {
+            if ((nm == "power") || (depth >= CAP_MAX_DEPTH))
+                continue;
+            m[r] = { 'D', { } };
+            cap_walk(root, r, depth + 1, m);
+        } else if (itr->is_regular_file(ec)) {
+            int fd { open(pt.c_str(), O_RDONLY | O_CLOEXEC) };
+
+            if (fd < 0)
+                continue;       // e.g. write only attribute
+            const ssize_t n { read(fd, b, sizeof(b)) };
+
+            close(fd);
+            if (n >= 0)
+                m[r] = { 'F', sstring(b, n) };
+        }
+    }
+}
+
+// The typec and usb_power_delivery classes, the objects their links point
+// to (and the directories leading there) and uevent_seqnum.
+static cap_state
+cap_read_state(const sstring & root_s) noexcept
+{
+    static const char * const cls_a[] = { "class/typec",
+                                          "class/usb_power_delivery" };
+    const fs::path root { root_s };
+    std::error_code ec { };
+    cap_state m;
+    char b[64];
+    int fd { open((root / "kernel/uevent_seqnum").c_str(),
+                  O_RDONLY | O_CLOEXEC) };
+
+    if (fd >= 0) {
+        const ssize_t n { read(fd, b, sizeof(b)) };
+
+        if (n >= 0) {
+            m["kernel"] = { 'D', { } };
+            m["kernel/uevent_seqnum"] = { 'F', sstring(b, n) };
+        }
+        close(fd);
+    }
+    m["class"] = { 'D', { } };
+    for (const char * cls : cls_a) {
+        m[cls] = { 'D', { } };
+        for (fs::directory_iterator itr(root / cls, dir_opt, ec);
+             (! ec) && (itr != end_itr); itr.increment(ec)) {
+            const sstring r { sstring(cls) + "/" +
+                              itr->path().filename().string() };
+
+            if (! itr->is_symlink(ec)) {
+                if (itr->is_directory(ec)) {
+                    m[r] = { 'D', { } };
+                    cap_walk(root, r, 0, m);
                 }
+                continue;
+            }
+            const fs::path tgt { fs::read_symlink(itr->path(), ec) };
+
+            m[r] = { 'L', tgt.string() };
+            const fs::path ct { fs::weakly_canonical(
+                                    itr->path().parent_path() / tgt, ec) };
+            const fs::path rt { ct.lexically_relative(
+                                    fs::weakly_canonical(root, ec)) };
+
+            if (ec || rt.empty() || (*rt.begin() == ".."))
+                continue;       // outside of the sysfs root
+            fs::path acc;
+
+            for (const auto & c : rt) {
+                acc /= c;
+                m[acc.string()] = { 'D', { } };
             }
+            cap_walk(root, rt.string(), 0, m);
         }
     }
-    if (filter_for_pd) {
-        if (filter_for_port)
-            sgj_hr_pri(jsp, "\n");
-        if (jsp->pr_as_json) {
-            jo2p = sgj_named_subobject_r(jsp, jop, cupd_sn);
-            jap = sgj_named_subarray_r(jsp, jo2p, "pdo_list");
+    return m;
+}
+
+class uevent_capture {
+public:
+    int open(const char * fn) noexcept;
+    // called from the event loop thread
+    void add_uevent(const char * bp, size_t len) noexcept;
+    // called after each scan of the tree at root by the scan worker
+    void add_state(const sstring & root) noexcept;
+    void close() noexcept;
+
+private:
+    uint64_t since_ms() const noexcept;
+    void put(const sstring & s) noexcept;
+
+    std::mutex mtx_;            // records are written by two threads
+    FILE * fp_ { };
+    std::chrono::steady_clock::time_point start_tp_;
+    cap_state last_;
+};
+
+static uevent_capture ev_cap;
+
+/* Creates (truncates) fn. Returns 0 on success, else an errno value. */
+int
+uevent_capture::open(const char * fn) noexcept
+{
+    fp_ = fopen(fn, "we");
+    if (nullptr == fp_)
+        return errno;
+    start_tp_ = std::chrono::steady_clock::now();
+    put(fmt_to_str("{} {}\n", cap_magic, clock_ms(CLOCK_REALTIME)));
+    return 0;
+}
+
+uint64_t
+uevent_capture::since_ms() const noexcept
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start_tp_).count();
+}
+
+void
+uevent_capture::put(const sstring & s) noexcept
+{
+    std::lock_guard<std::mutex> lk { mtx_ };
+
+    if (fp_ && ((fwrite(s.data(), 1, s.size(), fp_) != s.size()) ||
+                fflush(fp_))) {
+        pr3ser(-1, "--capture=FILE", "write failed, capture stopped");
+        fclose(fp_);
+        fp_ = nullptr;
+    }
+}
+
+void
+uevent_capture::add_uevent(const char * bp, size_t len) noexcept
+{
+    if (fp_)
+        put(fmt_to_str("U {} {}\n", since_ms(), len) + sstring(bp, len) +
+            "\n");
+}
+
+void
+uevent_capture::add_state(const sstring & root) noexcept
+{
+    if (nullptr == fp_)
+        return;
+    cap_state m { cap_read_state(root) };
+    sstring b;
+    unsigned int n { };
+
+    for (const auto & [pt, ce] : last_) {
+        if (! m.contains(pt)) {
+            b += "R " + pt + "\n";
+            ++n;
         }
-        for (const auto& filt : op->filter_pd_v) {
-            sregex pat { filt, std::regex_constants::grep |
-                               std::regex_constants::icase };
-            for (auto&& [nm, upd_d_el] : op->upd_de_m) {
-                if (regex_match_noexc(upd_d_el.match_str_, pat, ec)) {
-                    print_err(3, "nm={}, regex match on: {}\n", nm,
-                              upd_d_el.match_str_);
-                    ec = populate_src_snk_pdos(upd_d_el, op);
-                    if (ec) {
-                        pr3ser(-1, upd_d_el.path(), "from "
-                               "populate_src_snk_pdos", ec);
+    }
+    for (const auto & [pt, ce] : m) {
+        const auto it { last_.find(pt) };
+
+        if ((it != last_.end()) && (it->second == ce))
+            continue;
+        if ('D' == ce.type)
+            b += "D " + pt + "\n";
+        else
+            b += fmt_to_str("{} {} {}\n", ce.type, ce.data.size(), pt) +
+                 ce.data + "\n";
+        ++n;
+    }
+    last_ = std::move(m);
+    if (n > 0)
+        put(fmt_to_str("S {} {}\n", since_ms(), n) + b);
+}
+
+void
+uevent_capture::close() noexcept
+{
+    std::lock_guard<std::mutex> lk { mtx_ };
+
+    if (fp_) {
+        fclose(fp_);
+        fp_ = nullptr;
+    }
+}
+
+// A --capture=FILE read back for --replay=FILE
+class uevent_replay {
+public:
+    struct item {
+        bool uevent { };
+        bool applied { };       // state changes written to the root
+        uint64_t ms { };
+        sstring raw;            // uevent
+        // state: path and its new entry; type 'R' for removed
+        std::vector<std::pair<sstring, cap_ent>> chg_v;
+    };
+
+    // items are applied below root
+    int open(const char * fn, const sstring & root) noexcept;
+    bool apply(item & it) noexcept;
+
+    std::vector<item> item_v;
+
+private:
+    sstring root_;
+};
+
+/* Reads and checks all of fn. Returns 0 on success, else an errno value. */
+int
+uevent_replay::open(const char * fn, const sstring & root) noexcept
+{
+    FILE * fp { fopen(fn, "re") };
+    char * lp { };
+    size_t lsz { };
+    ssize_t n;
+    int res { };
+
+    if (nullptr == fp)
+        return errno;
+    root_ = root;
+    // reads a payload of len bytes and its trailing newline
+    auto payload = [fp](size_t len, sstring & d) {
+        d.resize(len);
+        return (fread(d.data(), 1, len, fp) == len) && ('\n' == fgetc(fp));
+    };
+    // path names must stay below the --sysfsroot
+    auto path_ok = [](const sstring & pt) {
+        return (! pt.empty()) && ('/' != pt[0]) &&
+               (fs::path(pt).lexically_normal().string() == pt) &&
+               (pt.substr(0, 2) != "..");
+    };
+    n = getline(&lp, &lsz, fp);
+    if ((n < 0) || strncmp(lp, cap_magic, sizeof(cap_magic) - 1))
+        res = EINVAL;
+    while ((0 == res) && ((n = getline(&lp, &lsz, fp)) > 0)) {
+        item it { };
+        unsigned long long ms, v;
+        unsigned int num;
+
+        if (2 == sscanf(lp, "U %llu %llu", &ms, &v)) {
+            it.uevent = true;
+            it.ms = ms;
+            if (! payload(v, it.raw))
+                res = EINVAL;
+        } else if (2 == sscanf(lp, "S %llu %u", &ms, &num)) {
+            it.ms = ms;
+            for (unsigned int k = 0; (0 == res) && (k < num); ++k) {
+                cap_ent ce;
+                int off { };
+
+                if ((n = getline(&lp, &lsz, fp)) < 3) {
+                    res = EINVAL;
+                    break;
+                }
+                lp[n - 1] = '\0';
+                ce.type = lp[0];
+                if (('F' == ce.type) || ('L' == ce.type)) {
+                    if ((1 != sscanf(lp + 2, "%llu %n", &v, &off)) ||
+                        (0 == off) || (! payload(v, ce.data))) {
+                        res = EINVAL;
                         break;
                     }
-                    jo3p = sgj_new_unattached_object_r(jsp);
-                    sstring s { "pd" + std::to_string(nm) };
-                    jo4p = sgj_named_subobject_r(jsp, jo3p, s.c_str());
-                    list_pd(nm, upd_d_el, op, jo4p);
-                    // sstring s { "pd" + std::to_string(nm) };
-// pr2serr("%s: sgj_js_nv_o(jsp, jap, s.c_str()\n", __func__);
-                    sgj_js_nv_o(jsp, jap, nullptr, jo3p);
-                } else if (ec) {
-                    pr3ser(-1, filt, "filter was an unacceptable regex "
-                           "pattern");
+                } else if (('D' != ce.type) && ('R' != ce.type)) {
+                    res = EINVAL;
                     break;
                 }
+                const sstring pt { lp + 2 + off };
+
+                if (! path_ok(pt))
+                    res = EINVAL;
+                else
+                    it.chg_v.emplace_back(pt, std::move(ce));
             }
-        }
-        op->caps_given = false;     // would be repeated otherwise
+        } else
+            res = EINVAL;
+        if (0 == res)
+            item_v.push_back(std::move(it));
     }
+    free(lp);
+    fclose(fp);
+    if (res)
+        pr3ser(-1, fn, "is not a well formed --capture= file");
+    return res;
 }
 
-/* Handles short options after '-j' including a sequence of short options
- * that include one 'j' (for JSON). Want optional argument to '-j' to be
- * prefixed by '='. Return 0 for good, 1 for syntax error
- * and 2 for exit with no error. */
-static int
-chk_short_opts(const char sopt_ch, struct opts_t * op) noexcept
+// Writes the state changes of it below the --sysfsroot. Returns false if
+// any failed.
+bool
+uevent_replay::apply(item & it) noexcept
 {
-    /* only need to process short, non-argument options */
-    switch (sopt_ch) {
-    case 'c':
-        ++op->do_caps;
-        op->caps_given = true;
+    const fs::path root { root_ };
+    bool ok { true };
+    std::error_code ec { };
+
+    it.applied = true;
+    for (auto rit { it.chg_v.rbegin() }; rit != it.chg_v.rend(); ++rit) {
+        if ('R' == rit->second.type)
+            fs::remove_all(root / rit->first, ec);
+    }
+    for (const auto & [pt, ce] : it.chg_v) {
+        const fs::path fp { root / pt };
+
+        switch (ce.type) {
+        case 'D':
+            fs::create_directories(fp, ec);
+            break;
+        case 'L':
+            fs::remove(fp, ec);
+            fs::create_directory_symlink(ce.data, fp, ec);
+            break;
+        case 'F':
+            {
+                int fd { ::open(fp.c_str(), O_WRONLY | O_CREAT | O_TRUNC |
+                                O_CLOEXEC, 0644) };
+
+                if ((fd < 0) ||
+                    (write(fd, ce.data.data(), ce.data.size()) !=
+                     static_cast<ssize_t>(ce.data.size())))
+                    ok = false;
+                if (fd >= 0)
+                    close(fd);
+            }
+            break;
+        default:
+            break;
+        }
+        if (ec) {
+            pr3ser(1, fp, "replay failed", ec);
+            ok = false;
+            ec.clear();
+        }
+    }
+    return ok;
+}
+
+/* --storm=RATE[,SECS] mutates the --sysfsroot tree RATE times a second
+ * and, for each change, sends a synthetic uevent through a local socket
+ * as the kernel would through netlink. Partners are unplugged and plugged
+ * back (together with their pd objects), partner pd objects come and go,
+ * power roles are flipped and PDO currents rewritten. The time of each
+ * change is kept per object (as named by devpath_object()) so the delay
+ * until a scan reports that object can be measured. Finally the tree is
+ * put back the way it was found. */
+#define STORM_DEF_SECS 10
+#define STORM_SEED 1            // same changes each run
+
+class storm_gen {
+public:
+    using tp_t = std::chrono::steady_clock::time_point;
+
+    int open(int sock_fd, const sysfs_tree & tr) noexcept;
+    void run(int rate, int secs, std::function<void()> done_fn) noexcept;
+    void stop() noexcept { stop_ = true; }
+    // a scan that started after flush_tp has reported the objects in
+    // obj_m (all of them if it is empty or has "" in it)
+    void reported(const std::map<sstring, unsigned int> & obj_m,
+                  tp_t flush_tp) noexcept;
+
+    enum kind_e { k_partner, k_pd, k_role, k_pdo, k_num };
+    static constexpr const char * kind_name[k_num] =
+                { "partner", "pd", "power_role", "pdo" };
+
+    uint64_t num_kind[k_num] { };
+    uint64_t num_uevents { };
+    uint64_t num_dropped { };   // socket was full
+    uint64_t num_changes { };   // per object, what reported() matches
+    int64_t gen_cpu_us { };     // used by the generator thread
+    double elapsed_s { };
+    std::vector<int64_t> lat_v; // change to report, in microseconds
+    std::map<sstring, std::deque<tp_t>> pend_m;     // not yet reported
+    std::mutex mtx;             // for the four above
+
+private:
+    struct partner {
+        sstring obj;            // "p<n>" of its port
+        sstring rel;            // directory relative to the sysfs root
+        sstring cls;            // class/typec/port<n>-partner
+        sstring cls_tgt;
+        sstring pd;             // "pd<m>" if it has a pd object
+        sstring pd_rel;
+        sstring pd_tgt;
+        bool plugged { true };
+        bool pd_present { true };
+    };
+    struct file_ent {
+        sstring obj;
+        sstring rel;
+        sstring orig;           // contents before the storm
+    };
+
+    bool get(const sstring & rel, sstring & s) noexcept;
+    bool put(const sstring & rel, const sstring & s) noexcept;
+    bool move(const sstring & from, const sstring & to) noexcept;
+    void send(const char * action, const sstring & rel,
+              const char * subsys, const sstring & obj) noexcept;
+    void plug(partner & pa, bool in) noexcept;
+    void plug_pd(partner & pa, bool in) noexcept;
+    void mutate(kind_e k) noexcept;
+    void restore() noexcept;
+
+    fs::path root_;
+    int fd_ { -1 };
+    uint64_t seqnum_ { };
+    std::atomic<bool> stop_ { };
+    std::mt19937 rng_ { STORM_SEED };
+    std::vector<partner> pa_v_;
+    std::vector<file_ent> role_v_;
+    std::vector<file_ent> pdo_v_;
+};
+
+static const char storm_stash[] = ".lsucpd-storm";
+
+// Resolves a class link to a path relative to the sysfs root. Returns an
+// empty string if it leads elsewhere.
+static sstring
+storm_rel(const fs::path & root, const fs::path & lnk) noexcept
+{
+    std::error_code ec { };
+    const fs::path ct { fs::weakly_canonical(lnk, ec) };
+    const fs::path rt { ct.lexically_relative(fs::weakly_canonical(root,
+                                                                   ec)) };
+
+    if (ec || rt.empty() || (*rt.begin() == ".."))
+        return sstring();
+    return rt.string();
+}
+
+/* Learns what can be changed under the sysfs root; uevents will be sent
+ * to sock_fd. Returns 0 on success, else an errno value. */
+int
+storm_gen::open(int sock_fd, const sysfs_tree & tr) noexcept
+{
+    std::error_code ec { };
+    uint64_t sn { };
+
+    root_ = tr.root_;
+    fd_ = sock_fd;
+    if (read_uevent_seqnum(tr, sn))
+        seqnum_ = sn;
+    const fs::path tc_pt { root_ / "class/typec" };
+
+    for (fs::directory_iterator itr(tc_pt, dir_opt, ec);
+         (! ec) && (itr != end_itr); itr.increment(ec)) {
+        const sstring nm { itr->path().filename() };
+        const sstring rel { storm_rel(root_, itr->path()) };
+        unsigned int n;
+        char c;
+        const int r { sscanf(nm.c_str(), "port%u%c", &n, &c) };
+
+        if (rel.empty() || (r < 1))
+            continue;
+        if (1 == r) {
+            file_ent fe { "p" + std::to_string(n), rel + "/power_role", { } };
+
+            if (get(fe.rel, fe.orig))
+                role_v_.push_back(std::move(fe));
+        } else if (nm == fmt_to_str("port{}-partner", n)) {
+            partner pa;
+            const fs::path upd { itr->path() / "usb_power_delivery" };
+
+            pa.obj = "p" + std::to_string(n);
+            pa.rel = rel;
+            pa.cls = "class/typec/" + nm;
+            pa.cls_tgt = fs::read_symlink(itr->path(), ec).string();
+            ec.clear();
+            pa.pd_rel = storm_rel(root_, upd);
+            if (! pa.pd_rel.empty()) {
+                pa.pd = fs::path(pa.pd_rel).filename().string();
+                pa.pd_tgt = fs::read_symlink(root_ /
+                                "class/usb_power_delivery" / pa.pd, ec)
+                                .string();
+                if (ec || (0 != pa.pd.compare(0, 2, "pd"))) {
+                    pa.pd.clear();  // not one it can put back
+                    ec.clear();
+                }
+            }
+            pa_v_.push_back(std::move(pa));
+        }
+    }
+    if (ec)
+        return ENOENT;
+    // PDO currents of every pd object
+    const fs::path upd_pt { root_ / "class/usb_power_delivery" };
+
+    for (fs::directory_iterator itr(upd_pt, dir_opt, ec);
+         (! ec) && (itr != end_itr); itr.increment(ec)) {
+        const sstring pd { itr->path().filename() };
+        const sstring rel { storm_rel(root_, itr->path()) };
+        std::error_code ec2 { };
+
+        if (rel.empty())
+            continue;
+        for (fs::recursive_directory_iterator ritr(root_ / rel, dir_opt,
+                                                   ec2);
+             (! ec2) && (ritr != fs::recursive_directory_iterator());
+             ritr.increment(ec2)) {
+            const sstring fn { ritr->path().filename() };
+            file_ent fe { pd, storm_rel(root_, ritr->path()), { } };
+
+            if (((fn == "maximum_current") ||
+                 (fn == "operational_current")) && (! fe.rel.empty()) &&
+                get(fe.rel, fe.orig))
+                pdo_v_.push_back(std::move(fe));
+        }
+    }
+    if (pa_v_.empty() && role_v_.empty() && pdo_v_.empty())
+        return ENOENT;
+    fs::create_directory(root_ / storm_stash, ec);
+    return ec ? ec.value() : 0;
+}
+
+// Contents of a (small) file without its trailing newline
+bool
+storm_gen::get(const sstring & rel, sstring & s) noexcept
+{
+    char b[256];
+    int fd { ::open((root_ / rel).c_str(), O_RDONLY | O_CLOEXEC) };
+    ssize_t n { -1 };
+
+    if (fd >= 0) {
+        n = read(fd, b, sizeof(b));
+        close(fd);
+    }
+    if (n < 0)
+        return false;
+    while ((n > 0) && ('\n' == b[n - 1]))
+        --n;
+    s.assign(b, n);
+    return true;
+}
+
+bool
+storm_gen::put(const sstring & rel, const sstring & s) noexcept
+{
+    const sstring v { s + "\n" };
+    int fd { ::open((root_ / rel).c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC) };
+    bool ok { fd >= 0 };
+
+    if (ok) {
+        ok = (write(fd, v.data(), v.size()) ==
+              static_cast<ssize_t>(v.size()));
+        close(fd);
+    }
+    return ok;
+}
+
+bool
+storm_gen::move(const sstring & from, const sstring & to) noexcept
+{
+    std::error_code ec { };
+
+    fs::rename(root_ / from, root_ / to, ec);
+    return ! ec;
+}
+
+// Notes the change to obj (made just before) and sends its uevent. As
+// with the kernel, uevent_seqnum is incremented first.
+void
+storm_gen::send(const char * action, const sstring & rel,
+                const char * subsys, const sstring & obj) noexcept
+{
+    const sstring dp { "/" + rel };
+    sstring s { fmt_to_str("{}@{}", action, dp) };
+    const auto now { std::chrono::steady_clock::now() };
+
+    s.push_back('\0');
+    s += fmt_to_str("ACTION={}", action);
+    s.push_back('\0');
+    s += fmt_to_str("DEVPATH={}", dp);
+    s.push_back('\0');
+    s += fmt_to_str("SUBSYSTEM={}", subsys);
+    s.push_back('\0');
+    s += fmt_to_str("SEQNUM={}", ++seqnum_);
+    s.push_back('\0');
+    put("kernel/uevent_seqnum", std::to_string(seqnum_));
+    {
+        std::lock_guard<std::mutex> lk { mtx };
+
+        pend_m[obj].push_back(now);
+        ++num_changes;
+        ++num_uevents;
+    }
+    if (::send(fd_, s.data(), s.size(), MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+        std::lock_guard<std::mutex> lk { mtx };
+
+        ++num_dropped;
+    }
+}
+
+// A partner arrives before its pd object and leaves after it
+void
+storm_gen::plug(partner & pa, bool in) noexcept
+{
+    std::error_code ec { };
+    const sstring st { sstring(storm_stash) + "/" + pa.obj + "-partner" };
+
+    if (in == pa.plugged)
+        return;
+    if (in) {
+        if (! move(st, pa.rel))
+            return;
+        fs::create_directory_symlink(pa.cls_tgt, root_ / pa.cls, ec);
+        pa.plugged = true;
+        send("add", pa.rel, typec_s, pa.obj);
+        if (pa.pd_present) {
+            pa.pd_present = false;
+            plug_pd(pa, true);
+        }
+    } else {
+        const bool pd_was { pa.pd_present };
+
+        plug_pd(pa, false);
+        pa.pd_present = pd_was;         // comes back with the partner
+        fs::remove(root_ / pa.cls, ec);
+        if (! move(pa.rel, st))
+            return;
+        pa.plugged = false;
+        send("remove", pa.rel, typec_s, pa.obj);
+    }
+}
+
+void
+storm_gen::plug_pd(partner & pa, bool in) noexcept
+{
+    std::error_code ec { };
+    const sstring st { sstring(storm_stash) + "/" + pa.pd };
+    const sstring cls { "class/usb_power_delivery/" + pa.pd };
+
+    if (pa.pd.empty() || (in == pa.pd_present))
+        return;
+    if (in) {
+        if (! move(st, pa.pd_rel))
+            return;
+        fs::create_directory_symlink(pa.pd_tgt, root_ / cls, ec);
+        pa.pd_present = true;
+        send("add", pa.pd_rel, upd_sn, pa.pd);
+    } else {
+        fs::remove(root_ / cls, ec);
+        if (! move(pa.pd_rel, st))
+            return;
+        pa.pd_present = false;
+        send("remove", pa.pd_rel, upd_sn, pa.pd);
+    }
+}
+
+void
+storm_gen::mutate(kind_e k) noexcept
+{
+    const uint64_t before { num_uevents };  // only this thread changes it
+    auto pick = [this](size_t n) {
+        return std::uniform_int_distribution<size_t>(0, n - 1)(rng_);
+    };
+
+    switch (k) {
+    case k_partner:
+        {
+            partner & pa { pa_v_[pick(pa_v_.size())] };
+
+            plug(pa, ! pa.plugged);
+        }
         break;
-    case 'd':
-        op->do_data_dir = true;
+    case k_pd:
+        {
+            partner & pa { pa_v_[pick(pa_v_.size())] };
+
+            if (pa.plugged)
+                plug_pd(pa, ! pa.pd_present);
+        }
         break;
-    case 'h':
-    case '?':
-        ++op->do_help;
+    case k_role:
+        {
+            const file_ent & fe { role_v_[pick(role_v_.size())] };
+            sstring cur;
+
+            get(fe.rel, cur);
+            put(fe.rel, (cur.find("[source]") != sstring::npos) ?
+                        "source [sink]" : "[source] sink");
+            send("change", fs::path(fe.rel).parent_path().string(),
+                 typec_s, fe.obj);
+        }
         break;
-    case 'j':
-        break;  /* simply ignore second 'j' (e.g. '-jxj') */
-    case 'l':
-        ++op->do_long;
+    case k_pdo:
+        {
+            const file_ent & fe { pdo_v_[pick(pdo_v_.size())] };
+            const unsigned int ma { 500 + 10 * static_cast<unsigned int>(
+                                                pick(451)) };
+
+            // silently fails while the pd object is unplugged
+            if (put(fe.rel, fmt_to_str("{}mA", ma)))
+                send("change", fs::path(fe.rel).parent_path().string(),
+                     upd_sn, fe.obj);
+        }
         break;
-    case 'v':
-        op->verbose_given = true;
-        ++lsucpd_verbose;
+    default:
+        return;
+    }
+    if (num_uevents != before) {
+        std::lock_guard<std::mutex> lk { mtx };
+
+        ++num_kind[k];
+    }
+}
+
+// Plugs everything back in and rewrites the original values. These are
+// changes (with uevents) like any other.
+void
+storm_gen::restore() noexcept
+{
+    std::error_code ec { };
+    sstring cur;
+
+    for (auto & pa : pa_v_) {
+        plug(pa, true);
+        plug_pd(pa, true);
+    }
+    for (const auto & fe : role_v_) {
+        if (get(fe.rel, cur) &&
+            (cur != fe.orig) && put(fe.rel, fe.orig))
+            send("change", fs::path(fe.rel).parent_path().string(),
+                 typec_s, fe.obj);
+    }
+    for (const auto & fe : pdo_v_) {
+        if (get(fe.rel, cur) &&
+            (cur != fe.orig) && put(fe.rel, fe.orig))
+            send("change", fs::path(fe.rel).parent_path().string(),
+                 upd_sn, fe.obj);
+    }
+    fs::remove(root_ / storm_stash, ec);
+}
+
+// Body of the generator thread. Changes are made at evenly spaced times
+// (so a late one does not shift those after it) until secs have passed
+// or stop() is called. done_fn is called after the tree is restored.
+void
+storm_gen::run(int rate, int secs, std::function<void()> done_fn) noexcept
+{
+    using namespace std::chrono;
+    std::vector<kind_e> k_v;
+    struct timespec ts0 { };
+    struct timespec ts1 { };
+    const auto t0 { steady_clock::now() };
+    const auto end_tp { t0 + seconds(secs) };
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts0);
+    if (! pa_v_.empty()) {
+        k_v.push_back(k_partner);
+        k_v.push_back(k_pd);
+    }
+    if (! role_v_.empty())
+        k_v.push_back(k_role);
+    if (! pdo_v_.empty())
+        k_v.push_back(k_pdo);
+    for (uint64_t k = 0; ! stop_; ++k) {
+        const auto due { t0 + nanoseconds(k * 1000000000ULL / rate) };
+
+        if ((due >= end_tp) || (steady_clock::now() >= end_tp))
+            break;              // also when it can not keep up
+        std::this_thread::sleep_until(due);
+        mutate(k_v[std::uniform_int_distribution<size_t>(
+                                0, k_v.size() - 1)(rng_)]);
+    }
+    restore();
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts1);
+    {
+        std::lock_guard<std::mutex> lk { mtx };
+
+        gen_cpu_us = (ts1.tv_sec - ts0.tv_sec) * 1000000LL +
+                     (ts1.tv_nsec - ts0.tv_nsec) / 1000;
+        elapsed_s = duration<double>(steady_clock::now() - t0).count();
+    }
+    done_fn();
+}
+
+void
+storm_gen::reported(const std::map<sstring, unsigned int> & obj_m,
+                    tp_t flush_tp) noexcept
+{
+    const auto now { std::chrono::steady_clock::now() };
+    const bool all { obj_m.empty() || obj_m.contains(empty_str) };
+    std::lock_guard<std::mutex> lk { mtx };
+
+    for (auto & [obj, dq] : pend_m) {
+        if ((! all) && (! obj_m.contains(obj)))
+            continue;
+        while ((! dq.empty()) && (dq.front() <= flush_tp)) {
+            lat_v.push_back(std::chrono::duration_cast<
+                        std::chrono::microseconds>(now - dq.front())
+                        .count());
+            dq.pop_front();
+        }
+    }
+}
+
+static void
+do_my_join(const scan_snap & ss, struct opts_t * op, sgj_opaque_p jop) noexcept
+{
+    sgj_state * jsp { &op->json_st };
+    sgj_opaque_p jo2p { };
+    sgj_opaque_p jap { };
+
+    jap = sgj_named_subarray_r(jsp, jop, "typec_dir_elem_list");
+    for (const auto& elem : ss.tc_de_v) {
+        jo2p = sgj_new_unattached_object_r(jsp);
+        sgj_js_nv_i(jsp, jo2p, "partner", elem.partner_);
+        sgj_js_nv_i(jsp, jo2p, "upd_dir_exists", elem.upd_dir_exists_);
+        sgj_js_nv_i(jsp, jo2p, "source_sink_known", elem.source_sink_known_);
+        sgj_js_nv_i(jsp, jo2p, "is_source", elem.is_source_);
+        sgj_js_nv_i(jsp, jo2p, "data_role_known", elem.data_role_known_);
+        sgj_js_nv_i(jsp, jo2p, "is_host", elem.is_host_);
+        sgj_js_nv_i(jsp, jo2p, "pow_op_mode", (unsigned int)elem.pow_op_mode_);
+        sgj_js_nv_i(jsp, jo2p, "port_num", elem.port_num_);
+        sgj_js_nv_i(jsp, jo2p, "pd_inum", elem.pd_inum_);
+        sgj_js_nv_i(jsp, jo2p, "partner_ind", elem.partner_ind_);
+        sgj_js_nv_s(jsp, jo2p, "match_str_", elem.match_str_.c_str());
+
+
+        sgj_js_nv_o(jsp, jap, nullptr, jo2p);
+    }
+}
+
+// want mapping from PDO's [{B31..B30} * 2 + (obj_pos==1)] to index in
+// pdo_part_a[]. Special case for PPS and AVS which are last 2 entries.
+static const uint8_t pdo_part_map[] = {9, 0, 13, 13, 17, 17, 21,
+                                       26 /* AVS */};
+
+// want mapping from RDO's object type; {f+v}:0, {b}:1, {pps}:2, {avs}:3
+// to index in pdo_part_a[].
+static const uint8_t rdo_part_map[] = {30, 40, 50, 58};
+
+static void
+pdo2str(uint32_t a_pdo, bool ind1, bool is_src, sstring & out) noexcept
+{
+    bool fl_cont { false };
+    uint8_t k, num_b_typ, nb;
+    uint8_t pp_map_ind = ((a_pdo >> 30) << 1);
+    uint32_t l_pdo, mask;
+    if (ind1)
+        pp_map_ind |= 1;
+    const struct do_fld_desc_t * do_fld_p =
+                         pdo_part_a + pdo_part_map[pp_map_ind];
+
+    k = static_cast<uint8_t>(a_pdo >> 30);
+    switch (k) {
+    case 0:
+        out = "Fixed";
         break;
-    case 'V':
-        op->version_given = true;
+    case 1:
+        out = "Battery";
         break;
-    default:
-        pr2serr("unrecognised option code %c [0x%x] ??\n", sopt_ch, sopt_ch);
+    case 2:
+        out = "Variable";
+        break;
+    case 3:
+        pp_map_ind = 6;
+        if (0x10000000 & a_pdo) {
+            do_fld_p = pdo_part_a + pdo_part_map[pp_map_ind + 1];
+            out = "Adjustable voltage";
+        } else {
+            do_fld_p = pdo_part_a + pdo_part_map[pp_map_ind];
+            out = "Programmable power";
+        }
+        break;
+    }
+    out += " supply PDO for ";
+    out += is_src ? "source" : "sink";
+    out += ind1 ? ", object index 1:\n" : ":\n";
+
+    for (k = 0; true; ++k, ++do_fld_p) {
+        num_b_typ = do_fld_p->num_bits_typ;
+        if (0 == num_b_typ)
+            break;
+        if (! fl_cont) {
+            if ((k > 0) && (num_b_typ & P_IT_FL_START))
+                break;
+        }
+        fl_cont = !!(P_IT_FL_CONT & num_b_typ);
+        if ((P_IT_FL_SRC & num_b_typ) && (! is_src))
+            continue;
+        if ((P_IT_FL_SINK & num_b_typ) && is_src)
+            continue;
+        if (do_fld_p->low_pdo_bit > 0)
+            l_pdo = a_pdo >> do_fld_p->low_pdo_bit;
+        else
+            l_pdo = a_pdo;
+        nb = num_b_typ & 0xf;
+        mask = (1 << nb) - 1;
+        l_pdo &= mask;
+        out += sstring("  ") + sstring(pdo_str[do_fld_p->nam_str_off]);
+        uint8_t mult = do_fld_p->mult;
+        uint16_t l_pdo16 = (uint16_t)l_pdo;
+        if (mult) {
+            arr_of_ch<16> b { };
+
+            l_pdo16 *= mult;
+            snprintf(b.d(), b.sz(), "=%u.%02u\n",
+                     l_pdo16 / 100, l_pdo16 % 100);
+            out += sstring(b.d());
+        } else
+            out += sstring("=") + std::to_string(l_pdo16) + sstring("\n");
+    }
+}
+
+static int
+do_pdo_opt(sstring & o_str, struct opts_t * op) noexcept
+{
+    int64_t n = sg_get_llnum(op->pdo_opt_p);
+    const char * snk_src_s = op->is_pdo_snk ? "snk" : "src";
+
+    if (n < 0) {
+        print_err(-1, "bad argument to --pdo-{}, decimal is the default\n",
+                  snk_src_s);
+        return 1;
+    } else if (n > UINT32_MAX) {
+        print_err(-1, "argument to --pdo-{}= does fit in 32 bits\n",
+                  snk_src_s);
+        return 1;
+    }
+    int k = 0;
+    if (const char * ccp = strchr(op->pdo_opt_p, ',')) {
+        k = sg_get_num(ccp + 1);
+        if (k < 0) {
+            print_err(-1, "bad numeric index to --pdo-{}=<si_pdo>,IND\n",
+                      snk_src_s);
+            return 1;
+        }
+    }
+    pdo2str((uint32_t)n, 1 == k, ! op->is_pdo_snk, o_str);
+    return 0;
+}
+
+/* RDOs are always sent by the sink to the source */
+static void
+rdo2str(uint32_t a_rdo, pdo_e ref_pdo, sstring & out) noexcept
+{
+    bool fl_cont { false };
+    bool check_giveback { false };
+    uint8_t k, num_b_typ, nb;
+    uint16_t ind;
+    uint32_t l_rdo, mask;
+
+    switch (ref_pdo) {
+    case pdo_e::pdo_fixed:
+        ind = rdo_part_map[0];
+        check_giveback = true;
+        break;
+    case pdo_e::pdo_battery:
+        ind = rdo_part_map[1];
+        check_giveback = true;
+        break;
+    case pdo_e::pdo_variable:
+        ind = rdo_part_map[0]; // Fixed and Variable RDOs have same structure
+        check_giveback = true;
+        break;
+    case pdo_e::apdo_pps:
+        ind = rdo_part_map[2];
+        break;
+    case pdo_e::apdo_epr_avs:
+        ind = rdo_part_map[3];
+        break;
+    case pdo_e::apdo_spr_avs:
+        ind = rdo_part_map[3];  // PD r3.2 v1.0 table 6.16 needs correction
+        break;
+    default:
+        out = "RDO refers to bad PDO type\n";
+        return;
+    }
+    out = sstring("RDO for ") + pdo_e_to_str(ref_pdo) + "\n";
+    const struct do_fld_desc_t * do_fld_p = pdo_part_a + ind;
+
+    for (k = 0; true; ++k, ++do_fld_p) {
+        num_b_typ = do_fld_p->num_bits_typ;
+        if (0 == num_b_typ)
+            break;
+        if (! fl_cont) {
+            if ((k > 0) && (num_b_typ & P_IT_FL_START))
+                break;
+        }
+        fl_cont = !!(P_IT_FL_CONT & num_b_typ);
+        if (check_giveback) {
+            bool report_giveback = !! (0x08000000 & a_rdo);
+            if ((P_IT_FL_SRC & num_b_typ) && (! report_giveback))
+                continue;
+            if ((P_IT_FL_SINK & num_b_typ) && report_giveback)
+                continue;
+        }
+        if (do_fld_p->low_pdo_bit > 0)
+            l_rdo = a_rdo >> do_fld_p->low_pdo_bit;
+        else
+            l_rdo = a_rdo;
+        nb = num_b_typ & 0xf;
+        mask = (1 << nb) - 1;
+        l_rdo &= mask;
+        out += sstring("  ") + sstring(pdo_str[do_fld_p->nam_str_off]);
+        uint8_t mult = do_fld_p->mult;
+        uint16_t l_rdo16 = (uint16_t)l_rdo;
+        if (mult) {
+            arr_of_ch<16> b { };
+
+            if (0xff == mult) {
+                // special case for AVS, bottom 2 lsb_s of voltage always 0
+                // mult should be 2.5 but is an integer, improvise ...
+                l_rdo16 = (l_rdo16 >> 1) * 25;
+            } else
+                l_rdo16 *= mult;
+            snprintf(b.d(), b.sz(), "=%u.%02u\n",
+                     l_rdo16 / 100, l_rdo16 % 100);
+            out += sstring(b.d());
+        } else
+            out += sstring("=") + std::to_string(l_rdo16) + sstring("\n");
+    }
+}
+
+static int
+do_rdo_opt(sstring & o_str, struct opts_t * op) noexcept
+{
+    int64_t n = sg_get_llnum(op->rdo_opt_p);
+
+    if (n < 0) {
+        print_err(-1, "bad argument to --rdo=, decimal is the default\n");
+        return 1;
+    } else if (n > UINT32_MAX) {
+        print_err(-1, "argument to --rdo=RDO does fit in 32 bits\n");
+        return 1;
+    }
+    pdo_e ref_pdo { };
+    if (const char * ccp = strchr(op->rdo_opt_p, ',')) {
+        switch (toupper(*(ccp + 1))) {
+        case 'F':
+            ref_pdo = pdo_e::pdo_fixed;
+            break;
+        case 'B':
+            ref_pdo = pdo_e::pdo_battery;
+            break;
+        case 'V':
+            ref_pdo = pdo_e::pdo_variable;
+            break;
+        case 'P':
+            ref_pdo = pdo_e::apdo_pps;
+            break;
+        case 'A':
+        case 'E':
+            ref_pdo = pdo_e::apdo_epr_avs;
+            break;
+        case 'S':
+            ref_pdo = pdo_e::apdo_spr_avs;
+            break;
+        default:
+            print_err(-1, "--rdo=<rdo>,REF expects F, B, V, P, A, E or S\n");
+            return 1;
+        }
+    } else {
+        print_err(-1, "--rdo= takes two arguments: RDO and REF separated by "
+                  "a comma, no spaces\n");
+        return 1;
+    }
+    rdo2str((uint32_t)n, ref_pdo, o_str);
+    return 0;
+}
+
+/* Sorts op->tc_de_v[0..n-1] {vector of 'struct tc_dir_elem' objects} in
+ * ascending order so that port<m>-partner entry will appear immediately
+ * after the port<m>. Build a summary map [port_num->summary_string]. */
+static int
+primary_scan(struct opts_t * op) noexcept
+{
+    size_t sz { op->tc_de_v.size() };
+    tc_dir_elem * elemp { };
+    arr_of_ch<128> b { };
+
+    if (sz > 1) {
+        std::ranges::sort(op->tc_de_v);
+        // assume, for example, "port3" precedes "port3-partner" after sort
+        // sort order example using match string: p0, p0p, p1, p2, p2p
+
+        tc_dir_elem * prev_elemp = nullptr;
+        [[maybe_unused]] int b_ind { };
+        arr_of_ch<32> c;
+
+#if 0
+        if (ucsi_psup_possible) {
+            for (fs::directory_iterator itr(op->tree.powsup_pt_, dir_opt,
+                                            ecc);
+                 (! ecc) && itr != end_itr;
+                 itr.increment(ecc) ) {
+                const fs::path & pt { itr->path() };
+                const sstring & name { pt.filename() };
+// xxxxxxxxxxx  missing code for power_supply object; don't know which one.
+// xxxxxxxxxxx  Would like symlink from pd object to corresponding
+// xxxxxxxxxxx  power_supply. Also having the active RDO (in hex ?) would
+// xxxxxxxxxxx  be extremely useful.
+            }
+            if (ecc)
+                pr3ser(-1, op->tree.powsup_pt_, "was scanning when failed",
+                       ecc);
+        }
+#endif
+
+        // associate ports (and possible partners) with pd objects
+        for (size_t k = 0; k < sz; ++k, prev_elemp = elemp) {
+            int j;
+
+            elemp = &op->tc_de_v[k];
+            j = elemp->pd_inum_;
+            if (elemp->partner_) {
+                if (k > 0) {
+                    bool ddir = op->do_data_dir;
+                    prev_elemp->partner_ind_ = k;
+                    elemp->partner_ind_ = k - 1;
+                    elemp->source_sink_known_ = prev_elemp->source_sink_known_;
+                    if (prev_elemp->source_sink_known_)
+                        elemp->is_source_ = ! prev_elemp->is_source_;
+                    elemp->data_role_known_ = prev_elemp->data_role_known_;
+                    if (elemp->data_role_known_)
+                        elemp->is_host_ = ! prev_elemp->is_host_;
+                    if (ddir && elemp->is_source_) {
+                        const auto it { op->upd_de_m.find(j) };
+                        if ((it != op->upd_de_m.end()) &&
+                            it->second.usb_comms_incapable_)
+                            ddir = false;
+                    }
+                    process_pw_d_dir_mode(prev_elemp, true, c.sz(), c.d(),
+                                          ddir);
+                    b_ind += sg_scn3pr(b.d(), b.sz(), b_ind, "%s partner ",
+                                       c.d());
+                    if (j > 0) {        // PDO of 0x0000 is place holder
+                        b_ind += sg_scn3pr(b.d(), b.sz(), b_ind, "[pd%d] ",
+                                           j);
+                    }
+                    op->summ_out_m.emplace(
+                        std::make_pair(prev_elemp->port_num_, b.d()));
+                    b_ind = 0;
+                } else {
+                    // don't expect partner as first element
+                    op->summ_out_m.emplace(
+                        std::make_pair(elemp->port_num_, "logic_err"));
+                    b_ind = 0;
+                }
+            } else {    /* local (machine's) typec port */
+                if (prev_elemp && (b_ind > 0)) {
+                    process_pw_d_dir_mode(prev_elemp, false, c.sz(), c.d(),
+                                          op->do_data_dir);
+                    sg_scn3pr(b.d(), b.sz(), b_ind, "%s", c.d());
+                    op->summ_out_m.emplace(
+                        std::make_pair(prev_elemp->port_num_, b.d()));
+                    b_ind = 0;
+                }
+                b_ind += sg_scn3pr(b.d(), b.sz(), b_ind, " port%d ",
+                                   elemp->port_num_);
+                if (j >= 0)
+                    b_ind += sg_scn3pr(b.d(), b.sz(), b_ind, "[pd%d] ", j);
+            }
+        }       // <<<<<<<<<<<  end of long classic for loop
+        // above loop needs potential cleanup on exit and that follows
+        if (prev_elemp && (b_ind > 0)) {
+            process_pw_d_dir_mode(prev_elemp, false, c.sz(), c.d(),
+                                  op->do_data_dir);
+            sg_scn3pr(b.d(), b.sz(), b_ind, "%s", c.d());
+            op->summ_out_m.emplace(std::make_pair(prev_elemp->port_num_,
+                                   b.d()));
+        }
+    } else if (sz == 1) {
+        int b_ind { };
+        arr_of_ch<32> c;
+
+        elemp = &op->tc_de_v[0];
+        int j = elemp->pd_inum_;
+
+        b_ind += sg_scn3pr(b.d(), b.sz(), b_ind, " port%d ",
+                           elemp->port_num_);
+        if (j >= 0)
+            b_ind += sg_scn3pr(b.d(), b.sz(), b_ind, "[pd%d] ", j);
+        process_pw_d_dir_mode(elemp, false, c.sz(), c.d(), op->do_data_dir);
+        sg_scn3pr(b.d(), b.sz(), b_ind, "%s", c.d());
+        op->summ_out_m.emplace(std::make_pair(elemp->port_num_, b.d()));
+    }
+    return 0;
+}
+
+/* Moves the scan results held in op into a new scan_snap; primary_scan()
+ * should be called first. Beforehand everything the output may need is
+ * read from sysfs: the PDOs and their attributes if want_pdos, the
+ * alternate modes if want_alt. So readers of the snapshot never block on
+ * sysfs I/O. If both_summ then summary lines are built both with and
+ * without the --data direction. */
+static std::shared_ptr<scan_snap>
+take_snapshot(bool want_pdos, bool want_alt, bool both_summ,
+              bool have_seqnum, uint64_t seqnum, struct opts_t * op) noexcept
+{
+    const bool dd { op->do_data_dir };
+    std::error_code ec { };
+    auto sp { std::make_shared<scan_snap>() };
+
+    if (want_pdos) {
+        for (auto && [nm, upd_d_el] : op->upd_de_m) {
+            ec = populate_src_snk_pdos(upd_d_el, op);
+            if (ec) {
+                pr3ser(-1, upd_d_el.path(), "from populate_src_snk_pdos",
+                       ec);
+                continue;
+            }
+            for (const auto * pv : { &upd_d_el.source_pdo_v_,
+                                     &upd_d_el.sink_pdo_v_ }) {
+                for (const auto & a_pdo : *pv) {
+                    if (a_pdo.ascii_pdo_m_.empty())
+                        map_d_regu_files(a_pdo.pdo_d_p_, a_pdo.ascii_pdo_m_);
+                }
+            }
+        }
+    }
+    if (want_alt) {
+        for (auto & de : op->tc_de_v)
+            load_alt_modes(de);
+    }
+    sp->summ_out_a[dd ? 1 : 0].swap(op->summ_out_m);
+    if (both_summ) {
+        op->do_data_dir = ! dd;
+        primary_scan(op);
+        sp->summ_out_a[dd ? 0 : 1].swap(op->summ_out_m);
+        op->do_data_dir = dd;
+    }
+    sp->tc_de_v.swap(op->tc_de_v);
+    sp->upd_de_m.swap(op->upd_de_m);
+    sp->have_seqnum = have_seqnum;
+    sp->seqnum = seqnum;
+    sp->inconsistent = op->scan_inconsistent;
+    sp->scan_tp = std::chrono::steady_clock::now();
+    return sp;
+}
+
+static void
+do_filter(bool filter_for_port, bool filter_for_pd, const scan_snap & ss,
+          struct opts_t * op, sgj_opaque_p jop) noexcept
+{
+    std::error_code ec { };
+    sgj_state * jsp { &op->json_st };
+    sgj_opaque_p jo2p { };
+    sgj_opaque_p jo3p { };
+    sgj_opaque_p jo4p { };
+    sgj_opaque_p jap { };
+
+    if (filter_for_port) {
+        for (const auto& filt : op->filter_port_v) {
+            sregex pat;     // standard say this is noexcept
+
+            regex_ctor_noexc(pat, filt, std::regex_constants::grep |
+                                        std::regex_constants::icase, ec);
+            if (ec) {
+                pr3ser(-1, filt,
+                       "filter was an unacceptable regex pattern");
+                break;
+            }
+            if (jsp->pr_as_json) {
+                jo2p = sgj_named_subobject_r(jsp, jop, ct_sn);
+                jap = sgj_named_subarray_r(jsp, jo2p, "typec_list");
+            }
+            for (const auto& entry : ss.tc_de_v) {
+                if (regex_match_noexc(entry.match_str_, pat, ec)) {
+                    const unsigned int port_num = entry.port_num_;
+                    if (port_num == UINT32_MAX) {
+                        print_err(0, "uninitialized port number for {}\n",
+                                  entry.match_str_);
+                        continue;
+                    }
+                    const auto & summ_m { ss.summ(op->do_data_dir) };
+                    const auto it { summ_m.find(port_num) };
+
+                    sgj_hr_pri(jsp, "{}\n", (it == summ_m.end()) ?
+                                            sstring() : it->second);
+                    if (op->do_long > 0) {
+                        jo3p = sgj_new_unattached_object_r(jsp);
+                        sstring s { "port" + std::to_string(port_num) };
+                        if (entry.partner_)
+                            s += "_partner";
+                        jo4p = sgj_named_subobject_r(jsp, jo3p,
+                                                     s.c_str());
+                        list_port(entry, op, jo4p);
+                        sgj_js_nv_o(jsp, jap, nullptr, jo3p);
+                    }
+                } else if (ec) {
+                    pr3ser(-1, filt, "filter was an unacceptable regex "
+                           "pattern");
+                    break;
+                }
+            }
+        }
+    }
+    if (filter_for_pd) {
+        if (filter_for_port)
+            sgj_hr_pri(jsp, "\n");
+        if (jsp->pr_as_json) {
+            jo2p = sgj_named_subobject_r(jsp, jop, cupd_sn);
+            jap = sgj_named_subarray_r(jsp, jo2p, "pdo_list");
+        }
+        for (const auto& filt : op->filter_pd_v) {
+            sregex pat { filt, std::regex_constants::grep |
+                               std::regex_constants::icase };
+            for (auto&& [nm, upd_d_el] : ss.upd_de_m) {
+                if (regex_match_noexc(upd_d_el.match_str_, pat, ec)) {
+                    print_err(3, "nm={}, regex match on: {}\n", nm,
+                              upd_d_el.match_str_);
+                    if (! upd_d_el.pdos_populated_)
+                        break;  // take_snapshot() reported why
+                    jo3p = sgj_new_unattached_object_r(jsp);
+                    sstring s { "pd" + std::to_string(nm) };
+                    jo4p = sgj_named_subobject_r(jsp, jo3p, s.c_str());
+                    list_pd(nm, upd_d_el, op, jo4p);
+                    // sstring s { "pd" + std::to_string(nm) };
+// pr2serr("%s: sgj_js_nv_o(jsp, jap, s.c_str()\n", __func__);
+                    sgj_js_nv_o(jsp, jap, nullptr, jo3p);
+                } else if (ec) {
+                    pr3ser(-1, filt, "filter was an unacceptable regex "
+                           "pattern");
+                    break;
+                }
+            }
+        }
+        op->caps_given = false;     // would be repeated otherwise
+    }
+}
+
+/* Outputs (or adds to the JSON object jop) the ports, partners and pd
+ * objects held in the snapshot ss as selected by the options in op. Does
+ * no sysfs I/O. */
+/* Places in pd_s the numbers of the pd objects in ss that match one of
+ * the pd FILTERs. Returns false if a FILTER is not an acceptable regex. */
+static bool
+pd_filter_match(const scan_snap & ss, const struct opts_t * op,
+                std::set<int> & pd_s) noexcept
+{
+    std::error_code ec { };
+
+    for (const auto & filt : op->filter_pd_v) {
+        sregex pat;
+
+        regex_ctor_noexc(pat, filt, std::regex_constants::grep |
+                                    std::regex_constants::icase, ec);
+        if (ec) {
+            pr3ser(-1, filt, "filter was an unacceptable regex pattern");
+            return false;
+        }
+        for (const auto & [nm, upd_d_el] : ss.upd_de_m) {
+            if (regex_match_noexc(upd_d_el.match_str_, pat, ec))
+                pd_s.insert(nm);
+        }
+    }
+    return true;
+}
+
+// Final mix of splitmix64, spreads the bits of x over the result
+static inline uint64_t
+mix64(uint64_t x) noexcept
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* Canonical 64 bit fingerprint of a PDO set (e.g. a source_pdo_v_): 64 bit
+ * FNV-1a over its raw PDO words, least significant byte first, in PDO
+ * index order, then mix64(). Identical chargers present identical source
+ * capabilities and so have the same fingerprint. */
+static uint64_t
+pdo_set_fp(const std::vector<pdo_elem> & pdo_v) noexcept
+{
+    uint64_t h { 0xcbf29ce484222325ULL };
+
+    for (const auto & a_pdo : pdo_v) {
+        for (int k = 0; k < 32; k += 8) {
+            h ^= (a_pdo.raw_pdo_ >> k) & 0xff;
+            h *= 0x100000001b3ULL;
+        }
+    }
+    return mix64(h);
+}
+
+/* Maps PDO set fingerprints to charger models, from the file given to
+ * --fingerprint=MFILE . A perfect hash is built when the file is loaded
+ * (hash and displace): keys are spread over buckets and, biggest bucket
+ * first, each bucket gets the first displacement that places all of its
+ * keys in free slots. So a lookup is two hashes and one comparison. */
+class fp_model_tab {
+public:
+    int load(const char * fn) noexcept;
+
+    const char * find(uint64_t fp) const noexcept
+    {
+        if (ent_v_.empty())
+            return nullptr;
+        const int32_t ind { slot_v_[slot(fp, disp_v_[bucket(fp)])] };
+
+        return ((ind >= 0) && (ent_v_[ind].first == fp)) ?
+               ent_v_[ind].second.c_str() : nullptr;
+    }
+
+    size_t size() const noexcept { return ent_v_.size(); }
+
+private:
+    size_t bucket(uint64_t fp) const noexcept
+        { return (mix64(fp) >> 32) % disp_v_.size(); }
+
+    size_t slot(uint64_t fp, uint32_t d) const noexcept
+        { return mix64(fp ^ ((d + 1) * 0x9e3779b97f4a7c15ULL)) %
+                 slot_v_.size(); }
+
+    bool build() noexcept;
+
+    std::vector<std::pair<uint64_t, sstring>> ent_v_;  // fingerprint, model
+    std::vector<uint32_t> disp_v_;      // displacement of each bucket
+    std::vector<int32_t> slot_v_;       // index into ent_v_, -1 if free
+};
+
+bool
+fp_model_tab::build() noexcept
+{
+    const size_t n { ent_v_.size() };
+    std::vector<std::vector<uint32_t>> bkt_v(n / 4 + 1);
+    std::vector<size_t> s_v;
+
+    disp_v_.assign(bkt_v.size(), 0);
+    slot_v_.assign(n + n / 4 + 1, -1);
+    for (uint32_t k = 0; k < n; ++k)
+        bkt_v[bucket(ent_v_[k].first)].push_back(k);
+    std::ranges::sort(bkt_v, [](const auto & lhs, const auto & rhs) {
+                                  return lhs.size() > rhs.size(); });
+    for (const auto & b : bkt_v) {
+        if (b.empty())
+            break;
+        const size_t b_ind { bucket(ent_v_[b[0]].first) };
+
+        for (uint32_t d = 0; ; ++d) {
+            if (d > (1U << 20))
+                return false;
+            s_v.clear();
+            for (auto k : b) {
+                const size_t s { slot(ent_v_[k].first, d) };
+
+                if ((slot_v_[s] >= 0) || (std::ranges::find(s_v, s) !=
+                                          s_v.end()))
+                    break;
+                s_v.push_back(s);
+            }
+            if (s_v.size() == b.size()) {
+                for (size_t j = 0; j < b.size(); ++j)
+                    slot_v_[s_v[j]] = b[j];
+                disp_v_[b_ind] = d;
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+/* Reads lines of "<fingerprint> <model>" from the file fn, with the
+ * fingerprint in hex, and builds the perfect hash. Blank lines and those
+ * starting with '#' are ignored. Returns 0 on success, else reports why
+ * and returns 1. */
+int
+fp_model_tab::load(const char * fn) noexcept
+{
+    int ln_num { 0 };
+    sstring line;
+    std::ifstream ifs(fn);
+    std::vector<uint64_t> fp_v;
+
+    if (! ifs) {
+        print_err(-1, "unable to open {}: {}\n", fn, strerror(errno));
+        return 1;
+    }
+    while (std::getline(ifs, line)) {
+        char * endp { };
+        const char * cp { line.c_str() };
+        uint64_t fp;
+
+        ++ln_num;
+        cp += strspn(cp, " \t");
+        if (('\0' == *cp) || ('#' == *cp))
+            continue;
+        errno = 0;
+        fp = strtoull(cp, &endp, 16);
+        if (errno || (endp == cp) || (! isblank(*endp))) {
+            print_err(-1, "{}:{}: expected <fingerprint> <model>\n", fn,
+                      ln_num);
+            return 1;
+        }
+        sstring model { endp + strspn(endp, " \t") };
+
+        while ((! model.empty()) && isspace(model.back()))
+            model.pop_back();
+        ent_v_.emplace_back(fp, std::move(model));
+        fp_v.push_back(fp);
+    }
+    std::ranges::sort(fp_v);
+    const auto it { std::ranges::adjacent_find(fp_v) };
+
+    if (it != fp_v.end()) {
+        print_err(-1, "{}: fingerprint 0x{:016x} given more than once\n",
+                  fn, *it);
+        return 1;
+    }
+    if (! build()) {
+        print_err(-1, "{}: unable to build a perfect hash\n", fn);
+        return 1;
+    }
+    print_err(1, "{}: {} charger model(s) in {} slots\n", fn, size(),
+              slot_v_.size());
+    return 0;
+}
+
+// A distinct PDO set, hash-consed by output_fingerprints()
+struct pdo_set_ent {
+    uint64_t fp_;
+    unsigned int coll_;     // > 0 if an earlier distinct set has this fp_
+    const std::vector<pdo_elem> * pdo_vp_;  // first seen, decoded once
+    unsigned int src_cnt_;  // times seen as source capabilities
+    unsigned int snk_cnt_;  // times seen as sink capabilities
+};
+
+/* --fingerprint: lists the fingerprints of the source and sink capabilities
+ * of each pd object in the snapshots of snap_v (root path and snapshot).
+ * Identical PDO sets are hash-consed so each distinct set is then listed
+ * and decoded once, with its use count and charger model (if known). The
+ * root path is shown when more than one --sysfsroot= is given. Returns 0
+ * on success. */
+static int
+output_fingerprints(const std::vector<std::pair<sstring,
+                                     const scan_snap *>> & snap_v,
+                    bool filter_for_pd, struct opts_t * op,
+                    sgj_opaque_p jop) noexcept
+{
+    const bool show_root { op->root_v.size() > 1 };
+    int num_pd { 0 };
+    int num_ref { 0 };
+    sgj_state * jsp { &op->json_st };
+    sgj_opaque_p jo2p { };
+    sgj_opaque_p jo3p { };
+    sgj_opaque_p jap { };
+    sgj_opaque_p ja2p { };
+    std::vector<pdo_set_ent> set_v;
+    std::unordered_multimap<uint64_t, size_t> set_m;    // fp_ --> set_v
+
+    auto intern = [&](const std::vector<pdo_elem> & pdo_v, bool src) {
+        const uint64_t fp { pdo_set_fp(pdo_v) };
+        const auto [b_it, e_it] { set_m.equal_range(fp) };
+        unsigned int coll { 0 };
+
+        for (auto it = b_it; it != e_it; ++it, ++coll) {
+            pdo_set_ent & ent { set_v[it->second] };
+
+            if (std::ranges::equal(*ent.pdo_vp_, pdo_v, { },
+                                   &pdo_elem::raw_pdo_,
+                                   &pdo_elem::raw_pdo_)) {
+                ++(src ? ent.src_cnt_ : ent.snk_cnt_);
+                return it->second;
+            }
+        }
+        set_v.push_back({ fp, coll, &pdo_v, src ? 1U : 0U, src ? 0U : 1U });
+        set_m.emplace(fp, set_v.size() - 1);
+        return set_v.size() - 1;
+    };
+    auto label = [&](size_t ind) {
+        const pdo_set_ent & ent { set_v[ind] };
+
+        return ent.coll_ ? fmt_to_str("0x{:016x}.{}", ent.fp_, ent.coll_) :
+                           fmt_to_str("0x{:016x}", ent.fp_);
+    };
+
+    if (jsp->pr_as_json)
+        jap = sgj_named_subarray_r(jsp, jop, "pd_fingerprint_list");
+    for (const auto & [root, ssp] : snap_v) {
+        std::set<int> pd_s;
+
+        if (filter_for_pd && (! pd_filter_match(*ssp, op, pd_s)))
+            return 1;
+        for (const auto & [nm, ue] : ssp->upd_de_m) {
+            sstring lab_a[2] { "-", "-" };      // source, sink
+
+            if ((filter_for_pd && (! pd_s.contains(nm))) ||
+                (! ue.pdos_populated_))
+                continue;
+            ++num_pd;
+            jo2p = sgj_new_unattached_object_r(jsp);
+            if (show_root)
+                sgj_js_nv_s(jsp, jo2p, "sysfs_root", root.c_str());
+            sgj_js_nv_i(jsp, jo2p, "pd_num", nm);
+            sgj_js_nv_i(jsp, jo2p, "partner", ue.is_partner_);
+            for (int k = 0; k < 2; ++k) {
+                const auto & pdo_v { k ? ue.sink_pdo_v_ : ue.source_pdo_v_ };
+
+                if (pdo_v.empty())
+                    continue;
+                ++num_ref;
+                lab_a[k] = label(intern(pdo_v, 0 == k));
+                sgj_js_nv_s(jsp, jo2p, k ? "sink_fingerprint" :
+                                           "source_fingerprint",
+                            lab_a[k].c_str());
+            }
+            sgj_hr_pri(jsp, "{}{}pd{}{}  source={}  sink={}\n",
+                       show_root ? root : empty_str, show_root ? " " : "",
+                       nm, ue.is_partner_ ? " partner" : "", lab_a[0],
+                       lab_a[1]);
+            sgj_js_nv_o(jsp, jap, nullptr, jo2p);
+        }
+    }
+    sgj_hr_pri(jsp, "\n{} distinct PDO set(s):\n", set_v.size());
+    if (jsp->pr_as_json)
+        jap = sgj_named_subarray_r(jsp, jop, "pdo_set_list");
+    for (size_t k = 0; k < set_v.size(); ++k) {
+        const pdo_set_ent & ent { set_v[k] };
+        const sstring lab { label(k) };
+        const char * model { op->fp_models ? op->fp_models->find(ent.fp_) :
+                                             nullptr };
+
+        sgj_hr_pri(jsp, "PDO set {}: source x{}, sink x{}{}{}{}\n", lab,
+                   ent.src_cnt_, ent.snk_cnt_, model ? "  [" : "",
+                   model ? model : "", model ? "]" : "");
+        jo2p = sgj_new_unattached_object_r(jsp);
+        sgj_js_nv_s(jsp, jo2p, "fingerprint", lab.c_str());
+        sgj_js_nv_i(jsp, jo2p, "source_count", ent.src_cnt_);
+        sgj_js_nv_i(jsp, jo2p, "sink_count", ent.snk_cnt_);
+        if (model)
+            sgj_js_nv_s(jsp, jo2p, "model", model);
+        ja2p = sgj_named_subarray_r(jsp, jo2p, "pdo_list");
+        for (const auto & a_pdo : *ent.pdo_vp_) {
+            const sstring pdo_nm { filename_as_str(a_pdo.pdo_d_p_) };
+
+            jo3p = sgj_new_unattached_object_r(jsp);
+            sgj_js_nv_s(jsp, jo3p, "name", pdo_nm.c_str());
+            if (a_pdo.raw_unavail_)
+                sgj_js_nv_o(jsp, jo3p, "raw_pdo",
+                            sgj_new_unattached_null_r(jsp));
+            else
+                sgj_js_nv_ihex(jsp, jo3p, "raw_pdo", a_pdo.raw_pdo_);
+            sgj_hr_pri(jsp, "  >> {}; {}\n", pdo_nm,
+                       build_summary_s(a_pdo, op, jo3p));
+            sgj_js_nv_o(jsp, ja2p, nullptr, jo3p);
+        }
+        sgj_js_nv_o(jsp, jap, nullptr, jo2p);
+    }
+    print_err(0, "{} pd object(s), {} PDO set(s) referenced, {} distinct\n",
+              num_pd, num_ref, set_v.size());
+    return 0;
+}
+
+// Rules of --check-compliance, each is a bit in a violation mask. The
+// names and descriptions are in compl_rule_a[] .
+enum compl_rule_e {
+    cr_first_5v = 0,
+    cr_type_order,
+    cr_volt_order,
+    cr_apdo_place,
+    cr_spr_range,
+    cr_epr_range,
+    cr_pps_limits,
+    cr_avs_limits,
+    cr_field_range,
+    cr_reserved,
+    cr_null_pdo,
+    cr_too_many,
+    cr_num,             // number of rules, keep last
+};
+
+static const char * const compl_rule_a[cr_num][2] = {
+    {"first_5v", "first PDO is not a fixed 5 Volt supply"},
+    {"type_order", "not in fixed, battery, variable then APDO order"},
+    {"voltage_order", "not in voltage order, lowest to highest"},
+    {"apdo_placement", "APDO in the wrong (SPR or EPR) object positions"},
+    {"spr_voltage", "above 20 Volts in an SPR object position (1 to 7)"},
+    {"epr_voltage", "EPR position (8 or more) not a fixed 28, 36 or 48 "
+                    "Volts"},
+    {"pps_limits", "PPS not within 3.3 to 21 Volts, 50 mA to 5 Amps"},
+    {"avs_limits", "AVS voltage, current or PDP out of range"},
+    {"field_range", "voltage or current field out of range"},
+    {"reserved_bits", "reserved bit set or reserved APDO type"},
+    {"null_pdo", "null PDO other than padding of SPR positions"},
+    {"too_many", "more than 11 PDOs (7 SPR and 4 EPR)"},
+};
+
+/* A PDO decoded from its raw word for the --check-compliance rules. The
+ * kind is 0: fixed, 1: battery, 2: variable, 3: PPS, 4: EPR AVS, 5: SPR
+ * AVS, 6: reserved APDO type; rank is B31..B30 which is also the order
+ * the PD specification requires (fixed, battery, variable, APDO). */
+struct compl_pdo {
+    uint32_t raw;
+    uint8_t kind;
+    uint8_t rank;
+    uint16_t ind;       // object position, starts at 1
+    uint32_t mv_max;
+    uint32_t mv_min;
+    uint32_t ma;        // SPR AVS: 9 to 15 Volts
+    uint32_t mw;
+    uint32_t ma2;       // SPR AVS: 15 to 20 Volts
+    uint32_t key;       // voltage order key
+};
+
+// Bit position, width and multiplier of the fields of compl_pdo from
+// mv_max to ma2 for each kind. A zero width means the field is 0.
+static const struct {
+    uint8_t low;
+    uint8_t nb;
+    uint16_t mult;
+} compl_fld_a[7][5] = {
+    {{10, 10, 50}, {10, 10, 50}, {0, 10, 10}, {}, {}},     // fixed
+    {{20, 10, 50}, {10, 10, 50}, {}, {0, 10, 250}, {}},    // battery
+    {{20, 10, 50}, {10, 10, 50}, {0, 10, 10}, {}, {}},     // variable
+    {{17, 8, 100}, {8, 8, 100}, {0, 7, 50}, {}, {}},       // PPS
+    {{17, 9, 100}, {8, 8, 100}, {}, {0, 8, 1000}, {}},     // EPR AVS
+    {{}, {}, {0, 10, 10}, {}, {10, 10, 10}},               // SPR AVS
+    {},                                                    // reserved
+};
+
+static compl_pdo
+compl_decode(uint32_t raw, int ind) noexcept
+{
+    const uint8_t t = raw >> 30;
+    compl_pdo r { raw, static_cast<uint8_t>(t + (3 == t) *
+                                            ((raw >> 28) & 3)), t,
+                  static_cast<uint16_t>(ind), 0, 0, 0, 0, 0, 0 };
+    uint32_t * const val_a[5] { &r.mv_max, &r.mv_min, &r.ma, &r.mw, &r.ma2 };
+
+    for (int k = 0; k < 5; ++k) {
+        const auto & f { compl_fld_a[r.kind][k] };
+
+        *val_a[k] = ((raw >> f.low) & ((1U << f.nb) - 1)) * f.mult;
+    }
+    // APDOs are ordered by their maximum voltage, the others by minimum
+    r.key = (3 == t) ? r.mv_max : r.mv_min;
+    return r;
+}
+
+/* Returns the mask of the PDO bits covered by the fields in the block of
+ * pdo_part_a[] starting at part_ind, for source (is_src) or sink
+ * capabilities. Walks the block as pdo2str() does. */
+static uint32_t
+pdo_fld_mask(uint8_t part_ind, bool is_src) noexcept
+{
+    bool fl_cont { false };
+    uint8_t num_b_typ;
+    uint32_t mask { };
+    const struct do_fld_desc_t * do_fld_p = pdo_part_a + part_ind;
+
+    for (int k = 0; true; ++k, ++do_fld_p) {
+        num_b_typ = do_fld_p->num_bits_typ;
+        if (0 == num_b_typ)
+            break;
+        if (! fl_cont) {
+            if ((k > 0) && (num_b_typ & P_IT_FL_START))
+                break;
+        }
+        fl_cont = !!(P_IT_FL_CONT & num_b_typ);
+        if ((P_IT_FL_SRC & num_b_typ) && (! is_src))
+            continue;
+        if ((P_IT_FL_SINK & num_b_typ) && is_src)
+            continue;
+        mask |= ((1U << (num_b_typ & 0xf)) - 1) << do_fld_p->low_pdo_bit;
+    }
+    return mask;
+}
+
+// Reserved bits of a PDO indexed by [kind][object position 1][is_src],
+// from the field definitions in pdo_part_a[]. That has no SPR AVS block,
+// its fields are: B27..B26 peak current (source only), B19..B0 currents.
+struct compl_rsv_t {
+    uint32_t m[7][2][2];
+};
+
+static compl_rsv_t
+compl_rsv_masks() noexcept
+{
+    static const uint8_t kind_part_a[5] = {9, 13, 17, 21, 26};
+    compl_rsv_t res { };
+
+    for (int k = 0; k < 6; ++k) {
+        for (int ind1 = 0; ind1 < 2; ++ind1) {
+            for (int src = 0; src < 2; ++src) {
+                uint32_t m;
+
+                if (5 == k)
+                    m = src ? 0x0c0fffff : 0x000fffff;
+                else
+                    m = pdo_fld_mask(((0 == k) && ind1) ? 0 :
+                                     kind_part_a[k], src);
+                res.m[k][ind1][src] = ~(m | ((k < 3) ? 0xc0000000 :
+                                                     0xf0000000));
+            }
+        }
+    }
+    return res;
+}
+
+/* Applies the --check-compliance rules to the n PDOs of a capabilities
+ * list (rec_a[], in object position order), placing the violations of
+ * each PDO in viol_a[]. Returns their union. The rules are evaluated as
+ * bit expressions on the compl_pdo records, with the previous non-null
+ * PDO as the only state, so millions of sets can be checked quickly. */
+static uint32_t
+compl_check_set(const compl_pdo * rec_a, int n, bool is_src,
+                uint32_t * viol_a) noexcept
+{
+    static const compl_rsv_t rsv_a { compl_rsv_masks() };
+    bool have_prev { false };
+    bool null_seen { false };
+    uint32_t set_m { };
+    compl_pdo prev { };
+
+    for (int k = 0; k < n; ++k) {
+        const compl_pdo & r { rec_a[k] };
+        const bool is_null { 0 == r.raw };
+        const bool spr { r.ind <= 7 };
+        const bool fixed { (0 == r.kind) && (! is_null) };
+        const bool same { have_prev && (! is_null) &&
+                          (spr == (prev.ind <= 7)) };
+        uint32_t m { };
+
+        m |= uint32_t((1 == r.ind) && (! (fixed && (5000 == r.mv_max))))
+             << cr_first_5v;
+        m |= uint32_t(same && (r.rank < prev.rank)) << cr_type_order;
+        m |= uint32_t(same && (r.kind == prev.kind) &&
+                      ((r.key < prev.key) || (fixed && (r.key == prev.key))))
+             << cr_volt_order;
+        m |= uint32_t(((4 == r.kind) && spr) ||
+                      (((3 == r.kind) || (5 == r.kind)) && (! spr)))
+             << cr_apdo_place;
+        m |= uint32_t(spr && (r.rank < 3) && (r.mv_max > 20000))
+             << cr_spr_range;
+        m |= uint32_t((! spr) && (! is_null) && (r.rank < 3) &&
+                      (! (fixed && ((28000 == r.mv_max) ||
+                                    (36000 == r.mv_max) ||
+                                    (48000 == r.mv_max)))))
+             << cr_epr_range;
+        m |= uint32_t((3 == r.kind) &&
+                      ((r.mv_min < 3300) || (r.mv_max > 21000) ||
+                       (r.mv_min >= r.mv_max) || (0 == r.ma) ||
+                       (r.ma > 5000)))
+             << cr_pps_limits;
+        m |= uint32_t(((4 == r.kind) &&
+                       ((r.mv_min < 15000) || (r.mv_max > 48000) ||
+                        (r.mv_min >= r.mv_max) || (0 == r.mw) ||
+                        (r.mw > 240000))) ||
+                      ((5 == r.kind) &&
+                       ((0 == r.ma) || (r.ma > 5000) || (r.ma2 > r.ma))))
+             << cr_avs_limits;
+        m |= uint32_t((fixed && ((0 == r.mv_max) || (r.ma > 5000))) ||
+                      (((1 == r.kind) || (2 == r.kind)) &&
+                       ((0 == r.mv_min) || (r.mv_min > r.mv_max))))
+             << cr_field_range;
+        m |= uint32_t((6 == r.kind) ||
+                      (0 != (r.raw & rsv_a.m[r.kind][1 == r.ind][is_src])))
+             << cr_reserved;
+        m |= uint32_t((is_null && (! (spr && (r.ind > 1) && (n > 7)))) ||
+                      ((! is_null) && spr && null_seen))
+             << cr_null_pdo;
+        m |= uint32_t(r.ind > 11) << cr_too_many;
+
+        viol_a[k] = m;
+        set_m |= m;
+        null_seen = null_seen || (is_null && spr);
+        prev = is_null ? prev : r;
+        have_prev = have_prev || (! is_null);
+    }
+    return set_m;
+}
+
+// Totals of a --check-compliance run
+struct compl_tally {
+    uint64_t num_sets;
+    uint64_t num_bad;
+    uint64_t rule_cnt[cr_num];
+};
+
+/* Outputs the result of checking one capabilities list, headed by label.
+ * Each violation is listed on its own line under the heading line. When
+ * jap is given, a JSON object for the list is added to it and its members
+ * are started with those in jo_hdp (e.g. pd_num) if that is given. */
+static void
+compl_report(const sstring & label, bool is_src, const compl_pdo * rec_a,
+             const uint32_t * viol_a, int n, uint32_t set_m,
+             struct opts_t * op, sgj_opaque_p jap,
+             sgj_opaque_p jo_hdp) noexcept
+{
+    sgj_state * jsp { &op->json_st };
+    sgj_opaque_p jo2p { jo_hdp ? jo_hdp : sgj_new_unattached_object_r(jsp) };
+    sgj_opaque_p ja2p { };
+    sgj_opaque_p jo3p { };
+
+    sgj_hr_pri(jsp, "{} {}: {}\n", label, is_src ? "source" : "sink",
+               set_m ? "NOT compliant" : "compliant");
+    sgj_js_nv_s(jsp, jo2p, "caps", is_src ? "source" : "sink");
+    sgj_js_nv_i(jsp, jo2p, "compliant", 0 == set_m);
+    if (jsp->pr_as_json)
+        ja2p = sgj_named_subarray_r(jsp, jo2p, "violation_list");
+    for (int k = 0; (k < n) && set_m; ++k) {
+        for (int j = 0; j < cr_num; ++j) {
+            if (0 == (viol_a[k] & (1U << j)))
+                continue;
+            sgj_hr_pri(jsp, "  PDO {} [0x{:08x}]: {}: {}\n", rec_a[k].ind,
+                       rec_a[k].raw, compl_rule_a[j][0],
+                       compl_rule_a[j][1]);
+            if (jsp->pr_as_json) {
+                jo3p = sgj_new_unattached_object_r(jsp);
+                sgj_js_nv_i(jsp, jo3p, "pdo_index", rec_a[k].ind);
+                sgj_js_nv_ihex(jsp, jo3p, "raw_pdo", rec_a[k].raw);
+                sgj_js_nv_s(jsp, jo3p, "rule", compl_rule_a[j][0]);
+                sgj_js_nv_o(jsp, ja2p, nullptr, jo3p);
+            }
+        }
+    }
+    sgj_js_nv_o(jsp, jap, nullptr, jo2p);
+}
+
+static int
+compl_summary(const compl_tally & t, struct opts_t * op,
+              sgj_opaque_p jop) noexcept
+{
+    sgj_state * jsp { &op->json_st };
+    sgj_opaque_p jo2p { sgj_named_subobject_r(jsp, jop,
+                                              "compliance_summary") };
+    sgj_opaque_p jo3p { };
+
+    sgj_hr_pri(jsp, "\n{} PDO set(s) checked, {} not compliant\n",
+               t.num_sets, t.num_bad);
+    sgj_js_nv_i(jsp, jo2p, "sets_checked", t.num_sets);
+    sgj_js_nv_i(jsp, jo2p, "not_compliant", t.num_bad);
+    if (jsp->pr_as_json)
+        jo3p = sgj_named_subobject_r(jsp, jo2p, "rule_violations");
+    for (int j = 0; j < cr_num; ++j) {
+        if (0 == t.rule_cnt[j])
+            continue;
+        sgj_hr_pri(jsp, "  {}: {}\n", compl_rule_a[j][0], t.rule_cnt[j]);
+        sgj_js_nv_i(jsp, jo3p, compl_rule_a[j][0], t.rule_cnt[j]);
+    }
+    return t.num_bad ? 2 : 0;
+}
+
+// Meaning of the exit status of --check-compliance , see compl_summary()
+static const char *
+compl_estr(int res) noexcept
+{
+    switch (res) {
+    case 0:
+        return "compliant";
+    case 2:
+        return "not compliant";
+    default:
+        return "syntax or I/O error";
+    }
+}
+
+static void
+compl_count(compl_tally & t, uint32_t set_m) noexcept
+{
+    ++t.num_sets;
+    t.num_bad += (0 != set_m);
+    for (int j = 0; j < cr_num; ++j)
+        t.rule_cnt[j] += (set_m >> j) & 1;
+}
+
+/* --check-compliance: checks the source and sink capabilities of each pd
+ * object in the snapshots of snap_v (root path and snapshot) against the
+ * rules in compl_rule_a[] . The raw PDOs are those rebuilt from the sysfs
+ * attributes, so their reserved bits are always clear. Returns 2 if any
+ * set is not compliant, 1 on error, else 0. */
+static int
+output_compliance(const std::vector<std::pair<sstring,
+                                   const scan_snap *>> & snap_v,
+                  bool filter_for_pd, struct opts_t * op,
+                  sgj_opaque_p jop) noexcept
+{
+    const bool show_root { op->root_v.size() > 1 };
+    sgj_state * jsp { &op->json_st };
+    sgj_opaque_p jap { };
+    sgj_opaque_p jo2p { };
+    compl_tally t { };
+    std::vector<compl_pdo> rec_v;
+    std::vector<uint32_t> viol_v;
+
+    if (jsp->pr_as_json)
+        jap = sgj_named_subarray_r(jsp, jop, "compliance_list");
+    for (const auto & [root, ssp] : snap_v) {
+        std::set<int> pd_s;
+
+        if (filter_for_pd && (! pd_filter_match(*ssp, op, pd_s)))
+            return 1;
+        for (const auto & [nm, ue] : ssp->upd_de_m) {
+            if ((filter_for_pd && (! pd_s.contains(nm))) ||
+                (! ue.pdos_populated_))
+                continue;
+            const sstring lab { fmt_to_str("{}{}pd{}{}",
+                                show_root ? root : empty_str,
+                                show_root ? " " : "", nm,
+                                ue.is_partner_ ? " partner" : "") };
+
+            for (int k = 0; k < 2; ++k) {
+                const auto & pdo_v { k ? ue.sink_pdo_v_ : ue.source_pdo_v_ };
+
+                if (pdo_v.empty())
+                    continue;
+                if (std::ranges::any_of(pdo_v, &pdo_elem::raw_unavail_)) {
+                    // see --deadline=, a raw PDO of 0 is not a null PDO
+                    print_err(-1, "{}: {} not checked, an attribute was "
+                              "unavailable\n", lab,
+                              k ? sink_cap_s : src_cap_s);
+                    continue;
+                }
+                rec_v.clear();
+                for (const auto & a_pdo : pdo_v)
+                    rec_v.push_back(compl_decode(a_pdo.raw_pdo_,
+                                                 a_pdo.pdo_ind_));
+                viol_v.resize(rec_v.size());
+                const uint32_t set_m { compl_check_set(rec_v.data(),
+                                           rec_v.size(), 0 == k,
+                                           viol_v.data()) };
+
+                compl_count(t, set_m);
+                if (jsp->pr_as_json) {
+                    jo2p = sgj_new_unattached_object_r(jsp);
+                    if (show_root)
+                        sgj_js_nv_s(jsp, jo2p, "sysfs_root", root.c_str());
+                    sgj_js_nv_i(jsp, jo2p, "pd_num", nm);
+                    sgj_js_nv_i(jsp, jo2p, "partner", ue.is_partner_);
+                }
+                compl_report(lab, 0 == k, rec_v.data(), viol_v.data(),
+                             rec_v.size(), set_m, op, jap, jo2p);
+            }
+        }
+    }
+    return compl_summary(t, op, jop);
+}
+
+/* --check-compliance=FILE (or '-' for stdin) checks capabilities lists
+ * given as raw PDO words, one list per line: "[LABEL] {source|sink} PDO
+ * [PDO ...]" with each PDO in hex (a "0x" prefix is optional). Empty lines
+ * and those starting with '#' are ignored. Only lists that are not
+ * compliant are output, unless --verbose is given. No sysfs access is
+ * made, lines are parsed in place. Returns 2 if any list is not
+ * compliant, 1 on a syntax or I/O error, else 0. */
+static int
+do_compliance_file(struct opts_t * op, sgj_opaque_p jop) noexcept
+{
+    int res { };
+    unsigned int ln { };
+    char * lp { };
+    size_t lsz { };
+    ssize_t n;
+    sgj_state * jsp { &op->json_st };
+    sgj_opaque_p jap { };
+    sgj_opaque_p jo2p { };
+    compl_tally t { };
+    compl_pdo rec_a[16];
+    uint32_t viol_a[16];
+    const char * fn { op->compl_fn };
+    const bool from_stdin { 0 == strcmp(fn, "-") };
+    FILE * fp { from_stdin ? stdin : fopen(fn, "re") };
+
+    if (nullptr == fp) {
+        print_err(-1, "unable to open {}: {}\n", fn, strerror(errno));
+        return 1;
+    }
+    if (jsp->pr_as_json)
+        jap = sgj_named_subarray_r(jsp, jop, "compliance_list");
+    while ((n = getline(&lp, &lsz, fp)) >= 0) {
+        static const char * const ws { " \t\r\n" };
+        int num { };
+        int is_src { -1 };
+        const char * cp { lp + strspn(lp, ws) };
+        const char * const ep { lp + n };
+        sstring_vw lab_sv;
+
+        ++ln;
+        if (('\0' == *cp) || ('#' == *cp))
+            continue;
+        while (cp < ep) {
+            const size_t len { strcspn(cp, ws) };
+            const sstring_vw tok { cp, len };
+
+            if (0 == len)
+                break;
+            cp += len;
+            cp += strspn(cp, ws);
+            if (is_src < 0) {
+                if ((tok == "source") || (tok == "src"))
+                    is_src = 1;
+                else if ((tok == "sink") || (tok == "snk"))
+                    is_src = 0;
+                else if (lab_sv.empty())
+                    lab_sv = tok;
+                else
+                    break;
+                continue;
+            }
+            const char * bp { tok.data() };
+            uint32_t raw;
+
+            if ((len > 2) && ('0' == bp[0]) && ('x' == (bp[1] | 0x20)))
+                bp += 2;
+            const auto [p, ec] { std::from_chars(bp, tok.data() + len, raw,
+                                                 16) };
+
+            if ((ec != std::errc()) || (p != tok.data() + len) ||
+                (num >= 16)) {
+                num = -1;
+                break;
+            }
+            rec_a[num] = compl_decode(raw, num + 1);
+            ++num;
+        }
+        if ((is_src < 0) || (num <= 0) || (cp < ep)) {
+            print_err(-1, "{}:{}: expected [LABEL] {{source|sink}} PDO "
+                      "[PDO ...], at most 16\n", fn, ln);
+            res = 1;
+            continue;
+        }
+        const uint32_t set_m { compl_check_set(rec_a, num, is_src,
+                                               viol_a) };
+
+        compl_count(t, set_m);
+        if ((0 == set_m) && (! op->verbose_given))
+            continue;
+        if (jsp->pr_as_json) {
+            jo2p = sgj_new_unattached_object_r(jsp);
+            sgj_js_nv_i(jsp, jo2p, "line_num", ln);
+            if (! lab_sv.empty())
+                sgj_js_nv_s(jsp, jo2p, "label", sstring(lab_sv).c_str());
+        }
+        compl_report(lab_sv.empty() ? fmt_to_str("line {}", ln) :
+                                      fmt_to_str("line {} {}", ln, lab_sv),
+                     is_src, rec_a, viol_a, num, set_m, op, jap, jo2p);
+    }
+    if (ferror(fp)) {
+        print_err(-1, "reading {}: {}\n", fn, strerror(errno));
+        res = 1;
+    }
+    free(lp);
+    if (! from_stdin)
+        fclose(fp);
+    const int c_res { compl_summary(t, op, jop) };
+
+    // not compliant (2) takes precedence over a syntax error (1)
+    return ((2 == c_res) || (0 == res)) ? c_res : res;
+}
+
+// Flag bits of a PDO listed in the flags column of --csv and --tsv. Those
+// wider than one bit are output as <name>=<value> when non-zero. Names
+// are those of the sysfs attributes, where there is one.
+struct pdo_flag_t {
+    enum pdo_e pdo_el;
+    int caps;           // 1: source caps only, 0: sink caps only, -1: both
+    uint8_t bit;
+    uint8_t width;
+    const char * name;
+};
+
+static const struct pdo_flag_t pdo_flag_a[] = {
+    {pdo_e::pdo_fixed, -1, 29, 1, "dual_role_power"},
+    {pdo_e::pdo_fixed, 1, 28, 1, "usb_suspend_supported"},
+    {pdo_e::pdo_fixed, 0, 28, 1, "higher_capability"},
+    {pdo_e::pdo_fixed, -1, 27, 1, "unconstrained_power"},
+    {pdo_e::pdo_fixed, -1, 26, 1, "usb_communication_capable"},
+    {pdo_e::pdo_fixed, -1, 25, 1, "dual_role_data"},
+    {pdo_e::pdo_fixed, 1, 24, 1, "unchunked_extended_messages_supported"},
+    {pdo_e::pdo_fixed, 1, 23, 1, "epr_mode_capable"},
+    {pdo_e::pdo_fixed, 0, 23, 2, "fast_role_swap_current"},
+    {pdo_e::pdo_fixed, 1, 20, 2, "peak_current"},
+    {pdo_e::apdo_pps, 1, 27, 1, "pps_power_limited"},
+    {pdo_e::apdo_spr_avs, 1, 26, 2, "peak_current"},
+    {pdo_e::apdo_epr_avs, 1, 26, 2, "peak_current"},
+};
+
+static const char * const pdo_csv_hdr =
+        "pd{0}partner{0}caps{0}index{0}type{0}raw{0}min_mv{0}max_mv{0}ma{0}"
+        "mw{0}flags\n";
+
+/* --csv and --tsv: outputs a row for each PDO in ss, with fields separated
+ * by op->pdo_sep, preceded by a header row if header. If root is given it
+ * is placed in an extra first column. Rows are formatted straight from the
+ * pdo_elem objects into a buffer that is written out when nearly full, so
+ * no strings are built per field. */
+static void
+output_pdo_rows(const scan_snap & ss, bool filter_for_pd, const char * root,
+                bool header, const struct opts_t * op) noexcept
+{
+    const char sep { op->pdo_sep };
+    size_t n { 0 };
+    std::set<int> pd_s;         // pd numbers that match a pd FILTER
+    FILE * fp { lsucpd_hr_fp ? lsucpd_hr_fp : stdout };
+    char b[8192];
+
+    auto flush = [&] {
+        if (n > 0)
+            fwrite(b, 1, n, fp);
+        n = 0;
+    };
+    auto put_s = [&](const char * cp, size_t len) {
+        if (len > sizeof(b) - n) {
+            flush();
+            if (len > sizeof(b)) {
+                fwrite(cp, 1, len, fp);
+                return;
+            }
+        }
+        memcpy(b + n, cp, len);
+        n += len;
+    };
+    auto put_c = [&](char c) {
+        if (n == sizeof(b))
+            flush();
+        b[n++] = c;
+    };
+    auto put_u = [&](uint64_t val) {
+        if (sizeof(b) - n < 24)
+            flush();
+        n = std::to_chars(b + n, b + sizeof(b), val).ptr - b;
+    };
+    // a CSV field holding the separator or a double quote is quoted
+    auto put_field = [&](const char * cp) {
+        const size_t len { strlen(cp) };
+
+        if ((',' == sep) && strpbrk(cp, ",\"\n")) {
+            put_c('"');
+            for (const char * p = cp; *p; ++p) {
+                if ('"' == *p)
+                    put_c('"');
+                put_c(*p);
+            }
+            put_c('"');
+        } else
+            put_s(cp, len);
+        put_c(sep);
+    };
+
+    if (filter_for_pd && (! pd_filter_match(ss, op, pd_s)))
+        return;
+    if (header) {
+        if (root)
+            put_field("root");
+        const sstring hdr { fmt_to_str(pdo_csv_hdr, sep) };
+
+        put_s(hdr.c_str(), hdr.size());
+    }
+    for (const auto & [nm, upd_d_el] : ss.upd_de_m) {
+        if ((filter_for_pd && (! pd_s.contains(nm))) ||
+            (! upd_d_el.pdos_populated_))
+            continue;
+        for (const auto * pv : { &upd_d_el.source_pdo_v_,
+                                 &upd_d_el.sink_pdo_v_ }) {
+            for (const auto & a_pdo : *pv) {
+                const bool src { a_pdo.is_source_caps_ };
+                const enum pdo_e pe { a_pdo.pdo_el_ };
+                const uint32_t raw { a_pdo.raw_pdo_ };
+                bool first { true };
+
+                if (root)
+                    put_field(root);
+                put_u(nm);
+                put_c(sep);
+                put_c(upd_d_el.is_partner_ ? '1' : '0');
+                put_c(sep);
+                put_field(src ? "source" : "sink");
+                put_u(a_pdo.pdo_ind_);
+                put_c(sep);
+                put_field((pe == pdo_e::pdo_null) ? "" : pdo_e_to_str(pe));
+                put_s("0x", 2);
+                for (int k = 28; k >= 0; k -= 4)
+                    put_c("0123456789abcdef"[(raw >> k) & 0xf]);
+                put_c(sep);
+                if (pe == pdo_e::pdo_null) {
+                    for (int k = 0; k < 4; ++k)
+                        put_c(sep);
+                    put_c('\n');
+                    continue;
+                }
+                const pdo_vals_t vals { decode_pdo_vals(a_pdo) };
+                const bool has_mw { (pe == pdo_e::pdo_battery) ||
+                                    (pe == pdo_e::apdo_spr_avs) ||
+                                    (pe == pdo_e::apdo_epr_avs) };
+
+                put_u(vals.mv_min);
+                put_c(sep);
+                put_u(vals.mv_max);
+                put_c(sep);
+                if (! has_mw)
+                    put_u(vals.ma);
+                put_c(sep);
+                if (has_mw)
+                    put_u(vals.mw);
+                put_c(sep);
+                for (const auto & fl : pdo_flag_a) {
+                    const uint32_t v { (raw >> fl.bit) &
+                                       ((1U << fl.width) - 1) };
+
+                    if ((fl.pdo_el != pe) || (0 == v) ||
+                        ((fl.caps >= 0) && (fl.caps != (int)src)))
+                        continue;
+                    if (! first)
+                        put_c('|');
+                    first = false;
+                    put_s(fl.name, strlen(fl.name));
+                    if (fl.width > 1) {
+                        put_c('=');
+                        put_u(v);
+                    }
+                }
+                put_c('\n');
+            }
+        }
+    }
+    flush();
+}
+
+static void
+output_snap(const scan_snap & ss, bool filter_for_port, bool filter_for_pd,
+            struct opts_t * op, sgj_opaque_p jop) noexcept
+{
+    sgj_state * jsp { &op->json_st };
+    sgj_opaque_p jo2p { };
+    sgj_opaque_p jo3p { };
+    sgj_opaque_p jo4p { };
+    sgj_opaque_p jap { };
+
+    if (op->pdo_sep) {
+        output_pdo_rows(ss, filter_for_pd, nullptr, true, op);
+        return;
+    }
+    if (op->do_fingerprint) {
+        output_fingerprints({{op->tree.root_, &ss}}, filter_for_pd, op, jop);
+        return;
+    }
+    if (jsp->pr_as_json) {
+        jo2p = sgj_named_subobject_r(jsp, jop, lsucpd_jn_sn);
+        do_my_join(ss, op, jo2p);
+    }
+    if (filter_for_port || filter_for_pd) {
+        do_filter(filter_for_port, filter_for_pd, ss, op, jop);
+    } else {       // no FILTER argument given
+        for (auto&& [n, v] : ss.summ(op->do_data_dir)) {
+            if (lsucpd_verbose > 4)
+                sgj_hr_pri(jsp, "port={}: ", n);
+            sgj_hr_pri(jsp, "{}\n", v);
+#if 0
+            if (op->do_long > 0) {
+                for (const auto& entry : op->tc_de_v) {
+                    if (n == entry.port_num_)
+                        list_port(entry, op);
+                }
+            }
+#endif
+        }
+        if (op->do_long > 0) {
+            sgj_hr_pri(jsp, "\n");
+            if (jsp->pr_as_json) {
+                jo2p = sgj_named_subobject_r(jsp, jop, ct_sn);
+                jap = sgj_named_subarray_r(jsp, jo2p, "typec_list");
+            }
+            for (auto&& [n, v] : ss.summ(op->do_data_dir)) {
+                for (const auto& entry : ss.tc_de_v) {
+                    if (n == entry.port_num_) {
+                        jo3p = sgj_new_unattached_object_r(jsp);
+                        sstring s { "port" + std::to_string(n) };
+                        if (entry.partner_)
+                            s += "_partner";
+                        jo4p = sgj_named_subobject_r(jsp, jo3p, s.c_str());
+                        list_port(entry, op, jo4p);
+                        sgj_js_nv_o(jsp, jap, nullptr, jo3p);
+                    }
+                }
+            }
+        }
+    }
+
+    if (op->caps_given) {
+        sgj_hr_pri(jsp, "\n");
+
+        if (jsp->pr_as_json) {
+            jo2p = sgj_named_subobject_r(jsp, jop, cupd_sn);
+            jap = sgj_named_subarray_r(jsp, jo2p, "pdo_list");
+        }
+        for (auto&& [nm, upd_d_el] : ss.upd_de_m) {
+            print_err(3, "nm={}, listing: {}\n", nm, upd_d_el.match_str_);
+            if (! upd_d_el.pdos_populated_)
+                break;  // take_snapshot() reported why
+            jo3p = sgj_new_unattached_object_r(jsp);
+            list_pd(nm, upd_d_el, op, jo3p);
+            sgj_js_nv_o(jsp, jap, nullptr /* name */, jo3p);
+        }
+    }
+}
+
+/* Output the --profile-io report: attributes sorted by the total time spent
+ * opening and reading them (slowest first) along with their share of the
+ * total runtime. If the option is given twice, a latency histogram is
+ * added for each attribute. */
+static void
+io_prof_report(struct opts_t * op, sgj_opaque_p jop) noexcept
+{
+    uint64_t tot_ns { };
+    uint64_t tot_cnt { };
+    sgj_state * jsp { &op->json_st };
+    sgj_opaque_p jo2p { };
+    sgj_opaque_p jo3p { };
+    sgj_opaque_p jap { };
+    sgj_opaque_p ja2p { };
+    std::vector<std::pair<sstring, const io_prof_elem *>> pe_v;
+    const uint64_t run_ns = std::chrono::duration_cast<
+                std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+                                          io_prof.start_tp).count();
+    const double run_d { run_ns ? static_cast<double>(run_ns) : 1.0 };
+
+    for (const auto & [nm, pe] : io_prof.attr_m) {
+        tot_ns += pe.total_ns();
+        tot_cnt += pe.count;
+        pe_v.emplace_back(nm, &pe);
+    }
+    std::ranges::sort(pe_v, [](const auto & lhs, const auto & rhs) {
+                                return lhs.second->total_ns() >
+                                       rhs.second->total_ns(); });
+
+    sgj_hr_pri(jsp, "\nI/O profile: {} reads of {} attributes took {}.{:03} "
+               "ms, {:.1f}% of {}.{:03} ms runtime\n", tot_cnt, pe_v.size(),
+               tot_ns / 1000000, (tot_ns / 1000) % 1000,
+               (100.0 * tot_ns) / run_d, run_ns / 1000000,
+               (run_ns / 1000) % 1000);
+    if (pe_v.empty())
+        return;
+    sgj_hr_pri(jsp, "  {:<38} {:>6} {:>11} {:>10} {:>10} {:>6}\n",
+               "attribute", "count", "total(us)", "mean(us)", "max(us)",
+               "share");
+    jo2p = sgj_named_subobject_r(jsp, jop, "io_profile");
+    sgj_js_nv_i(jsp, jo2p, "number_of_reads", tot_cnt);
+    sgj_js_nv_ihex_nex(jsp, jo2p, "io_time", tot_ns, false,
+                       "unit: nanosecond");
+    sgj_js_nv_ihex_nex(jsp, jo2p, "runtime", run_ns, false,
+                       "unit: nanosecond");
+    jap = sgj_named_subarray_r(jsp, jo2p, "attribute_list");
+    for (const auto & [nm, pep] : pe_v) {
+        const uint64_t t_ns { pep->total_ns() };
+        const double share { (100.0 * t_ns) / run_d };
+
+        const uint64_t m_ns { t_ns / pep->count };
+
+        sgj_hr_pri(jsp, "  {:<38} {:>6} {:>7}.{:03} {:>6}.{:03} {:>6}.{:03} "
+                   "{:>5.1f}%\n", nm, pep->count, t_ns / 1000, t_ns % 1000,
+                   m_ns / 1000, m_ns % 1000, pep->max_ns / 1000,
+                   pep->max_ns % 1000, share);
+        jo3p = sgj_new_unattached_object_r(jsp);
+        sgj_js_nv_s(jsp, jo3p, "name", nm.c_str());
+        sgj_js_nv_i(jsp, jo3p, "count", pep->count);
+        sgj_js_nv_i(jsp, jo3p, "errors", pep->errs);
+        sgj_js_nv_i(jsp, jo3p, "open_ns", pep->open_ns);
+        sgj_js_nv_i(jsp, jo3p, "read_ns", pep->read_ns);
+        sgj_js_nv_i(jsp, jo3p, "total_ns", t_ns);
+        sgj_js_nv_i(jsp, jo3p, "max_ns", pep->max_ns);
+        sgj_js_nv_s(jsp, jo3p, "runtime_share_percent",
+                    fmt_to_str("{:.2f}", share).c_str());
+        ja2p = sgj_named_subarray_r(jsp, jo3p, "histogram_log2_us");
+        for (int k = 0; k < IO_PROF_NUM_BUCKETS; ++k)
+            sgj_js_nv_i(jsp, ja2p, nullptr, pep->hist[k]);
+        sgj_js_nv_o(jsp, jap, nullptr, jo3p);
+
+        if (op->do_profile_io > 1) {
+            sstring hs;
+
+            for (int k = 0; k < IO_PROF_NUM_BUCKETS; ++k) {
+                if (0 == pep->hist[k])
+                    continue;
+                if (0 == k)
+                    hs += fmt_to_str(" <1:{}", pep->hist[k]);
+                else if (k == (IO_PROF_NUM_BUCKETS - 1))
+                    hs += fmt_to_str(" >={}:{}", 1U << (k - 1),
+                                     pep->hist[k]);
+                else
+                    hs += fmt_to_str(" {}-{}:{}", 1U << (k - 1), 1U << k,
+                                     pep->hist[k]);
+            }
+            sgj_hr_pri(jsp, "      histogram(us):{}\n", hs);
+        }
+    }
+}
+
+/* Handles short options after '-j' including a sequence of short options
+ * that include one 'j' (for JSON). Want optional argument to '-j' to be
+ * prefixed by '='. Return 0 for good, 1 for syntax error
+ * and 2 for exit with no error. If err_p is given a syntax error is put
+ * there rather than sent to stderr. */
+static int
+chk_short_opts(const char sopt_ch, struct opts_t * op,
+               sstring * err_p = nullptr) noexcept
+{
+    /* only need to process short, non-argument options */
+    switch (sopt_ch) {
+    case 'c':
+        ++op->do_caps;
+        op->caps_given = true;
+        break;
+    case 'd':
+        op->do_data_dir = true;
+        break;
+    case 'h':
+    case '?':
+        ++op->do_help;
+        break;
+    case 'j':
+        break;  /* simply ignore second 'j' (e.g. '-jxj') */
+    case 'l':
+        ++op->do_long;
+        break;
+    case 'v':
+        op->verbose_given = true;
+        ++op->verbose;
+        break;
+    case 'V':
+        op->version_given = true;
+        break;
+    default:
+        if (err_p)
+            *err_p = fmt_to_str("unrecognised option code {:c} [0x{:x}]",
+                                sopt_ch, sopt_ch);
+        else
+            pr2serr("unrecognised option code %c [0x%x] ??\n", sopt_ch,
+                    sopt_ch);
+        return 1;
+    }
+    return 0;
+}
+
+/* Parses the command line options and FILTER arguments into op. Returns
+ * 0 if good, else 1 after reporting why. If err_p is given (e.g. for the
+ * request lines of --batch=FILE or --serve=PATH) the reason is put there
+ * instead of on stderr, and the usage is not shown. */
+static int
+cl_parse(struct opts_t * op, int argc, char * argv[],
+         sstring * err_p = nullptr)
+{
+    arr_of_ch<128> b { };
+    auto bad = [err_p](const sstring & why) {
+        if (err_p)
+            *err_p = why;
+        else
+            print_err(-1, "{}\n", why);
+    };
+
+    while (1) {
+        int option_index = 0;
+
+        int c = getopt_long(argc, argv, short_opts, long_options,
+                            &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 'c':
+            ++op->do_caps;
+            op->caps_given = true;
+            break;
+        case lo_cache:
+            if ((nullptr == optarg) || (0 == strcmp(optarg, "reread")))
+                op->cache_pol = cache_pol_reread;
+            else if (0 == strcmp(optarg, "flag"))
+                op->cache_pol = cache_pol_flag;
+            else {
+                bad("--cache=POL expects POL to be 'reread' or 'flag'");
+                return 1;
+            }
+            break;
+        case 'd':
+            op->do_data_dir = true;
+            break;
+        case lo_deadline:
+            {
+                const char * ccp { strchr(optarg, ',') };
+
+                op->deadline_ms = sg_get_num(optarg);
+                if (op->deadline_ms < 1) {
+                    bad("--deadline=MS expects MS to be a "
+                        "positive number of milliseconds");
+                    return 1;
+                }
+                if (ccp) {
+                    op->run_deadline_ms = sg_get_num(ccp + 1);
+                    if (op->run_deadline_ms < 1) {
+                        bad("--deadline=MS,RUN_MS expects RUN_MS "
+                            "to be a positive number");
+                        return 1;
+                    }
+                }
+            }
+            break;
+        case 'h':
+            ++op->do_help;
+            break;
+        case 'j':       /* for: -j[=JO] */
+        case '^':       /* for: --json[=JO] */
+            op->do_json = true;
+            /* Now want '=' to precede all JSON optional arguments */
+            if (optarg) {
+                int k, n, q;
+
+                if ('^' == c) {
+                    op->json_arg = optarg;
+                    break;
+                } else if ('=' == *optarg) {
+                    op->json_arg = optarg + 1;
+                    break;
+                }
+                n = strlen(optarg);
+                for (k = 0; k < n; ++k) {
+                    q = chk_short_opts(*(optarg + k), op, err_p);
+                    if (1 == q)
+                        return 1;
+                    if (2 == q)
+                        return 0;
+                }
+            } else
+                op->json_arg = nullptr;
+            break;
+       case 'J':
+            op->do_json = true;
+            op->js_file = optarg;
+            break;
+        case 'l':
+            ++op->do_long;
+            break;
+        case 'p':
+            op->pdo_opt_p = optarg;
+            op->is_pdo_snk = true;
+            break;
+        case 'P':
+            op->pdo_opt_p = optarg;
+            op->is_pdo_snk = false;
+            break;
+        case 'r':
+            op->rdo_opt_p = optarg;
+            break;
+        case lo_http:
+            op->http_addr = optarg;
+            break;
+        case lo_max_age:
+            op->max_age_ms = sg_get_num(optarg);
+            if (op->max_age_ms < 0) {
+                bad("--max-age=MS expects MS to be 0 or more milliseconds");
+                return 1;
+            }
+            break;
+        case lo_record:
+            op->rec_path = optarg;
+            break;
+        case lo_history:
+            op->hist_path = optarg;
+            break;
+        case lo_count:
+            op->do_count = true;
+            break;
+        case lo_check:
+            op->do_count = true;
+            op->check_arg = optarg;
+            break;
+        case lo_fields:
+            op->fields_arg = optarg;
+            break;
+        case lo_fingerprint:
+            op->do_fingerprint = true;
+            op->fp_model_fn = optarg;
+            break;
+        case lo_check_compliance:
+            op->do_compliance = true;
+            op->compl_fn = optarg;
+            break;
+        case lo_batch:
+            op->batch_path = optarg;
+            break;
+        case lo_storm:
+            {
+                const char * ccp { strchr(optarg, ',') };
+
+                op->storm_rate = sg_get_num(optarg);
+                op->storm_secs = ccp ? sg_get_num(ccp + 1) : STORM_DEF_SECS;
+                if ((op->storm_rate < 1) || (op->storm_secs < 1)) {
+                    bad("--storm=RATE[,SECS] expects both to be 1 or more");
+                    return 1;
+                }
+            }
+            break;
+        case lo_capture:
+            op->cap_path = optarg;
+            break;
+        case lo_replay:
+            {
+                static sstring rp_s;    // optarg without ",N"
+                const char * ccp { strrchr(optarg, ',') };
+
+                op->replay_speed = 1;
+                if (ccp) {
+                    op->replay_speed = sg_get_num(ccp + 1);
+                    if (op->replay_speed < 0) {
+                        bad("--replay=FILE,N expects N to be 0 "
+                            "(no delays) or more");
+                        return 1;
+                    }
+                    rp_s.assign(optarg, ccp - optarg);
+                    op->replay_path = rp_s.c_str();
+                } else
+                    op->replay_path = optarg;
+            }
+            break;
+        case lo_arrow:
+            if (0 == strlen(optarg)) {
+                bad("--arrow=PREFIX expects a non-empty PREFIX");
+                return 1;
+            }
+            op->arrow_prefix = optarg;
+            break;
+        case lo_at:
+            op->hist_at = optarg;
+            break;
+        case lo_between:
+            op->hist_between = optarg;
+            break;
+        case lo_serve:
+            op->serve_path = optarg;
+            break;
+        case lo_shm:
+            if ((0 == strlen(optarg)) || strchr(optarg, '/')) {
+                bad("--shm=NAME expects NAME to be a file name without '/'");
+                return 1;
+            }
+            op->shm_name = optarg;
+            break;
+        case lo_csv:
+            op->pdo_sep = ',';
+            break;
+        case lo_tsv:
+            op->pdo_sep = '\t';
+            break;
+        case lo_sqlite:
+            op->sqlite_db = optarg;
+            break;
+        case lo_retries:
+            op->scan_retries = sg_get_num(optarg);
+            if (op->scan_retries < 0) {
+                bad("--retries=N expects N to be 0 or more");
+                return 1;
+            }
+            break;
+        case lo_profile_io:
+            ++op->do_profile_io;
+            break;
+        case 'v':
+            op->verbose_given = true;
+            ++op->verbose;
+            break;
+        case 'V':
+            op->version_given = true;
+            break;
+        case lo_watch:
+            op->do_watch = true;
+            if (optarg) {
+                const char * ccp { strchr(optarg, ',') };
+
+                op->watch_quiet_ms = sg_get_num(optarg);
+                if (ccp)
+                    op->watch_max_ms = sg_get_num(ccp + 1);
+                if ((op->watch_quiet_ms < 0) || (op->watch_max_ms < 0)) {
+                    bad("--watch=QUIET,MAX expects QUIET and "
+                        "MAX to be 0 or more milliseconds");
+                    return 1;
+                }
+            }
+            break;
+        case 'y':
+            if (nullptr == op->pseudo_mount_point)
+                op->pseudo_mount_point = optarg;
+            op->root_v.push_back(optarg);
+            break;
+        default:
+            bad(fmt_to_str("unrecognised option code: {:c} [0x{:x}]", c, c));
+            if (nullptr == err_p)
+                usage();
+            return 1;
+        }
+    }
+    while (optind < argc) {
+        const char * oip = argv[optind];
+        auto ln = strlen(oip);
+
+        if ((ln < 2) || (ln >= 31)) {
+            bad(fmt_to_str("expect argument of the form: 'p<num>', "
+                           "'p<num>[p]' or 'pd<num>', got: {}", oip));
+            return 1;
+        }
+        if (tolower(oip[0]) != 'p') {
+            bad("FILTER arguments must start with a 'p'");
+            if (nullptr == err_p) {
+                print_err(-1, "\n");
+                usage();
+            }
+            return 1;
+        }
+        if (tolower(oip[1]) == 'd')
+            op->filter_pd_v.push_back(oip);
+        else {
+            memset(b.d(), 0, 32);
+            strncpy(b.d(), oip, (ln < b.sz() ? ln : (b.sz() - 1)));
+            if (ln > 4) {       // also accept 'port1' or 'port3p'
+                if (0 == memcmp(b.d(), "port", 4)) {
+                    memmove(b.d() + 1, b.d() + 4, 3);
+                    ln -= 3;    // transform to 'p1' and 'p3p'
+                } else {
+                    bad(fmt_to_str("malformed FILTER argument: {}", b.d()));
+                    return 1;
+                }
+            }
+            if (b[ln - 1] == 'P')
+                b[ln - 1] = 'p';
+            op->filter_port_v.push_back(b.d());
+        }
+        ++optind;
+    }
+    return 0;
+}
+
+// Options (and states of options) that are checked for conflicts after
+// the command line is parsed. One bit each.
+enum opt_bit_e : uint64_t {
+    ob_json = 1ULL << 0,
+    ob_caps = 1ULL << 1,
+    ob_data = 1ULL << 2,
+    ob_long = 1ULL << 3,
+    ob_profile_io = 1ULL << 4,
+    ob_cache = 1ULL << 5,
+    ob_js_file = 1ULL << 6,
+    ob_filt_port = 1ULL << 7,
+    ob_filt_pd = 1ULL << 8,
+    ob_serve = 1ULL << 9,
+    ob_http = 1ULL << 10,
+    ob_watch = 1ULL << 11,
+    ob_record = 1ULL << 12,
+    ob_capture = 1ULL << 13,
+    ob_replay = 1ULL << 14,
+    ob_storm = 1ULL << 15,
+    ob_real_sys = 1ULL << 16,   // no --sysfsroot= other than /sys
+    ob_multi_root = 1ULL << 17, // more than one --sysfsroot=
+    ob_batch = 1ULL << 18,
+    ob_history = 1ULL << 19,
+    ob_no_history = 1ULL << 20,
+    ob_at = 1ULL << 21,
+    ob_between = 1ULL << 22,
+    ob_shm = 1ULL << 23,
+    ob_count = 1ULL << 24,
+    ob_fields = 1ULL << 25,
+    ob_fingerprint = 1ULL << 26,
+    ob_compliance = 1ULL << 27,
+    ob_compl_file = 1ULL << 28,
+    ob_csv = 1ULL << 29,        // --csv or --tsv
+    ob_arrow = 1ULL << 30,
+    ob_sqlite = 1ULL << 31,
+};
+
+// the modes that keep running, or that re-scan, rather than list one scan
+static const uint64_t ob_long_run { ob_serve | ob_http | ob_watch |
+                                    ob_record | ob_capture | ob_replay |
+                                    ob_storm };
+static const uint64_t ob_out_sel { ob_caps | ob_data | ob_long };
+static const uint64_t ob_filt { ob_filt_port | ob_filt_pd };
+
+static const char * const compl_conf_s =
+    "--check-compliance checks PDO sets, it can not be used with --csv,\n"
+    "--data, --fingerprint, --long, --tsv, port FILTERs or the other "
+    "output\nmodes. With FILE pd FILTERs and --sysfsroot= are not "
+    "accepted";
+static const char * const hist_conf_s =
+    "--history=FILE takes either --at= or --between=, output options and\n"
+    "port FILTERs. PDOs are not recorded so --caps and pd FILTERs are\n"
+    "not supported";
+
+// An option in 'mode' given with one in 'with' is a conflict, reported
+// with 'msg'. Checked in order, the first conflict found is reported.
+struct opt_conflict {
+    uint64_t mode;
+    uint64_t with;
+    const char * msg;
+};
+
+static const struct opt_conflict opt_conflict_a[] = {
+    {ob_serve | ob_http,
+     ob_json | ob_out_sel | ob_profile_io | ob_cache | ob_filt,
+     "with --serve=PATH or --http=[ADDR:]PORT, output options and "
+     "FILTERs\nare given in each request; --cache and --profile-io are "
+     "not supported"},
+    {ob_watch | ob_record | ob_capture | ob_replay | ob_storm,
+     ob_profile_io | ob_cache | ob_js_file | ob_filt,
+     "--watch, --record=, --capture=, --replay= and --storm= select what "
+     "is\noutput themselves, FILTERs, --js-file=, --cache and "
+     "--profile-io are not supported"},
+    {ob_storm, ob_replay | ob_real_sys,
+     "--storm=RATE changes the synthetic tree given by --sysfsroot=SPATH\n"
+     "and can not be used with --replay=FILE"},
+    {ob_replay, ob_capture | ob_real_sys,
+     "--replay=FILE writes into a synthetic tree given by "
+     "--sysfsroot=SPATH\nand can not be used with --capture=FILE"},
+    {ob_batch,
+     ob_out_sel | ob_long_run | ob_history | ob_shm | ob_js_file |
+     ob_profile_io | ob_cache | ob_filt,
+     "with --batch=FILE, output options and FILTERs are given on each "
+     "line;\n--json selects JSON lines output"},
+    {ob_count,
+     ob_out_sel | ob_long_run | ob_history | ob_batch | ob_shm |
+     ob_js_file | ob_profile_io | ob_cache | ob_filt,
+     "--count and --check= only take --json, --sysfsroot= and --verbose"},
+    {ob_fields,
+     ob_out_sel | ob_long_run | ob_history | ob_batch | ob_count |
+     ob_shm | ob_js_file | ob_cache | ob_filt_pd,
+     "--fields= only takes --deadline=, --json, --profile-io, "
+     "--sysfsroot=,\n--verbose and port FILTERs"},
+    {ob_fingerprint,
+     ob_csv | ob_long | ob_data | ob_long_run | ob_history | ob_batch |
+     ob_count | ob_fields | ob_filt_port,
+     "--fingerprint lists PDO sets, it can not be used with --csv, "
+     "--data,\n--long, --tsv, port FILTERs or the other output modes"},
+    {ob_compliance,
+     ob_csv | ob_fingerprint | ob_long | ob_data | ob_long_run |
+     ob_history | ob_batch | ob_count | ob_fields | ob_arrow | ob_sqlite |
+     ob_filt_port,
+     compl_conf_s},
+    {ob_compl_file, ob_filt_pd | ob_multi_root, compl_conf_s},
+    {ob_csv,
+     ob_json | ob_long | ob_data | ob_long_run | ob_history | ob_batch |
+     ob_count | ob_fields | ob_filt_port,
+     "--csv and --tsv output a row per PDO, they can not be used with "
+     "--data,\n--json, --long, port FILTERs or the other output modes"},
+    {ob_arrow | ob_sqlite,
+     ob_long_run | ob_history | ob_batch | ob_count | ob_fields,
+     "--arrow= and --sqlite= export a scan, they can not be used with\n"
+     "--batch=, --count, --fields=, --history= or the long running modes"},
+    {ob_at | ob_between, ob_no_history,
+     "--at= and --between= need --history=FILE"},
+    {ob_history,
+     ob_serve | ob_http | ob_watch | ob_record | ob_shm | ob_caps |
+     ob_profile_io | ob_cache | ob_filt_pd,
+     hist_conf_s},
+    {ob_at, ob_between, hist_conf_s},
+    {ob_multi_root,
+     ob_long_run | ob_history | ob_batch | ob_count | ob_fields | ob_shm |
+     ob_cache,
+     "with more than one --sysfsroot= only output options, FILTERs,\n"
+     "--deadline= and --profile-io are accepted"},
+};
+
+// Returns the opt_bit_e bits of what the command line in op holds
+static uint64_t
+opt_bits(const struct opts_t * op) noexcept
+{
+    const char * pmp { op->pseudo_mount_point };
+    uint64_t res { };
+    auto set = [&res](bool given, uint64_t bit) {
+        if (given)
+            res |= bit;
+    };
+
+    set(op->do_json, ob_json);
+    set(op->caps_given, ob_caps);
+    set(op->do_data_dir, ob_data);
+    set(op->do_long, ob_long);
+    set(op->do_profile_io, ob_profile_io);
+    set(op->cache_pol != cache_pol_off, ob_cache);
+    set(op->js_file, ob_js_file);
+    set(! op->filter_port_v.empty(), ob_filt_port);
+    set(! op->filter_pd_v.empty(), ob_filt_pd);
+    set(op->serve_path, ob_serve);
+    set(op->http_addr, ob_http);
+    set(op->do_watch, ob_watch);
+    set(op->rec_path, ob_record);
+    set(op->cap_path, ob_capture);
+    set(op->replay_path, ob_replay);
+    set(op->storm_rate > 0, ob_storm);
+    set((nullptr == pmp) || (0 == strcmp(pmp, "/sys")), ob_real_sys);
+    set(op->root_v.size() > 1, ob_multi_root);
+    set(op->batch_path, ob_batch);
+    set(op->hist_path, ob_history);
+    set(nullptr == op->hist_path, ob_no_history);
+    set(op->hist_at, ob_at);
+    set(op->hist_between, ob_between);
+    set(op->shm_name, ob_shm);
+    set(op->do_count, ob_count);
+    set(op->fields_arg, ob_fields);
+    set(op->do_fingerprint, ob_fingerprint);
+    set(op->do_compliance, ob_compliance);
+    set(op->compl_fn, ob_compl_file);
+    set(op->pdo_sep, ob_csv);
+    set(op->arrow_prefix, ob_arrow);
+    set(op->sqlite_db, ob_sqlite);
+    return res;
+}
+
+/* Checks the parsed command line in op against opt_conflict_a[]. Returns 0
+ * if there is no conflict, else reports the first one found and
+ * returns 1. */
+static int
+chk_opt_conflicts(const struct opts_t * op) noexcept
+{
+    const uint64_t given { opt_bits(op) };
+
+    for (const auto & oc : opt_conflict_a) {
+        if ((given & oc.mode) && (given & oc.with)) {
+            print_err(-1, "{}\n", oc.msg);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// One decoded --record=FILE record
+struct rec_record {
+    bool key { };
+    uint64_t wall_ms { };       // absolute
+    uint64_t boot_ms { };
+    rec_table tab;              // keyframe: all ports
+    // delta: port number, rec_f_* flags and the fields they name
+    std::vector<std::tuple<uint32_t, uint8_t, rec_port>> chg_v;
+};
+
+// Reads a --record=FILE. seek() uses FILE.idx to find the last keyframe
+// at or before a given time, then next() and apply() go forward from
+// there rebuilding the port table.
+class rec_reader {
+public:
+    int open(const char * fn) noexcept;
+    void seek(uint64_t wall_ms) noexcept;
+    bool next(rec_record & r) noexcept;
+    // returns a description of what changed for each port that did
+    std::map<uint32_t, sstring> apply(rec_record & r) noexcept;
+
+    const rec_table & table() const noexcept { return tab_; }
+    uint64_t wall_ms() const noexcept { return wall_ms_; }
+
+private:
+    bool read_idx(const sstring & idx_fn) noexcept;
+
+    sstring buf_;
+    size_t pos_ { };
+    std::vector<rec_idx_ent> idx_v_;
+    rec_table tab_;
+    bool have_key_ { };         // deltas before a keyframe are skipped
+    uint64_t wall_ms_ { };      // of the last record applied
+    uint64_t boot_ms_ { };
+};
+
+/* Reads fn and its index. Returns 0 on success, else an errno value. */
+int
+rec_reader::open(const char * fn) noexcept
+{
+    int res { };
+    int fd { ::open(fn, O_RDONLY | O_CLOEXEC) };
+    struct stat st { };
+
+    if (fd < 0)
+        return errno;
+    if (fstat(fd, &st) < 0) {
+        res = errno;
+        ::close(fd);
+        return res;
+    }
+    buf_.resize(st.st_size);
+    if (pread(fd, buf_.data(), buf_.size(), 0) != st.st_size)
+        res = errno ? errno : EIO;
+    ::close(fd);
+    if (res)
+        return res;
+    if ((buf_.size() < sizeof(rec_magic)) ||
+        (0 != memcmp(buf_.data(), rec_magic, sizeof(rec_magic)))) {
+        pr3ser(-1, fn, "is not a lsucpd --record= file");
+        return EINVAL;
+    }
+    pos_ = sizeof(rec_magic);
+    if (! read_idx(sstring(fn) + ".idx")) {
+        pr3ser(0, fn, "index missing or stale, reading whole file");
+        idx_v_.clear();
+    }
+    return 0;
+}
+
+// Returns false if the index is unusable: each entry must point at a
+// keyframe in buf_.
+bool
+rec_reader::read_idx(const sstring & idx_fn) noexcept
+{
+    int fd { ::open(idx_fn.c_str(), O_RDONLY | O_CLOEXEC) };
+    struct stat st { };
+    bool ok { false };
+
+    if (fd < 0)
+        return false;
+    if ((fstat(fd, &st) == 0) &&
+        (0 == (st.st_size % sizeof(rec_idx_ent)))) {
+        idx_v_.resize(st.st_size / sizeof(rec_idx_ent));
+        ok = (pread(fd, idx_v_.data(), st.st_size, 0) == st.st_size);
+    }
+    ::close(fd);
+    for (size_t k = 0; ok && (k < idx_v_.size()); ++k) {
+        const auto & ie { idx_v_[k] };
+        const uint8_t * bp { reinterpret_cast<const uint8_t *>(
+                                buf_.data()) + ie.offset };
+        const uint8_t * ep { reinterpret_cast<const uint8_t *>(
+                                buf_.data()) + buf_.size() };
+        uint64_t len;
+
+        ok = (ie.offset >= sizeof(rec_magic)) && (ie.offset < buf_.size()) &&
+             rec_get_uv(bp, ep, len) && (len > 0) && ('K' == *bp) &&
+             ((0 == k) || (idx_v_[k - 1].offset < ie.offset));
+    }
+    return ok;
+}
+
+// Positions at the last keyframe at or before wall_ms, else at the first
+// record. The index is searched by binary search; without one, the file
+// is read from its first record.
+void
+rec_reader::seek(uint64_t wall_ms) noexcept
+{
+    const auto it { std::upper_bound(idx_v_.begin(), idx_v_.end(), wall_ms,
+                                     [](uint64_t t, const rec_idx_ent & ie)
+                                     { return t < ie.wall_ms; }) };
+
+    pos_ = (it == idx_v_.begin()) ? sizeof(rec_magic) : (it - 1)->offset;
+    tab_.clear();
+    have_key_ = false;
+}
+
+/* Decodes the record at the current position into r and moves past it.
+ * Deltas before the first keyframe (i.e. when there is no base to apply
+ * them to) are skipped. Returns false at the end of the file or if a
+ * record is malformed. */
+bool
+rec_reader::next(rec_record & r) noexcept
+{
+    const uint8_t * const sp { reinterpret_cast<const uint8_t *>(
+                                buf_.data()) };
+    const uint8_t * const fep { sp + buf_.size() };
+
+    while (sp + pos_ < fep) {
+        const uint8_t * bp { sp + pos_ };
+        uint64_t len, v, n;
+
+        if ((! rec_get_uv(bp, fep, len)) ||
+            (len > static_cast<uint64_t>(fep - bp)) || (0 == len))
+            return false;
+        const uint8_t * const ep { bp + len };
+
+        pos_ = ep - sp;
+        r = rec_record { };
+        r.key = ('K' == *bp++);
+        if ((! r.key) && (! have_key_))
+            continue;
+        if (! rec_get_uv(bp, ep, v))
+            return false;
+        if (r.key)
+            r.wall_ms = v;
+        else    // zigzag
+            r.wall_ms = wall_ms_ + static_cast<uint64_t>(
+                            static_cast<int64_t>(v >> 1) ^
+                            -static_cast<int64_t>(v & 1));
+        if (! rec_get_uv(bp, ep, v))
+            return false;
+        r.boot_ms = r.key ? v : (boot_ms_ + v);
+        if (! rec_get_uv(bp, ep, n))
+            return false;
+        for (uint64_t k = 0; k < n; ++k) {
+            uint64_t pn;
+            uint8_t fl { rec_f_all };
+            rec_port rp;
+
+            if (! rec_get_uv(bp, ep, pn))
+                return false;
+            if (! r.key) {
+                if (bp >= ep)
+                    return false;
+                fl = *bp++;
+            }
+            if (fl & rec_f_flags) {
+                if (bp >= ep)
+                    return false;
+                rp.flags = *bp++;
+            }
+            if (fl & rec_f_pom) {
+                if (bp >= ep)
+                    return false;
+                rp.pow_op_mode = *bp++;
+            }
+            if (fl & rec_f_pd) {
+                if (! rec_get_uv(bp, ep, v))
+                    return false;
+                rp.pd_num = static_cast<int32_t>(v) - 1;
+            }
+            if (fl & rec_f_partner_pd) {
+                if (! rec_get_uv(bp, ep, v))
+                    return false;
+                rp.partner_pd_num = static_cast<int32_t>(v) - 1;
+            }
+            if (fl & rec_f_pdo_hash) {
+                if (ep - bp < 4)
+                    return false;
+                rp.pdo_hash = bp[0] | (bp[1] << 8) | (bp[2] << 16) |
+                              (static_cast<uint32_t>(bp[3]) << 24);
+                bp += 4;
+            }
+            if (r.key)
+                r.tab[pn] = rp;
+            else
+                r.chg_v.emplace_back(pn, fl, rp);
+        }
+        return true;
+    }
+    return false;
+}
+
+// Names what differs between rows a and b: "added", "removed" or a list
+static sstring
+rec_port_diff(const rec_port * ap, const rec_port * bp) noexcept
+{
+    static const uint8_t pr_mask { LSUCPD_SHM_PF_ROLE_KNOWN |
+                                   LSUCPD_SHM_PF_SOURCE };
+    static const uint8_t dr_mask { LSUCPD_SHM_PF_DATA_KNOWN |
+                                   LSUCPD_SHM_PF_HOST };
+    sstring s;
+
+    if (nullptr == ap)
+        return "added";
+    if (nullptr == bp)
+        return "removed";
+    auto add = [&s](const char * nm) {
+        if (! s.empty())
+            s += ' ';
+        s += nm;
+    };
+    if ((ap->flags ^ bp->flags) & pr_mask)
+        add("power_role");
+    if ((ap->flags ^ bp->flags) & dr_mask)
+        add("data_role");
+    if ((ap->flags ^ bp->flags) & LSUCPD_SHM_PF_PARTNER)
+        add("partner");
+    if (ap->pow_op_mode != bp->pow_op_mode)
+        add("power_operation_mode");
+    if (ap->pd_num != bp->pd_num)
+        add("pd");
+    if (ap->partner_pd_num != bp->partner_pd_num)
+        add("partner_pd");
+    if (ap->pdo_hash != bp->pdo_hash)
+        add("pdos");
+    return s;
+}
+
+std::map<uint32_t, sstring>
+rec_reader::apply(rec_record & r) noexcept
+{
+    rec_table prev { std::move(tab_) };
+    std::map<uint32_t, sstring> chg_m;
+
+    if (r.key) {
+        tab_ = std::move(r.tab);
+        have_key_ = true;
+    } else {
+        tab_ = prev;
+        for (const auto & [pn, fl, rp] : r.chg_v) {
+            if (fl & rec_f_removed) {
+                tab_.erase(pn);
+                continue;
+            }
+            rec_port & tp { tab_[pn] };
+
+            if (fl & rec_f_flags)
+                tp.flags = rp.flags;
+            if (fl & rec_f_pom)
+                tp.pow_op_mode = rp.pow_op_mode;
+            if (fl & rec_f_pd)
+                tp.pd_num = rp.pd_num;
+            if (fl & rec_f_partner_pd)
+                tp.partner_pd_num = rp.partner_pd_num;
+            if (fl & rec_f_pdo_hash)
+                tp.pdo_hash = rp.pdo_hash;
+        }
+    }
+    wall_ms_ = r.wall_ms;
+    boot_ms_ = r.boot_ms;
+    // a keyframe may hide changes made while nothing was recording
+    for (const auto & [pn, rp] : tab_) {
+        const auto it { prev.find(pn) };
+
+        if (it == prev.end())
+            chg_m[pn] = rec_port_diff(nullptr, &rp);
+        else if (! (it->second == rp))
+            chg_m[pn] = rec_port_diff(&it->second, &rp);
+    }
+    for (const auto & [pn, rp] : prev) {
+        if (! tab_.contains(pn))
+            chg_m[pn] = rec_port_diff(&rp, nullptr);
+    }
+    return chg_m;
+}
+
+/* Parses a --at= or --between= TIME into milliseconds since the epoch.
+ * Accepts 'now', '@<secs_since_epoch>', '-<n>{s|m|h|d}' (that long ago)
+ * and local times of the form 'YYYY-MM-DD[{T| }HH:MM[:SS]]'. Returns
+ * false if TIME is none of those. */
+static bool
+parse_hist_time(const char * cp, uint64_t & wall_ms) noexcept
+{
+    static const char * const fmt_a[] = { "%Y-%m-%dT%H:%M:%S",
+                                          "%Y-%m-%d %H:%M:%S",
+                                          "%Y-%m-%dT%H:%M", "%Y-%m-%d %H:%M",
+                                          "%Y-%m-%d" };
+    const uint64_t now_ms { clock_ms(CLOCK_REALTIME) };
+    char * ep;
+
+    if (0 == strcmp(cp, "now")) {
+        wall_ms = now_ms;
+        return true;
+    }
+    if ('@' == *cp) {
+        const long long v { strtoll(cp + 1, &ep, 10) };
+
+        if ((ep == (cp + 1)) || *ep || (v < 0))
+            return false;
+        wall_ms = v * 1000;
+        return true;
+    }
+    if ('-' == *cp) {
+        const long long v { strtoll(cp + 1, &ep, 10) };
+        uint64_t mult;
+
+        if ((ep == (cp + 1)) || (v < 0) || (ep[0] && ep[1]))
+            return false;
+        switch (*ep) {
+        case 's': mult = 1000; break;
+        case 'm': mult = 60 * 1000; break;
+        case 'h': mult = 3600 * 1000; break;
+        case 'd': mult = 86400 * 1000; break;
+        default: return false;
+        }
+        wall_ms = now_ms - std::min<uint64_t>(now_ms, v * mult);
+        return true;
+    }
+    for (const char * fmt : fmt_a) {
+        struct tm tm { };
+        const char * rp { strptime(cp, fmt, &tm) };
+
+        if (rp && (0 == *rp)) {
+            tm.tm_isdst = -1;
+            const time_t t { mktime(&tm) };
+
+            if (t < 0)
+                return false;
+            wall_ms = static_cast<uint64_t>(t) * 1000;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Builds a snapshot from a recorded port table so the live renderers
+ * (i.e. primary_scan()'s summary lines and output_snap()) can be used.
+ * Only what the table holds is known; there are no pd objects. */
+static std::shared_ptr<scan_snap>
+rec_table_snap(const rec_table & tab, struct opts_t * op) noexcept
+{
+    std::error_code ec { };
+
+    op->tc_de_v.clear();
+    op->summ_out_m.clear();
+    for (const auto & [pn, rp] : tab) {
+        const sstring nm { "port" + std::to_string(pn) };
+        tc_dir_elem de { fs::directory_entry(op->tree.typec_pt_ / nm, ec) };
+
+        de.port_num_ = pn;
+        de.match_str_ = "p" + std::to_string(pn);
+        de.pd_inum_ = rp.pd_num;
+        de.pow_op_mode_ = static_cast<pw_op_mode_e>(rp.pow_op_mode);
+        de.source_sink_known_ = !! (rp.flags & LSUCPD_SHM_PF_ROLE_KNOWN);
+        de.is_source_ = !! (rp.flags & LSUCPD_SHM_PF_SOURCE);
+        de.data_role_known_ = !! (rp.flags & LSUCPD_SHM_PF_DATA_KNOWN);
+        de.is_host_ = !! (rp.flags & LSUCPD_SHM_PF_HOST);
+        op->tc_de_v.push_back(de);
+        if (rp.flags & LSUCPD_SHM_PF_PARTNER) {
+            tc_dir_elem pde { fs::directory_entry(op->tree.typec_pt_ /
+                                                  (nm + "-partner"), ec) };
+
+            pde.partner_ = true;
+            pde.port_num_ = pn;
+            pde.match_str_ = de.match_str_ + "p";
+            pde.pd_inum_ = rp.partner_pd_num;
+            op->tc_de_v.push_back(pde);
+        }
+    }
+    primary_scan(op);
+    return take_snapshot(false, false, false, false, 0, op);
+}
+
+// Adds the rows of tab, with their summary lines from ss, to JSON array jap
+static void
+rec_table_json(const rec_table & tab, const scan_snap & ss,
+               const std::map<uint32_t, sstring> * chg_mp,
+               struct opts_t * op, sgj_opaque_p jap) noexcept
+{
+    sgj_state * jsp { &op->json_st };
+    const auto & summ_m { ss.summ(op->do_data_dir) };
+
+    auto add = [&](uint32_t pn, const rec_port * rp, const sstring * chp) {
+        sgj_opaque_p jo2p { sgj_new_unattached_object_r(jsp) };
+        const auto it { summ_m.find(pn) };
+
+        sgj_js_nv_i(jsp, jo2p, "port_num", pn);
+        if (chp)
+            sgj_js_nv_s(jsp, jo2p, "changed", chp->c_str());
+        if (rp) {
+            if (it != summ_m.end())
+                sgj_js_nv_s(jsp, jo2p, "summary", it->second.c_str());
+            sgj_js_nv_i(jsp, jo2p, "pd_num", rp->pd_num);
+            sgj_js_nv_i(jsp, jo2p, "partner",
+                        !! (rp->flags & LSUCPD_SHM_PF_PARTNER));
+            sgj_js_nv_i(jsp, jo2p, "partner_pd_num", rp->partner_pd_num);
+            sgj_js_nv_s(jsp, jo2p, "pdo_hash",
+                        fmt_to_str("{:08x}", rp->pdo_hash).c_str());
+        }
+        sgj_js_nv_o(jsp, jap, nullptr, jo2p);
+    };
+    if (nullptr == chg_mp) {
+        for (const auto & [pn, rp] : tab)
+            add(pn, &rp, nullptr);
+        return;
+    }
+    for (const auto & [pn, ch] : *chg_mp) {
+        const auto it { tab.find(pn) };
+
+        add(pn, (it == tab.end()) ? nullptr : &it->second, &ch);
+    }
+}
+
+/* --history=FILE: with --at=TIME outputs the port table as recorded at
+ * TIME, else lists the changes recorded between --between=T1,T2 (def:
+ * all of them). Port FILTERs restrict the output as they do live. */
+static int
+do_history(bool filter_for_port, struct opts_t * op,
+           sgj_opaque_p jop) noexcept
+{
+    int res;
+    uint64_t t1 { };
+    uint64_t t2 { UINT64_MAX };
+    sgj_state * jsp { &op->json_st };
+    sgj_opaque_p jo2p { };
+    sgj_opaque_p jap { };
+    rec_reader rr;
+    rec_record r;
+    std::vector<sregex> pat_v;
+
+    if (op->hist_at && (! parse_hist_time(op->hist_at, t2))) {
+        print_err(-1, "--at=TIME: unable to decode: {}\n", op->hist_at);
+        return 1;
+    }
+    if (op->hist_between) {
+        const char * ccp { strchr(op->hist_between, ',') };
+        const sstring s1 { ccp ? sstring(op->hist_between,
+                                          ccp - op->hist_between) :
+                                 sstring(op->hist_between) };
+
+        if ((! parse_hist_time(s1.c_str(), t1)) ||
+            (ccp && (! parse_hist_time(ccp + 1, t2))) || (t2 < t1)) {
+            print_err(-1, "--between=T1,T2: unable to decode: {}\n",
+                      op->hist_between);
+            return 1;
+        }
+    }
+    res = rr.open(op->hist_path);
+    if (res) {
+        print_err(-1, "unable to read {}: {}\n", op->hist_path,
+                  strerror(res));
+        return 1;
+    }
+    if (jsp->pr_as_json) {
+        jo2p = sgj_named_subobject_r(jsp, jop, "history");
+        sgj_js_nv_s(jsp, jo2p, "file", op->hist_path);
+    }
+    rr.seek(op->hist_at ? t2 : t1);
+    if (op->hist_at) {
+        bool found { false };
+
+        while (rr.next(r) && (r.wall_ms <= t2)) {
+            rr.apply(r);
+            found = true;
+        }
+        if (! found) {
+            print_err(-1, "nothing recorded at or before {}\n",
+                      local_time_ms(t2));
+            return 1;
+        }
+        const auto sp { rec_table_snap(rr.table(), op) };
+
+        if (jsp->pr_as_json) {
+            sgj_js_nv_s(jsp, jo2p, "at", local_time_ms(t2).c_str());
+            sgj_js_nv_s(jsp, jo2p, "recorded",
+                        local_time_ms(rr.wall_ms()).c_str());
+            rec_table_json(rr.table(), *sp, nullptr, op,
+                           sgj_named_subarray_r(jsp, jo2p, "port_list"));
+        } else
+            sgj_hr_pri(jsp, "# at {}, as recorded {}\n", local_time_ms(t2),
+                       local_time_ms(rr.wall_ms()));
+        output_snap(*sp, filter_for_port, false, op, jop);
+        return 0;
+    }
+    for (const auto & filt : op->filter_port_v) {
+        std::error_code ec { };
+
+        pat_v.emplace_back();
+        regex_ctor_noexc(pat_v.back(), filt, std::regex_constants::grep |
+                                             std::regex_constants::icase, ec);
+        if (ec) {
+            pr3ser(-1, filt, "filter was an unacceptable regex pattern");
+            return 1;
+        }
+    }
+    if (jsp->pr_as_json)
+        jap = sgj_named_subarray_r(jsp, jo2p, "change_list");
+    while (rr.next(r) && (r.wall_ms <= t2)) {
+        auto chg_m { rr.apply(r) };
+
+        if (r.wall_ms < t1)
+            continue;
+        if (filter_for_port) {      // like do_filter(), p<n> or p<n>p
+            std::erase_if(chg_m, [&pat_v](const auto & pr) {
+                const sstring ms { "p" + std::to_string(pr.first) };
+                std::error_code ec { };
+
+                for (const auto & pat : pat_v) {
+                    if (regex_match_noexc(ms, pat, ec) ||
+                        regex_match_noexc(ms + "p", pat, ec))
+                        return false;
+                }
+                return true;
+            });
+        }
+        if (chg_m.empty())
+            continue;
+        const auto sp { rec_table_snap(rr.table(), op) };
+        const auto & summ_m { sp->summ(op->do_data_dir) };
+
+        if (jsp->pr_as_json) {
+            sgj_opaque_p jo3p { sgj_new_unattached_object_r(jsp) };
+
+            sgj_js_nv_s(jsp, jo3p, "time", local_time_ms(r.wall_ms).c_str());
+            sgj_js_nv_i(jsp, jo3p, "time_ms", r.wall_ms);
+            sgj_js_nv_i(jsp, jo3p, "boot_time_ms", r.boot_ms);
+            rec_table_json(rr.table(), *sp, &chg_m, op,
+                           sgj_named_subarray_r(jsp, jo3p, "port_list"));
+            sgj_js_nv_o(jsp, jap, nullptr, jo3p);
+            continue;
+        }
+        sgj_hr_pri(jsp, "# {}\n", local_time_ms(r.wall_ms));
+        for (const auto & [pn, ch] : chg_m) {
+            const auto it { summ_m.find(pn) };
+
+            if (it == summ_m.end())
+                sgj_hr_pri(jsp, " port{}  [{}]\n", pn, ch);
+            else
+                sgj_hr_pri(jsp, "{}  [{}]\n", it->second, ch);
+        }
+    }
+    return 0;
+}
+
+/* Does a full scan using the settings in the service's options (sv_op) and
+ * publishes the result in cur_snap. Everything any request may want is
+ * put in the snapshot. */
+static void
+serve_scan(const struct opts_t * sv_op) noexcept
+{
+    bool ucsi_psup_possible { false };
+    bool have_seqnum { false };
+    uint64_t seqnum { };
+    std::error_code ec { };
+    struct opts_t s_opts { };
+    struct opts_t * sop { &s_opts };
+
+    sop->scan_all = true;
+    sop->scan_retries = sv_op->scan_retries;
+    sop->tree = sv_op->tree;
+    ec = consistent_scan(true, true, ucsi_psup_possible, have_seqnum,
+                         seqnum, sop);
+    if (ec)
+        pr3ser(0, sop->tree.typec_pt_, "scan failed", ec);
+    else if (sop->scan_inconsistent)
+        print_err(0, "scan still inconsistent after {} re-scan round(s)\n",
+                  sop->scan_rounds);
+    primary_scan(sop);
+    cur_snap.publish(take_snapshot(true, true, true, have_seqnum, seqnum,
+                                   sop));
+    if (sv_op->shm_name && (! sop->scan_inconsistent)) {
+        bool changed { };
+        uint64_t gen { };
+        int res { shm_publish(sv_op->shm_name, *cur_snap.load(), gen,
+                              changed) };
+
+        if (res)
+            print_err(0, "unable to publish to /dev/shm/{}: {}\n",
+                      sv_op->shm_name, strerror(res));
+    }
+    if (sv_op->rec_path && (! sop->scan_inconsistent))
+        port_rec.append(*cur_snap.load());
+    if (sv_op->cap_path)
+        ev_cap.add_state(sv_op->tree.root_);
+}
+
+// Counters of the long running modes. Only touched by the event loop
+// thread.
+struct serve_stats {
+    uint64_t scans { };
+    uint64_t joined { };        // requests that waited on a scan in flight
+    uint64_t http_reqs { };
+};
+
+static serve_stats serve_st;
+
+// A rendered response. For JSON, the "service" object is not included
+// since its values change with each request; it is spliced in at json_pos
+// when the response is sent.
+struct resp_ent {
+    uint64_t content_gen { };   // of the snapshot it was rendered from
+    sstring body;
+    size_t json_pos { sstring::npos };
+};
+
+// Rendered responses keyed by request line. An entry is reused until the
+// content generation of the current snapshot moves on, so repeats of
+// popular requests are answered without any formatting.
+class resp_cache {
+public:
+    std::shared_ptr<const resp_ent>
+    find(const sstring & key, uint64_t content_gen) noexcept
+    {
+        std::lock_guard<std::mutex> lk { mtx_ };
+        const auto it { m_.find(key) };
+
+        if ((it == m_.end()) || (it->second->content_gen != content_gen)) {
+            ++misses;
+            return nullptr;
+        }
+        ++hits;
+        return it->second;
+    }
+
+    void store(const sstring & key, std::shared_ptr<const resp_ent> rep)
+        noexcept
+    {
+        std::lock_guard<std::mutex> lk { mtx_ };
+
+        if ((m_.size() >= SERVE_MAX_CACHED) && (! m_.contains(key))) {
+            std::erase_if(m_, [&rep](const auto & pr)
+                    { return pr.second->content_gen != rep->content_gen; });
+            if (m_.size() >= SERVE_MAX_CACHED)
+                m_.clear();
+        }
+        m_[key] = std::move(rep);
+    }
+
+    std::atomic<uint64_t> hits { };
+    std::atomic<uint64_t> misses { };
+
+private:
+    std::mutex mtx_;
+    std::unordered_map<sstring, std::shared_ptr<const resp_ent>> m_;
+};
+
+static resp_cache serve_cache;
+
+/* Renders the response to a request (r_op) from snapshot ss. Returns
+ * nullptr if that fails. */
+static std::shared_ptr<const resp_ent>
+render_resp(const scan_snap & ss, bool filter_for_port, bool filter_for_pd,
+            struct opts_t * r_op, int argc, char * argv[]) noexcept
+{
+    size_t len { };
+    char * bp { };
+    FILE * fp { open_memstream(&bp, &len) };
+    sgj_state * jsp { &r_op->json_st };
+    sgj_opaque_p jop { };
+    auto rep { std::make_shared<resp_ent>() };
+
+    if (nullptr == fp)
+        return nullptr;
+    if (r_op->do_json)
+        jop = sgj_start_r(my_name, version_str, argc, argv, jsp);
+    lsucpd_hr_fp = fp;
+    output_snap(ss, filter_for_port, filter_for_pd, r_op, jop);
+    lsucpd_hr_fp = nullptr;
+    if (r_op->do_json) {
+        sgj_js2file_estr(jsp, nullptr, 0, strerror(0), fp);
+        sgj_finish(jsp);
+    }
+    fclose(fp);
+    rep->content_gen = ss.content_gen;
+    rep->body.assign(bp, len);
+    free(bp);
+    if (r_op->do_json) {
+        // point after the last member of the top level object
+        size_t pos { rep->body.rfind('}') };
+
+        if (pos != sstring::npos) {
+            pos = rep->body.find_last_not_of(" \t\r\n", pos - 1);
+            if (pos != sstring::npos)
+                rep->json_pos = pos + 1;
+        }
+    }
+    return rep;
+}
+
+/* Returns the "service" object, as a member of a top level object
+ * formatted like the response (i.e. without the opening brace). */
+static sstring
+service_json(const scan_snap & ss, const struct opts_t * r_op) noexcept
+{
+    size_t len { };
+    char * bp { };
+    FILE * fp;
+    sgj_state f_js { };
+    sgj_state * jsp { &f_js };
+    sgj_opaque_p jop;
+    sstring res;
+
+    if (! sgj_init_state(jsp, r_op->json_arg))
+        return res;
+    jsp->pr_leadin = false;
+    jsp->pr_exit_status = false;
+    jop = sgj_start_r(nullptr, nullptr, 0, nullptr, jsp);
+    jop = sgj_named_subobject_r(jsp, jop, "service");
+    sgj_js_nv_i(jsp, jop, "snapshot_generation", ss.generation);
+    sgj_js_nv_i(jsp, jop, "snapshot_age_ms",
+                std::chrono::duration_cast<std::chrono::milliseconds>
+                (std::chrono::steady_clock::now() - ss.scan_tp).count());
+    if (ss.have_seqnum)
+        sgj_js_nv_i(jsp, jop, seqnum_sn, ss.seqnum);
+    sgj_js_nv_i(jsp, jop, "scans", serve_st.scans);
+    sgj_js_nv_i(jsp, jop, "requests_that_joined_a_scan",
+                serve_st.joined);
+    sgj_js_nv_i(jsp, jop, "response_cache_hits", serve_cache.hits);
+    sgj_js_nv_i(jsp, jop, "response_cache_misses", serve_cache.misses);
+    fp = open_memstream(&bp, &len);
+    if (fp) {
+        sgj_js2file_estr(jsp, nullptr, 0, nullptr, fp);
+        fclose(fp);
+        const char * cp { static_cast<const char *>(memchr(bp, '{', len)) };
+
+        if (cp)
+            res.assign(cp + 1, len - (cp + 1 - bp));
+        free(bp);
+    }
+    sgj_finish(jsp);
+    return res;
+}
+
+/* Splits the argument of --http=[ADDR:]PORT . An IPv6 ADDR may be given
+ * in brackets (e.g. '[::1]:9090'). */
+static bool
+http_split_addr(const sstring & arg, sstring & host, sstring & port) noexcept
+{
+    const auto pos { arg.rfind(':') };
+
+    if (pos == sstring::npos) {
+        host = "127.0.0.1";
+        port = arg;
+    } else {
+        host = arg.substr(0, pos);
+        port = arg.substr(pos + 1);
+        if ((host.size() > 1) && ('[' == host.front()) &&
+            (']' == host.back()))
+            host = host.substr(1, host.size() - 2);
+    }
+    return (! host.empty()) && (! port.empty());
+}
+
+// Milli units (e.g. milliVolts) as a decimal string of base units
+static sstring
+om_milli(unsigned int val) noexcept
+{
+    char b[32];
+
+    snprintf(b, sizeof(b), "%u.%03u", val / 1000, val % 1000);
+    return b;
+}
+
+// As in the power_operation_mode attribute
+static const char *
+om_pow_op_mode(pw_op_mode_e pom) noexcept
+{
+    switch (pom) {
+    case pw_op_mode_e::v5i1_5: return "1.5A";
+    case pw_op_mode_e::v5i3_0: return "3.0A";
+    case pw_op_mode_e::usb_pd: return "usb_power_delivery";
+    default: return "default";
+    }
+}
+
+static void
+om_family(sstring & out, const char * name, const char * type,
+          const char * unit, const char * help) noexcept
+{
+    out += sstring("# TYPE ") + name + " " + type + "\n";
+    if (unit)
+        out += sstring("# UNIT ") + name + " " + unit + "\n";
+    out += sstring("# HELP ") + name + " " + help + "\n";
+}
+
+/* Appends one sample per PDO of the snapshot for the metric family 'name'.
+ * 'which' selects the decoded value: 0: minimum voltage, 1: maximum
+ * voltage, 2: current, 3: power. PDOs that do not have that value (e.g.
+ * the current of a battery PDO) are skipped. */
+static void
+om_pdo_samples(sstring & out, const char * name, int which,
+               const scan_snap & ss) noexcept
+{
+    for (const auto & [k, ue] : ss.upd_de_m) {
+        for (int src = 0; src < 2; ++src) {
+            for (const auto & a_pdo : src ? ue.source_pdo_v_ :
+                                            ue.sink_pdo_v_) {
+                const pdo_vals_t pv { decode_pdo_vals(a_pdo) };
+                const unsigned int v { (0 == which) ? pv.mv_min :
+                                       (1 == which) ? pv.mv_max :
+                                       (2 == which) ? pv.ma : pv.mw };
+
+                if (0 == v)
+                    continue;
+                out += sstring(name) + "{pd=\"" + std::to_string(k) +
+                       "\",caps=\"" + (src ? "source" : "sink") +
+                       "\",index=\"" + std::to_string(a_pdo.pdo_ind_) +
+                       "\",type=\"" + pdo_e_to_str(a_pdo.pdo_el_) +
+                       "\"} " + om_milli(v) + "\n";
+            }
+        }
+    }
+}
+
+/* Builds the OpenMetrics text exposition of snapshot ss: one info sample
+ * per port and partner, then the decoded values of all PDOs. */
+static sstring
+om_metrics(const scan_snap & ss, uint64_t num_reqs) noexcept
+{
+    sstring out;
+
+    om_family(out, "lsucpd_port", "info", nullptr, "USB Type-C port");
+    for (const auto & de : ss.tc_de_v) {
+        if (de.is_partner())
+            continue;
+        out += "lsucpd_port_info{port=\"" + std::to_string(de.port_num_) +
+               "\",pd=\"" + ((de.pd_inum_ < 0) ? sstring() :
+                             std::to_string(de.pd_inum_)) +
+               "\",power_role=\"" + (de.source_sink_known_ ?
+                        (de.is_source_ ? "source" : "sink") : "unknown") +
+               "\",data_role=\"" + (de.data_role_known_ ?
+                        (de.is_host_ ? "host" : "device") : "unknown") +
+               "\",power_operation_mode=\"" +
+               om_pow_op_mode(de.pow_op_mode_) + "\"} 1\n";
+    }
+    om_family(out, "lsucpd_partner", "info", nullptr,
+              "Partner attached to a USB Type-C port");
+    for (const auto & de : ss.tc_de_v) {
+        if (! de.is_partner())
+            continue;
+        out += "lsucpd_partner_info{port=\"" +
+               std::to_string(de.port_num_) + "\",pd=\"" +
+               ((de.pd_inum_ < 0) ? sstring() :
+                                    std::to_string(de.pd_inum_)) +
+               "\"} 1\n";
+    }
+    om_family(out, "lsucpd_pdo_voltage_min_volts", "gauge", "volts",
+              "PDO minimum (or fixed) voltage");
+    om_pdo_samples(out, "lsucpd_pdo_voltage_min_volts", 0, ss);
+    om_family(out, "lsucpd_pdo_voltage_max_volts", "gauge", "volts",
+              "PDO maximum (or fixed) voltage");
+    om_pdo_samples(out, "lsucpd_pdo_voltage_max_volts", 1, ss);
+    om_family(out, "lsucpd_pdo_current_amperes", "gauge", "amperes",
+              "PDO maximum or operational current");
+    om_pdo_samples(out, "lsucpd_pdo_current_amperes", 2, ss);
+    om_family(out, "lsucpd_pdo_power_watts", "gauge", "watts",
+              "PDO maximum or operational power");
+    om_pdo_samples(out, "lsucpd_pdo_power_watts", 3, ss);
+    om_family(out, "lsucpd_snapshot_generation", "gauge", nullptr,
+              "Generation of the scan results shown");
+    out += "lsucpd_snapshot_generation " + std::to_string(ss.generation) +
+           "\n";
+    if (ss.have_seqnum) {
+        om_family(out, "lsucpd_uevent_seqnum", "gauge", nullptr,
+                  "Kernel uevent sequence number at end of scan");
+        out += "lsucpd_uevent_seqnum " + std::to_string(ss.seqnum) + "\n";
+    }
+    om_family(out, "lsucpd_scans", "counter", nullptr,
+              "Scans done by this service");
+    out += "lsucpd_scans_total " +
+           std::to_string(serve_st.scans) + "\n";
+    om_family(out, "lsucpd_http_requests", "counter", nullptr,
+              "HTTP requests received");
+    out += "lsucpd_http_requests_total " + std::to_string(num_reqs) + "\n";
+    out += "# EOF\n";
+    return out;
+}
+
+// Opens a netlink socket that receives kernel uevents. Returns -1 if that
+// is not possible.
+static int
+uevent_open() noexcept
+{
+    struct sockaddr_nl sa { };
+    int fd { socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    NETLINK_KOBJECT_UEVENT) };
+
+    if (fd < 0)
+        return -1;
+    sa.nl_family = AF_NETLINK;
+    sa.nl_groups = 1;           // kernel uevents
+    if (bind(fd, reinterpret_cast<struct sockaddr *>(&sa), sizeof(sa)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Names the object a DEVPATH refers to: "p<n>" for port<n>, its partner
+// and their alternate modes, "pd<n>" for pd<n> and what is below it. The
+// innermost one wins (e.g. pd8 in .../port0-partner/pd8/sink-capabilities).
+// An empty string is returned for anything else (e.g. a power_supply).
+static sstring
+devpath_object(const char * dp) noexcept
+{
+    unsigned int n;
+    char c;
+    sstring res;
+
+    for (const char * cp { dp }; cp && *cp; cp = strchr(cp + 1, '/')) {
+        const char * np { ('/' == *cp) ? cp + 1 : cp };
+        const int r { sscanf(np, "pd%u%c", &n, &c) };
+
+        if (1 == sscanf(np, "port%u", &n))
+            res = "p" + std::to_string(n);
+        else if ((1 == r) || ((2 == r) && ('/' == c)))
+            res = "pd" + std::to_string(n);
+    }
+    return res;
+}
+
+// A uevent is "ACTION@DEVPATH" followed by "KEY=VALUE" strings, each
+// terminated by a NUL. Returns true if its SUBSYSTEM is one this utility
+// lists, in which case obj is set as by devpath_object().
+static bool
+uevent_relevant(const char * bp, size_t len, sstring & obj) noexcept
+{
+    static const char subsys_s[] = "SUBSYSTEM=";
+    static const char devpath_s[] = "DEVPATH=";
+    bool relevant { false };
+    const char * dp { };
+
+    for (size_t k = 0; k < len; ) {
+        const char * cp { bp + k };
+        const size_t n { strnlen(cp, len - k) };
+
+        if (0 == strncmp(cp, subsys_s, sizeof(subsys_s) - 1)) {
+            const char * vp { cp + sizeof(subsys_s) - 1 };
+
+            relevant = (0 == strcmp(vp, typec_s)) ||
+                       (0 == strcmp(vp, upd_sn)) ||
+                       (0 == strcmp(vp, powsup_sn));
+        } else if (0 == strncmp(cp, devpath_s, sizeof(devpath_s) - 1))
+            dp = cp + sizeof(devpath_s) - 1;
+        k += n + 1;
+    }
+    if (relevant)
+        obj = dp ? devpath_object(dp) : sstring();
+    return relevant;
+}
+
+// Event loop for the long running modes (--serve=PATH and --http=...).
+// Client sockets, timers, uevents and sysfs attribute notifications are
+// all handled on the thread that calls run(). Blocking work (i.e. scans)
+// is handed to worker threads with run_blocking(); its completion comes
+// back to the loop through an eventfd. So when nothing happens, nothing
+// runs.
+class ev_loop {
+public:
+    using handler_t = std::function<void(uint32_t events)>;
+
+    ev_loop() noexcept
+        : efd_(epoll_create1(EPOLL_CLOEXEC)),
+          wake_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+    {
+        if (ok())
+            add(wake_fd_, EPOLLIN, [this](uint32_t) { drain_posted(); });
+    }
+
+    ~ev_loop()
+    {
+        {
+            std::lock_guard<std::mutex> lk { wk_mtx_ };
+
+            wk_stop_ = true;
+        }
+        wk_cv_.notify_all();
+        for (auto & t : workers_)
+            t.join();
+        for (int fd : timer_v_)
+            close(fd);
+        if (wake_fd_ >= 0)
+            close(wake_fd_);
+        if (efd_ >= 0)
+            close(efd_);
+    }
+
+    ev_loop(const ev_loop &) = delete;
+    ev_loop & operator=(const ev_loop &) = delete;
+
+    bool ok() const noexcept { return (efd_ >= 0) && (wake_fd_ >= 0); }
+
+    // The handler is called with the epoll events of fd until del(fd)
+    bool add(int fd, uint32_t events, handler_t h) noexcept
+    {
+        struct epoll_event ev { };
+
+        ev.events = events;
+        ev.data.fd = fd;
+        if (epoll_ctl(efd_, EPOLL_CTL_ADD, fd, &ev) < 0)
+            return false;
+        hand_m_[fd] = std::make_shared<handler_t>(std::move(h));
+        return true;
+    }
+
+    void mod(int fd, uint32_t events) noexcept
+    {
+        struct epoll_event ev { };
+
+        ev.events = events;
+        ev.data.fd = fd;
+        epoll_ctl(efd_, EPOLL_CTL_MOD, fd, &ev);
+    }
+
+    // Does not close fd
+    void del(int fd) noexcept
+    {
+        epoll_ctl(efd_, EPOLL_CTL_DEL, fd, nullptr);
+        hand_m_.erase(fd);
+    }
+
+    // Calls fn every period, from the loop
+    bool add_timer(std::chrono::milliseconds period,
+                   std::function<void()> fn) noexcept
+    {
+        struct itimerspec its { };
+        int tfd { timerfd_create(CLOCK_MONOTONIC,
+                                 TFD_NONBLOCK | TFD_CLOEXEC) };
+
+        if (tfd < 0)
+            return false;
+        its.it_interval.tv_sec = period.count() / 1000;
+        its.it_interval.tv_nsec = (period.count() % 1000) * 1000000;
+        its.it_value = its.it_interval;
+        if ((timerfd_settime(tfd, 0, &its, nullptr) < 0) ||
+            (! add(tfd, EPOLLIN, [tfd, fn](uint32_t) {
+                    uint64_t expired;
+
+                    if (read(tfd, &expired, sizeof(expired)) > 0)
+                        fn();
+                }))) {
+            close(tfd);
+            return false;
+        }
+        timer_v_.push_back(tfd);
+        return true;
+    }
+
+    // Thread safe: fn will be called from the loop
+    void post(std::function<void()> fn) noexcept
+    {
+        const uint64_t one { 1 };
+
+        {
+            std::lock_guard<std::mutex> lk { post_mtx_ };
+
+            posted_v_.push_back(std::move(fn));
+        }
+        if (write(wake_fd_, &one, sizeof(one)) < 0)
+            pr3ser(1, "eventfd", "write failed");
+    }
+
+    // Calls work on a worker thread, then done from the loop
+    void run_blocking(std::function<void()> work,
+                      std::function<void()> done) noexcept
+    {
+        if (workers_.empty()) {
+            for (int k = 0; k < EV_NUM_WORKERS; ++k)
+                workers_.emplace_back([this] { worker(); });
+        }
+        {
+            std::lock_guard<std::mutex> lk { wk_mtx_ };
+
+            wk_q_.emplace_back(std::move(work), std::move(done));
+        }
+        wk_cv_.notify_one();
+    }
+
+    // Dispatches events until stop() is called, then returns its argument
+    int run() noexcept
+    {
+        struct epoll_event evs[64];
+
+        while (! stop_) {
+            int n { epoll_wait(efd_, evs, 64, -1) };
+
+            if (n < 0) {
+                if (EINTR == errno)
+                    continue;
+                pr3ser(-1, "epoll_wait", "failed");
+                return 1;
+            }
+            for (int k = 0; (k < n) && (! stop_); ++k) {
+                const auto it { hand_m_.find(evs[k].data.fd) };
+
+                if (it == hand_m_.end())
+                    continue;
+                // keep the handler alive even if it del()s its own fd
+                const auto hp { it->second };
+
+                (*hp)(evs[k].events);
+            }
+        }
+        return res_;
+    }
+
+    void stop(int res) noexcept
+    {
+        stop_ = true;
+        res_ = res;
+    }
+
+private:
+    void drain_posted() noexcept
+    {
+        uint64_t cnt;
+        std::vector<std::function<void()>> v;
+
+        if (read(wake_fd_, &cnt, sizeof(cnt)) < 0)
+            return;
+        {
+            std::lock_guard<std::mutex> lk { post_mtx_ };
+
+            v.swap(posted_v_);
+        }
+        for (auto & fn : v)
+            fn();
+    }
+
+    void worker() noexcept
+    {
+        while (true) {
+            std::unique_lock<std::mutex> lk { wk_mtx_ };
+
+            wk_cv_.wait(lk, [this] { return wk_stop_ || (! wk_q_.empty()); });
+            if (wk_stop_)
+                return;
+            auto job { std::move(wk_q_.front()) };
+
+            wk_q_.pop_front();
+            lk.unlock();
+            job.first();
+            post(std::move(job.second));
+        }
+    }
+
+    int efd_;
+    int wake_fd_;
+    bool stop_ { };
+    int res_ { };
+    std::map<int, std::shared_ptr<handler_t>> hand_m_;
+    std::vector<int> timer_v_;
+    std::mutex post_mtx_;
+    std::vector<std::function<void()>> posted_v_;
+    std::mutex wk_mtx_;
+    std::condition_variable wk_cv_;
+    bool wk_stop_ { };
+    std::deque<std::pair<std::function<void()>, std::function<void()>>> wk_q_;
+    std::vector<std::thread> workers_;
+};
+
+// A request line given to --serve=PATH (or in a --batch=FILE), kept until
+// it is answered
+struct line_req {
+    sstring line;               // tokenized in place, argv points into it
+    sstring key;                // for the response cache
+    std::vector<char *> argv;
+    sstring err;                // why parse_req_line() rejected it
+    struct opts_t r_opts { };
+    bool filter_for_port { };
+    bool filter_for_pd { };
+};
+
+// Options (as returned by getopt_long()) that may be given in a request
+// line to --serve=PATH, --http=[ADDR:]PORT or --batch=FILE: those that
+// only select what is output. Any other option makes the request bad.
+static const int req_opt_allow_a[] = {
+    'c', 'd', 'j', '^', 'l', 'v', lo_max_age,
+};
+
+// Splits lr.line into arguments and parses them as output options and
+// FILTERs. Options that are not in req_opt_allow_a[] (e.g. --sysfsroot=)
+// are rejected. Returns 0 if the request is good, else 1 with the reason
+// in lr.err (nothing is sent to stderr).
+static int
+parse_req_line(line_req & lr) noexcept
+{
+    int c, argc;
+    int li { -1 };
+    int res { };
+    char * cp;
+    char * savep { };
+    static char util_name[] = "lsucpd";
+    struct opts_t * r_op { &lr.r_opts };
+
+    lr.argv.push_back(util_name);
+    for (cp = strtok_r(lr.line.data(), " \t\r\n", &savep); cp;
+         cp = strtok_r(nullptr, " \t\r\n", &savep)) {
+        if (lr.argv.size() > 1)
+            lr.key += ' ';
+        lr.argv.push_back(cp);
+        lr.key += cp;
+    }
+    lr.argv.push_back(nullptr);
+    argc = lr.argv.size() - 1;
+
+    r_op->max_age_ms = -1;
+    optind = 0;     // glibc: re-initialize getopt_long() fully
+    opterr = 0;     // a bad request is not the service's error
+    while (-1 != (c = getopt_long(argc, lr.argv.data(), short_opts,
+                                  long_options, &li))) {
+        if (std::ranges::find(req_opt_allow_a, c) ==
+            std::ranges::end(req_opt_allow_a)) {
+            if ('?' == c)
+                lr.err = fmt_to_str("unrecognised option: {}",
+                                    lr.argv[optind - 1]);
+            else if (li >= 0)
+                lr.err = fmt_to_str("--{} is not an output option",
+                                    long_options[li].name);
+            else
+                lr.err = fmt_to_str("-{:c} is not an output option", c);
+            res = 1;
+            break;
+        }
+        li = -1;
+    }
+    if (0 == res) {
+        optind = 0;
+        res = cl_parse(r_op, argc, lr.argv.data(), &lr.err);
+    }
+    opterr = 1;
+    // -j takes short options in its argument (e.g. '-jh')
+    if ((0 == res) && (r_op->do_help || r_op->version_given)) {
+        lr.err = "help and version are not output options";
+        res = 1;
+    }
+    if (r_op->do_json && (0 == res) &&
+        (! sgj_init_state(&r_op->json_st, r_op->json_arg))) {
+        lr.err = fmt_to_str("bad JSON option: {}", r_op->json_arg);
+        res = 1;
+    }
+    if (res)
+        return res;
+    if (r_op->filter_port_v.size() > 0)
+        lr.filter_for_port = true;
+    if (r_op->filter_pd_v.size() > 0) {
+        lr.filter_for_pd = true;
+        ++r_op->do_caps;
+    }
+    return 0;
+}
+
+// The --serve=PATH and --http=[ADDR:]PORT services and --watch output on
+// an ev_loop. A request is answered from cur_snap if that is fresh
+// enough; otherwise it waits for a scan, which is done on a worker thread.
+// Requests that arrive while a scan is in flight wait for that scan
+// (singleflight). Uevents, sysfs attribute notifications (POLLPRI) or,
+// failing those, changes of uevent_seqnum sampled by a timer are merged
+// per object until things are quiet (or a maximum delay passes), then
+// cause one re-scan and one --watch record. So /events subscribers and the
+// --shm=NAME segment are kept current.
+class lsucpd_server {
+public:
+    lsucpd_server(ev_loop & lp, const struct opts_t * op) noexcept
+        : loop_(lp), op_(op) { }
+
+    bool start() noexcept;
+    void finish() noexcept;
+
+private:
+    enum class proto_e { http, line };
+
+    // One output chunk: [off, end) of *sp. Bodies from the response cache
+    // are shared rather than copied.
+    struct chunk {
+        std::shared_ptr<const sstring> sp;
+        size_t off { };
+        size_t end { };
+    };
+
+    struct conn {
+        int fd { -1 };
+        uint64_t id { };        // fds are reused, ids are not
+        proto_e proto { proto_e::http };
+        bool sse { };           // subscribed to /events
+        bool waiting { };       // for a scan, later input is not parsed
+        bool req_taken { };     // line protocol: one request per connection
+        bool eof { };
+        bool close_after { };   // close when the output queue drains
+        bool want_out { };      // EPOLLOUT is registered
+        uint64_t cgen { };      // content_gen last sent to /events
+        sstring in;
+        std::deque<chunk> out_q;
+        size_t pending { };     // bytes in out_q
+        std::chrono::steady_clock::time_point last_tp;
+    };
+
+    using snap_fn = std::function<void(const std::shared_ptr<const scan_snap> &)>;
+    using resp_fn = std::function<void(conn &, const scan_snap &)>;
+
+    int listen_http() noexcept;
+    int listen_unix() noexcept;
+    void accept_conns(int lfd, proto_e proto) noexcept;
+    void on_conn_event(int fd, uint64_t id, uint32_t events) noexcept;
+    bool process(conn & c) noexcept;
+    void handle_http(conn & c, const sstring & head) noexcept;
+    void handle_line(conn & c, sstring line) noexcept;
+    void line_respond(conn & c, line_req & lr, const scan_snap & ss)
+        noexcept;
+    void respond(conn & c, int status, const char * reason,
+                 const char * ctype, std::shared_ptr<const sstring> body,
+                 bool head_only, bool keep_alive) noexcept;
+    void queue(conn & c, std::shared_ptr<const sstring> sp,
+               size_t off = 0, size_t end = sstring::npos) noexcept;
+    bool flush(conn & c) noexcept;
+    void close_conn(int fd) noexcept;
+    void with_snap(conn & c, int max_age_ms, resp_fn fn) noexcept;
+    void request_scan(snap_fn fn, bool after_event = false) noexcept;
+    void start_scan() noexcept;
+    void scan_done() noexcept;
+    bool sse_send(conn & c, const scan_snap & ss) noexcept;
+    void send_events() noexcept;
+    void watch_attrs(const scan_snap & ss) noexcept;
+    void sample_seqnum() noexcept;
+    void sweep_idle() noexcept;
+    void note_event(const sstring & obj) noexcept;
+    void flush_events() noexcept;
+    void emit_record(const scan_snap & ss,
+                     const std::map<sstring, unsigned int> & obj_m,
+                     unsigned int num_ev, bool delayed) noexcept;
+    void writer() noexcept;
+    void on_uevent(const char * bp, size_t len) noexcept;
+    bool replay_start() noexcept;
+    void replay_step() noexcept;
+    void check_fed_all() noexcept;
+    int storm_open() noexcept;
+    void storm_report(const std::shared_ptr<const scan_snap> & prev,
+                      const std::shared_ptr<const scan_snap> & sp) noexcept;
+    bool load_test() const noexcept
+        { return op_->replay_path || (op_->storm_rate > 0); }
+    std::shared_ptr<const sstring> state_json(const scan_snap & ss)
+        noexcept;
+
+    ev_loop & loop_;
+    const struct opts_t * op_;
+    int http_fd_ { -1 };
+    int unix_fd_ { -1 };
+    int uevent_fd_ { -1 };
+    int num_sse_ { };
+    uint64_t next_id_ { 1 };
+    bool scanning_ { };
+    bool rescan_ { };           // an event arrived during the scan
+    std::vector<snap_fn> waiters_;
+    std::vector<snap_fn> next_waiters_;   // need a scan started later
+
+    // events merged since the last flush, per object ("" is unknown)
+    int deb_fd_ { -1 };         // one shot timerfd
+    std::map<sstring, unsigned int> pend_m_;
+    unsigned int pend_events_ { };
+    std::chrono::steady_clock::time_point first_tp_;
+    bool held_ { };             // flush waits for room in wr_q_
+    uint64_t noted_sn_ { };     // last uevent_seqnum given to note_event()
+
+    // --watch records are written to stdout by a thread of their own so a
+    // slow reader does not stall the loop. When wr_q_ is full, events keep
+    // being merged into the pending set until there is room again
+    std::thread wr_thr_;
+    std::mutex wr_mtx_;
+    std::condition_variable wr_cv_;
+    std::deque<sstring> wr_q_;
+    bool wr_stop_ { };
+
+    // --replay=FILE[,N]: items are fed at their recorded times (divided
+    // by N) from a one shot timerfd
+    uevent_replay rp_;
+    size_t rp_next_ { };
+    int rp_fd_ { -1 };
+    uint64_t rp_uevents_ { };
+    uint64_t rp_relevant_ { };
+    std::vector<int64_t> rp_lat_v_;     // first event to record, in us
+
+    // --storm=RATE[,SECS]: a generator thread changes the tree and sends
+    // uevents into a socketpair; uevent_fd_ is the other end
+    storm_gen st_;
+    std::thread st_thr_;
+
+    // either of the above
+    bool fed_all_ { };
+    uint64_t ld_records_ { };
+    std::chrono::steady_clock::time_point ld_start_tp_;
+    std::chrono::steady_clock::time_point ld_last_tp_;  // last scan done
+    struct rusage ld_ru0_ { };
+
+    std::map<int, conn> conns_;
+    std::map<sstring, int> attr_m_;     // watched sysfs attributes
+};
+
+int
+lsucpd_server::listen_http() noexcept
+{
+    int fd { -1 };
+    int res { };
+    sstring host;
+    sstring port;
+    struct addrinfo hints { };
+    struct addrinfo * aip { };
+
+    if (! http_split_addr(op_->http_addr, host, port)) {
+        print_err(-1, "--http= expects [ADDR:]PORT\n");
+        return -1;
+    }
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+    res = getaddrinfo(host.c_str(), port.c_str(), &hints, &aip);
+    if (res) {
+        print_err(-1, "--http={}: {}\n", op_->http_addr, gai_strerror(res));
+        return -1;
+    }
+    for (auto ap { aip }; ap; ap = ap->ai_next) {
+        const int on { 1 };
+
+        fd = socket(ap->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    0);
+        if (fd < 0)
+            continue;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if ((0 == bind(fd, ap->ai_addr, ap->ai_addrlen)) &&
+            (0 == listen(fd, SERVE_MAX_CLIENTS)))
+            break;
+        res = errno;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(aip);
+    if (fd < 0)
+        print_err(-1, "unable to listen on {}: {}\n", op_->http_addr,
+                  strerror(res));
+    else
+        print_err(0, "serving HTTP on {}, default max-age: {} ms\n",
+                  op_->http_addr, op_->max_age_ms);
+    return fd;
+}
+
+int
+lsucpd_server::listen_unix() noexcept
+{
+    int res { };
+    int fd;
+    struct sockaddr_un sa { };
+    struct stat st { };
+    const sstring path { op_->serve_path };
+
+    if (path.size() >= sizeof(sa.sun_path)) {
+        print_err(-1, "--serve=PATH: PATH too long\n");
+        return -1;
+    }
+    sa.sun_family = AF_UNIX;
+    memcpy(sa.sun_path, path.c_str(), path.size() + 1);
+    // remove a socket left by an earlier instance, but nothing else
+    if ((0 == lstat(path.c_str(), &st)) && S_ISSOCK(st.st_mode))
+        unlink(path.c_str());
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if ((fd < 0) ||
+        (bind(fd, reinterpret_cast<struct sockaddr *>(&sa), sizeof(sa)) < 0) ||
+        (listen(fd, SERVE_MAX_CLIENTS) < 0)) {
+        res = errno;
+        print_err(-1, "unable to listen on {}: {}\n", path, strerror(res));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    print_err(0, "serving requests on {}, default max-age: {} ms\n", path,
+              op_->max_age_ms);
+    return fd;
+}
+
+bool
+lsucpd_server::start() noexcept
+{
+    if (op_->http_addr) {
+        http_fd_ = listen_http();
+        if ((http_fd_ < 0) ||
+            (! loop_.add(http_fd_, EPOLLIN, [this](uint32_t) {
+                                accept_conns(http_fd_, proto_e::http); })))
+            return false;
+    }
+    if (op_->serve_path) {
+        unix_fd_ = listen_unix();
+        if ((unix_fd_ < 0) ||
+            (! loop_.add(unix_fd_, EPOLLIN, [this](uint32_t) {
+                                accept_conns(unix_fd_, proto_e::line); })))
+            return false;
+    }
+    // uevents only describe the running system, not a --sysfsroot copy
+    if (op_->storm_rate > 0) {
+        uevent_fd_ = storm_open();
+        if (uevent_fd_ < 0)
+            return false;
+    } else if (nullptr == op_->pseudo_mount_point)
+        uevent_fd_ = uevent_open();
+    if (uevent_fd_ >= 0) {
+        loop_.add(uevent_fd_, EPOLLIN, [this](uint32_t) {
+            char b[8192];
+
+            while (true) {
+                ssize_t n { recv(uevent_fd_, b, sizeof(b), 0) };
+
+                if (n < 0) {
+                    if (EINTR == errno)
+                        continue;
+                    if (ENOBUFS == errno)   // some were lost
+                        note_event(empty_str);
+                    break;
+                }
+                on_uevent(b, n);
+            }
+        });
+    } else if (nullptr == op_->replay_path) {
+        const int ms { (op_->max_age_ms > 0) ? op_->max_age_ms :
+                                               DEF_MAX_AGE_MS };
+
+        pr3ser(1, "uevent", "not available, sampling uevent_seqnum instead");
+        loop_.add_timer(std::chrono::milliseconds(ms),
+                        [this] { sample_seqnum(); });
+    }
+    loop_.add_timer(std::chrono::milliseconds(HTTP_IDLE_MS / 2),
+                    [this] { sweep_idle(); });
+    deb_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if ((deb_fd_ < 0) ||
+        (! loop_.add(deb_fd_, EPOLLIN, [this](uint32_t) {
+                uint64_t expired;
+
+                if (read(deb_fd_, &expired, sizeof(expired)) > 0)
+                    flush_events();
+            }))) {
+        pr3ser(-1, "timerfd", "setup failed");
+        return false;
+    }
+    if (op_->replay_path && (! replay_start()))
+        return false;
+    if (op_->do_watch)
+        wr_thr_ = std::thread([this] { writer(); });
+    if (op_->do_watch || load_test()) {
+        // first record lists everything, load tests start after it
+        request_scan([this](const std::shared_ptr<const scan_snap> & sp) {
+            if (sp && op_->do_watch)
+                emit_record(*sp, { }, 0, false);
+            if (! load_test())
+                return;
+            getrusage(RUSAGE_SELF, &ld_ru0_);
+            ld_start_tp_ = std::chrono::steady_clock::now();
+            ld_last_tp_ = ld_start_tp_;
+            if (op_->replay_path)
+                loop_.post([this] { replay_step(); });
+            else
+                st_thr_ = std::thread([this] {
+                    st_.run(op_->storm_rate, op_->storm_secs, [this] {
+                        loop_.post([this] {
+                            fed_all_ = true;
+                            check_fed_all();
+                        });
+                    });
+                });
+        });
+    } else
+        request_scan(nullptr);  // have a snapshot ready for requests
+    return true;
+}
+
+// A uevent as received (or replayed)
+void
+lsucpd_server::on_uevent(const char * bp, size_t len) noexcept
+{
+    sstring obj;
+
+    if (! uevent_relevant(bp, len, obj))
+        return;
+    if (op_->cap_path)
+        ev_cap.add_uevent(bp, len);
+    if (op_->replay_path)
+        ++rp_relevant_;
+    note_event(obj);
+}
+
+// Reads the --replay= file and writes the state changes that precede the
+// first uevent, so the first scan sees them.
+bool
+lsucpd_server::replay_start() noexcept
+{
+    int res { rp_.open(op_->replay_path, op_->tree.root_) };
+
+    if (res) {
+        if (EINVAL != res)      // otherwise open() has said what is wrong
+            print_err(-1, "unable to replay {}: {}\n", op_->replay_path,
+                      strerror(res));
+        return false;
+    }
+    rp_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if ((rp_fd_ < 0) ||
+        (! loop_.add(rp_fd_, EPOLLIN, [this](uint32_t) {
+                uint64_t expired;
+
+                if (read(rp_fd_, &expired, sizeof(expired)) > 0)
+                    replay_step();
+            }))) {
+        pr3ser(-1, "timerfd", "setup failed");
+        return false;
+    }
+    for (auto & it : rp_.item_v) {
+        if (it.uevent)
+            break;
+        rp_.apply(it);
+    }
+    return true;
+}
+
+// Feeds the items that are due. Before a uevent is fed, the next state
+// changes in the file are written, since the scan the uevent causes
+// read them when the capture was made.
+void
+lsucpd_server::replay_step() noexcept
+{
+    using namespace std::chrono;
+    auto & iv { rp_.item_v };
+    const uint64_t ms0 { iv.empty() ? 0 : iv.front().ms };
+
+    for ( ; rp_next_ < iv.size(); ++rp_next_) {
+        auto & it { iv[rp_next_] };
+
+        if (op_->replay_speed > 0) {
+            const auto due { ld_start_tp_ + microseconds(
+                        (it.ms - ms0) * 1000 / op_->replay_speed) };
+            const auto now { steady_clock::now() };
+
+            if (due > now) {
+                const int64_t ns { duration_cast<nanoseconds>(due - now)
+                                   .count() };
+                struct itimerspec its { };
+
+                its.it_value.tv_sec = ns / 1000000000;
+                its.it_value.tv_nsec = ns % 1000000000;
+                timerfd_settime(rp_fd_, 0, &its, nullptr);
+                return;
+            }
+        }
+        if (it.uevent) {
+            for (size_t k = rp_next_ + 1; k < iv.size(); ++k) {
+                if (! iv[k].uevent) {
+                    if (! iv[k].applied)
+                        rp_.apply(iv[k]);
+                    break;
+                }
+            }
+            ++rp_uevents_;
+            on_uevent(it.raw.data(), it.raw.size());
+        } else if (! it.applied)
+            rp_.apply(it);
+        if (0 == op_->replay_speed) {   // let the loop run in between
+            ++rp_next_;
+            if (rp_next_ < iv.size()) {
+                loop_.post([this] { replay_step(); });
+                return;
+            }
+            break;
+        }
+    }
+    fed_all_ = true;
+    check_fed_all();
+}
+
+// cpu time used since ru0 was taken, in microseconds
+static int64_t
+cpu_us_since(const struct rusage & ru0) noexcept
+{
+    struct rusage ru { };
+
+    getrusage(RUSAGE_SELF, &ru);
+    auto tv_us = [](const struct timeval & tv) {
+        return static_cast<int64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+    };
+    return tv_us(ru.ru_utime) + tv_us(ru.ru_stime) - tv_us(ru0.ru_utime) -
+           tv_us(ru0.ru_stime);
+}
+
+// Sorts lv (microseconds) and prints its spread in milliseconds
+static void
+pr_latency(const char * leader, const char * what,
+           std::vector<int64_t> & lv) noexcept
+{
+    if (lv.empty())
+        return;
+    std::sort(lv.begin(), lv.end());
+    print_err(-1, "{}: {} latency (ms): min {:.3f}, median {:.3f}, p99 "
+              "{:.3f}, max {:.3f}\n", leader, what, lv.front() / 1000.0,
+              lv[lv.size() / 2] / 1000.0, lv[lv.size() * 99 / 100] / 1000.0,
+              lv.back() / 1000.0);
+}
+
+// Once everything has been fed and dealt with, a summary goes to stderr
+// and the loop is stopped. A storm first checks that one more scan finds
+// nothing that was not reported.
+void
+lsucpd_server::check_fed_all() noexcept
+{
+    if ((! fed_all_) || (pend_events_ > 0) || scanning_ ||
+        (! waiters_.empty()) || (! next_waiters_.empty()))
+        return;
+    {
+        std::lock_guard<std::mutex> lk { wr_mtx_ };
+
+        if (! wr_q_.empty())
+            return;
+    }
+    fed_all_ = false;           // report once
+    if (op_->storm_rate > 0) {
+        request_scan([this, prev = cur_snap.load()]
+                     (const std::shared_ptr<const scan_snap> & sp) {
+                         storm_report(prev, sp);
+                     }, true);
+        return;
+    }
+    const int64_t cpu_us { cpu_us_since(ld_ru0_) };
+    const auto & iv { rp_.item_v };
+    const double span_s { iv.empty() ? 0.0 :
+                          (iv.back().ms - iv.front().ms) / 1000.0 };
+    const double el_s { std::chrono::duration<double>(ld_last_tp_ -
+                                                      ld_start_tp_).count() };
+
+    print_err(-1, "replay: {} uevents ({} relevant) spanning {:.3f} s, fed "
+              "in {:.3f} s ({})\n", rp_uevents_, rp_relevant_, span_s,
+              el_s, (op_->replay_speed > 0) ?
+              fmt_to_str("x{}", op_->replay_speed) : sstring("no delays"));
+    print_err(-1, "replay: {} scans, {} watch records\n", serve_st.scans,
+              ld_records_);
+    pr_latency("replay", op_->do_watch ? "first event to record" :
+                                         "first event to scan", rp_lat_v_);
+    print_err(-1, "replay: cpu {:.3f} s{}\n", cpu_us / 1000000.0,
+              rp_uevents_ ? fmt_to_str(", {:.1f} us per uevent",
+                                       static_cast<double>(cpu_us) /
+                                       rp_uevents_) : sstring());
+    loop_.stop(0);
+}
+
+// Learns the --sysfsroot tree and returns the end of a socketpair that
+// the generator's uevents arrive on, or -1.
+int
+lsucpd_server::storm_open() noexcept
+{
+    int sv[2];
+    int res;
+
+    if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+                   sv) < 0) {
+        pr3ser(-1, "socketpair", "failed",
+               std::error_code(errno, std::generic_category()));
+        return -1;
+    }
+    res = st_.open(sv[1], op_->tree);
+    if (res) {
+        print_err(-1, "--storm: nothing to change below {}: {}\n",
+                  op_->tree.root_, strerror(res));
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    return sv[0];
+}
+
+// prev is the snapshot the last report was rendered from and sp a scan
+// made after the storm. If they differ (or some change was never
+// reported) then events were missed and the exit status is 1.
+void
+lsucpd_server::storm_report(const std::shared_ptr<const scan_snap> & prev,
+                            const std::shared_ptr<const scan_snap> & sp)
+                            noexcept
+{
+    const int64_t cpu_us { cpu_us_since(ld_ru0_) };
+    const bool stale { (! prev) || (! sp) ||
+                       (rec_table_of(*prev) != rec_table_of(*sp)) };
+    uint64_t missed { };
+    sstring kinds_s;
+    std::lock_guard<std::mutex> lk { st_.mtx };
+    const int64_t srv_cpu_us { cpu_us - st_.gen_cpu_us };
+
+    for (const auto & [obj, dq] : st_.pend_m)
+        missed += dq.size();
+    for (int k = 0; k < storm_gen::k_num; ++k)
+        kinds_s += fmt_to_str("{}{} {}", k ? ", " : "",
+                              storm_gen::kind_name[k], st_.num_kind[k]);
+    print_err(-1, "storm: {} changes in {:.3f} s ({}) and restore\n",
+              st_.num_changes, st_.elapsed_s, kinds_s);
+    print_err(-1, "storm: {} uevents sent, {} dropped (socket full)\n",
+              st_.num_uevents, st_.num_dropped);
+    print_err(-1, "storm: {} scans, {} watch records\n",
+              serve_st.scans - 1, ld_records_);
+    pr_latency("storm", op_->do_watch ? "change to record" :
+                                        "change to scan", st_.lat_v);
+    print_err(-1, "storm: {} changes never reported, final state {}\n",
+              missed, stale ? "differs from a fresh scan" : "is current");
+    print_err(-1, "storm: cpu {:.3f} s excluding the generator{}\n",
+              srv_cpu_us / 1000000.0,
+              st_.num_changes ? fmt_to_str(", {:.1f} us per change",
+                                           static_cast<double>(srv_cpu_us) /
+                                           st_.num_changes) : sstring());
+    loop_.stop((missed || stale) ? 1 : 0);
+}
+
+void
+lsucpd_server::finish() noexcept
+{
+    if (st_thr_.joinable()) {   // it puts the tree back first
+        st_.stop();
+        st_thr_.join();
+    }
+    if (wr_thr_.joinable()) {   // after writing what is queued
+        {
+            std::lock_guard<std::mutex> lk { wr_mtx_ };
+
+            wr_stop_ = true;
+        }
+        wr_cv_.notify_all();
+        wr_thr_.join();
+    }
+    for (int * fdp : { &deb_fd_, &rp_fd_ }) {
+        if (*fdp >= 0) {
+            loop_.del(*fdp);
+            close(*fdp);
+            *fdp = -1;
+        }
+    }
+    while (! conns_.empty())
+        close_conn(conns_.begin()->first);
+    for (const auto & [pt, fd] : attr_m_) {
+        loop_.del(fd);
+        close(fd);
+    }
+    attr_m_.clear();
+    for (int * fdp : { &http_fd_, &unix_fd_, &uevent_fd_ }) {
+        if (*fdp >= 0) {
+            loop_.del(*fdp);
+            close(*fdp);
+            *fdp = -1;
+        }
+    }
+    if (op_->serve_path)
+        unlink(op_->serve_path);
+}
+
+void
+lsucpd_server::accept_conns(int lfd, proto_e proto) noexcept
+{
+    static const char busy_s[] = "lsucpd: busy, try again\n";
+
+    while (true) {
+        int cfd { accept4(lfd, nullptr, nullptr,
+                          SOCK_NONBLOCK | SOCK_CLOEXEC) };
+
+        if (cfd < 0) {
+            if ((EINTR == errno) || (ECONNABORTED == errno))
+                continue;
+            if ((EAGAIN != errno) && (EWOULDBLOCK != errno))
+                pr3ser(0, "accept", "failed");
+            return;
+        }
+        if (conns_.size() >= SERVE_MAX_CLIENTS) {
+            if ((proto_e::line == proto) &&
+                (write(cfd, busy_s, sizeof(busy_s) - 1) < 0))
+                pr3ser(2, "client", "busy message not sent");
+            close(cfd);
+            continue;
+        }
+        const uint64_t id { next_id_++ };
+
+        if (! loop_.add(cfd, EPOLLIN, [this, cfd, id](uint32_t events) {
+                            on_conn_event(cfd, id, events); })) {
+            close(cfd);
+            continue;
+        }
+        conn & c { conns_[cfd] };
+
+        c.fd = cfd;
+        c.id = id;
+        c.proto = proto;
+        c.last_tp = std::chrono::steady_clock::now();
+    }
+}
+
+void
+lsucpd_server::on_conn_event(int fd, uint64_t id, uint32_t events) noexcept
+{
+    bool ok { true };
+    const auto it { conns_.find(fd) };
+
+    if ((it == conns_.end()) || (it->second.id != id))
+        return;
+    conn & c { it->second };
+
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        char b[4096];
+
+        // errors and hang ups show up as a failed or empty read
+        while (! c.eof) {
+            ssize_t n { read(fd, b, sizeof(b)) };
+
+            if (n < 0) {
+                if (EINTR == errno)
+                    continue;
+                if ((EAGAIN != errno) && (EWOULDBLOCK != errno))
+                    ok = false;
+                break;
+            }
+            if (0 == n)     // client may still want responses to what it sent
+                c.eof = true;
+            else if ((! c.sse) && (! c.req_taken))
+                c.in.append(b, n);
+            if (c.in.size() > HTTP_MAX_REQ_LEN)
+                break;
+        }
+        c.last_tp = std::chrono::steady_clock::now();
+        if (ok)
+            ok = process(c);
+    } else if (events & EPOLLOUT)
+        ok = flush(c);
+    if (! ok)
+        close_conn(fd);
+}
+
+// Handles the complete requests in c's input unless c is waiting for a
+// scan, then writes what it can. Returns false if c should be closed.
+bool
+lsucpd_server::process(conn & c) noexcept
+{
+    if (c.sse && c.eof)
+        return false;
+    while ((! c.waiting) && (! c.sse) && (! c.close_after) &&
+           (! c.req_taken)) {
+        if (proto_e::line == c.proto) {
+            const auto pos { c.in.find('\n') };
+
+            if ((pos == sstring::npos) && (! c.eof) &&
+                (c.in.size() < (SERVE_MAX_REQ_LEN - 1)))
+                break;
+            c.req_taken = true;
+            handle_line(c, c.in.substr(0, std::min(pos, static_cast<size_t>(
+                                                SERVE_MAX_REQ_LEN - 1))));
+            c.in.clear();
+            break;
+        }
+        const auto pos { c.in.find("\r\n\r\n") };
+
+        if (pos == sstring::npos) {
+            if (c.in.size() > HTTP_MAX_REQ_LEN)
+                respond(c, 431, "Request Header Fields Too Large",
+                        "text/plain; charset=utf-8", nullptr, false, false);
+            else if (c.eof && c.out_q.empty())
+                return false;
+            break;
+        }
+        const sstring head { c.in.substr(0, pos) };
+
+        c.in.erase(0, pos + 4);
+        handle_http(c, head);
+    }
+    if (c.eof && (! c.sse) && (! c.waiting))
+        c.close_after = true;
+    return flush(c);
+}
+
+void
+lsucpd_server::queue(conn & c, std::shared_ptr<const sstring> sp,
+                     size_t off, size_t end) noexcept
+{
+    if (nullptr == sp)
+        return;
+    end = std::min(end, sp->size());
+    if (off < end) {
+        c.pending += end - off;
+        c.out_q.push_back(chunk { std::move(sp), off, end });
+    }
+}
+
+// Writes as much of c's output queue as the socket takes. Returns false
+// if c should be closed.
+bool
+lsucpd_server::flush(conn & c) noexcept
+{
+    while (! c.out_q.empty()) {
+        struct iovec iov[16];
+        int n_iov { };
+
+        for (const auto & ck : c.out_q) {
+            if (n_iov >= 16)
+                break;
+            iov[n_iov].iov_base = const_cast<char *>(ck.sp->data() + ck.off);
+            iov[n_iov++].iov_len = ck.end - ck.off;
+        }
+        ssize_t n { writev(c.fd, iov, n_iov) };
+
+        if (n < 0) {
+            if (EINTR == errno)
+                continue;
+            if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
+                if (! c.want_out) {
+                    // after the client's EOF only wait for output space
+                    loop_.mod(c.fd, c.eof ? EPOLLOUT : (EPOLLIN | EPOLLOUT));
+                    c.want_out = true;
+                }
+                return true;
+            }
+            return false;
+        }
+        c.pending -= n;
+        while (n > 0) {
+            chunk & ck { c.out_q.front() };
+            const size_t left { ck.end - ck.off };
+
+            if (static_cast<size_t>(n) < left) {
+                ck.off += n;
+                break;
+            }
+            n -= left;
+            c.out_q.pop_front();
+        }
+    }
+    if (c.want_out) {
+        loop_.mod(c.fd, EPOLLIN);
+        c.want_out = false;
+    }
+    return (! c.close_after) || c.waiting;
+}
+
+void
+lsucpd_server::close_conn(int fd) noexcept
+{
+    const auto it { conns_.find(fd) };
+
+    if (it == conns_.end())
+        return;
+    if (it->second.sse)
+        --num_sse_;
+    loop_.del(fd);
+    close(fd);
+    conns_.erase(it);
+}
+
+// Calls fn with a snapshot no older than max_age_ms, now if cur_snap is
+// fresh enough, otherwise when a scan completes. Meanwhile c is parked.
+void
+lsucpd_server::with_snap(conn & c, int max_age_ms, resp_fn fn) noexcept
+{
+    const auto sp { cur_snap.load() };
+
+    if (sp && ((std::chrono::steady_clock::now() - sp->scan_tp) <=
+               std::chrono::milliseconds(max_age_ms))) {
+        fn(c, *sp);
+        return;
+    }
+    const int fd { c.fd };
+    const uint64_t id { c.id };
+
+    c.waiting = true;
+    request_scan([this, fd, id, fn](const std::shared_ptr<const scan_snap> &
+                                    ssp) {
+        const auto it { conns_.find(fd) };
+
+        if ((it == conns_.end()) || (it->second.id != id))
+            return;     // client went away
+        conn & wc { it->second };
+
+        wc.waiting = false;
+        if (ssp)
+            fn(wc, *ssp);
+        else
+            wc.close_after = true;
+        if (! process(wc))
+            close_conn(fd);
+    });
+}
+
+// fn (if given) is called when the next scan completes. Only one scan is
+// in flight at a time; requests for a scan meanwhile join it unless
+// after_event is set, since the scan in flight may predate the event.
+void
+lsucpd_server::request_scan(snap_fn fn, bool after_event) noexcept
+{
+    const bool want_snap { static_cast<bool>(fn) };
+
+    if (scanning_) {
+        if (after_event || (! want_snap)) {
+            rescan_ = true;
+            if (want_snap)
+                next_waiters_.push_back(std::move(fn));
+        } else {
+            waiters_.push_back(std::move(fn));
+            ++serve_st.joined;
+        }
+        return;
+    }
+    if (want_snap)
+        waiters_.push_back(std::move(fn));
+    start_scan();
+}
+
+void
+lsucpd_server::start_scan() noexcept
+{
+    scanning_ = true;
+    rescan_ = false;
+    loop_.run_blocking([op = op_] { serve_scan(op); },
+                       [this] { scan_done(); });
+}
+
+void
+lsucpd_server::scan_done() noexcept
+{
+    const auto sp { cur_snap.load() };
+    std::vector<snap_fn> w_v;
+
+    scanning_ = false;
+    ++serve_st.scans;
+    w_v.swap(waiters_);
+    waiters_.swap(next_waiters_);
+    for (auto & fn : w_v)
+        fn(sp);
+    if (sp) {
+        send_events();
+        watch_attrs(*sp);
+    }
+    if (rescan_ || (! waiters_.empty()))
+        start_scan();
+    else if (load_test()) {
+        ld_last_tp_ = std::chrono::steady_clock::now();
+        check_fed_all();
+    }
+}
+
+// Queues an event for subscriber c if it has not seen the content
+// generation of ss. Returns false if c does not keep up and should be
+// dropped rather than buffered without bound.
+bool
+lsucpd_server::sse_send(conn & c, const scan_snap & ss) noexcept
+{
+    size_t num_ports { };
+
+    if (c.cgen == ss.content_gen)
+        return true;
+    if (c.pending > HTTP_MAX_PENDING)
+        return false;
+    for (const auto & de : ss.tc_de_v) {
+        if (! de.is_partner())
+            ++num_ports;
+    }
+    queue(c, std::make_shared<const sstring>(
+                sstring(c.cgen ? "event: change\n" : "event: state\n") +
+                "id: " + std::to_string(ss.content_gen) + "\n" +
+                "data: {\"snapshot_generation\": " +
+                std::to_string(ss.generation) + ", \"uevent_seqnum\": " +
+                (ss.have_seqnum ? std::to_string(ss.seqnum) :
+                                  sstring("null")) +
+                ", \"ports\": " + std::to_string(num_ports) +
+                ", \"pd_objects\": " + std::to_string(ss.upd_de_m.size()) +
+                "}\n\n"));
+    c.cgen = ss.content_gen;
+    return flush(c);
+}
+
+void
+lsucpd_server::send_events() noexcept
+{
+    const auto sp { cur_snap.load() };
+    std::vector<int> drop_v;
+
+    if ((0 == num_sse_) || (nullptr == sp))
+        return;
+    for (auto & [fd, c] : conns_) {
+        if (c.sse && (! sse_send(c, *sp)))
+            drop_v.push_back(fd);
+    }
+    for (int fd : drop_v)
+        close_conn(fd);
+}
+
+// Watches the role and power operation mode attributes of each port. The
+// kernel calls sysfs_notify() on them when they change, which shows up as
+// POLLPRI (EPOLLPRI). Regular files (e.g. in a --sysfsroot copy) can not
+// be watched this way and are skipped.
+void
+lsucpd_server::watch_attrs(const scan_snap & ss) noexcept
+{
+    static const char * const attr_a[] = { "power_role", "data_role",
+                                           "power_operation_mode" };
+    const size_t typec_len { op_->tree.typec_pt_.string().size() };
+    std::set<sstring> want_s;
+    char b[64];
+
+    if (op_->pseudo_mount_point)
+        return;
+    for (const auto & de : ss.tc_de_v) {
+        if (de.is_partner())
+            continue;
+        for (const char * ap : attr_a)
+            want_s.insert((op_->tree.typec_pt_ / ("port" +
+                           std::to_string(de.port_num_)) / ap).string());
+    }
+    for (auto it { attr_m_.begin() }; it != attr_m_.end(); ) {
+        if (want_s.contains(it->first)) {
+            want_s.erase(it->first);
+            ++it;
+        } else {
+            loop_.del(it->second);
+            close(it->second);
+            it = attr_m_.erase(it);
+        }
+    }
+    for (const auto & pt : want_s) {
+        int fd { open(pt.c_str(), O_RDONLY | O_CLOEXEC) };
+
+        if (fd < 0)
+            continue;
+        // must be read once before a change is notified
+        if ((read(fd, b, sizeof(b)) < 0) ||
+            (! loop_.add(fd, EPOLLPRI, [this, fd, pt, typec_len](uint32_t) {
+                    char rb[64];
+
+                    if (pread(fd, rb, sizeof(rb), 0) < 0)
+                        pr3ser(2, "attribute", "re-read failed");
+                    note_event(devpath_object(pt.c_str() + typec_len));
+                }))) {
+            close(fd);
+            continue;
+        }
+        attr_m_[pt] = fd;
+    }
+}
+
+// Used when uevents can not be received
+void
+lsucpd_server::sample_seqnum() noexcept
+{
+    uint64_t sn { };
+    const auto sp { cur_snap.load() };
+
+    if (scanning_)
+        return;
+    if (read_uevent_seqnum(op_->tree, sn)) {
+        // note each new value once, a scan follows when it is quiet
+        if (((nullptr == sp) || (! sp->have_seqnum) || (sn != sp->seqnum)) &&
+            (sn != noted_sn_)) {
+            noted_sn_ = sn;
+            note_event(empty_str);
+        }
+    } else if ((num_sse_ > 0) || op_->do_watch || op_->rec_path)
+        note_event(empty_str);
+}
+
+void
+lsucpd_server::sweep_idle() noexcept
+{
+    std::vector<int> idle_v;
+    const auto now { std::chrono::steady_clock::now() };
+
+    for (const auto & [fd, c] : conns_) {
+        if ((! c.sse) && (! c.waiting) &&
+            ((now - c.last_tp) > std::chrono::milliseconds(HTTP_IDLE_MS)))
+            idle_v.push_back(fd);
+    }
+    for (int fd : idle_v)
+        close_conn(fd);
+}
+
+// Merges an event for obj with those pending and (re)arms the one shot
+// timer. The pending events are flushed after watch_quiet_ms without
+// another event, but no later than watch_max_ms after the first of them.
+void
+lsucpd_server::note_event(const sstring & obj) noexcept
+{
+    using namespace std::chrono;
+    const auto now { steady_clock::now() };
+    struct itimerspec its { };
+
+    if (0 == pend_events_)
+        first_tp_ = now;
+    ++pend_m_[obj];
+    ++pend_events_;
+    if (held_)
+        return;         // flushed when the writer has room
+    const auto due { std::min(now + milliseconds(op_->watch_quiet_ms),
+                              first_tp_ + milliseconds(op_->watch_max_ms)) };
+    int64_t ns { duration_cast<nanoseconds>(due - now).count() };
+
+    if (ns <= 0)
+        ns = 1;         // a zero it_value would disarm the timer
+    its.it_value.tv_sec = ns / 1000000000;
+    its.it_value.tv_nsec = ns % 1000000000;
+    if (timerfd_settime(deb_fd_, 0, &its, nullptr) < 0)
+        flush_events();
+}
+
+// One re-scan for all pending events. With --watch, one record for them
+// follows. That scan must start after the events, so it does not join one
+// in flight. If the writer's queue is full, events are held (and keep
+// being merged) until it has room; no change is lost, records are merged
+// instead.
+void
+lsucpd_server::flush_events() noexcept
+{
+    if (0 == pend_events_)
+        return;
+    if (op_->do_watch) {
+        std::lock_guard<std::mutex> lk { wr_mtx_ };
+
+        if (wr_q_.size() >= WATCH_MAX_QUEUED) {
+            if (! held_)
+                pr3ser(1, "--watch", "output backlog, merging records");
+            held_ = true;
+            return;
+        }
+    }
+    const bool delayed { held_ };
+    auto obj_m { std::move(pend_m_) };
+    const unsigned int num_ev { pend_events_ };
+    const auto t0 { first_tp_ };
+    const auto flush_tp { std::chrono::steady_clock::now() };
+
+    held_ = false;
+    pend_m_.clear();
+    pend_events_ = 0;
+    if ((! op_->do_watch) && (! load_test())) {
+        request_scan(nullptr);
+        return;
+    }
+    request_scan([this, obj_m = std::move(obj_m), num_ev, delayed, t0,
+                  flush_tp] (const std::shared_ptr<const scan_snap> & sp) {
+                     if (sp && op_->do_watch) {
+                         emit_record(*sp, obj_m, num_ev, delayed);
+                         ++ld_records_;
+                     }
+                     if (sp && (op_->storm_rate > 0))
+                         st_.reported(obj_m, flush_tp);
+                     if (op_->replay_path)
+                         rp_lat_v_.push_back(std::chrono::duration_cast<
+                                std::chrono::microseconds>(
+                                std::chrono::steady_clock::now() - t0)
+                                .count());
+                 }, true);
+}
+
+// Renders a --watch record for the objects in obj_m (all of them if it is
+// empty or has "" in it) as the command line options would, with a
+// header line (or "watch_record" object) in front. Then queues it for the
+// writer thread.
+void
+lsucpd_server::emit_record(const scan_snap & ss,
+                           const std::map<sstring, unsigned int> & obj_m,
+                           unsigned int num_ev, bool delayed) noexcept
+{
+    static char a0[] = "lsucpd";
+    static char * argv[] = { a0, nullptr };
+    const bool all { obj_m.empty() || obj_m.contains(empty_str) };
+    bool filter_for_port { false };
+    bool filter_for_pd { false };
+    size_t len { };
+    char * bp { };
+    FILE * fp;
+    struct opts_t r_opts { *op_ };
+    struct opts_t * r_op { &r_opts };
+    sgj_state * jsp { &r_op->json_st };
+    sgj_opaque_p jop { };
+    sgj_opaque_p jo2p;
+    sstring objs_s;
+    const sstring time_s { local_time_ms(clock_ms(CLOCK_REALTIME)) };
+
+    r_op->filter_port_v.clear();
+    r_op->filter_pd_v.clear();
+    for (const auto & [obj, cnt] : obj_m) {
+        if (! objs_s.empty())
+            objs_s += ' ';
+        objs_s += obj.empty() ? "*" : obj;
+        if (all)
+            continue;
+        if (0 == obj.compare(0, 2, "pd"))
+            r_op->filter_pd_v.push_back(obj);
+        else {
+            r_op->filter_port_v.push_back(obj);
+            r_op->filter_port_v.push_back(obj + "p");   // its partner
+        }
+    }
+    if (obj_m.empty())
+        objs_s = "initial";
+    if (r_op->filter_port_v.size() > 0)
+        filter_for_port = true;
+    if (r_op->filter_pd_v.size() > 0) {
+        filter_for_pd = true;
+        ++r_op->do_caps;
+    }
+    if (r_op->do_json && (! sgj_init_state(jsp, r_op->json_arg)))
+        return;
+    fp = open_memstream(&bp, &len);
+    if (nullptr == fp)
+        return;
+    lsucpd_hr_fp = fp;
+    if (r_op->do_json) {
+        jop = sgj_start_r(my_name, version_str, 1, argv, jsp);
+        jo2p = sgj_named_subobject_r(jsp, jop, "watch_record");
+        sgj_js_nv_s(jsp, jo2p, "time", time_s.c_str());
+        sgj_js_nv_i(jsp, jo2p, "events", num_ev);
+        sgj_js_nv_s(jsp, jo2p, "objects", objs_s.c_str());
+        sgj_js_nv_b(jsp, jo2p, "delayed_by_backpressure", delayed);
+        sgj_js_nv_i(jsp, jo2p, "snapshot_generation", ss.generation);
+    } else
+        sgj_hr_pri(jsp, "# {} [{} event{}{}] {}\n", time_s, num_ev,
+                   (1 == num_ev) ? "" : "s", delayed ? ", delayed" : "",
+                   objs_s);
+    output_snap(ss, filter_for_port, filter_for_pd, r_op, jop);
+    lsucpd_hr_fp = nullptr;
+    if (r_op->do_json) {
+        sgj_js2file_estr(jsp, nullptr, 0, strerror(0), fp);
+        sgj_finish(jsp);
+    }
+    fclose(fp);
+    {
+        std::lock_guard<std::mutex> lk { wr_mtx_ };
+
+        wr_q_.emplace_back(bp, len);
+    }
+    free(bp);
+    wr_cv_.notify_one();
+}
+
+// --watch writer thread. Blocking on a slow stdout reader is fine here.
+// Each time the queue gets shorter the loop is told, so held events can
+// be flushed.
+void
+lsucpd_server::writer() noexcept
+{
+    std::unique_lock<std::mutex> lk { wr_mtx_ };
+
+    while (true) {
+        wr_cv_.wait(lk, [this] { return wr_stop_ || (! wr_q_.empty()); });
+        if (wr_q_.empty())
+            break;      // stop asked for and all written
+        const sstring rec { std::move(wr_q_.front()) };
+
+        wr_q_.pop_front();
+        lk.unlock();
+        fputs(rec.c_str(), stdout);
+        fflush(stdout);
+        loop_.post([this] {
+            if (held_)
+                flush_events();
+            else if (load_test())
+                check_fed_all();
+        });
+        lk.lock();
+    }
+}
+
+// Same as 'lsucpd --json --caps --long' (i.e. without "service" object).
+// Shares the response cache with --serve=PATH requests.
+std::shared_ptr<const sstring>
+lsucpd_server::state_json(const scan_snap & ss) noexcept
+{
+    static char a0[] = "lsucpd";
+    static char a1[] = "--json";
+    static char a2[] = "--caps";
+    static char a3[] = "--long";
+    static char * argv[] = { a0, a1, a2, a3, nullptr };
+    static const sstring key { "--json --caps --long" };
+    auto rep { serve_cache.find(key, ss.content_gen) };
+
+    if (nullptr == rep) {
+        struct opts_t r_opts { };
+        struct opts_t * r_op { &r_opts };
+
+        r_op->do_json = true;
+        r_op->do_caps = 1;
+        r_op->caps_given = true;
+        r_op->do_long = 1;
+        if (! sgj_init_state(&r_op->json_st, nullptr))
+            return nullptr;
+        rep = render_resp(ss, false, false, r_op, 4, argv);
+        if (nullptr == rep)
+            return nullptr;
+        serve_cache.store(key, rep);
+    }
+    return std::shared_ptr<const sstring>(rep, &rep->body);
+}
+
+void
+lsucpd_server::respond(conn & c, int status, const char * reason,
+                       const char * ctype,
+                       std::shared_ptr<const sstring> body, bool head_only,
+                       bool keep_alive) noexcept
+{
+    auto hp { std::make_shared<sstring>() };
+
+    *hp = "HTTP/1.1 " + std::to_string(status) + " " + reason + "\r\n" +
+          "Content-Type: " + ctype + "\r\n" +
+          "Content-Length: " + std::to_string(body ? body->size() : 0) +
+          "\r\n";
+    if (405 == status)
+        *hp += "Allow: GET, HEAD\r\n";
+    *hp += keep_alive ? "Connection: keep-alive\r\n\r\n" :
+                        "Connection: close\r\n\r\n";
+    queue(c, std::move(hp));
+    if (! head_only)
+        queue(c, std::move(body));
+    if (! keep_alive)
+        c.close_after = true;
+}
+
+// Handles one HTTP request whose request line and headers are in head
+// (without the blank line)
+void
+lsucpd_server::handle_http(conn & c, const sstring & head) noexcept
+{
+    bool keep_alive { };
+    bool has_body { };
+    const char * txt { "text/plain; charset=utf-8" };
+    const auto eol { head.find("\r\n") };
+    const sstring rl { head.substr(0, eol) };
+    const auto sp1 { rl.find(' ') };
+    const auto sp2 { (sp1 == sstring::npos) ? sp1 : rl.find(' ', sp1 + 1) };
+
+    ++serve_st.http_reqs;
+    if (sp2 == sstring::npos) {
+        respond(c, 400, "Bad Request", txt,
+                std::make_shared<const sstring>("bad request line\n"),
+                false, false);
+        return;
+    }
+    const sstring method { rl.substr(0, sp1) };
+    sstring target { rl.substr(sp1 + 1, sp2 - sp1 - 1) };
+    const sstring ver { rl.substr(sp2 + 1) };
+
+    if ("HTTP/1.1" == ver)
+        keep_alive = true;
+    else if ("HTTP/1.0" != ver) {
+        respond(c, 505, "HTTP Version Not Supported", txt, nullptr, false,
+                false);
+        return;
+    }
+    // headers: only Connection matters; request bodies are not accepted
+    for (auto pos { eol }; pos != sstring::npos; ) {
+        const auto nxt { head.find("\r\n", pos + 2) };
+        sstring ln { head.substr(pos + 2, (nxt == sstring::npos) ?
+                                          sstring::npos : nxt - pos - 2) };
+
+        std::ranges::transform(ln, ln.begin(), [](unsigned char ch)
+                               { return std::tolower(ch); });
+        if (ln.starts_with("connection:")) {
+            if (ln.find("close") != sstring::npos)
+                keep_alive = false;
+            else if (ln.find("keep-alive") != sstring::npos)
+                keep_alive = true;
+        } else if (ln.starts_with("transfer-encoding:") ||
+                   (ln.starts_with("content-length:") &&
+                    (ln.find_first_not_of(" \t0", 15) != sstring::npos)))
+            has_body = true;
+        pos = nxt;
+    }
+    if (has_body) {
+        respond(c, 400, "Bad Request", txt,
+                std::make_shared<const sstring>("request body not "
+                                                "accepted\n"), false, false);
+        return;
+    }
+    const bool head_only { "HEAD" == method };
+
+    if ((! head_only) && ("GET" != method)) {
+        respond(c, 405, "Method Not Allowed", txt, nullptr, false,
+                keep_alive);
+        return;
+    }
+    const auto q { target.find('?') };
+
+    if (q != sstring::npos)
+        target.resize(q);
+    if ("/metrics" == target)
+        with_snap(c, op_->max_age_ms, [this, head_only, keep_alive]
+                  (conn & wc, const scan_snap & ss) {
+            respond(wc, 200, "OK", "application/openmetrics-text; "
+                    "version=1.0.0; charset=utf-8",
+                    std::make_shared<const sstring>(om_metrics(ss,
+                                                    serve_st.http_reqs)),
+                    head_only, keep_alive);
+        });
+    else if ("/state.json" == target)
+        with_snap(c, op_->max_age_ms, [this, head_only, keep_alive, txt]
+                  (conn & wc, const scan_snap & ss) {
+            auto bp { state_json(ss) };
+
+            if (bp)
+                respond(wc, 200, "OK", "application/json", std::move(bp),
+                        head_only, keep_alive);
+            else
+                respond(wc, 500, "Internal Server Error", txt, nullptr,
+                        head_only, false);
+        });
+    else if ("/events" == target) {
+        if (head_only) {
+            respond(c, 200, "OK", "text/event-stream", nullptr, true,
+                    keep_alive);
+            return;
+        }
+        // server-sent events: the response never ends; one event now and
+        // one each time the scan results change
+        queue(c, std::make_shared<const sstring>(
+                        "HTTP/1.1 200 OK\r\n"
+                        "Content-Type: text/event-stream\r\n"
+                        "Cache-Control: no-cache\r\n"
+                        "Connection: keep-alive\r\n\r\n"));
+        c.sse = true;
+        ++num_sse_;
+        with_snap(c, op_->max_age_ms, [this](conn & wc,
+                                             const scan_snap & ss) {
+            if (! sse_send(wc, ss))
+                wc.close_after = true;
+        });
+    } else
+        respond(c, 404, "Not Found", txt,
+                std::make_shared<const sstring>("try /metrics, "
+                        "/state.json or /events\n"), head_only, keep_alive);
+}
+
+/* Handles the request line from a --serve=PATH client. It holds command
+ * line options (e.g. '-c -l p0' or '--json --max-age=500'), without the
+ * utility name. Only options that select what is output are accepted. */
+void
+lsucpd_server::handle_line(conn & c, sstring line) noexcept
+{
+    const auto lrp { std::make_shared<line_req>() };
+    line_req & lr { *lrp };
+    struct opts_t * r_op { &lr.r_opts };
+
+    lr.line = std::move(line);
+    if (parse_req_line(lr)) {
+        queue(c, std::make_shared<const sstring>(fmt_to_str(
+                "lsucpd: bad request: {}\n", lr.err)));
+        c.close_after = true;
+        return;
+    }
+    with_snap(c, (r_op->max_age_ms >= 0) ? r_op->max_age_ms :
+                                           op_->max_age_ms,
+              [this, lrp](conn & wc, const scan_snap & ss) {
+                  line_respond(wc, *lrp, ss);
+              });
+}
+
+// The response is rendered (or taken from the response cache) and then
+// queued in up to 3 chunks: the body, a ',' and the "service" object
+// spliced in for JSON.
+void
+lsucpd_server::line_respond(conn & c, line_req & lr,
+                            const scan_snap & ss) noexcept
+{
+    static const auto comma_sp { std::make_shared<const sstring>(",") };
+    struct opts_t * r_op { &lr.r_opts };
+    auto rep { serve_cache.find(lr.key, ss.content_gen) };
+
+    c.close_after = true;
+    if (nullptr == rep) {
+        rep = render_resp(ss, lr.filter_for_port, lr.filter_for_pd, r_op,
+                          lr.argv.size() - 1, lr.argv.data());
+        if (nullptr == rep)
+            return;
+        serve_cache.store(lr.key, rep);
+    }
+    const std::shared_ptr<const sstring> bp { rep, &rep->body };
+    sstring svc_s;
+
+    if (r_op->do_json && (rep->json_pos != sstring::npos))
+        svc_s = service_json(ss, r_op);
+    if (svc_s.empty()) {
+        queue(c, bp);
+        return;
+    }
+    // body up to its last member, ',' then "service" object followed by
+    // the closing brace
+    const size_t pos { rep->json_pos };
+
+    queue(c, bp, 0, pos);
+    if ((pos > 0) && ('{' != rep->body[pos - 1]))
+        queue(c, comma_sp);
+    queue(c, std::make_shared<const sstring>(std::move(svc_s)));
+}
+
+/* Runs the --serve=PATH and/or --http=[ADDR:]PORT services until SIGINT
+ * or SIGTERM is received. */
+static int
+serve_main(const struct opts_t * op) noexcept
+{
+    int res;
+    int sfd;
+    sigset_t sig_set;
+
+    // block these in all threads (workers inherit the mask), they are
+    // taken from a signalfd by the loop
+    sigemptyset(&sig_set);
+    sigaddset(&sig_set, SIGINT);
+    sigaddset(&sig_set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sig_set, nullptr);
+    signal(SIGPIPE, SIG_IGN);   // clients may go away before the response
+
+    if (op->rec_path) {
+        res = port_rec.open(op->rec_path);
+        if (res) {
+            print_err(-1, "unable to record to {}: {}\n", op->rec_path,
+                      strerror(res));
+            return 1;
+        }
+    }
+    if (op->cap_path) {
+        res = ev_cap.open(op->cap_path);
+        if (res) {
+            print_err(-1, "unable to capture to {}: {}\n", op->cap_path,
+                      strerror(res));
+            return 1;
+        }
+    }
+    ev_loop loop;
+    lsucpd_server srv { loop, op };
+
+    sfd = signalfd(-1, &sig_set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if ((! loop.ok()) || (sfd < 0) ||
+        (! loop.add(sfd, EPOLLIN, [&loop, sfd](uint32_t) {
+                struct signalfd_siginfo si;
+
+                while (read(sfd, &si, sizeof(si)) == sizeof(si))
+                    ;
+                loop.stop(0);
+            }))) {
+        pr3ser(-1, "event loop", "setup failed");
+        if (sfd >= 0)
+            close(sfd);
+        return 1;
+    }
+    res = srv.start() ? loop.run() : 1;
+    srv.finish();
+    loop.del(sfd);
+    close(sfd);
+    port_rec.close();
+    ev_cap.close();
+    return res;
+}
+
+/* --fields=F[,F...] outputs just the named fields for each port (one line
+ * each, or a JSON object each) and reads only the sysfs attributes they
+ * need. A field is one of:
+ *     port, partner, pd, partner_pd    name, partner present, pd numbers
+ *     partner.ATTR                     attribute of the port's partner
+ *     GRP.ATTR                         attribute of each PDO in a list
+ *     ATTR                             attribute of the port
+ * where GRP is source_caps or sink_caps (of the port's pd) or
+ * partner_source_caps or partner_sink_caps. ATTR is a sysfs attribute
+ * name (e.g. power_role or voltage) from the tables below; for PDOs "type"
+ * is taken from the directory name (e.g. fixed_supply) and "index" is the
+ * object position, without reading anything. */
+static const char * const fld_grp_a[] = { "source_caps", "sink_caps",
+                                          "partner_source_caps",
+                                          "partner_sink_caps" };
+
+// Attributes of class/typec/port<n>
+static const char * const fld_port_attr_a[] = {
+    "data_role", "orientation", "port_type", "power_operation_mode",
+    "power_role", "preferred_role", "select_usb_power_delivery",
+    "supported_accessory_modes", "usb_capability", "usb_mode",
+    "usb_power_delivery_revision", "usb_typec_revision", "vconn_source",
+};
+
+// Attributes of class/typec/port<n>-partner
+static const char * const fld_partner_attr_a[] = {
+    "accessory_mode", "number_of_alternate_modes",
+    "supports_usb_power_delivery", "type", "usb_mode",
+    "usb_power_delivery_revision",
+};
+
+// Attributes of a PDO directory below <pd>/{source|sink}-capabilities
+static const char * const fld_pdo_attr_a[] = {
+    "dual_role_data", "dual_role_power", "fast_role_swap_current",
+    "higher_capability", "index", "maximum_current",
+    "maximum_current_15V_to_20V", "maximum_current_9V_to_15V",
+    "maximum_power", "maximum_voltage", "minimum_voltage",
+    "operational_current", "operational_power", "peak_current",
+    "pps_power_limited", "type", "unchunked_extended_messages_supported",
+    "unconstrained_power", "usb_communication_capable",
+    "usb_suspend_supported", "voltage",
+};
+
+template <size_t N>
+static bool
+fld_known(const char * const (&a)[N], const sstring & nm) noexcept
+{
+    return std::ranges::any_of(a, [&nm](const char * s) { return nm == s; });
+}
+
+struct fld_spec {
+    std::vector<sstring> name_v;        // as given
+    std::vector<sstring> port_attr_v;
+    std::vector<sstring> partner_attr_v;
+    std::vector<sstring> grp_attr_a[4]; // per fld_grp_a[] entry
+};
+
+// Number from "<prefix><n>" link target's file name, -1 if unavailable
+static int
+fld_pd_num(const fs::path & dir) noexcept
+{
+    std::error_code ec { };
+    unsigned int n;
+    const fs::path tgt { fs::read_symlink(dir / upd_sn, ec) };
+
+    if (ec || (1 != sscanf(tgt.filename().c_str(), "pd%u", &n)))
+        return -1;
+    return n;
+}
+
+static bool
+fld_parse(const char * arg, fld_spec & fs) noexcept
+{
+    sstring spec { arg };
+    char * savep { };
+
+    for (char * cp { strtok_r(spec.data(), ",", &savep) }; cp;
+         cp = strtok_r(nullptr, ",", &savep)) {
+        const sstring f { cp };
+        const size_t dot { f.find('.') };
+        const sstring attr { (dot == sstring::npos) ? f : f.substr(dot + 1) };
+        bool found { false };
+
+        fs.name_v.push_back(f);
+        if (dot == sstring::npos) {
+            if ((f == "port") || (f == "partner") || (f == "pd") ||
+                (f == "partner_pd"))
+                continue;
+            if (! fld_known(fld_port_attr_a, f))
+                return false;
+            fs.port_attr_v.push_back(f);
+            continue;
+        }
+        const sstring grp { f.substr(0, dot) };
+
+        if (grp == "partner") {
+            if (! fld_known(fld_partner_attr_a, attr))
+                return false;
+            fs.partner_attr_v.push_back(attr);
+            continue;
+        }
+        if (! fld_known(fld_pdo_attr_a, attr))
+            return false;
+        for (int k = 0; k < 4; ++k) {
+            if (grp == fld_grp_a[k]) {
+                fs.grp_attr_a[k].push_back(attr);
+                found = true;
+            }
+        }
+        if (! found)
+            return false;
+    }
+    return ! fs.name_v.empty();
+}
+
+// Values of one PDO list: per PDO (in object position order) the
+// requested attributes, by name
+using fld_pdos = std::vector<std::map<sstring, sstring>>;
+
+static fld_pdos
+fld_read_pdos(const sysfs_tree & tr, int pd_num, bool source,
+              const std::vector<sstring> & attr_v) noexcept
+{
+    std::error_code ec { };
+    std::map<unsigned int, fs::path> pos_m;
+    fld_pdos res;
+
+    if ((pd_num < 0) || attr_v.empty())
+        return res;
+    const fs::path caps_pt { tr.upd_pt_ /
+                             ("pd" + std::to_string(pd_num)) /
+                             (source ? src_cap_s : sink_cap_s) };
+
+    for (fs::directory_iterator itr(caps_pt, dir_opt, ec);
+         (! ec) && (itr != end_itr); itr.increment(ec)) {
+        unsigned int pos;
+
+        if (1 == sscanf(itr->path().filename().c_str(), "%u:", &pos))
+            pos_m[pos] = itr->path();
+    }
+    for (const auto & [pos, pt] : pos_m) {
+        std::map<sstring, sstring> & m { res.emplace_back() };
+        const sstring nm { pt.filename() };
+
+        for (const auto & a : attr_v) {
+            sstring v;
+
+            if (a == "type")
+                v = nm.substr(nm.find(':') + 1);
+            else if (a == "index")
+                v = std::to_string(pos);
+            else if (get_value(pt, a, v, 128))
+                v = "-";
+            m[a] = v;
+        }
+    }
+    return res;
+}
+
+static sstring
+fld_quote(const sstring & v) noexcept
+{
+    if ((! v.empty()) && (v.find_first_of(" \t'") == sstring::npos))
+        return v;
+    return "'" + v + "'";
+}
+
+static int
+do_fields(bool filter_for_port, struct opts_t * op, sgj_opaque_p jop)
+          noexcept
+{
+    std::error_code ec { };
+    sgj_state * jsp { &op->json_st };
+    sgj_opaque_p jap { };
+    fld_spec fs;
+    std::vector<sregex> pat_v;
+    std::map<unsigned int, bool> port_m;        // port number -> partner
+
+    if (! fld_parse(op->fields_arg, fs)) {
+        print_err(-1, "--fields=: unable to decode: {}\n", op->fields_arg);
+        return 1;
+    }
+    for (const auto & filt : op->filter_port_v) {
+        pat_v.emplace_back();
+        regex_ctor_noexc(pat_v.back(), filt, std::regex_constants::grep |
+                                             std::regex_constants::icase, ec);
+        if (ec) {
+            pr3ser(-1, filt, "filter was an unacceptable regex pattern");
+            return 1;
+        }
+    }
+    // one listing gives the ports and which have partners
+    for (fs::directory_iterator itr(op->tree.typec_pt_, dir_opt, ec);
+         (! ec) && (itr != end_itr); itr.increment(ec)) {
+        unsigned int n;
+        char c;
+        const sstring nm { itr->path().filename() };
+        const int r { sscanf(nm.c_str(), "port%u%c", &n, &c) };
+
+        if (1 == r)
+            port_m.try_emplace(n, false);
+        else if ((2 == r) && (nm == fmt_to_str("port{}-partner", n)))
+            port_m[n] = true;
+    }
+    if (ec) {
+        pr3ser(-1, op->tree.typec_pt_, "failed in iterate of scan directory",
+               ec);
+        return 1;
+    }
+    if (jsp->pr_as_json)
+        jap = sgj_named_subarray_r(jsp, jop, "port_fields_list");
+    for (const auto & [pn, has_partner] : port_m) {
+        const sstring pname { "port" + std::to_string(pn) };
+        const fs::path port_pt { op->tree.typec_pt_ / pname };
+        const fs::path partner_pt { op->tree.typec_pt_ /
+                                    (pname + "-partner") };
+        int pd { -1 };
+        int partner_pd { -1 };
+        fld_pdos pdos_a[4];
+        std::map<sstring, sstring> val_m;
+        sgj_opaque_p jo2p { };
+        sgj_opaque_p jo3p { };
+        sstring line;
+
+        if (filter_for_port) {      // like do_filter(), p<n> or p<n>p
+            const sstring ms { "p" + std::to_string(pn) };
+            bool match { false };
+
+            for (const auto & pat : pat_v) {
+                if (regex_match_noexc(ms, pat, ec) ||
+                    (has_partner && regex_match_noexc(ms + "p", pat, ec)))
+                    match = true;
+            }
+            if (! match)
+                continue;
+        }
+        if (std::ranges::count(fs.name_v, "pd") ||
+            (! fs.grp_attr_a[0].empty()) || (! fs.grp_attr_a[1].empty()))
+            pd = fld_pd_num(port_pt);
+        if (has_partner && (std::ranges::count(fs.name_v, "partner_pd") ||
+                            (! fs.grp_attr_a[2].empty()) ||
+                            (! fs.grp_attr_a[3].empty())))
+            partner_pd = fld_pd_num(partner_pt);
+        for (int k = 0; k < 4; ++k)
+            pdos_a[k] = fld_read_pdos(op->tree, (k < 2) ? pd : partner_pd,
+                                      ! (k & 1), fs.grp_attr_a[k]);
+        for (const auto & a : fs.port_attr_v) {
+            if (get_value(port_pt, a, val_m[a], 128))
+                val_m[a] = "-";
+        }
+        for (const auto & a : fs.partner_attr_v) {
+            sstring & v { val_m["partner." + a] };
+
+            if ((! has_partner) || get_value(partner_pt, a, v, 128))
+                v = "-";
+        }
+        if (jsp->pr_as_json)
+            jo2p = sgj_new_unattached_object_r(jsp);
+        for (const auto & f : fs.name_v) {
+            const size_t dot { f.find('.') };
+            const sstring grp { (dot == sstring::npos) ? sstring() :
+                                                          f.substr(0, dot) };
+            sstring v;
+
+            if (f == "port")
+                v = pname;
+            else if (f == "partner")
+                v = has_partner ? "1" : "0";
+            else if ((f == "pd") || (f == "partner_pd")) {
+                const int num { (f == "pd") ? pd : partner_pd };
+
+                v = (num < 0) ? sstring("-") : std::to_string(num);
+                if (jsp->pr_as_json && (num >= 0))
+                    sgj_js_nv_i(jsp, jo2p, f.c_str(), num);
+                if (jsp->pr_as_json)
+                    continue;
+            } else if (grp.empty() || (grp == "partner"))
+                v = val_m[f];
+            else {
+                const int k { static_cast<int>(std::ranges::find_if(
+                        fld_grp_a, [&grp](const char * g) {
+                                return grp == g; }) - fld_grp_a) };
+                const sstring a { f.substr(dot + 1) };
+
+                for (const auto & m : pdos_a[k])
+                    v += (v.empty() ? "" : ",") + m.at(a);
+                if (jsp->pr_as_json)
+                    continue;   // as arrays of objects below
+                if (v.empty())  // no such list, or it is empty
+                    v = "-";
+            }
+            if (jsp->pr_as_json) {
+                if (grp == "partner") {
+                    if (nullptr == jo3p)
+                        jo3p = sgj_named_subobject_r(jsp, jo2p,
+                                                     "partner_attributes");
+                    sgj_js_nv_s(jsp, jo3p, f.c_str() + dot + 1, v.c_str());
+                } else if (f == "partner")
+                    sgj_js_nv_i(jsp, jo2p, "partner", has_partner);
+                else
+                    sgj_js_nv_s(jsp, jo2p, f.c_str(), v.c_str());
+            } else
+                line += (line.empty() ? "" : "  ") +
+                        ((f == "port") ? v : f + "=" + fld_quote(v));
+        }
+        if (jsp->pr_as_json) {
+            for (int k = 0; k < 4; ++k) {
+                if (fs.grp_attr_a[k].empty())
+                    continue;
+                sgj_opaque_p ja2p { sgj_named_subarray_r(jsp, jo2p,
+                                                         fld_grp_a[k]) };
+
+                for (const auto & m : pdos_a[k]) {
+                    sgj_opaque_p jo4p { sgj_new_unattached_object_r(jsp) };
+
+                    for (const auto & a : fs.grp_attr_a[k])
+                        sgj_js_nv_s(jsp, jo4p, a.c_str(), m.at(a).c_str());
+                    sgj_js_nv_o(jsp, ja2p, nullptr, jo4p);
+                }
+            }
+            sgj_js_nv_o(jsp, jap, nullptr, jo2p);
+        } else
+            sgj_hr_pri(jsp, "{}\n", line);
+    }
+    if (io_prof.active)
+        io_prof_report(op, jop);
+    return 0;
+}
+
+/* Exit statuses of --check= as health probes (e.g. Nagios plugins) expect
+ * them */
+enum check_st_e {
+    check_ok = 0,
+    check_warning = 1,
+    check_critical = 2,
+    check_unknown = 3,
+};
+
+/* --count and --check=: reports that the counts could not be taken (e.g.
+ * the sysfs root does not exist) as a status line on stdout, where probes
+ * read it, or in a "check" object with --json. Returns check_unknown. */
+static int
+count_unknown(struct opts_t * op, sgj_opaque_p jop, const sstring & why)
+              noexcept
+{
+    sgj_state * jsp { &op->json_st };
+
+    if (jsp->pr_as_json) {
+        sgj_opaque_p jo2p { sgj_named_subobject_r(jsp, jop, "check") };
+
+        sgj_js_nv_s(jsp, jo2p, "status", "UNKNOWN");
+        sgj_js_nv_s(jsp, jo2p, "error", why.c_str());
+        sgj_js2file_estr(jsp, nullptr, check_unknown, "UNKNOWN", stdout);
+        sgj_finish(jsp);
+    } else
+        bw::print("LSUCPD UNKNOWN - {}\n", why);
+    return check_unknown;
+}
+
+/* --count and --check=COND[,COND...] answer from a listing of class/typec
+ * and, for each port with a partner, its power_operation_mode. Nothing
+ * else (e.g. usb_power_delivery) is touched, so a probe costs a few dozen
+ * system calls. The counts are "ports", "partners" and "pd" (partners
+ * in USB PD mode). A COND is [w:]NAME{=|<|>|<=|>=}N ; if one does not
+ * hold the status is CRITICAL, or WARNING if it has the "w:" prefix. A
+ * missing class/typec (e.g. no typec driver loaded) counts as no ports,
+ * other errors opening it give UNKNOWN. */
+static int
+do_count(struct opts_t * op, sgj_opaque_p jop) noexcept
+{
+    struct check_cond {
+        bool warn_only;
+        sstring name;
+        sstring rel;            // "=", "<", ">", "<=" or ">="
+        long long val;
+        sstring text;
+    };
+    static const char * const st_name[] = { "OK", "WARNING", "CRITICAL",
+                                            "UNKNOWN" };
+    int st { check_ok };
+    int num_ports { };
+    int num_partners { };
+    int num_pd { };
+    sgj_state * jsp { &op->json_st };
+    const sstring dir_s { (fs::path(op->tree.root_) / class_s / typec_s)
+                          .string() };
+    std::vector<check_cond> cond_v;
+    std::vector<sstring> failed_v;
+    DIR * dp;
+    struct dirent * dep;
+
+    if (op->check_arg) {
+        sstring spec { op->check_arg };
+        char * savep { };
+
+        for (char * cp { strtok_r(spec.data(), ",", &savep) }; cp;
+             cp = strtok_r(nullptr, ",", &savep)) {
+            check_cond cc { false, { }, { }, 0, cp };
+            const char * ep;
+            char * np;
+
+            if (0 == strncmp(cp, "w:", 2)) {
+                cc.warn_only = true;
+                cp += 2;
+            }
+            ep = cp + strspn(cp, "abcdefghijklmnopqrstuvwxyz_");
+            cc.name.assign(cp, ep - cp);
+            cc.rel.assign(ep, strspn(ep, "=<>"));
+            ep += cc.rel.size();
+            cc.val = strtoll(ep, &np, 10);
+            if (((cc.name != "ports") && (cc.name != "partners") &&
+                 (cc.name != "pd")) ||
+                ((cc.rel != "=") && (cc.rel != "<") && (cc.rel != ">") &&
+                 (cc.rel != "<=") && (cc.rel != ">=")) ||
+                (np == ep) || ('\0' != *np)) {
+                print_err(-1, "--check=: bad condition '{}', expect "
+                          "[w:]NAME{{=|<|>|<=|>=}}N\nwhere NAME is ports, "
+                          "partners or pd\n", cc.text);
+                return check_unknown;
+            }
+            cond_v.push_back(std::move(cc));
+        }
+    }
+    dp = opendir(dir_s.c_str());
+    if ((nullptr == dp) && (ENOENT != errno))
+        return count_unknown(op, jop, fmt_to_str("{}: {}", dir_s,
+                                                 strerror(errno)));
+    // each port<n> and port<n>-partner, nothing below them
+    while (dp && (dep = readdir(dp))) {
+        unsigned int n;
+        char c;
+        const int r { sscanf(dep->d_name, "port%u%c", &n, &c) };
+
+        if (1 == r)
+            ++num_ports;
+        else if ((2 == r) && ('-' == c) &&
+                 (0 == strcmp(strchr(dep->d_name, '-'), "-partner"))) {
+            char b[32];
+            int fd;
+            ssize_t len { -1 };
+
+            ++num_partners;
+            fd = openat(dirfd(dp), fmt_to_str("port{}/power_operation_mode",
+                                              n).c_str(),
+                        O_RDONLY | O_CLOEXEC);
+            if (fd >= 0) {
+                len = read(fd, b, sizeof(b) - 1);
+                close(fd);
+            }
+            if ((len > 0) && (0 == strncmp(b, "usb_power_delivery", 18)))
+                ++num_pd;
+        }
+    }
+    if (dp)
+        closedir(dp);
+
+    const std::map<sstring, int> cnt_m { { "ports", num_ports },
+                                         { "partners", num_partners },
+                                         { "pd", num_pd } };
+
+    for (const auto & cc : cond_v) {
+        const long long v { cnt_m.at(cc.name) };
+        bool ok;
+
+        if (cc.rel == "=")
+            ok = (v == cc.val);
+        else if (cc.rel == "<")
+            ok = (v < cc.val);
+        else if (cc.rel == ">")
+            ok = (v > cc.val);
+        else if (cc.rel == "<=")
+            ok = (v <= cc.val);
+        else
+            ok = (v >= cc.val);
+        if (ok)
+            continue;
+        failed_v.push_back(cc.text);
+        st = std::max(st, cc.warn_only ? (int)check_warning :
+                                         (int)check_critical);
+    }
+    if (jsp->pr_as_json) {
+        sgj_opaque_p jo2p { sgj_named_subobject_r(jsp, jop, "port_counts") };
+        sgj_opaque_p jap;
+
+        for (const auto & [nm, v] : cnt_m)
+            sgj_js_nv_i(jsp, jo2p, nm.c_str(), v);
+        if (op->check_arg) {
+            jo2p = sgj_named_subobject_r(jsp, jop, "check");
+            sgj_js_nv_s(jsp, jo2p, "status", st_name[st]);
+            jap = sgj_named_subarray_r(jsp, jo2p, "failed_list");
+            for (const auto & f : failed_v)
+                sgj_js_nv_s(jsp, jap, nullptr, f.c_str());
+        }
+        sgj_js2file_estr(jsp, nullptr, st, st_name[st], stdout);
+        sgj_finish(jsp);
+        return st;
+    }
+    const sstring cnt_s { fmt_to_str("ports={} partners={} pd={}",
+                                     num_ports, num_partners, num_pd) };
+
+    if (nullptr == op->check_arg)
+        bw::print("{}\n", cnt_s);
+    else {
+        sstring f_s;
+
+        for (const auto & f : failed_v)
+            f_s += (f_s.empty() ? "" : ", ") + f;
+        bw::print("LSUCPD {} - {}{}{} | {}\n", st_name[st], cnt_s,
+                  f_s.empty() ? "" : ", failed: ", f_s, cnt_s);
+    }
+    return st;
+}
+
+/* --arrow=PREFIX writes the scan results as two Apache Arrow IPC files
+ * (the "Feather V2" file format): PREFIX.ports.arrow with a row per port
+ * and partner and PREFIX.pdos.arrow with a row per PDO. They can be
+ * loaded directly by pyarrow, polars, DuckDB and the like, or converted
+ * to Parquet by them. Enumerations are dictionary encoded. With several
+ * --sysfsroot= trees the rows of all of them go into the same files and
+ * the "root" column tells them apart. No Arrow library is needed: the
+ * metadata, which is made of flatbuffers, is built by the small builder
+ * below and the columns are built in memory then written as one record
+ * batch. Everything is written little endian. */
+
+// Appends the n low order bytes of v to b, little endian
+static void
+put_le(sstring & b, uint64_t v, int n) noexcept
+{
+    for (int k = 0; k < n; ++k, v >>= 8)
+        b.push_back(static_cast<char>(v & 0xff));
+}
+
+// Builds a flatbuffer back to front, as the flatbuffers library does.
+// Positions are offsets from the end of the buffer, so they do not change
+// as more is prepended.
+class fb_builder {
+public:
+    uint32_t size() const noexcept { return buf_.size(); }
+
+    // prepends zeros so that after n more bytes the size is a multiple of
+    // align
+    void align(size_t align, size_t n) noexcept
+    {
+        size_t pad { (align - ((buf_.size() + n) % align)) % align };
+
+        buf_.insert(0, pad, '\0');
+    }
+
+    template<typename T> void push(T v) noexcept
+    {
+        sstring b;
+
+        align(sizeof(T), sizeof(T));
+        put_le(b, static_cast<uint64_t>(v), sizeof(T));
+        buf_.insert(0, b);
+    }
+
+    void push_off(uint32_t pos) noexcept
+    {
+        align(4, 4);
+        push<uint32_t>(size() + 4 - pos);
+    }
+
+    uint32_t add_string(const sstring & s) noexcept
+    {
+        align(4, s.size() + 1);
+        buf_.insert(0, 1, '\0');
+        buf_.insert(0, s);
+        push<uint32_t>(s.size());
+        return size();
+    }
+
+    uint32_t add_off_vec(const std::vector<uint32_t> & pos_v) noexcept
+    {
+        align(4, 4 * pos_v.size());
+        for (auto it { pos_v.rbegin() }; it != pos_v.rend(); ++it)
+            push_off(*it);
+        push<uint32_t>(pos_v.size());
+        return size();
+    }
+
+    // elements of a vector of structs, already serialized
+    uint32_t add_struct_vec(const sstring & elems, size_t elem_align,
+                            uint32_t num) noexcept
+    {
+        align(std::max<size_t>(elem_align, 4), elems.size());
+        buf_.insert(0, elems);
+        push<uint32_t>(num);
+        return size();
+    }
+
+    void start_table() noexcept
+    {
+        fld_v_.clear();
+        tbl_start_ = size();
+    }
+
+    template<typename T> void add_field(int id, T v) noexcept
+    {
+        push<T>(v);
+        fld_v_.emplace_back(id, size());
+    }
+
+    void add_off_field(int id, uint32_t pos) noexcept
+    {
+        push_off(pos);
+        fld_v_.emplace_back(id, size());
+    }
+
+    uint32_t end_table() noexcept
+    {
+        int num_ids { };
+        sstring vt;
+
+        push<int32_t>(0);       // becomes the offset to the vtable
+        const uint32_t tbl_pos { size() };
+
+        for (const auto & [id, pos] : fld_v_)
+            num_ids = std::max(num_ids, id + 1);
+        std::vector<uint16_t> fo_v(num_ids);
+
+        for (const auto & [id, pos] : fld_v_)
+            fo_v[id] = tbl_pos - pos;
+        put_le(vt, 4 + (2 * num_ids), 2);
+        put_le(vt, tbl_pos - tbl_start_, 2);
+        for (auto fo : fo_v)
+            put_le(vt, fo, 2);
+        align(2, vt.size());
+        buf_.insert(0, vt);
+        const int32_t so { static_cast<int32_t>(size() - tbl_pos) };
+
+        for (int k = 0; k < 4; ++k)
+            buf_[size() - tbl_pos + k] = static_cast<char>(so >> (8 * k));
+        return tbl_pos;
+    }
+
+    // Puts the offset of the root table first, size is then a multiple
+    // of 8
+    const sstring & finish(uint32_t root) noexcept
+    {
+        align(8, 4);
+        push_off(root);
+        return buf_;
+    }
+
+private:
+    sstring buf_;
+    uint32_t tbl_start_ { };
+    std::vector<std::pair<int, uint32_t>> fld_v_;
+};
+
+// From the Arrow format's Schema.fbs and Message.fbs
+enum arw_type_e {
+    arw_int = 2,
+    arw_utf8 = 5,
+    arw_bool = 6,
+};
+enum arw_msg_e {
+    arw_msg_schema = 1,
+    arw_msg_dict = 2,
+    arw_msg_batch = 3,
+};
+static const int16_t arw_meta_v5 = 4;
+
+// One column being built. A dictionary encoded column holds indices into
+// the strings of its dictionary.
+struct arw_col {
+    sstring name_;
+    int type_ { arw_int };
+    int bit_width_ { 32 };
+    bool is_signed_ { };
+    int dict_id_ { -1 };
+    int64_t length_ { };
+    int64_t null_count_ { };
+    sstring valid_;             // validity bitmap
+    sstring data_;              // values, bits if bool, offsets if utf8
+    sstring values_;            // utf8 only: the strings
+
+    void add(int64_t v) noexcept
+    {
+        set_valid(true);
+        if (arw_bool == type_) {
+            if (0 == (length_ % 8))
+                data_.push_back('\0');
+            if (v)
+                data_.back() |= static_cast<char>(1 << (length_ % 8));
+        } else
+            put_le(data_, static_cast<uint64_t>(v), bit_width_ / 8);
+        ++length_;
+    }
+
+    void add_null() noexcept
+    {
+        set_valid(false);
+        if (arw_bool == type_) {
+            if (0 == (length_ % 8))
+                data_.push_back('\0');
+        } else
+            data_.append(bit_width_ / 8, '\0');
+        ++null_count_;
+        ++length_;
+    }
+
+private:
+    void set_valid(bool valid) noexcept
+    {
+        if (0 == (length_ % 8))
+            valid_.push_back('\0');
+        if (valid)
+            valid_.back() |= static_cast<char>(1 << (length_ % 8));
+    }
+};
+
+// A dictionary is a utf8 column of its own
+struct arw_dict {
+    std::vector<sstring> val_v;
+
+    int index_of(const sstring & s) noexcept
+    {
+        auto it { std::ranges::find(val_v, s) };
+
+        if (it != val_v.end())
+            return it - val_v.begin();
+        val_v.push_back(s);
+        return val_v.size() - 1;
+    }
+};
+
+struct arw_table {
+    std::vector<arw_col> col_v;
+    std::vector<arw_dict> dict_v;       // dictionary id is the index
+
+    arw_col & col(const char * name, int type, int bit_width,
+                  bool is_signed, int dict_id = -1) noexcept
+    {
+        arw_col & c { col_v.emplace_back() };
+
+        c.name_ = name;
+        c.type_ = type;
+        c.bit_width_ = bit_width;
+        c.is_signed_ = is_signed;
+        c.dict_id_ = dict_id;
+        return c;
+    }
+
+    arw_col & dict_col(const char * name, int bit_width,
+                       std::vector<sstring> val_v = { }) noexcept
+    {
+        dict_v.emplace_back(std::move(val_v));
+        return col(name, arw_int, bit_width, true, dict_v.size() - 1);
+    }
+};
+
+static uint32_t
+arw_int_type(fb_builder & fb, int bit_width, bool is_signed) noexcept
+{
+    fb.start_table();
+    fb.add_field<int32_t>(0, bit_width);
+    fb.add_field<uint8_t>(1, is_signed);
+    return fb.end_table();
+}
+
+static uint32_t
+arw_schema(fb_builder & fb, const arw_table & tab) noexcept
+{
+    std::vector<uint32_t> fld_v;
+
+    for (const auto & c : tab.col_v) {
+        const bool dict { c.dict_id_ >= 0 };
+        const uint32_t name { fb.add_string(c.name_) };
+        uint32_t type;
+        uint32_t enc { };
+
+        if (dict || (arw_int != c.type_)) {
+            fb.start_table();           // Utf8 and Bool have no fields
+            type = fb.end_table();
+        } else
+            type = arw_int_type(fb, c.bit_width_, c.is_signed_);
+        if (dict) {
+            const uint32_t it { arw_int_type(fb, c.bit_width_, true) };
+
+            fb.start_table();
+            fb.add_field<int64_t>(0, c.dict_id_);
+            fb.add_off_field(1, it);
+            enc = fb.end_table();
+        }
+        const uint32_t children { fb.add_off_vec({ }) };
+
+        fb.start_table();
+        fb.add_off_field(0, name);
+        fb.add_field<uint8_t>(1, c.null_count_ > 0);
+        fb.add_field<uint8_t>(2, dict ? arw_utf8 : c.type_);
+        fb.add_off_field(3, type);
+        if (dict)
+            fb.add_off_field(4, enc);
+        fb.add_off_field(5, children);
+        fld_v.push_back(fb.end_table());
+    }
+    const uint32_t fields { fb.add_off_vec(fld_v) };
+
+    fb.start_table();
+    fb.add_field<int16_t>(0, 0);        // little endian
+    fb.add_off_field(1, fields);
+    return fb.end_table();
+}
+
+// Appends buffer b to body, padded to 8 bytes, and notes where it is
+static void
+arw_buffer(sstring & body, sstring & bufs, const sstring & b) noexcept
+{
+    put_le(bufs, body.size(), 8);
+    put_le(bufs, b.size(), 8);
+    body += b;
+    body.append((8 - (b.size() % 8)) % 8, '\0');
+}
+
+// Builds a RecordBatch table for the columns in col_v; its buffers are
+// appended to body
+static uint32_t
+arw_batch(fb_builder & fb, const std::vector<const arw_col *> & col_v,
+          int64_t length, sstring & body) noexcept
+{
+    sstring nodes;
+    sstring bufs;
+    uint32_t num_bufs { };
+
+    for (const auto * cp : col_v) {
+        put_le(nodes, cp->length_, 8);
+        put_le(nodes, cp->null_count_, 8);
+        arw_buffer(body, bufs, (cp->null_count_ > 0) ? cp->valid_ :
+                                                        empty_str);
+        arw_buffer(body, bufs, cp->data_);
+        num_bufs += 2;
+        if (arw_utf8 == cp->type_) {
+            arw_buffer(body, bufs, cp->values_);
+            ++num_bufs;
+        }
+    }
+    const uint32_t nv { fb.add_struct_vec(nodes, 8, col_v.size()) };
+    const uint32_t bv { fb.add_struct_vec(bufs, 8, num_bufs) };
+
+    fb.start_table();
+    fb.add_field<int64_t>(0, length);
+    fb.add_off_field(1, nv);
+    fb.add_off_field(2, bv);
+    return fb.end_table();
+}
+
+// Writes an encapsulated message: continuation marker, metadata length,
+// the Message flatbuffer and the body. Notes its Block in blocks.
+static bool
+arw_message(FILE * fp, uint64_t & pos, int hdr_type,
+            const std::function<uint32_t(fb_builder &, sstring &)> & hdr_fn,
+            sstring * blocks) noexcept
+{
+    fb_builder fb;
+    sstring body;
+    sstring pre;
+    const uint32_t hdr { hdr_fn(fb, body) };
+
+    fb.start_table();
+    fb.add_field<int16_t>(0, arw_meta_v5);
+    fb.add_field<uint8_t>(1, hdr_type);
+    fb.add_off_field(2, hdr);
+    fb.add_field<int64_t>(3, body.size());
+    const sstring & meta { fb.finish(fb.end_table()) };
+
+    put_le(pre, 0xffffffff, 4);
+    put_le(pre, meta.size(), 4);
+    if (blocks) {
+        put_le(*blocks, pos, 8);
+        put_le(*blocks, pre.size() + meta.size(), 4);
+        put_le(*blocks, 0, 4);
+        put_le(*blocks, body.size(), 8);
+    }
+    pos += pre.size() + meta.size() + body.size();
+    return (1 == fwrite(pre.data(), pre.size(), 1, fp)) &&
+           (1 == fwrite(meta.data(), meta.size(), 1, fp)) &&
+           (body.empty() || (1 == fwrite(body.data(), body.size(), 1, fp)));
+}
+
+/* Writes tab to the file fn in the Arrow IPC file format. Returns 0 on
+ * success, else an errno value. */
+static int
+arw_write(const sstring & fn, const arw_table & tab) noexcept
+{
+    static const char magic[8] { 'A', 'R', 'R', 'O', 'W', '1', 0, 0 };
+    bool ok;
+    int64_t length { tab.col_v.empty() ? 0 : tab.col_v[0].length_ };
+    uint64_t pos { sizeof(magic) };
+    sstring dict_blocks;
+    sstring batch_blocks;
+    std::vector<const arw_col *> col_v;
+    FILE * fp { fopen(fn.c_str(), "we") };
+
+    if (nullptr == fp)
+        return errno;
+    ok = (1 == fwrite(magic, sizeof(magic), 1, fp));
+    ok = ok && arw_message(fp, pos, arw_msg_schema,
+                           [&tab](fb_builder & fb, sstring &) {
+                                return arw_schema(fb, tab); }, nullptr);
+    for (size_t k = 0; ok && (k < tab.dict_v.size()); ++k) {
+        arw_col dc;
+        uint32_t off { };
+
+        dc.type_ = arw_utf8;
+        put_le(dc.data_, off, 4);
+        for (const auto & v : tab.dict_v[k].val_v) {
+            off += v.size();
+            put_le(dc.data_, off, 4);
+            dc.values_ += v;
+        }
+        dc.length_ = tab.dict_v[k].val_v.size();
+        ok = arw_message(fp, pos, arw_msg_dict,
+                         [&dc, k](fb_builder & fb, sstring & body) {
+                const uint32_t rb { arw_batch(fb, { &dc }, dc.length_,
+                                              body) };
+
+                fb.start_table();
+                fb.add_field<int64_t>(0, k);
+                fb.add_off_field(1, rb);
+                return fb.end_table();
+            }, &dict_blocks);
+    }
+    for (const auto & c : tab.col_v)
+        col_v.push_back(&c);
+    ok = ok && arw_message(fp, pos, arw_msg_batch,
+                           [&col_v, length](fb_builder & fb, sstring & body) {
+                                return arw_batch(fb, col_v, length, body);
+                           }, &batch_blocks);
+    if (ok) {
+        fb_builder fb;
+        sstring tail;
+        const uint32_t schema { arw_schema(fb, tab) };
+        const uint32_t dv { fb.add_struct_vec(dict_blocks, 8,
+                                              tab.dict_v.size()) };
+        const uint32_t bv { fb.add_struct_vec(batch_blocks, 8, 1) };
+
+        fb.start_table();
+        fb.add_field<int16_t>(0, arw_meta_v5);
+        fb.add_off_field(1, schema);
+        fb.add_off_field(2, dv);
+        fb.add_off_field(3, bv);
+        const sstring & footer { fb.finish(fb.end_table()) };
+
+        put_le(tail, 0xffffffff, 4);    // end of stream marker
+        put_le(tail, 0, 4);
+        tail += footer;
+        put_le(tail, footer.size(), 4);
+        tail.append(magic, 6);
+        ok = (1 == fwrite(tail.data(), tail.size(), 1, fp));
+    }
+    if ((EOF == fclose(fp)) || (! ok)) {
+        int err { errno ? errno : EIO };
+
+        unlink(fn.c_str());
+        return err;
+    }
+    return 0;
+}
+
+static void
+arw_add_pdos(arw_table & pdo_tab, int root_ind, int pd_num, bool partner,
+             const std::vector<pdo_elem> & pdo_v) noexcept
+{
+    for (const auto & a_pdo : pdo_v) {
+        const pdo_vals_t pv { decode_pdo_vals(a_pdo) };
+        const int ty { static_cast<int>(a_pdo.pdo_el_) };
+
+        pdo_tab.col_v[0].add(root_ind);
+        pdo_tab.col_v[1].add(pd_num);
+        pdo_tab.col_v[2].add(partner);
+        pdo_tab.col_v[3].add(a_pdo.is_source_caps_ ? 0 : 1);
+        pdo_tab.col_v[4].add(a_pdo.pdo_ind_);
+        if (ty > 0)
+            pdo_tab.col_v[5].add(ty - 1);
+        else
+            pdo_tab.col_v[5].add_null();
+        pdo_tab.col_v[6].add(a_pdo.raw_pdo_);
+        pdo_tab.col_v[7].add(pv.mv_min);
+        pdo_tab.col_v[8].add(pv.mv_max);
+        pdo_tab.col_v[9].add(pv.ma);
+        pdo_tab.col_v[10].add(pv.mw);
+    }
+}
+
+/* Writes <prefix>.ports.arrow and <prefix>.pdos.arrow from the snapshots
+ * of the trees in snap_v (root path and snapshot). Returns 0 on success,
+ * else an errno value; the number of rows of each is placed in nrows. */
+static int
+arrow_export(const char * prefix,
+             const std::vector<std::pair<sstring, const scan_snap *>> & snap_v,
+             int64_t (& nrows)[2]) noexcept
+{
+    int res;
+    arw_table port_tab;
+    arw_table pdo_tab;
+
+    port_tab.dict_col("root", 32);
+    port_tab.col("port_num", arw_int, 32, false);
+    port_tab.col("partner", arw_bool, 1, false);
+    port_tab.col("pd_num", arw_int, 32, true);
+    port_tab.dict_col("power_role", 8, { "source", "sink" });
+    port_tab.dict_col("data_role", 8, { "host", "device" });
+    port_tab.dict_col("power_operation_mode", 8, { "default", "1.5A", "3.0A",
+                                             "usb_power_delivery" });
+    pdo_tab.dict_col("root", 32);
+    pdo_tab.col("pd_num", arw_int, 32, true);
+    pdo_tab.col("partner", arw_bool, 1, false);
+    pdo_tab.dict_col("caps", 8, { "source", "sink" });
+    pdo_tab.col("pdo_index", arw_int, 16, false);
+    pdo_tab.dict_col("type", 8, { fixed_ln_sn, vari_ln_sn, batt_ln_sn,
+                             pps_ln_sn, spr_avs_ln_sn, epr_avs_ln_sn });
+    for (const char * cp : { "raw", "min_mv", "max_mv", "ma", "mw" })
+        pdo_tab.col(cp, arw_int, 32, false);
+    for (const auto & [root, ssp] : snap_v) {
+        const int tri { port_tab.dict_v[0].index_of(root) };
+        const int pri { pdo_tab.dict_v[0].index_of(root) };
+
+        for (const auto & de : ssp->tc_de_v) {
+            port_tab.col_v[0].add(tri);
+            port_tab.col_v[1].add(de.port_num_);
+            port_tab.col_v[2].add(de.partner_);
+            if (de.pd_inum_ >= 0)
+                port_tab.col_v[3].add(de.pd_inum_);
+            else
+                port_tab.col_v[3].add_null();
+            if (de.source_sink_known_)
+                port_tab.col_v[4].add(de.is_source_ ? 0 : 1);
+            else
+                port_tab.col_v[4].add_null();
+            if (de.data_role_known_)
+                port_tab.col_v[5].add(de.is_host_ ? 0 : 1);
+            else
+                port_tab.col_v[5].add_null();
+            if (de.partner_)
+                port_tab.col_v[6].add_null();
+            else
+                port_tab.col_v[6].add(static_cast<int>(de.pow_op_mode_));
+        }
+        for (const auto & [pd_num, ue] : ssp->upd_de_m) {
+            arw_add_pdos(pdo_tab, pri, pd_num, ue.is_partner_,
+                         ue.source_pdo_v_);
+            arw_add_pdos(pdo_tab, pri, pd_num, ue.is_partner_,
+                         ue.sink_pdo_v_);
+        }
+    }
+    nrows[0] = port_tab.col_v[0].length_;
+    nrows[1] = pdo_tab.col_v[0].length_;
+    res = arw_write(sstring(prefix) + ".ports.arrow", port_tab);
+    if (0 == res)
+        res = arw_write(sstring(prefix) + ".pdos.arrow", pdo_tab);
+    return res;
+}
+
+// Does the --arrow=PREFIX export of the snapshots in snap_v and reports
+// the outcome. Returns 0 on success.
+static int
+arrow_out(struct opts_t * op,
+          const std::vector<std::pair<sstring, const scan_snap *>> & snap_v,
+          sgj_opaque_p jop) noexcept
+{
+    int64_t nrows[2] { };
+    sgj_state * jsp { &op->json_st };
+    const int res { arrow_export(op->arrow_prefix, snap_v, nrows) };
+
+    if (res) {
+        print_err(-1, "unable to write --arrow={} files: {}\n",
+                  op->arrow_prefix, strerror(res));
+        return 1;
+    }
+    print_err(0, "{}.ports.arrow: {} rows, {}.pdos.arrow: {} rows\n",
+              op->arrow_prefix, nrows[0], op->arrow_prefix, nrows[1]);
+    if (jsp->pr_as_json) {
+        sgj_opaque_p jo2p { sgj_named_subobject_r(jsp, jop,
+                                                  "arrow_export") };
+
+        sgj_js_nv_s(jsp, jo2p, "prefix", op->arrow_prefix);
+        sgj_js_nv_i(jsp, jo2p, "port_rows", nrows[0]);
+        sgj_js_nv_i(jsp, jo2p, "pdo_rows", nrows[1]);
+    }
+    return 0;
+}
+
+#ifdef HAVE_SQLITE3_H
+
+/* Normalized schema of a --sqlite=DB database. Each tree scanned adds a row
+ * to scan, under the host it was scanned on. pd rows hold the pd objects
+ * of that scan, port and partner rows refer to them, pdo rows hold their
+ * source and sink capabilities decoded into milliVolts, milliAmps and
+ * milliWatts. The indexes cover the usual fleet queries (e.g. "sources
+ * offering more than 20 Volts") so they need not touch the tables. */
+static const char * const sqlt_schema =
+    "CREATE TABLE IF NOT EXISTS host (host_id INTEGER PRIMARY KEY, "
+    "name TEXT NOT NULL UNIQUE);\n"
+    "CREATE TABLE IF NOT EXISTS scan (scan_id INTEGER PRIMARY KEY, "
+    "host_id INTEGER NOT NULL REFERENCES host, sysfs_root TEXT NOT NULL, "
+    "scan_time INTEGER NOT NULL, uevent_seqnum INTEGER, "
+    "consistent INTEGER NOT NULL);\n"
+    "CREATE TABLE IF NOT EXISTS pd (pd_id INTEGER PRIMARY KEY, "
+    "scan_id INTEGER NOT NULL REFERENCES scan, pd_num INTEGER NOT NULL, "
+    "partner INTEGER NOT NULL);\n"
+    "CREATE TABLE IF NOT EXISTS port (port_id INTEGER PRIMARY KEY, "
+    "scan_id INTEGER NOT NULL REFERENCES scan, port_num INTEGER NOT NULL, "
+    "pd_id INTEGER REFERENCES pd, power_role TEXT, data_role TEXT, "
+    "power_operation_mode TEXT NOT NULL);\n"
+    "CREATE TABLE IF NOT EXISTS partner (partner_id INTEGER PRIMARY KEY, "
+    "port_id INTEGER NOT NULL REFERENCES port, pd_id INTEGER REFERENCES pd, "
+    "power_role TEXT, data_role TEXT);\n"
+    "CREATE TABLE IF NOT EXISTS pdo (pd_id INTEGER NOT NULL REFERENCES pd, "
+    "caps TEXT NOT NULL, pdo_index INTEGER NOT NULL, type TEXT, "
+    "raw INTEGER NOT NULL, min_mv INTEGER NOT NULL, max_mv INTEGER NOT NULL, "
+    "ma INTEGER NOT NULL, mw INTEGER NOT NULL, "
+    "PRIMARY KEY (pd_id, caps, pdo_index)) WITHOUT ROWID;\n"
+    "CREATE TABLE IF NOT EXISTS alt_mode (alt_mode_id INTEGER PRIMARY KEY, "
+    "port_id INTEGER REFERENCES port, "
+    "partner_id INTEGER REFERENCES partner, name TEXT NOT NULL, "
+    "svid INTEGER, mode INTEGER, vdo INTEGER, active INTEGER, "
+    "description TEXT);\n"
+    "CREATE INDEX IF NOT EXISTS scan_host_ix ON scan (host_id, scan_time);\n"
+    "CREATE INDEX IF NOT EXISTS pd_scan_ix ON pd (scan_id, pd_num);\n"
+    "CREATE INDEX IF NOT EXISTS port_role_ix ON port (power_role, "
+    "data_role, scan_id, port_num, pd_id);\n"
+    "CREATE INDEX IF NOT EXISTS port_scan_ix ON port (scan_id);\n"
+    "CREATE INDEX IF NOT EXISTS partner_role_ix ON partner (power_role, "
+    "data_role, port_id, pd_id);\n"
+    "CREATE INDEX IF NOT EXISTS partner_port_ix ON partner (port_id);\n"
+    "CREATE INDEX IF NOT EXISTS pdo_type_ix ON pdo (type, max_mv, min_mv, "
+    "ma, mw, caps);\n"
+    "CREATE INDEX IF NOT EXISTS pdo_volt_ix ON pdo (max_mv, min_mv, type, "
+    "caps, ma, mw);\n"
+    "CREATE INDEX IF NOT EXISTS alt_mode_svid_ix ON alt_mode (svid, mode, "
+    "port_id, partner_id);\n";
+
+// The prepared statements of a --sqlite=DB export, in sqlt_stmt_e order
+static const char * const sqlt_stmt_a[] = {
+    "INSERT OR IGNORE INTO host (name) VALUES (?)",
+    "SELECT host_id FROM host WHERE name = ?",
+    "INSERT INTO scan (host_id, sysfs_root, scan_time, uevent_seqnum, "
+    "consistent) VALUES (?, ?, ?, ?, ?)",
+    "INSERT INTO pd (scan_id, pd_num, partner) VALUES (?, ?, ?)",
+    "INSERT INTO pdo (pd_id, caps, pdo_index, type, raw, min_mv, max_mv, "
+    "ma, mw) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)",
+    "INSERT INTO port (scan_id, port_num, pd_id, power_role, data_role, "
+    "power_operation_mode) VALUES (?, ?, ?, ?, ?, ?)",
+    "INSERT INTO partner (port_id, pd_id, power_role, data_role) "
+    "VALUES (?, ?, ?, ?)",
+    "INSERT INTO alt_mode (port_id, partner_id, name, svid, mode, vdo, "
+    "active, description) VALUES (?, ?, ?, ?, ?, ?, ?, ?)",
+};
+
+enum sqlt_stmt_e {
+    sqlt_host_ins = 0,
+    sqlt_host_sel,
+    sqlt_scan_ins,
+    sqlt_pd_ins,
+    sqlt_pdo_ins,
+    sqlt_port_ins,
+    sqlt_partner_ins,
+    sqlt_alt_ins,
+    sqlt_stmt_num,
+};
+
+using sqlt_null = std::optional<int64_t>;
+
+static void
+sqlt_bind(sqlite3_stmt * stp, int ind, int64_t val) noexcept
+{
+    sqlite3_bind_int64(stp, ind, val);
+}
+
+static void
+sqlt_bind(sqlite3_stmt * stp, int ind, const sqlt_null & val) noexcept
+{
+    if (val)
+        sqlite3_bind_int64(stp, ind, *val);
+    else
+        sqlite3_bind_null(stp, ind);
+}
+
+// A nullptr binds NULL, otherwise the text is copied by SQLite
+static void
+sqlt_bind(sqlite3_stmt * stp, int ind, const char * cp) noexcept
+{
+    if (cp)
+        sqlite3_bind_text(stp, ind, cp, -1, SQLITE_TRANSIENT);
+    else
+        sqlite3_bind_null(stp, ind);
+}
+
+/* Binds args to the parameters of prepared statement stp, in order, and
+ * steps it once. Returns the result of sqlite3_step(): SQLITE_DONE after an
+ * INSERT, SQLITE_ROW if a SELECT found something. */
+template <typename... Ts>
+static int
+sqlt_step(sqlite3_stmt * stp, const Ts & ... args) noexcept
+{
+    int ind { 0 };
+
+    sqlite3_reset(stp);
+    (sqlt_bind(stp, ++ind, args), ...);
+    return sqlite3_step(stp);
+}
+
+// Parses the sysfs attribute nm of an alternate mode, e.g. svid (hex
+// without "0x") or vdo (hex with "0x"). Empty if absent or garbage.
+static sqlt_null
+alt_md_num(const strstr_m & nv_m, const char * nm, int base) noexcept
+{
+    const auto it { nv_m.find(nm) };
+    char * endp { };
+    int64_t val;
+
+    if ((it == nv_m.end()) || it->second.empty())
+        return std::nullopt;
+    val = strtoll(it->second.c_str(), &endp, base);
+    if (*endp)
+        return std::nullopt;
+    return val;
+}
+
+/* Adds the rows of one scan (sysfs root and snapshot) with host_id under
+ * the open transaction of db. Returns SQLITE_DONE on success. */
+static int
+sqlt_add_scan(sqlite3 * db, sqlite3_stmt * (& st_a)[sqlt_stmt_num],
+              int64_t host_id, const sstring & root,
+              const scan_snap & snap) noexcept
+{
+    int rc;
+    int64_t scan_id;
+    std::map<int, int64_t> pd_id_m;     // pd_num --> pd.pd_id
+    std::vector<int64_t> row_id_v(snap.tc_de_v.size(), -1);
+    const auto now { std::chrono::system_clock::now() };
+
+    rc = sqlt_step(st_a[sqlt_scan_ins], host_id, root.c_str(),
+                   (int64_t)std::chrono::duration_cast<
+                        std::chrono::seconds>(now.time_since_epoch()).count(),
+                   snap.have_seqnum ? sqlt_null((int64_t)snap.seqnum) :
+                                      sqlt_null(),
+                   (int64_t)(! snap.inconsistent));
+    if (SQLITE_DONE != rc)
+        return rc;
+    scan_id = sqlite3_last_insert_rowid(db);
+    for (const auto & [pd_num, ue] : snap.upd_de_m) {
+        rc = sqlt_step(st_a[sqlt_pd_ins], scan_id, (int64_t)pd_num,
+                       (int64_t)ue.is_partner_);
+        if (SQLITE_DONE != rc)
+            return rc;
+        const int64_t pd_id { sqlite3_last_insert_rowid(db) };
+
+        pd_id_m[pd_num] = pd_id;
+        for (const auto * pv : { &ue.source_pdo_v_, &ue.sink_pdo_v_ }) {
+            for (const auto & a_pdo : *pv) {
+                const pdo_vals_t vals { decode_pdo_vals(a_pdo) };
+                const bool null_pdo { a_pdo.pdo_el_ == pdo_e::pdo_null };
+
+                rc = sqlt_step(st_a[sqlt_pdo_ins], pd_id,
+                               a_pdo.is_source_caps_ ? "source" : "sink",
+                               (int64_t)a_pdo.pdo_ind_,
+                               null_pdo ? nullptr :
+                                   pdo_e_to_str(a_pdo.pdo_el_),
+                               (int64_t)a_pdo.raw_pdo_,
+                               (int64_t)vals.mv_min, (int64_t)vals.mv_max,
+                               (int64_t)vals.ma, (int64_t)vals.mw);
+                if (SQLITE_DONE != rc)
+                    return rc;
+            }
+        }
+    }
+    auto pd_id_of = [&](int pd_num) -> sqlt_null {
+        const auto it { pd_id_m.find(pd_num) };
+
+        if (it == pd_id_m.end())
+            return std::nullopt;
+        return it->second;
+    };
+    // local ports first, their partners refer to them
+    for (int pass = 0; pass < 2; ++pass) {
+        for (size_t k = 0; k < snap.tc_de_v.size(); ++k) {
+            const tc_dir_elem & de { snap.tc_de_v[k] };
+            const char * pr { de.source_sink_known_ ?
+                              (de.is_source_ ? "source" : "sink") : nullptr };
+            const char * dr { de.data_role_known_ ?
+                              (de.is_host_ ? "host" : "device") : nullptr };
+
+            if (de.partner_ != (pass > 0))
+                continue;
+            if (! de.partner_)
+                rc = sqlt_step(st_a[sqlt_port_ins], scan_id,
+                               (int64_t)de.port_num_, pd_id_of(de.pd_inum_),
+                               pr, dr, om_pow_op_mode(de.pow_op_mode_));
+            else {
+                sqlt_null port_id { };
+
+                for (size_t j = 0; j < snap.tc_de_v.size(); ++j) {
+                    if (snap.tc_de_v[j].partner_ind_ == (int)k)
+                        port_id = row_id_v[j];
+                }
+                if (! port_id)
+                    continue;   // torn scan, partner without its port
+                rc = sqlt_step(st_a[sqlt_partner_ins], port_id,
+                               pd_id_of(de.pd_inum_), pr, dr);
+            }
+            if (SQLITE_DONE != rc)
+                return rc;
+            row_id_v[k] = sqlite3_last_insert_rowid(db);
+            for (const auto & [alt_md_s, nv_m] : de.alt_md_v_) {
+                const auto it_a { nv_m.find("active") };
+                const auto it_d { nv_m.find("description") };
+                const sstring name { filename_as_str(alt_md_s) };
+                sqlt_null active { };
+
+                if (it_a != nv_m.end())
+                    active = (it_a->second == "yes");
+                rc = sqlt_step(st_a[sqlt_alt_ins],
+                               de.partner_ ? sqlt_null() : row_id_v[k],
+                               de.partner_ ? row_id_v[k] : sqlt_null(),
+                               name.c_str(), alt_md_num(nv_m, "svid", 16),
+                               alt_md_num(nv_m, "mode", 10),
+                               alt_md_num(nv_m, "vdo", 16), active,
+                               (it_d != nv_m.end()) ? it_d->second.c_str() :
+                                                      nullptr);
+                if (SQLITE_DONE != rc)
+                    return rc;
+            }
+        }
+    }
+    return SQLITE_DONE;
+}
+
+/* Appends the snapshots of the trees in snap_v (root path and snapshot) to
+ * the SQLite database db_fn, creating its schema if needed. Uses one
+ * transaction per scan so a concurrent reader or writer never sees part of
+ * one. Returns 0 on success, else places a message in err. */
+static int
+sqlite_export(const char * db_fn, const std::vector<std::pair<sstring,
+                                      const scan_snap *>> & snap_v,
+              sstring & err) noexcept
+{
+    int rc;
+    int64_t host_id { };
+    char hname[256] { };
+    sqlite3 * db { };
+    sqlite3_stmt * st_a[sqlt_stmt_num] { };
+    const char * what { "open" };
+
+    if (gethostname(hname, sizeof(hname) - 1))
+        strcpy(hname, "localhost");
+    rc = sqlite3_open_v2(db_fn, &db, SQLITE_OPEN_READWRITE |
+                         SQLITE_OPEN_CREATE, nullptr);
+    if (SQLITE_OK != rc)
+        goto fini;
+    // wait for other lsucpd instances appending to the same database
+    sqlite3_busy_timeout(db, 5000);
+    what = "create schema";
+    rc = sqlite3_exec(db, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr);
+    if (SQLITE_OK == rc) {
+        rc = sqlite3_exec(db, sqlt_schema, nullptr, nullptr, nullptr);
+        sqlite3_exec(db, (SQLITE_OK == rc) ? "COMMIT" : "ROLLBACK",
+                     nullptr, nullptr, nullptr);
+    }
+    if (SQLITE_OK != rc)
+        goto fini;
+    what = "prepare";
+    for (int k = 0; k < sqlt_stmt_num; ++k) {
+        rc = sqlite3_prepare_v3(db, sqlt_stmt_a[k], -1,
+                                SQLITE_PREPARE_PERSISTENT, &st_a[k],
+                                nullptr);
+        if (SQLITE_OK != rc)
+            goto fini;
+    }
+    for (const auto & [root, ssp] : snap_v) {
+        what = "begin";
+        rc = sqlite3_exec(db, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr);
+        if (SQLITE_OK != rc)
+            goto fini;
+        what = "insert";
+        rc = sqlt_step(st_a[sqlt_host_ins], hname);
+        if (SQLITE_DONE == rc) {
+            rc = sqlt_step(st_a[sqlt_host_sel], hname);
+            if (SQLITE_ROW == rc) {
+                host_id = sqlite3_column_int64(st_a[sqlt_host_sel], 0);
+                rc = sqlt_add_scan(db, st_a, host_id, root, *ssp);
+            }
+        }
+        if (SQLITE_DONE != rc) {
+            err = fmt_to_str("{} {}: {}", what, root, sqlite3_errmsg(db));
+            sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+            rc = SQLITE_ERROR;
+            goto fini;
+        }
+        what = "commit";
+        rc = sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr);
+        if (SQLITE_OK != rc)
+            goto fini;
+    }
+fini:
+    if ((SQLITE_OK != rc) && err.empty())
+        err = fmt_to_str("{}: {}", what, db ? sqlite3_errmsg(db) :
+                                              sqlite3_errstr(rc));
+    for (auto stp : st_a)
+        sqlite3_finalize(stp);
+    sqlite3_close(db);
+    return (SQLITE_OK == rc) ? 0 : 1;
+}
+
+#endif          // HAVE_SQLITE3_H
+
+// Does the --sqlite=DB export of the snapshots in snap_v and reports the
+// outcome. Returns 0 on success.
+static int
+sqlite_out(struct opts_t * op,
+           const std::vector<std::pair<sstring, const scan_snap *>> & snap_v,
+           sgj_opaque_p jop) noexcept
+{
+    sgj_state * jsp { &op->json_st };
+#ifdef HAVE_SQLITE3_H
+    sstring err;
+
+    if (sqlite_export(op->sqlite_db, snap_v, err)) {
+        print_err(-1, "--sqlite={}: {}\n", op->sqlite_db, err);
         return 1;
     }
+#else
+    print_err(-1, "--sqlite=DB: lsucpd was built without SQLite\n");
+    return 1;
+#endif
+    print_err(0, "{}: {} scan(s) added\n", op->sqlite_db, snap_v.size());
+    if (jsp->pr_as_json) {
+        sgj_opaque_p jo2p { sgj_named_subobject_r(jsp, jop,
+                                                  "sqlite_export") };
+
+        sgj_js_nv_s(jsp, jo2p, "database", op->sqlite_db);
+        sgj_js_nv_i(jsp, jo2p, "scans_added", snap_v.size());
+    }
     return 0;
 }
 
-static int
-cl_parse(struct opts_t * op, int argc, char * argv[])
+// Reports reads that exceeded --deadline= and, if --profile-io is given,
+// the I/O profile of the run
+static void
+pr_read_stats(struct opts_t * op, sgj_opaque_p jop) noexcept
 {
-    arr_of_ch<128> b { };
+    const uint64_t num_to { rd_deadline.num_timeouts };
+    const uint64_t num_exh { rd_deadline.num_exhausted };
 
-    while (1) {
-        int option_index = 0;
+    if (num_to > 0) {
+        print_err(-1, "{} sysfs attribute read(s) exceeded --deadline= and "
+                  "are shown as unavailable\n", num_to);
+        sgj_js_nv_i(&op->json_st, jop, "read_timeouts", num_to);
+    }
+    if (num_exh > 0) {
+        print_err(-1, "{} sysfs attribute read(s) not issued as the read "
+                  "pool was exhausted\n(too many wedged reads), shown as "
+                  "unavailable\n", num_exh);
+        sgj_js_nv_i(&op->json_st, jop, "read_pool_exhausted", num_exh);
+    }
+    if (io_prof.active)
+        io_prof_report(op, jop);
+}
 
-        int c = getopt_long(argc, argv, "^cdhj::J:lp:P:r:vVy:", long_options,
-                            &option_index);
-        if (c == -1)
-            break;
+/* With more than one --sysfsroot=SPATH (e.g. trees copied from VMs or
+ * containers) each tree is scanned by a pool of threads, one per CPU at
+ * most, into its own copy of the options. Then the trees
+ * are output in the order given: in text each after a
+ * "# sysfs root: SPATH" line, in JSON as the elements of the
+ * "sysfs_root_list" array. */
+struct root_scan {
+    struct opts_t r_opts_ { };
+    std::shared_ptr<scan_snap> ssp_;
+    bool failed_ { };
+};
 
-        switch (c) {
-        case 'c':
-            ++op->do_caps;
-            op->caps_given = true;
-            break;
-        case 'd':
-            op->do_data_dir = true;
-            break;
-        case 'h':
-            ++op->do_help;
-            break;
-        case 'j':       /* for: -j[=JO] */
-        case '^':       /* for: --json[=JO] */
-            op->do_json = true;
-            /* Now want '=' to precede all JSON optional arguments */
-            if (optarg) {
-                int k, n, q;
+static int
+do_multi_root(bool filter_for_port, bool filter_for_pd, struct opts_t * op,
+              sgj_opaque_p jop) noexcept
+{
+    const bool want_upd { (op->do_caps > 0) || filter_for_pd ||
+                          op->scan_all };
+    const bool want_pdos { op->caps_given || filter_for_pd || op->scan_all };
+    const size_t num_roots { op->root_v.size() };
+    int res { };
+    std::error_code ec { };
+    std::atomic<size_t> next_ind { 0 };
+    std::vector<root_scan> rs_v(num_roots);
+    std::vector<std::thread> thr_v;
+    std::vector<std::pair<sstring, const scan_snap *>> snap_v;
+    sgj_state * jsp { &op->json_st };
+    sgj_opaque_p jap { };
 
-                if ('^' == c) {
-                    op->json_arg = optarg;
-                    break;
-                } else if ('=' == *optarg) {
-                    op->json_arg = optarg + 1;
-                    break;
-                }
-                n = strlen(optarg);
-                for (k = 0; k < n; ++k) {
-                    q = chk_short_opts(*(optarg + k), op);
-                    if (1 == q)
-                        return 1;
-                    if (2 == q)
-                        return 0;
-                }
-            } else
-                op->json_arg = nullptr;
-            break;
-       case 'J':
-            op->do_json = true;
-            op->js_file = optarg;
-            break;
-        case 'l':
-            ++op->do_long;
-            break;
-        case 'p':
-            op->pdo_opt_p = optarg;
-            op->is_pdo_snk = true;
-            break;
-        case 'P':
-            op->pdo_opt_p = optarg;
-            op->is_pdo_snk = false;
-            break;
-        case 'r':
-            op->rdo_opt_p = optarg;
-            break;
-        case 'v':
-            op->verbose_given = true;
-            ++lsucpd_verbose;
-            break;
-        case 'V':
-            op->version_given = true;
-            break;
-        case 'y':
-            op->pseudo_mount_point = optarg;
-            break;
-        default:
-            print_err(-1, "unrecognised option code: {:c} [0x{:x}]\n", c, c);
-            usage();
+    for (size_t k = 0; k < num_roots; ++k) {
+        const fs::path pt { op->root_v[k] };
+
+        if (! fs::is_directory(pt, ec)) {
+            if (ec)
+                pr3ser(-1, pt, "fs::is_directory error", ec);
+            else
+                pr3ser(-1, pt, "is not a directory");
             return 1;
         }
+        rs_v[k].r_opts_ = *op;
+        rs_v[k].r_opts_.tree.set_root(op->root_v[k]);
     }
-    while (optind < argc) {
-        const char * oip = argv[optind];
-        auto ln = strlen(oip);
+    auto worker = [&] {
+        for (size_t k; (k = next_ind++) < num_roots; ) {
+            root_scan & rs { rs_v[k] };
+            struct opts_t * r_op { &rs.r_opts_ };
+            bool ucsi_psup_possible { false };
+            bool have_seqnum { false };
+            uint64_t seqnum { };
+
+            if (consistent_scan(want_upd, want_pdos, ucsi_psup_possible,
+                                have_seqnum, seqnum, r_op) ||
+                primary_scan(r_op)) {
+                rs.failed_ = true;
+                continue;
+            }
+            rs.ssp_ = take_snapshot(want_pdos, (r_op->do_long > 1) ||
+                                    r_op->sqlite_db, false, have_seqnum,
+                                    seqnum, r_op);
+        }
+    };
+    try {
+        const size_t num_thr { std::min<size_t>(num_roots,
+                                   std::thread::hardware_concurrency()) };
+
+        // the calling thread is one of the pool
+        for (size_t k = 1; k < num_thr; ++k)
+            thr_v.emplace_back(worker);
+    } catch (...) {
+        print_err(1, "{}: scanning with fewer threads\n", __func__);
+    }
+    worker();
+    for (auto & t : thr_v)
+        t.join();
 
-        if ((ln < 2) || (ln >= 31)) {
-            print_err(-1, "expect argument of the form: 'p<num>', "
-                      "'p<num>[p]' or 'pd<num>', got: {}\n", oip);
-            return 1;
+    for (const auto & rs : rs_v) {
+        if (rs.ssp_)
+            snap_v.emplace_back(rs.r_opts_.tree.root_, rs.ssp_.get());
+    }
+    if (jsp->pr_as_json && (! op->do_fingerprint) &&
+        (! op->do_compliance))
+        jap = sgj_named_subarray_r(jsp, jop, "sysfs_root_list");
+    for (auto & rs : rs_v) {
+        struct opts_t * r_op { &rs.r_opts_ };
+        sgj_opaque_p jo2p { };
+
+        // a root column or one report over all trees, not a heading line
+        if (op->pdo_sep || op->do_fingerprint || op->do_compliance) {
+            if (rs.failed_) {
+                print_err(-1, "{}: scan failed\n", r_op->tree.root_);
+                res = 1;
+            } else if (op->pdo_sep)
+                output_pdo_rows(*rs.ssp_, filter_for_pd,
+                                r_op->tree.root_.c_str(), &rs == &rs_v[0],
+                                r_op);
+            continue;
         }
-        if (tolower(oip[0]) != 'p') {
-            print_err(-1, "FILTER arguments must start with a 'p'\n\n");
-            usage();
-            return 1;
+        if (jsp->pr_as_json) {
+            jo2p = sgj_new_unattached_object_r(jsp);
+            sgj_js_nv_s(jsp, jo2p, "sysfs_root",
+                        r_op->tree.root_.c_str());
+            sgj_js_nv_o(jsp, jap, nullptr, jo2p);
+        } else
+            sgj_hr_pri(jsp, "# sysfs root: {}\n", r_op->tree.root_);
+        if (rs.failed_) {
+            print_err(-1, "{}: scan failed\n", r_op->tree.root_);
+            sgj_js_nv_i(jsp, jo2p, "scan_failed", 1);
+            res = 1;
+            continue;
         }
-        if (tolower(oip[1]) == 'd')
-            op->filter_pd_v.push_back(oip);
-        else {
-            memset(b.d(), 0, 32);
-            strncpy(b.d(), oip, (ln < b.sz() ? ln : (b.sz() - 1)));
-            if (ln > 4) {       // also accept 'port1' or 'port3p'
-                if (0 == memcmp(b.d(), "port", 4)) {
-                    memmove(b.d() + 1, b.d() + 4, 3);
-                    ln -= 3;    // transform to 'p1' and 'p3p'
-                } else {
-                    print_err(-1, "malformed FILTER argument: {}\n", b.d());
-                    return 1;
-                }
+        if (r_op->scan_inconsistent)
+            print_err(-1, "{}: scan still inconsistent after {} re-scan "
+                      "round(s)\n", r_op->tree.root_, r_op->scan_rounds);
+        output_snap(*rs.ssp_, filter_for_port, filter_for_pd, r_op, jo2p);
+    }
+    if (op->do_fingerprint &&
+        output_fingerprints(snap_v, filter_for_pd, op, jop))
+        res = 1;
+    if (op->do_compliance) {
+        const int c_res { output_compliance(snap_v, filter_for_pd, op,
+                                            jop) };
+
+        if ((2 == c_res) || (0 == res))
+            res = c_res;
+    }
+    if (op->arrow_prefix && arrow_out(op, snap_v, jop))
+        res = 1;
+    if (op->sqlite_db && sqlite_out(op, snap_v, jop))
+        res = 1;
+    pr_read_stats(op, jop);
+    return res;
+}
+
+/* --batch=FILE (or '-' for stdin) holds one request per line, made of
+ * output options and FILTERs as given to --serve=PATH. All of them are
+ * answered from one scan that reads what their union needs. Each text
+ * response follows a "# <line_num>: <request>" line. With --json every
+ * response is a JSON object on a single line (i.e. JSON lines) that has
+ * the request in its "batch_request" member. Empty lines and those
+ * starting with '#' are ignored. */
+static int
+do_batch(struct opts_t * op) noexcept
+{
+    bool ucsi_psup_possible { false };
+    bool have_seqnum { false };
+    bool want_upd { false };
+    bool want_pdos { false };
+    bool want_alt { false };
+    bool any_dd { false };
+    bool any_not_dd { false };
+    int res { };
+    uint64_t seqnum { };
+    unsigned int ln { };
+    char * lp { };
+    size_t lsz { };
+    ssize_t n;
+    std::error_code ec { };
+    struct opts_t s_opts { };
+    struct opts_t * sop { &s_opts };
+    // argv of each points into its own line, so they are not moved
+    std::vector<std::pair<unsigned int, std::unique_ptr<line_req>>> lr_v;
+    const bool from_stdin { 0 == strcmp(op->batch_path, "-") };
+    FILE * fp { from_stdin ? stdin : fopen(op->batch_path, "re") };
+
+    if (nullptr == fp) {
+        print_err(-1, "unable to open {}: {}\n", op->batch_path,
+                  strerror(errno));
+        return 1;
+    }
+    while ((n = getline(&lp, &lsz, fp)) >= 0) {
+        const char * cp { lp + strspn(lp, " \t\r\n") };
+        auto lrp { std::make_unique<line_req>() };
+        line_req & lr { *lrp };
+        struct opts_t * r_op { &lr.r_opts };
+
+        ++ln;
+        if (('\0' == *cp) || ('#' == *cp))
+            continue;
+        lr.line.assign(lp, n);
+        if (parse_req_line(lr)) {
+            print_err(-1, "{}: line {}: bad request: {}\n", op->batch_path,
+                      ln, lr.err);
+            res = 1;
+            continue;
+        }
+        if (op->do_json) {      // JSON lines
+            if (! r_op->do_json) {
+                r_op->do_json = true;
+                r_op->json_arg = op->json_arg;
+                sgj_init_state(&r_op->json_st, r_op->json_arg);
             }
-            if (b[ln - 1] == 'P')
-                b[ln - 1] = 'p';
-            op->filter_port_v.push_back(b.d());
+            r_op->json_st.pr_pretty = false;
         }
-        ++optind;
+        want_upd = want_upd || (r_op->do_caps > 0) || r_op->do_data_dir;
+        want_pdos = want_pdos || r_op->caps_given || lr.filter_for_pd;
+        want_alt = want_alt || (r_op->do_long > 1);
+        (r_op->do_data_dir ? any_dd : any_not_dd) = true;
+        lr_v.emplace_back(ln, std::move(lrp));
     }
-    return 0;
-}
+    free(lp);
+    if (! from_stdin)
+        fclose(fp);
+    if (lr_v.empty())
+        return res;
 
+    sop->scan_retries = op->scan_retries;
+    sop->tree = op->tree;
+    sop->do_data_dir = any_dd;
+    ec = consistent_scan(want_upd, want_pdos, ucsi_psup_possible,
+                         have_seqnum, seqnum, sop);
+    if (ec)
+        return 1;
+    if (sop->scan_inconsistent)
+        print_err(-1, "scan still inconsistent after {} re-scan round(s)\n",
+                  sop->scan_rounds);
+    if (primary_scan(sop))
+        return 1;
+    cur_snap.publish(take_snapshot(want_pdos, want_alt, any_dd && any_not_dd,
+                                   have_seqnum, seqnum, sop));
+    const auto ssp { cur_snap.load() };
+
+    for (auto & [num, lrp] : lr_v) {
+        line_req & lr { *lrp };
+        struct opts_t * r_op { &lr.r_opts };
+        sgj_state * jsp { &r_op->json_st };
+        sgj_opaque_p jop { };
+
+        if (r_op->do_json) {
+            jop = sgj_start_r(my_name, version_str, lr.argv.size() - 1,
+                              lr.argv.data(), jsp);
+            if (op->do_json)
+                sgj_js_nv_s(jsp, jop, "batch_request", lr.key.c_str());
+        }
+        if (! op->do_json)
+            bw::print("# {}: {}\n", num, lr.key);
+        output_snap(*ssp, lr.filter_for_port, lr.filter_for_pd, r_op, jop);
+        if (r_op->do_json) {
+            sgj_js2file_estr(jsp, nullptr, 0, strerror(0), stdout);
+            sgj_finish(jsp);
+        }
+    }
+    fflush(stdout);
+    return res;
+}
 
 int
 main(int argc, char * argv[])
@@ -2234,7 +11180,16 @@ main(int argc, char * argv[])
     bool filter_for_port { false };
     bool filter_for_pd { false };
     bool ucsi_psup_possible { false };
+    bool cache_hit { false };
+    bool have_seqnum { false };
+    bool shm_changed { false };
     int res { };
+    int shm_res { };
+    uint64_t seqnum { };
+    uint64_t shm_gen { };
+    std::shared_ptr<const scan_snap> ssp;
+    uint64_t fprint { };
+    sstring cache_fn;
     std::error_code ec { };
     std::error_code ecc { };
     struct opts_t opts { };
@@ -2242,13 +11197,17 @@ main(int argc, char * argv[])
     sgj_state * jsp;
     sgj_opaque_p jop { };
     sgj_opaque_p jo2p { };
-    sgj_opaque_p jo3p { };
-    sgj_opaque_p jo4p { };
     sgj_opaque_p jap { };
 
+    io_prof.start_tp = std::chrono::steady_clock::now();
+    op->scan_retries = DEF_SCAN_RETRIES;
+    op->max_age_ms = -1;
+    op->watch_quiet_ms = DEF_WATCH_QUIET_MS;
+    op->watch_max_ms = DEF_WATCH_MAX_MS;
     res = cl_parse(op, argc, argv);
     if (res)
         return res;
+    lsucpd_verbose = op->verbose;
     if (op->do_help > 0) {
         usage();
         return 0;
@@ -2291,6 +11250,8 @@ main(int argc, char * argv[])
         bw::print("{}", ss);
         return res;
     }
+    if (chk_opt_conflicts(op))
+        return 1;
     if (op->filter_port_v.size() > 0)
         filter_for_port = true;
     if (op->filter_pd_v.size() > 0) {
@@ -2301,6 +11262,11 @@ main(int argc, char * argv[])
         if (op->do_caps == 0)
             ++op->do_caps;     // look for usb_communication_capable setting
     }
+    if (op->pdo_sep || op->do_fingerprint || op->do_compliance) {
+        op->caps_given = true;      // made from the PDOs
+        if (op->do_caps == 0)
+            ++op->do_caps;
+    }
 
     jsp = &op->json_st;
     if (op->do_json) {
@@ -2324,100 +11290,198 @@ main(int argc, char * argv[])
         const fs::path & pt { op->pseudo_mount_point };
 
         if (! fs::exists(pt, ec)) {
+            if (op->do_count)
+                return count_unknown(op, jop, pt.string() + ": " +
+                                     (ec ? ec.message() : "does not exist"));
             if (ec)
                 pr3ser(-1, pt, "fs::exists error", ec);
             else
                 pr3ser(-1, pt, "does not exist");
             return 1;
         } else if (! fs::is_directory(pt, ec)) {
+            if (op->do_count)
+                return count_unknown(op, jop, pt.string() + ": " +
+                                     (ec ? ec.message() :
+                                           "is not a directory"));
             if (ec)
                 pr3ser(-1, pt, "fs::is_directory error", ec);
             else
                 pr3ser(-1, pt, "is not a directory");
             return 1;
         } else
-            sysfs_root = pt;
+            op->tree.root_ = pt;
     }
-    sc_pt = fs::path(sysfs_root) / class_s;
-    sc_typec_pt = sc_pt / typec_s;
-    sc_upd_pt = sc_pt / upd_sn;
-    sc_powsup_pt = sc_pt / powsup_sn;
+    op->tree.set_root(op->tree.root_);
+    if (op->fp_model_fn) {
+        auto mtp { std::make_shared<fp_model_tab>() };
 
-    ec = scan_for_typec_obj(ucsi_psup_possible, op);
-    if (ec)
-        return 1;
-    if ((op->do_caps > 0) || filter_for_pd) {
-        ec = scan_for_upd_obj(op);
-        if (ec)
+        if (mtp->load(op->fp_model_fn))
             return 1;
+        op->fp_models = mtp;
+    }
+    io_prof.active = (op->do_profile_io > 0);
+    if (op->deadline_ms > 0) {
+        rd_deadline.active = true;
+        rd_deadline.attr_ms = std::chrono::milliseconds(op->deadline_ms);
+        if ((op->run_deadline_ms > 0) && (nullptr == op->serve_path) &&
+            (nullptr == op->http_addr) && (! op->do_watch) &&
+            (nullptr == op->rec_path) && (nullptr == op->cap_path) &&
+            (nullptr == op->replay_path) && (0 == op->storm_rate))
+            rd_deadline.run_end = io_prof.start_tp +
+                        std::chrono::milliseconds(op->run_deadline_ms);
+    }
+    if (op->serve_path || op->http_addr || op->do_watch || op->rec_path ||
+        op->cap_path || op->replay_path || (op->storm_rate > 0)) {
+        if (op->max_age_ms < 0)
+            op->max_age_ms = DEF_MAX_AGE_MS;
+        return serve_main(op);
+    }
+    if (op->do_count)
+        return do_count(op, jop);
+    if (op->compl_fn) {
+        res = do_compliance_file(op, jop);
+        goto fini;
+    }
+    if (op->fields_arg) {
+        res = do_fields(filter_for_port, op, jop);
+        goto fini;
+    }
+    if (op->hist_path) {
+        res = do_history(filter_for_port, op, jop);
+        goto fini;
+    }
+    if (op->batch_path)
+        return do_batch(op);
+    if (op->arrow_prefix || op->sqlite_db)
+        op->scan_all = true;    // export holds everything
+    if (op->root_v.size() > 1) {
+        res = do_multi_root(filter_for_port, filter_for_pd, op, jop);
+        goto fini;
     }
-    res = primary_scan(op);
-    if (res)
-        return res;
 
-    if (jsp->pr_as_json) {
-        jo2p = sgj_named_subobject_r(jsp, jop, lsucpd_jn_sn);
-        do_my_join(op, jo2p);
+    if (op->shm_name)
+        op->scan_all = true;    // segment holds everything
+    if (op->cache_pol != cache_pol_off) {
+        op->scan_all = true;    // cache holds everything
+        if (cache_filename(op->tree, cache_fn)) {
+            have_seqnum = read_uevent_seqnum(op->tree, seqnum);
+            fprint = listing_fprint(op->tree);
+            cache_hit = load_scan_cache(cache_fn, have_seqnum, seqnum,
+                                        fprint, op);
+            pr3ser(2, cache_fn, cache_hit ? "scan cache hit" :
+                                            "scan cache miss");
+        } else
+            cache_fn.clear();
     }
+    if (cache_hit) {
+        if ((op->cache_pol == cache_pol_reread) && reread_volatile(op) &&
+            (0 == rd_deadline.num_timeouts) &&
+            (0 == rd_deadline.num_exhausted))
+            store_scan_cache(cache_fn, have_seqnum, seqnum, fprint, op);
+    } else {
+        const uint64_t sn0 { seqnum };
 
-    if (filter_for_port || filter_for_pd) {
-        do_filter(filter_for_port, filter_for_pd, op, jop);
-    } else {       // no FILTER argument given
-        for (auto&& [n, v] : op->summ_out_m) {
-            if (lsucpd_verbose > 4)
-                sgj_hr_pri(jsp, "port={}: ", n);
-            sgj_hr_pri(jsp, "{}\n", v);
-#if 0
-            if (op->do_long > 0) {
-                for (const auto& entry : op->tc_de_v) {
-                    if (n == entry.port_num_)
-                        list_port(entry, op);
-                }
-            }
-#endif
-        }
-        if (op->do_long > 0) {
-            sgj_hr_pri(jsp, "\n");
-            if (jsp->pr_as_json) {
-                jo2p = sgj_named_subobject_r(jsp, jop, ct_sn);
-                jap = sgj_named_subarray_r(jsp, jo2p, "typec_list");
-            }
-            for (auto&& [n, v] : op->summ_out_m) {
-                for (const auto& entry : op->tc_de_v) {
-                    if (n == entry.port_num_) {
-                        jo3p = sgj_new_unattached_object_r(jsp);
-                        sstring s { "port" + std::to_string(n) };
-                        if (entry.partner_)
-                            s += "_partner";
-                        jo4p = sgj_named_subobject_r(jsp, jo3p, s.c_str());
-                        list_port(entry, op, jo4p);
-                        sgj_js_nv_o(jsp, jap, nullptr, jo3p);
-                    }
-                }
-            }
+        ec = consistent_scan((op->do_caps > 0) || filter_for_pd ||
+                             op->scan_all, op->caps_given || op->scan_all,
+                             ucsi_psup_possible, have_seqnum, seqnum, op);
+        if (ec)
+            return 1;
+        // don't cache a scan that is torn or missing (timed out) attributes
+        if (op->scan_all && (! cache_fn.empty()) &&
+            (! op->scan_inconsistent) && (0 == rd_deadline.num_timeouts) &&
+            (0 == rd_deadline.num_exhausted)) {
+            if (seqnum != sn0)
+                fprint = listing_fprint(op->tree);
+            store_scan_cache(cache_fn, have_seqnum, seqnum, fprint, op);
         }
     }
+    if (op->scan_inconsistent) {
+        sstring ss;
 
-    if (op->caps_given) {
-        sgj_hr_pri(jsp, "\n");
+        for (auto pn : op->torn_port_s)
+            ss += " p" + std::to_string(pn);
+        print_err(-1, "scan still inconsistent after {} re-scan round(s){}"
+                  "{}\n", op->scan_rounds, ss.empty() ? "" : ", torn:",
+                  ss);
+    }
+    res = primary_scan(op);
+    if (res)
+        return res;
+    cur_snap.publish(take_snapshot(op->caps_given || filter_for_pd ||
+                                   op->scan_all,
+                                   (op->do_long > 1) || op->sqlite_db, false,
+                                   have_seqnum, seqnum, op));
+    ssp = cur_snap.load();
+    if (op->shm_name) {
+        if (op->scan_inconsistent)
+            print_err(-1, "inconsistent scan not published to "
+                      "/dev/shm/{}\n", op->shm_name);
+        else {
+            shm_res = shm_publish(op->shm_name, *ssp, shm_gen, shm_changed);
+            if (shm_res)
+                print_err(-1, "unable to publish to /dev/shm/{}: {}\n",
+                          op->shm_name, strerror(shm_res));
+            else
+                print_err(0, "/dev/shm/{}: generation {}{}\n", op->shm_name,
+                          shm_gen, shm_changed ? "" : " (unchanged)");
+        }
+    }
+    if (op->arrow_prefix)
+        res = arrow_out(op, {{op->tree.root_, ssp.get()}}, jop);
+    if (op->sqlite_db && sqlite_out(op, {{op->tree.root_, ssp.get()}}, jop))
+        res = 1;
 
-        if (jsp->pr_as_json) {
-            jo2p = sgj_named_subobject_r(jsp, jop, cupd_sn);
-            jap = sgj_named_subarray_r(jsp, jo2p, "pdo_list");
+    if (jsp->pr_as_json) {
+        if (op->cache_pol != cache_pol_off) {
+            jo2p = sgj_named_subobject_r(jsp, jop, "scan_cache");
+            sgj_js_nv_s(jsp, jo2p, "status", cache_fn.empty() ?
+                        "unavailable" : (cache_hit ? "hit" : "miss"));
+            if (! cache_fn.empty())
+                sgj_js_nv_s(jsp, jo2p, "file", cache_fn.c_str());
+            if (have_seqnum)
+                sgj_js_nv_i(jsp, jo2p, seqnum_sn, seqnum);
+            if (cache_hit)
+                sgj_js_nv_s(jsp, jo2p, "volatile_attributes",
+                            (op->cache_pol == cache_pol_reread) ?
+                            "re-read" : "from cache, may be stale");
         }
-        for (auto&& [nm, upd_d_el] : op->upd_de_m) {
-            print_err(3, "nm={}, about to populate on: {}\n", nm,
-                      upd_d_el.match_str_);
-            ec = populate_src_snk_pdos(upd_d_el, op);
-            if (ec) {
-                pr3ser(-1, upd_d_el.path(), "from populate_src_snk_pdos", ec);
-                break;
-            }
-            jo3p = sgj_new_unattached_object_r(jsp);
-            list_pd(nm, upd_d_el, op, jo3p);
-            sgj_js_nv_o(jsp, jap, nullptr /* name */, jo3p);
+        if (op->shm_name && (0 == shm_res) && (! op->scan_inconsistent)) {
+            jo2p = sgj_named_subobject_r(jsp, jop, "shm_segment");
+            sgj_js_nv_s(jsp, jo2p, "name", op->shm_name);
+            sgj_js_nv_i(jsp, jo2p, "generation", shm_gen);
+            sgj_js_nv_i(jsp, jo2p, "changed", shm_changed);
+        }
+        if ((op->scan_rounds > 0) || op->scan_inconsistent) {
+            jo2p = sgj_named_subobject_r(jsp, jop, "scan_consistency");
+            sgj_js_nv_i(jsp, jo2p, "consistent", ! op->scan_inconsistent);
+            sgj_js_nv_i(jsp, jo2p, "rescan_rounds", op->scan_rounds);
+            if (have_seqnum)
+                sgj_js_nv_i(jsp, jo2p, seqnum_sn, seqnum);
+            jap = sgj_named_subarray_r(jsp, jo2p, "rescanned_port_list");
+            for (auto pn : op->rescan_port_s)
+                sgj_js_nv_i(jsp, jap, nullptr, pn);
+            jap = sgj_named_subarray_r(jsp, jo2p, "torn_port_list");
+            for (auto pn : op->torn_port_s)
+                sgj_js_nv_i(jsp, jap, nullptr, pn);
         }
     }
+    // the JSON equivalent is "volatile_attributes" in "scan_cache"
+    if (cache_hit && (op->cache_pol == cache_pol_flag) &&
+        (! jsp->pr_as_json) && (! op->pdo_sep) && (! op->do_fingerprint) &&
+        (! op->do_compliance))
+        sgj_hr_pri(jsp, "# from scan cache, may be stale: power_role, "
+                   "data_role and power_operation_mode\n");
+    if (op->do_compliance) {
+        const int c_res { output_compliance({{op->tree.root_, ssp.get()}},
+                                            filter_for_pd, op, jop) };
+
+        if ((2 == c_res) || (0 == res))
+            res = c_res;
+    } else
+        output_snap(*ssp, filter_for_port, filter_for_pd, op, jop);
+    pr_read_stats(op, jop);
+    if (shm_res)
+        res = shm_res;
 fini:
     if (jsp->pr_as_json) {
         FILE * fp = stdout;
@@ -2434,7 +11498,8 @@ fini:
             /* '--js-file=-' will send JSON output to stdout */
         }
         if (fp)
-            sgj_js2file_estr(jsp, nullptr, res, strerror(res), fp);
+            sgj_js2file_estr(jsp, nullptr, res, op->do_compliance ?
+                             compl_estr(res) : strerror(res), fp);
         if (op->js_file && fp && (stdout != fp))
             fclose(fp);
         sgj_finish(jsp);
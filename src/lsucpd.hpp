@@ -95,6 +95,10 @@ template<typename... Args>
 void
 sgj_hr_pri_helper(const std::string_view s, sgj_state * jsp);
 
+// When set, plain text output from sgj_hr_pri() goes to this stream rather
+// than stdout. Per thread so service threads can each render a response.
+extern thread_local FILE * lsucpd_hr_fp;
+
 /* sgj_hr_pri() is similar to sgj_pr_hr() [See sg_json.h]. The difference
  * is that this template function uses std::format() style formatting from
  * C++20 rather than C style as used in printf() . */
@@ -106,7 +110,7 @@ constexpr void sgj_hr_pri(sgj_state * jsp, const std::string_view str_fmt,
                                    BWP_FMTNS::make_format_args(args...)) };
 
     if ((NULL == jsp) || (! jsp->pr_as_json))
-        fputs(s.c_str(), stdout);
+        fputs(s.c_str(), lsucpd_hr_fp ? lsucpd_hr_fp : stdout);
     else if (jsp->pr_out_hr) {
         sgj_hr_pri_helper(s, jsp);
     }
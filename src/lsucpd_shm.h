@@ -0,0 +1,153 @@
+#ifndef LSUCPD_SHM_H
+#define LSUCPD_SHM_H
+
+/*
+ * Copyright (c) 2023 Douglas Gilbert.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the BSD_LICENSE file.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <inttypes.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Layout of the shared memory segment that 'lsucpd --shm=NAME' publishes
+ * as /dev/shm/NAME . Consumers mmap() that file read-only and then take
+ * a copy with lsucpd_shm_snapshot() below; after that they can inspect the
+ * USB-C ports, pd objects and decoded PDOs without further system calls
+ * or parsing. The segment is protected by a seqlock: 'seq' is odd while
+ * the writer is updating it. 'generation' is only incremented when the
+ * published state changes, so a consumer that remembers it can cheaply
+ * tell if anything has changed. All integers are in host byte order. */
+
+#define LSUCPD_SHM_MAGIC 0x4450434cU       /* "LCPD" when little endian */
+#define LSUCPD_SHM_VERSION 1
+
+#define LSUCPD_SHM_MAX_PORTS 16
+#define LSUCPD_SHM_MAX_PDS 32
+#define LSUCPD_SHM_MAX_PDOS 16      /* per capabilities list */
+
+/* lsucpd_shm_port::flags */
+#define LSUCPD_SHM_PF_PARTNER 0x1       /* port<n>-partner is present */
+#define LSUCPD_SHM_PF_ROLE_KNOWN 0x2    /* power role known */
+#define LSUCPD_SHM_PF_SOURCE 0x4        /* valid if PF_ROLE_KNOWN */
+#define LSUCPD_SHM_PF_DATA_KNOWN 0x8    /* data role known */
+#define LSUCPD_SHM_PF_HOST 0x10         /* valid if PF_DATA_KNOWN */
+
+/* lsucpd_shm_port::pow_op_mode, from power_operation_mode attribute */
+#define LSUCPD_SHM_POM_DEFAULT 0        /* 5 Volts, 900 mA */
+#define LSUCPD_SHM_POM_5V_1_5A 1
+#define LSUCPD_SHM_POM_5V_3_0A 2
+#define LSUCPD_SHM_POM_USB_PD 3
+
+/* lsucpd_shm_pd::flags */
+#define LSUCPD_SHM_DF_PARTNER 0x1       /* pd object belongs to a partner */
+#define LSUCPD_SHM_DF_USB_COMMS_INCAPABLE 0x2
+
+/* lsucpd_shm_body::flags */
+#define LSUCPD_SHM_BF_TRUNCATED 0x1     /* some table was too small */
+
+/* lsucpd_shm_pdo::type */
+#define LSUCPD_SHM_PDO_NULL 0
+#define LSUCPD_SHM_PDO_FIXED 1
+#define LSUCPD_SHM_PDO_VARIABLE 2
+#define LSUCPD_SHM_PDO_BATTERY 3
+#define LSUCPD_SHM_PDO_PPS 4            /* APDO: SPR Programmable Supply */
+#define LSUCPD_SHM_PDO_SPR_AVS 5        /* APDO: SPR Adjustable Voltage */
+#define LSUCPD_SHM_PDO_EPR_AVS 6        /* APDO: EPR Adjustable Voltage */
+
+/* Decoded PDO. Values are in milliVolts, milliAmps and milliWatts; those
+ * that do not apply to the PDO's type are 0. For a fixed supply, min_mv
+ * and max_mv are both its voltage. Current and power are maximums for
+ * source capabilities and operational values for sink capabilities. */
+struct lsucpd_shm_pdo {
+    uint32_t raw;               /* PDO rebuilt from sysfs attributes */
+    uint8_t type;               /* LSUCPD_SHM_PDO_* */
+    uint8_t index;              /* object position, starts at 1 */
+    uint8_t reserved[2];
+    uint32_t min_mv;
+    uint32_t max_mv;
+    uint32_t ma;
+    uint32_t mw;
+};
+
+struct lsucpd_shm_port {
+    uint32_t port_num;
+    int32_t pd_num;             /* -1 if the port has no pd object */
+    int32_t partner_pd_num;     /* -1 if no partner or it has no pd */
+    uint8_t flags;              /* LSUCPD_SHM_PF_* */
+    uint8_t pow_op_mode;        /* LSUCPD_SHM_POM_* */
+    uint8_t reserved[2];
+};
+
+struct lsucpd_shm_pd {
+    int32_t pd_num;
+    uint8_t flags;              /* LSUCPD_SHM_DF_* */
+    uint8_t num_src_pdos;
+    uint8_t num_snk_pdos;
+    uint8_t reserved;
+    struct lsucpd_shm_pdo src_pdos[LSUCPD_SHM_MAX_PDOS];
+    struct lsucpd_shm_pdo snk_pdos[LSUCPD_SHM_MAX_PDOS];
+};
+
+struct lsucpd_shm_body {
+    uint32_t flags;             /* LSUCPD_SHM_BF_* */
+    uint32_t num_ports;
+    uint32_t num_pds;
+    uint32_t reserved;
+    struct lsucpd_shm_port ports[LSUCPD_SHM_MAX_PORTS];
+    struct lsucpd_shm_pd pds[LSUCPD_SHM_MAX_PDS];
+};
+
+struct lsucpd_shm {
+    uint32_t magic;             /* LSUCPD_SHM_MAGIC */
+    uint16_t version;           /* LSUCPD_SHM_VERSION */
+    uint16_t reserved1;
+    uint32_t size;              /* sizeof(struct lsucpd_shm) */
+    uint32_t reserved2;
+    uint64_t seq;               /* seqlock sequence, odd during update */
+    uint64_t generation;        /* incremented when body changes */
+    uint64_t update_ns;         /* CLOCK_REALTIME of last change */
+    uint64_t uevent_seqnum;     /* at time of last change, 0 if unknown */
+    struct lsucpd_shm_body body;
+};
+
+/* Copies the segment mapped at shp to *outp without tearing. Gives up
+ * after max_tries attempts that overlap a writer. Returns 0 on success,
+ * -1 if the segment is busy and -2 if it is not a (compatible) lsucpd
+ * segment. */
+static inline int
+lsucpd_shm_snapshot(const struct lsucpd_shm * shp, struct lsucpd_shm * outp,
+                    int max_tries)
+{
+    int k;
+    uint64_t s1;
+
+    for (k = 0; k < max_tries; ++k) {
+        s1 = __atomic_load_n(&shp->seq, __ATOMIC_ACQUIRE);
+        if (s1 & 1)
+            continue;
+        memcpy(outp, (const void *)shp, sizeof(*outp));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shp->seq, __ATOMIC_RELAXED) != s1)
+            continue;
+        if ((LSUCPD_SHM_MAGIC != outp->magic) ||
+            (LSUCPD_SHM_VERSION != outp->version) ||
+            (sizeof(*outp) != outp->size))
+            return -2;
+        return 0;
+    }
+    return -1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
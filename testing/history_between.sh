@@ -0,0 +1,24 @@
+#!/bin/sh
+# Records a short --storm= of a copy of testing/sysfs, then checks that
+# --history=FILE answers --between= with one bound (T1) and with both.
+# Usage: history_between.sh LSUCPD SYSFS_TREE WORK_DIR
+
+LSUCPD=$1
+TREE=$2
+WD=$3/history_between
+
+rm -rf "$WD"
+mkdir -p "$WD" || exit 1
+cp -a "$TREE" "$WD/sysfs" || exit 1
+"$LSUCPD" -y "$WD/sysfs" --record="$WD/h.rec" --storm=20,1 \
+    > /dev/null 2>&1 || exit 1
+
+for b in -1h -10s -1h,now ; do
+    # a crash (e.g. an exception in a noexcept function) lists nothing
+    n=$("$LSUCPD" --history="$WD/h.rec" --between=$b | grep -c '^# ')
+    if [ "$n" -lt 1 ] ; then
+        echo "--between=$b: no records listed"
+        exit 1
+    fi
+done
+exit 0